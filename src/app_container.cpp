@@ -20,28 +20,33 @@
 
 namespace dmkit {
 
-ThreadLocalDataFactory::ThreadLocalDataFactory(ApplicationBase* application) {
-    this->_application = application;
+ThreadLocalDataFactory::ThreadLocalDataFactory(ThreadDataPool* data_pool) {
+    this->_data_pool = data_pool;
 }
 
 ThreadLocalDataFactory::~ThreadLocalDataFactory() {
-    this->_application = nullptr;
+    this->_data_pool = nullptr;
 }
 
 void* ThreadLocalDataFactory::CreateData() const {
-    return this->_application->create_thread_data();
+    // Created by the pool so that workers of requests are able to acquire their data from it.
+    return this->_data_pool->create();
 }
 
 void ThreadLocalDataFactory::DestroyData(void* d) const {
-    this->_application->destroy_thread_data(d);
+    this->_data_pool->destroy(static_cast<ThreadDataBase*>(d));
 }
 
 AppContainer::AppContainer() {
     this->_application = nullptr;
+    this->_data_pool = nullptr;
     this->_data_factory = nullptr;
 }
 
 AppContainer::~AppContainer() {
+    delete this->_data_pool;
+    this->_data_pool = nullptr;
+
     delete this->_application;
     this->_application = nullptr;
 
@@ -63,11 +68,13 @@ int AppContainer::load_application() {
         return -1;
     }
 
-    this->_data_factory = new ThreadLocalDataFactory(this->_application);
+    this->_data_pool = new ThreadDataPool(this->_application);
+    this->_data_factory = new ThreadLocalDataFactory(this->_data_pool);
 
     return 0;
 }
 
+
 ThreadLocalDataFactory* AppContainer::get_thread_local_data_factory() {
     if (nullptr == this->_data_factory) {
         APP_LOG(ERROR) << "Data factory has not been initialized!!!";
@@ -77,6 +84,45 @@ ThreadLocalDataFactory* AppContainer::get_thread_local_data_factory() {
     return this->_data_factory;
 }
 
+// Log the notice log of a finished request, including the total time cost.
+static void log_request_finished(ThreadDataBase* tls,
+                                 const std::chrono::steady_clock::time_point& time_start) {
+    auto time_end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> diff = std::chrono::duration_cast<std::chrono::duration<double>>(time_end - time_start);
+    double total_cost = diff.count() * 1000;
+    APP_LOG(TRACE) << "Application run cost(ms): " << total_cost;
+    tls->add_notice_log("tm", std::to_string(total_cost));
+    APP_LOG(NOTICE) << tls->get_notice_log();
+}
+
+// Closure given to asynchronous applications, run once the application finishes a request.
+// The brpc thread local data is given to other requests as soon as the service method returns,
+// so an asynchronous request owns its thread data, which is released here after
+// the notice log is logged.
+class AsyncRunDone : public google::protobuf::Closure {
+public:
+    AsyncRunDone(ThreadDataPool* data_pool, ThreadDataBase* data, google::protobuf::Closure* done)
+        : _data_pool(data_pool), _data(data), _done(done),
+          _time_start(std::chrono::steady_clock::now()) {}
+
+    void Run() {
+        {
+            ScopedThreadData scoped_data(this->_data);
+            log_request_finished(this->_data, this->_time_start);
+        }
+        this->_data_pool->release(this->_data);
+        google::protobuf::Closure* done = this->_done;
+        delete this;
+        done->Run();
+    }
+
+private:
+    ThreadDataPool* _data_pool;
+    ThreadDataBase* _data;
+    google::protobuf::Closure* _done;
+    std::chrono::steady_clock::time_point _time_start;
+};
+
 int AppContainer::run(BRPC_NAMESPACE::Controller* cntl) {
     if (nullptr == this->_application) {
         APP_LOG(ERROR) << "No application is not loaded for processing!!!";
@@ -86,20 +132,70 @@ int AppContainer::run(BRPC_NAMESPACE::Controller* cntl) {
     auto time_start = std::chrono::steady_clock::now();
 
     // Need to reset thread data status before running the application
-    ThreadDataBase* tls = static_cast<ThreadDataBase*>(BRPC_NAMESPACE::thread_local_data());
+    ThreadDataBase* tls = current_thread_data();
     tls->reset();
     APP_LOG(TRACE) << "Running application";
     int result = this->_application->run(cntl);
 
-    auto time_end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> diff = std::chrono::duration_cast<std::chrono::duration<double>>(time_end - time_start);
-    double total_cost = diff.count() * 1000;
-    APP_LOG(TRACE) << "Application run cost(ms): " << total_cost;
-    tls->add_notice_log("tm", std::to_string(total_cost));
-    APP_LOG(NOTICE) << tls->get_notice_log();
+    log_request_finished(tls, time_start);
 
     return result;
 }
 
+int AppContainer::run_batch(BRPC_NAMESPACE::Controller* cntl) {
+    if (nullptr == this->_application) {
+        APP_LOG(ERROR) << "No application is not loaded for processing!!!";
+        return -1;
+    }
+
+    auto time_start = std::chrono::steady_clock::now();
+
+    // Need to reset thread data status before running the application
+    ThreadDataBase* tls = current_thread_data();
+    tls->reset();
+    APP_LOG(TRACE) << "Running application for batch";
+    this->_application->run_batch(cntl);
+
+    log_request_finished(tls, time_start);
+
+    return 0;
+}
+
+int AppContainer::resolve(BRPC_NAMESPACE::Controller* cntl,
+                          const DialogRequest* request,
+                          DialogResponse* response) {
+    if (nullptr == this->_application) {
+        APP_LOG(ERROR) << "No application is not loaded for processing!!!";
+        return -1;
+    }
+
+    auto time_start = std::chrono::steady_clock::now();
+
+    // Need to reset thread data status before running the application
+    ThreadDataBase* tls = current_thread_data();
+    tls->reset();
+    APP_LOG(TRACE) << "Running application for protobuf request";
+    this->_application->resolve(cntl, request, response);
+
+    log_request_finished(tls, time_start);
+
+    return 0;
+}
+
+void AppContainer::run(BRPC_NAMESPACE::Controller* cntl, google::protobuf::Closure* done) {
+    BRPC_NAMESPACE::ClosureGuard done_guard(done);
+    if (nullptr == this->_application || !this->_application->is_async()) {
+        this->run(cntl);
+        return;
+    }
+
+    ThreadDataBase* data = this->_data_pool->acquire();
+    AsyncRunDone* run_done = new AsyncRunDone(this->_data_pool, data, done_guard.release());
+    // The thread data is bound by the application, which drops the binding before the request
+    // is finished, since run_done gives the thread data to other requests.
+    // The request may be finished inside run_async, run_done must not be touched afterwards.
+    this->_application->run_async(cntl, data, run_done);
+}
+
 } // namespace dmkit
 
@@ -17,22 +17,23 @@
 
 #include "application_base.h"
 #include "brpc.h"
+#include "thread_data_base.h"
 
 namespace dmkit {
 
 class ThreadLocalDataFactory : public BRPC_NAMESPACE::DataFactory {
 public:
-    ThreadLocalDataFactory(ApplicationBase* application);
+    ThreadLocalDataFactory(ThreadDataPool* data_pool);
     ~ThreadLocalDataFactory();
     void* CreateData() const;
     void DestroyData(void* d) const;
 
 private:
-    ApplicationBase* _application;
+    ThreadDataPool* _data_pool;
 };
 
 // Container class which manages the instances of application,
-// as well as a thread data factory instance.
+// as well as the thread data pool and a thread data factory instance.
 class AppContainer {
 public:
     AppContainer();
@@ -40,11 +41,24 @@ public:
     int load_application();
     ThreadLocalDataFactory* get_thread_local_data_factory();
     int run(BRPC_NAMESPACE::Controller* cntl);
+    // Run the application for a request, done is run once the request is finished.
+    void run(BRPC_NAMESPACE::Controller* cntl, google::protobuf::Closure* done);
+    // Run the application for a batch request.
+    int run_batch(BRPC_NAMESPACE::Controller* cntl);
+    // Run the application for a protobuf dialog request.
+    int resolve(BRPC_NAMESPACE::Controller* cntl,
+                const DialogRequest* request,
+                DialogResponse* response);
 
 private:
     // The application instance is shared for all rpc threads
     ApplicationBase* _application;
 
+    // Thread data of asynchronous requests and workers of requests are pooled and reused,
+    // so that their buffers and json arenas are kept for following requests
+    // like brpc thread local data.
+    ThreadDataPool* _data_pool;
+
     ThreadLocalDataFactory* _data_factory;
 };
 
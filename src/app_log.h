@@ -23,8 +23,8 @@ namespace dmkit {
 
 // Wrapper for application logging to include trace id for each log during a request.
 #define APP_LOG(severity)  \
-    LOG(severity) << "logid=" << (BRPC_NAMESPACE::thread_local_data() == nullptr ? "" : \
-      (static_cast<dmkit::ThreadDataBase*>(BRPC_NAMESPACE::thread_local_data()))->get_log_id()) \
+    LOG(severity) << "logid=" << (dmkit::current_thread_data() == nullptr ? "" : \
+      dmkit::current_thread_data()->get_log_id()) \
       << " "
 
 } // namespace dmkit
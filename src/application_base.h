@@ -16,6 +16,7 @@
 #define DMKIT_APPLICATION_BASE_H
 
 #include "brpc.h"
+#include "http.pb.h"
 #include "thread_data_base.h"
 
 namespace dmkit {
@@ -35,6 +36,38 @@ public:
     // Interface for application to handle requests, it should be thread safe.
     virtual int run(BRPC_NAMESPACE::Controller* cntl) = 0;
 
+    // Whether requests are handled by run_async instead of run.
+    virtual bool is_async() const {
+        return false;
+    }
+
+    // Interface for application to handle requests asynchronously, it should be thread safe.
+    // done must be run once the response is ready, which may happen in another bthread
+    // after this method returns. The request has its own thread data which is not bound to
+    // any bthread, application binds it with ScopedThreadData while working on the request.
+    // done gives the thread data to other requests, it must not be bound when done is run.
+    virtual void run_async(BRPC_NAMESPACE::Controller* cntl,
+                           ThreadDataBase* data,
+                           google::protobuf::Closure* done) {
+        BRPC_NAMESPACE::ClosureGuard done_guard(done);
+        ScopedThreadData scoped_data(data);
+        this->run(cntl);
+    }
+
+    // Interface for application to handle a batch of requests in one http request.
+    // Applications not supporting batch respond 404.
+    virtual void run_batch(BRPC_NAMESPACE::Controller* cntl) {
+        cntl->http_response().set_status_code(404);
+    }
+
+    // Interface for application to resolve a dialog turn given in protobuf messages,
+    // it should be thread safe. Applications not supporting it fail the rpc.
+    virtual void resolve(BRPC_NAMESPACE::Controller* cntl,
+                         const DialogRequest* request,
+                         DialogResponse* response) {
+        cntl->SetFailed(BRPC_NAMESPACE::ENOMETHOD, "resolve is not supported");
+    }
+
     // Interface for application to register customized thread data.
     virtual void* create_thread_data() const {
         return new ThreadDataBase();
@@ -48,13 +81,13 @@ public:
     // Set log id for current request,
     // application should set log id as early as possible when processing request
     virtual void set_log_id(const std::string& log_id) {
-        ThreadDataBase* tls = static_cast<ThreadDataBase*>(BRPC_NAMESPACE::thread_local_data());
+        ThreadDataBase* tls = current_thread_data();
         tls->set_log_id(log_id);
     }
 
     // Add a key/value notice log which will be logged when finish processing request
     virtual void add_notice_log(const std::string& key, const std::string& value) {
-        ThreadDataBase* tls = static_cast<ThreadDataBase*>(BRPC_NAMESPACE::thread_local_data());
+        ThreadDataBase* tls = current_thread_data();
         tls->add_notice_log(key, value);
     }
 };
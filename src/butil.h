@@ -28,6 +28,9 @@
 #include BUTIL_INCLUDE_PREFIX/comlog_sink.h>
 #endif
 #include BUTIL_INCLUDE_PREFIX/containers/flat_map.h>
+#include BUTIL_INCLUDE_PREFIX/files/file_path.h>
+#include BUTIL_INCLUDE_PREFIX/files/file_util.h>
 #include BUTIL_INCLUDE_PREFIX/logging.h>
+#include BUTIL_INCLUDE_PREFIX/rand_util.h>
 
 #endif  //DMKIT_BUTIL_H
@@ -0,0 +1,105 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_COMPILED_POLICY_H
+#define DMKIT_COMPILED_POLICY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Interface between dmkit and a domain compiled into a shared object by tools/policy_compiler.
+// The generated source includes only this header, everything else it needs from dmkit
+// is given by CompiledPolicyHost. Bump the version whenever anything below changes.
+#define DMKIT_COMPILED_POLICY_ABI_VERSION 1
+
+namespace dmkit {
+
+// Values of the param environment of a policy, as seen by compiled functions.
+struct CompiledParamEnv {
+    const std::string* values;
+    const char* is_set;
+    size_t size;
+};
+
+// Render a template with param values and append to result,
+// returns false if a param is not set.
+typedef bool (*CompiledRenderFunc)(const CompiledParamEnv& env, std::string& result);
+
+// Evaluate an assertion with param values.
+typedef bool (*CompiledAssertionFunc)(const CompiledParamEnv& env);
+
+// Functions of dmkit called by compiled functions, so that they behave as the interpreter.
+struct CompiledPolicyHost {
+    void (*split_list)(const std::string& str, const char delimiter, std::vector<std::string>& parts);
+    bool (*try_atof)(const std::string& str, double& value);
+    void (*trim)(std::string& str);
+};
+
+// The compiler and standard library a module is built with. Compiled functions exchange
+// std::string with dmkit, a module is only used if it is built with the same ABI as dmkit.
+struct CompiledPolicyAbi {
+    int version;
+    int gxx_abi_version;
+    int cxx11_abi;
+    int string_size;
+    int vector_size;
+};
+
+inline CompiledPolicyAbi compiled_policy_abi() {
+    CompiledPolicyAbi abi = {
+        DMKIT_COMPILED_POLICY_ABI_VERSION,
+#ifdef __GXX_ABI_VERSION
+        __GXX_ABI_VERSION,
+#else
+        0,
+#endif
+#ifdef _GLIBCXX_USE_CXX11_ABI
+        _GLIBCXX_USE_CXX11_ABI,
+#else
+        -1,
+#endif
+        (int)sizeof(std::string),
+        (int)sizeof(std::vector<std::string>)
+    };
+    return abi;
+}
+
+// Compiled functions of a domain. Templates and assertions are indexed in the order
+// of Policy::get_compiled_parts over the policies of the domain conf, null for those
+// which are interpreted.
+struct CompiledDomain {
+    // Fingerprint of the domain conf the module is compiled from.
+    const char* fingerprint;
+    size_t policy_count;
+    // Number of param slots of each policy.
+    const size_t* policy_slot_counts;
+    size_t template_count;
+    const CompiledRenderFunc* templates;
+    size_t assertion_count;
+    const CompiledAssertionFunc* assertions;
+};
+
+} // namespace dmkit
+
+// Symbols exported by a compiled module. The ABI is checked before the domain is got.
+extern "C" {
+typedef const dmkit::CompiledPolicyAbi* (*DmkitCompiledPolicyAbiFunc)();
+typedef const dmkit::CompiledDomain* (*DmkitCompiledDomainFunc)(const dmkit::CompiledPolicyHost* host);
+}
+
+#define DMKIT_COMPILED_POLICY_ABI_SYMBOL "dmkit_compiled_policy_abi"
+#define DMKIT_COMPILED_DOMAIN_SYMBOL "dmkit_compiled_domain"
+
+#endif  //DMKIT_COMPILED_POLICY_H
@@ -0,0 +1,131 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "compiled_policy_module.h"
+#include <dlfcn.h>
+#include <cstdint>
+#include <cstdio>
+#include "app_log.h"
+#include "param_template.h"
+#include "utils.h"
+
+namespace dmkit {
+
+static bool host_try_atof(const std::string& str, double& value) {
+    return utils::try_atof(str, value);
+}
+
+static void host_trim(std::string& str) {
+    utils::trim(str);
+}
+
+static const CompiledPolicyHost HOST = {
+    ParamTemplate::split_list,
+    host_try_atof,
+    host_trim
+};
+
+static bool abi_equals(const CompiledPolicyAbi& a, const CompiledPolicyAbi& b) {
+    return a.version == b.version
+        && a.gxx_abi_version == b.gxx_abi_version
+        && a.cxx11_abi == b.cxx11_abi
+        && a.string_size == b.string_size
+        && a.vector_size == b.vector_size;
+}
+
+CompiledPolicyModule::CompiledPolicyModule(const std::string& path,
+                                           void* handle,
+                                           const CompiledDomain* domain)
+    : _path(path), _handle(handle), _domain(domain) {
+}
+
+CompiledPolicyModule::~CompiledPolicyModule() {
+    dlclose(this->_handle);
+}
+
+std::shared_ptr<CompiledPolicyModule> CompiledPolicyModule::load(const std::string& path,
+                                                                 const std::string& conf_fingerprint) {
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        APP_LOG(WARNING) << "Failed to load compiled policy " << path << ": " << dlerror();
+        return nullptr;
+    }
+    DmkitCompiledPolicyAbiFunc get_abi = reinterpret_cast<DmkitCompiledPolicyAbiFunc>(
+        dlsym(handle, DMKIT_COMPILED_POLICY_ABI_SYMBOL));
+    DmkitCompiledDomainFunc get_domain = reinterpret_cast<DmkitCompiledDomainFunc>(
+        dlsym(handle, DMKIT_COMPILED_DOMAIN_SYMBOL));
+    if (get_abi == nullptr || get_domain == nullptr) {
+        APP_LOG(WARNING) << "Invalid compiled policy " << path << ", symbols not found";
+        dlclose(handle);
+        return nullptr;
+    }
+    const CompiledPolicyAbi* abi = get_abi();
+    CompiledPolicyAbi expected_abi = compiled_policy_abi();
+    if (abi == nullptr || !abi_equals(*abi, expected_abi)) {
+        APP_LOG(WARNING) << "ABI of compiled policy " << path << " does not match dmkit";
+        dlclose(handle);
+        return nullptr;
+    }
+    const CompiledDomain* domain = get_domain(&HOST);
+    if (domain == nullptr || domain->fingerprint == nullptr || conf_fingerprint != domain->fingerprint) {
+        APP_LOG(WARNING) << "Compiled policy " << path << " is compiled from a different conf";
+        dlclose(handle);
+        return nullptr;
+    }
+    return std::shared_ptr<CompiledPolicyModule>(new CompiledPolicyModule(path, handle, domain));
+}
+
+bool CompiledPolicyModule::attach(const std::vector<Policy*>& policies) const {
+    const CompiledDomain* domain = this->_domain;
+    if (policies.size() != domain->policy_count) {
+        APP_LOG(WARNING) << "Compiled policy " << this->_path << " has " << domain->policy_count
+            << " policies, " << policies.size() << " loaded";
+        return false;
+    }
+    std::vector<ParamTemplate*> templates;
+    std::vector<PolicyOutputAssertion*> assertions;
+    for (size_t i = 0; i < policies.size(); ++i) {
+        if (policies[i]->param_slots().size() != domain->policy_slot_counts[i]) {
+            APP_LOG(WARNING) << "Compiled policy " << this->_path
+                << " does not match param slots of policy " << i;
+            return false;
+        }
+        policies[i]->get_compiled_parts(templates, assertions);
+    }
+    if (templates.size() != domain->template_count || assertions.size() != domain->assertion_count) {
+        APP_LOG(WARNING) << "Compiled policy " << this->_path << " does not match templates and assertions";
+        return false;
+    }
+    for (size_t i = 0; i < templates.size(); ++i) {
+        templates[i]->set_compiled(domain->templates[i]);
+    }
+    for (size_t i = 0; i < assertions.size(); ++i) {
+        assertions[i]->compiled = domain->assertions[i];
+    }
+    return true;
+}
+
+// 64 bit FNV-1a hash along with the length of the conf.
+std::string CompiledPolicyModule::fingerprint(const std::string& conf) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c: conf) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%016llx-%zu", (unsigned long long)hash, conf.length());
+    return buffer;
+}
+
+} // namespace dmkit
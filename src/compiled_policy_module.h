@@ -0,0 +1,60 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_COMPILED_POLICY_MODULE_H
+#define DMKIT_COMPILED_POLICY_MODULE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "compiled_policy.h"
+#include "policy.h"
+
+namespace dmkit {
+
+// A domain compiled into a shared object by tools/policy_compiler, loaded with dlopen.
+// Templates and assertions of the policies of the domain are run by the compiled functions,
+// everything else is interpreted as before. The module is unloaded when it is destroyed,
+// it must outlive the policies it is attached to.
+class CompiledPolicyModule {
+public:
+    ~CompiledPolicyModule();
+
+    // Load a module compiled from a domain conf with the given fingerprint. Returns null
+    // with a warning if the module cannot be loaded, is built with a different ABI
+    // or is compiled from a different conf, in which case the domain is interpreted.
+    static std::shared_ptr<CompiledPolicyModule> load(const std::string& path,
+                                                      const std::string& conf_fingerprint);
+
+    // Attach compiled functions to the policies of the domain, in the order of the domain conf.
+    // Nothing is attached and false is returned if the module does not match the policies.
+    bool attach(const std::vector<Policy*>& policies) const;
+
+    // Fingerprint of the content of a domain conf.
+    static std::string fingerprint(const std::string& conf);
+
+    CompiledPolicyModule(CompiledPolicyModule const&) = delete;
+    void operator=(CompiledPolicyModule const&) = delete;
+
+private:
+    CompiledPolicyModule(const std::string& path, void* handle, const CompiledDomain* domain);
+
+    std::string _path;
+    void* _handle;
+    const CompiledDomain* _domain;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_COMPILED_POLICY_MODULE_H
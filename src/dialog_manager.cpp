@@ -13,20 +13,339 @@
 // limitations under the License.
 
 #include "dialog_manager.h"
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include "app_log.h"
+#include "bthread.h"
 #include "butil.h"
 #include "rapidjson.h"
 #include "request_context.h"
+#include "session_store.h"
 #include "utils.h"
 
+DEFINE_bool(log_request_body, true, "Add the full request body to notice log");
+DEFINE_bool(parallel_rewrite_query, false, "Call unit bot for query and rewrite_query in parallel");
+DEFINE_bool(async_run, false, "Handle requests asynchronously without blocking bthreads on unit bot calls");
+DEFINE_bool(session_store, false, "Keep dmkit sessions on server side and only send session id to clients");
+DEFINE_string(session_store_path, "./data/session", "Leveldb path of session store, keep sessions in memory only if empty");
+DEFINE_int32(session_cache_capacity, 100000, "Max number of sessions cached in memory");
+DEFINE_int32(session_ttl_s, 86400, "Seconds a session expires after it was last saved");
+DEFINE_int32(session_sweep_interval_s, 600, "Seconds between sweeps removing expired sessions, 0 to disable");
+DEFINE_int32(max_batch_size, 100, "Max number of requests in a batch request");
+DEFINE_int32(batch_concurrency, 8, "Number of bthreads processing requests of a batch concurrently");
+
 namespace dmkit {
 
+// Returned by process_request when policies of an asynchronous turn wait for
+// remote service calls of user functions.
+static const int PROCESS_WAITING_SERVICE_CALLS = 1;
+
+// SAX handler to extract the dmkit session from a bot_session json string.
+// Only top level bot_id & session_id and the path dialog_state.contexts.dmkit.session
+// are looked at, the parsing stops as soon as all of them are found,
+// so no DOM is built for the rest of bot_session such as interactions.
+class DmSessionHandler
+    : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, DmSessionHandler> {
+public:
+    DmSessionHandler()
+        : _depth(0), _matched(0), _key_hit(false), _top_key(TOP_KEY_NONE),
+          _is_object(false), _has_bot_id(false), _has_session_id(false), _has_session(false) {}
+
+    bool Default() {
+        if (this->_depth == 1 && this->_top_key == TOP_KEY_SESSION_ID) {
+            this->_has_session_id = true;
+        }
+        this->_key_hit = false;
+        this->_top_key = TOP_KEY_NONE;
+        return !this->done();
+    }
+
+    bool String(const char* str, rapidjson::SizeType length, bool copy) {
+        (void)copy;
+        if (this->_depth == 1 && this->_top_key == TOP_KEY_BOT_ID) {
+            this->_bot_id.assign(str, length);
+            this->_has_bot_id = true;
+        } else if (this->_key_hit && this->_matched == PATH_SIZE - 1) {
+            this->_session.assign(str, length);
+            this->_has_session = true;
+        }
+        return this->Default();
+    }
+
+    bool Key(const char* str, rapidjson::SizeType length, bool copy) {
+        (void)copy;
+        this->_key_hit = this->_matched == this->_depth - 1
+            && this->_matched < PATH_SIZE
+            && key_equals(str, length, SESSION_PATH[this->_matched]);
+        this->_top_key = TOP_KEY_NONE;
+        if (this->_depth == 1) {
+            if (key_equals(str, length, "bot_id")) {
+                this->_top_key = TOP_KEY_BOT_ID;
+            } else if (key_equals(str, length, "session_id")) {
+                this->_top_key = TOP_KEY_SESSION_ID;
+            }
+        }
+        return true;
+    }
+
+    bool StartObject() {
+        if (this->_depth == 0) {
+            this->_is_object = true;
+        } else if (this->_key_hit && this->_matched == this->_depth - 1) {
+            this->_matched = this->_depth;
+        }
+        this->start_container();
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType member_count) {
+        (void)member_count;
+        return this->end_container();
+    }
+
+    bool StartArray() {
+        this->start_container();
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType element_count) {
+        (void)element_count;
+        return this->end_container();
+    }
+
+    // Whether all required fields are found and parsing can stop
+    bool done() const {
+        return this->_has_bot_id && this->_has_session_id && this->_has_session;
+    }
+
+    bool is_object() const { return this->_is_object; }
+    const std::string& bot_id() const { return this->_bot_id; }
+    const std::string& session() const { return this->_session; }
+
+private:
+    enum TopKey {
+        TOP_KEY_NONE,
+        TOP_KEY_BOT_ID,
+        TOP_KEY_SESSION_ID
+    };
+
+    static const int PATH_SIZE = 4;
+    static const char* const SESSION_PATH[PATH_SIZE];
+
+    static bool key_equals(const char* str, rapidjson::SizeType length, const char* key) {
+        return strlen(key) == length && strncmp(str, key, length) == 0;
+    }
+
+    void start_container() {
+        if (this->_depth == 1 && this->_top_key == TOP_KEY_SESSION_ID) {
+            this->_has_session_id = true;
+        }
+        this->_depth++;
+        this->_key_hit = false;
+        this->_top_key = TOP_KEY_NONE;
+    }
+
+    bool end_container() {
+        if (this->_matched > 0 && this->_matched == this->_depth - 1) {
+            this->_matched--;
+        }
+        this->_depth--;
+        this->_key_hit = false;
+        this->_top_key = TOP_KEY_NONE;
+        return !this->done();
+    }
+
+    // Count of open objects/arrays
+    int _depth;
+    // Count of leading SESSION_PATH elements matched by the open objects
+    int _matched;
+    // Whether the last key continues the matched path
+    bool _key_hit;
+    TopKey _top_key;
+    bool _is_object;
+    bool _has_bot_id;
+    bool _has_session_id;
+    bool _has_session;
+    std::string _bot_id;
+    std::string _session;
+};
+
+const char* const DmSessionHandler::SESSION_PATH[DmSessionHandler::PATH_SIZE] = {
+    "dialog_state", "contexts", "dmkit", "session"
+};
+
+// Extract dmkit session from the bot_session string in request.
+// Returns -1 if it is not a valid bot_session saved by DMKit for the bot.
+static int extract_dm_session(const char* bot_session,
+                              size_t length,
+                              const std::string& bot_id,
+                              std::string& dm_session) {
+    if (length == 0) {
+        return -1;
+    }
+    DmSessionHandler handler;
+    rapidjson::MemoryStream ms(bot_session, length);
+    rapidjson::Reader reader;
+    rapidjson::ParseResult result = reader.Parse(ms, handler);
+    // Parsing is terminated by the handler once it got everything required.
+    if (result.IsError() && !(result.Code() == rapidjson::kParseErrorTermination && handler.done())) {
+        return -1;
+    }
+    if (!handler.is_object() || !handler.done() || handler.bot_id() != bot_id) {
+        return -1;
+    }
+    dm_session = handler.session();
+    return 0;
+}
+
+// Write the ':' separator and json string value of a query to the end of buf.
+static void write_query_value(const std::string& query, BUTIL_NAMESPACE::IOBuf& buf) {
+    utils::IOBufOutputStream os;
+    os.Put(':');
+    rapidjson::Writer<utils::IOBufOutputStream, rapidjson::UTF8<>, rapidjson::UTF8<>,
+                      JsonArenaAllocator> writer(os, current_json_arena());
+    writer.String(query.c_str(), query.length());
+    os.move_to(buf);
+}
+
+// Serialize the request json for UNIT bot api into IOBuf in three parts:
+// everything before the value of request.query, the value with its leading ':',
+// and everything after it. Query of the request can be replaced by writing
+// a different value part with write_query_value.
+static void write_unit_request(const rapidjson::Value& request_doc,
+                               BUTIL_NAMESPACE::IOBuf& prefix,
+                               BUTIL_NAMESPACE::IOBuf& query,
+                               BUTIL_NAMESPACE::IOBuf& suffix) {
+    utils::IOBufOutputStream os;
+    rapidjson::Writer<utils::IOBufOutputStream, rapidjson::UTF8<>, rapidjson::UTF8<>,
+                      JsonArenaAllocator> writer(os, current_json_arena());
+    writer.StartObject();
+    for (auto& m_request: request_doc.GetObject()) {
+        writer.Key(m_request.name.GetString(), m_request.name.GetStringLength());
+        if (strcmp(m_request.name.GetString(), "request") != 0 || !m_request.value.IsObject()) {
+            m_request.value.Accept(writer);
+            continue;
+        }
+        writer.StartObject();
+        for (auto& m_field: m_request.value.GetObject()) {
+            writer.Key(m_field.name.GetString(), m_field.name.GetStringLength());
+            if (strcmp(m_field.name.GetString(), "query") != 0) {
+                m_field.value.Accept(writer);
+                continue;
+            }
+            os.move_to(prefix);
+            m_field.value.Accept(writer);
+            os.move_to(query);
+        }
+        writer.EndObject();
+    }
+    writer.EndObject();
+    os.move_to(suffix);
+}
+
+// Get the type of the first action in unit bot response, empty if there is none.
+static std::string get_action_type(const rapidjson::Value& unit_response_doc) {
+    if (unit_response_doc.HasMember("result")
+            && unit_response_doc["result"].IsObject()
+            && unit_response_doc["result"].HasMember("response")
+            && unit_response_doc["result"]["response"].IsObject()
+            && unit_response_doc["result"]["response"].HasMember("action_list")
+            && unit_response_doc["result"]["response"]["action_list"].IsArray()
+            && unit_response_doc["result"]["response"]["action_list"].Size() > 0
+            && unit_response_doc["result"]["response"]["action_list"][0].IsObject()
+            && unit_response_doc["result"]["response"]["action_list"][0].HasMember("type")
+            && unit_response_doc["result"]["response"]["action_list"][0]["type"].IsString()) {
+        return unit_response_doc["result"]["response"]["action_list"][0]["type"].GetString();
+    }
+    APP_LOG(WARNING) << "Failed to parse action type from unit bot response: "
+        << utils::json_to_string(unit_response_doc);
+    return "";
+}
+
+// Get the bot session string in result of a successful unit bot response,
+// null if the result is not an object or has no bot session string.
+static const rapidjson::Value* get_bot_session(const rapidjson::Value& unit_response_doc) {
+    if (!unit_response_doc.HasMember("result")
+            || !unit_response_doc["result"].IsObject()
+            || !unit_response_doc["result"].HasMember("bot_session")
+            || !unit_response_doc["result"]["bot_session"].IsString()) {
+        APP_LOG(ERROR) << "No bot session in unit bot result: "
+            << utils::json_to_string(unit_response_doc);
+        return nullptr;
+    }
+    return &unit_response_doc["result"]["bot_session"];
+}
+
+// Serialize the request json for UNIT bot api from a protobuf dialog request.
+static void write_unit_request(const DialogRequest& request,
+                               const std::string& log_id,
+                               const std::string& query,
+                               BUTIL_NAMESPACE::IOBuf& payload) {
+    // Request params are sent to unit bot as a json string in client_session.
+    ArenaStringBuffer client_session(current_json_arena());
+    ArenaWriter client_session_writer(client_session, current_json_arena());
+    client_session_writer.StartObject();
+    for (auto const& param: request.client_params()) {
+        client_session_writer.Key(param.key().c_str(), param.key().length());
+        client_session_writer.String(param.value().c_str(), param.value().length());
+    }
+    client_session_writer.EndObject();
+
+    utils::IOBufOutputStream os;
+    rapidjson::Writer<utils::IOBufOutputStream, rapidjson::UTF8<>, rapidjson::UTF8<>,
+                      JsonArenaAllocator> writer(os, current_json_arena());
+    writer.StartObject();
+    writer.Key("version");
+    writer.String("2.0");
+    writer.Key("bot_id");
+    writer.String(request.bot_id().c_str(), request.bot_id().length());
+    writer.Key("log_id");
+    writer.String(log_id.c_str(), log_id.length());
+    writer.Key("request");
+    writer.StartObject();
+    writer.Key("user_id");
+    writer.String(request.user_id().c_str(), request.user_id().length());
+    writer.Key("query");
+    writer.String(query.c_str(), query.length());
+    const QueryInfo& query_info = request.query_info();
+    writer.Key("query_info");
+    writer.StartObject();
+    writer.Key("type");
+    writer.String(query_info.type().c_str(), query_info.type().length());
+    writer.Key("source");
+    writer.String(query_info.source().c_str(), query_info.source().length());
+    if (query_info.has_asr_candidates()) {
+        // Validated as a json array when the request is received.
+        writer.Key("asr_candidates");
+        writer.RawValue(query_info.asr_candidates().c_str(),
+                        query_info.asr_candidates().length(), rapidjson::kArrayType);
+    }
+    writer.EndObject();
+    writer.Key("updates");
+    writer.String(request.updates().c_str(), request.updates().length());
+    writer.Key("client_session");
+    writer.String(client_session.GetString(), client_session.GetSize());
+    writer.Key("bernard_level");
+    writer.Int(request.bernard_level());
+    writer.EndObject();
+    writer.Key("bot_session");
+    writer.String(request.bot_session().c_str(), request.bot_session().length());
+    writer.EndObject();
+    os.move_to(payload);
+}
+
 DialogManager::DialogManager() {
     this->_remote_service_manager = new RemoteServiceManager();
     this->_policy_manager = new PolicyManager();
     this->_token_manager = new TokenManager();
+    this->_session_store = nullptr;
 }
 
 DialogManager::~DialogManager() {
@@ -36,6 +355,8 @@ DialogManager::~DialogManager() {
     this->_remote_service_manager = nullptr;
     delete this->_token_manager;
     this->_token_manager = nullptr;
+    delete this->_session_store;
+    this->_session_store = nullptr;
 }
 
 int DialogManager::init() {
@@ -56,27 +377,590 @@ int DialogManager::init() {
     }
     APP_LOG(TRACE) << "_policy_manager init done";
 
+    if (FLAGS_session_store) {
+        this->_session_store = new SessionStore();
+        if (0 != this->_session_store->init(FLAGS_session_store_path,
+                FLAGS_session_cache_capacity, FLAGS_session_ttl_s, FLAGS_session_sweep_interval_s)) {
+            APP_LOG(ERROR) << "Failed to init _session_store";
+            return -1;
+        }
+        APP_LOG(TRACE) << "_session_store init done";
+    }
+
     return 0;
 }
 
+// Unit bot response of a query understood by unit bot, parsed once and kept by the turn
+// while resolving its policies waits for service calls.
+struct UnitBotResponse {
+    ArenaDocument unit_response_doc;
+    ArenaDocument bot_session_doc;
+    std::unordered_map<std::string, std::string> request_params;
+};
+
+// State of a dialog turn shared by the steps handling a request.
+// An asynchronous turn lives on heap until all of its unit bot calls have called back.
+struct DialogTurn {
+    DialogTurn()
+        : cntl(nullptr), done(nullptr), thread_data(nullptr), parallel_rewrite_query(false),
+          pending_calls(0), query_processed(false), rewrite_query_returned(false),
+          finished(false) {}
+
+    BRPC_NAMESPACE::Controller* cntl;
+    google::protobuf::Closure* done;
+    ThreadDataBase* thread_data;
+    ArenaDocument request_doc;
+    std::string bot_id;
+    std::string rewrite_query;
+    std::string dm_session;
+    // The session is parsed on first use and shared by all process_request calls.
+    std::unique_ptr<PolicyOutputSession> session;
+    // Id of the session if it is found in session store.
+    std::string session_id;
+    std::string access_token;
+    // Policy dict snapshot to resolve with, the current policy dict is used if null.
+    std::shared_ptr<ProductPolicyMap> policy_dict;
+    BUTIL_NAMESPACE::IOBuf payload;
+    BUTIL_NAMESPACE::IOBuf rewrite_payload;
+    // When enabled, unit bot is called for rewrite query at the same time with the
+    // original query instead of after the original query gets no DMKit response.
+    bool parallel_rewrite_query;
+    RemoteServiceCall query_call;
+    RemoteServiceCall rewrite_query_call;
+    std::string query_response;
+    std::string response;
+    // Pure user function results of the passes resolving the query and the rewrite query,
+    // including passes of an asynchronous turn resumed after service calls.
+    UserFunctionMemo memo;
+
+    // Following fields are only used by asynchronous turns.
+    RemoteServiceCall token_call;
+    // Remote service calls of user functions
+    std::unique_ptr<AsyncServiceCalls> service_calls;
+    // The query whose policies are waiting for service calls
+    std::unique_ptr<UnitBotResponse> waiting_response;
+    // Following fields are guarded by mutex.
+    std::mutex mutex;
+    // Number of continuations which have not finished yet, including calls not called back
+    int pending_calls;
+    // The original query has no DMKit response and is waiting for the rewrite query
+    bool query_processed;
+    // The rewrite query result arrived before the original query was processed
+    bool rewrite_query_returned;
+    // The response is decided, results of other calls are ignored
+    bool finished;
+};
+
 int DialogManager::run(BRPC_NAMESPACE::Controller* cntl) {
-    std::string request_json = cntl->request_attachment().to_string();
-    APP_LOG(TRACE) << "received request: " << request_json;
-    this->add_notice_log("req", request_json);
+    DialogTurn turn;
+    turn.cntl = cntl;
+    if (this->parse_request(turn) != 0) {
+        return 0;
+    }
+    if (this->prepare_turn(turn) == 0) {
+        this->run_turn(turn);
+    }
+    this->send_json_response(cntl, turn.response);
+    return 0;
+}
+
+void DialogManager::run_turn(DialogTurn& turn) {
+    this->call_unit_bot(turn.access_token, turn.payload, turn.query_call, nullptr);
+    if (turn.parallel_rewrite_query) {
+        this->call_unit_bot(turn.access_token, turn.rewrite_payload, turn.rewrite_query_call, nullptr);
+    }
+
+    bool is_dmkit_response = false;
+    this->process_request(turn, turn.query_call, turn.query_response, is_dmkit_response);
+    if (is_dmkit_response || turn.rewrite_query.empty()) {
+        if (turn.parallel_rewrite_query) {
+            // Response of the original query is used, cancel the rewrite query call.
+            turn.rewrite_query_call.cancel();
+            RemoteServiceResult canceled_result;
+            turn.rewrite_query_call.join(canceled_result);
+        }
+        turn.response.swap(turn.query_response);
+        return;
+    }
+    if (!turn.parallel_rewrite_query) {
+        this->call_unit_bot(turn.access_token, turn.rewrite_payload, turn.rewrite_query_call, nullptr);
+    }
+    this->process_rewrite_query(turn);
+}
+
+// A request in a batch, processed by one of the batch workers.
+struct DialogBatchItem {
+    const rapidjson::Value* request;
+    std::string access_token;
+    std::string response;
+    std::string notice_log;
+};
+
+// State of a batch shared by its worker bthreads, each worker takes the next unprocessed item.
+struct DialogBatch {
+    DialogManager* dialog_manager;
+    // Pool of the thread data of the batch request, workers acquire their thread data from it
+    ThreadDataPool* data_pool;
+    std::shared_ptr<ProductPolicyMap> policy_dict;
+    std::vector<DialogBatchItem> items;
+    std::atomic<size_t> next_item;
+};
+
+void DialogManager::run_batch(BRPC_NAMESPACE::Controller* cntl) {
+    const BUTIL_NAMESPACE::IOBuf& request_body = cntl->request_attachment();
+    if (FLAGS_log_request_body) {
+        this->add_notice_log("req", request_body.to_string());
+    }
+    std::vector<char>& request_buffer = current_thread_data()->request_buffer();
+    request_buffer.resize(request_body.size() + 1);
+    request_body.copy_to(request_buffer.data(), request_body.size());
+    request_buffer[request_body.size()] = '\0';
+
+    ArenaDocument batch_doc;
+    if (batch_doc.ParseInsitu(request_buffer.data()).HasParseError() || !batch_doc.IsArray()) {
+        APP_LOG(WARNING) << "Failed to parse batch request data to json array";
+        cntl->http_response().set_status_code(400);
+        return;
+    }
+    if (batch_doc.Size() > static_cast<rapidjson::SizeType>(FLAGS_max_batch_size)) {
+        APP_LOG(WARNING) << "Batch size " << batch_doc.Size() << " exceeds " << FLAGS_max_batch_size;
+        this->send_json_response(cntl, this->get_error_response(-1, "Batch size exceeds limit"));
+        return;
+    }
+    this->add_notice_log("batch_size", std::to_string(batch_doc.Size()));
+
+    // All items are resolved with the same policy dict even if it is reloaded meanwhile,
+    // and access token is got only once for each bot.
+    DialogBatch batch;
+    batch.dialog_manager = this;
+    batch.data_pool = current_thread_data()->pool();
+    batch.policy_dict = this->_policy_manager->get_policy_dict();
+    batch.next_item = 0;
+    std::string uri_access_token;
+    const std::string* access_token_ptr = cntl->http_request().uri().GetQuery("access_token");
+    if (access_token_ptr != nullptr) {
+        uri_access_token = *access_token_ptr;
+    }
+    std::unordered_map<std::string, std::string> bot_access_tokens;
+    batch.items.resize(batch_doc.Size());
+    for (rapidjson::SizeType i = 0; i < batch_doc.Size(); ++i) {
+        DialogBatchItem& item = batch.items[i];
+        item.request = &batch_doc[i];
+        item.access_token = uri_access_token;
+        if (!item.access_token.empty() || !item.request->IsObject()
+                || !item.request->HasMember("bot_id") || !(*item.request)["bot_id"].IsString()) {
+            continue;
+        }
+        std::string bot_id = (*item.request)["bot_id"].GetString();
+        auto token_iter = bot_access_tokens.find(bot_id);
+        if (token_iter == bot_access_tokens.end()) {
+            std::string access_token;
+            if (this->_token_manager->get_access_token(
+                    bot_id, this->_remote_service_manager, access_token) != 0) {
+                APP_LOG(ERROR) << "Failed to get access token for bot " << bot_id;
+            }
+            token_iter = bot_access_tokens.insert({bot_id, access_token}).first;
+        }
+        item.access_token = token_iter->second;
+    }
+
+    size_t worker_count = std::min(batch.items.size(),
+                                   static_cast<size_t>(std::max(FLAGS_batch_concurrency, 1)));
+    std::vector<bthread_t> workers;
+    for (size_t i = 0; i < worker_count; ++i) {
+        bthread_t worker;
+        if (bthread_start_background(&worker, nullptr, DialogManager::run_batch_worker, &batch) != 0) {
+            APP_LOG(WARNING) << "Failed to start batch worker";
+            continue;
+        }
+        workers.push_back(worker);
+    }
+    if (workers.empty()) {
+        // Process all items in current bthread.
+        DialogManager::run_batch_worker(&batch);
+    }
+    for (bthread_t worker: workers) {
+        bthread_join(worker, nullptr);
+    }
+
+    std::string response = "[";
+    for (size_t i = 0; i < batch.items.size(); ++i) {
+        const DialogBatchItem& item = batch.items[i];
+        if (i > 0) {
+            response += ",";
+        }
+        response += item.response;
+        if (!item.notice_log.empty()) {
+            this->add_notice_log("item" + std::to_string(i), item.notice_log);
+        }
+    }
+    response += "]";
+    this->send_json_response(cntl, response);
+}
+
+void* DialogManager::run_batch_worker(void* arg) {
+    DialogBatch* batch = static_cast<DialogBatch*>(arg);
+    DialogManager* dialog_manager = batch->dialog_manager;
+    // Each worker has its own thread data so that items have their own log id,
+    // notice log and json arena.
+    ThreadDataBase* data = nullptr;
+    if (batch->data_pool != nullptr) {
+        data = batch->data_pool->acquire();
+    } else {
+        data = static_cast<ThreadDataBase*>(dialog_manager->create_thread_data());
+    }
+    {
+        ScopedThreadData scoped_data(data);
+        size_t index = 0;
+        while ((index = batch->next_item.fetch_add(1)) < batch->items.size()) {
+            data->reset();
+            DialogBatchItem& item = batch->items[index];
+            dialog_manager->run_batch_item(batch->policy_dict, item);
+            item.notice_log = data->get_notice_log();
+        }
+        data->reset();
+    }
+    if (batch->data_pool != nullptr) {
+        batch->data_pool->release(data);
+    } else {
+        dialog_manager->destroy_thread_data(data);
+    }
+    return nullptr;
+}
+
+void DialogManager::run_batch_item(const std::shared_ptr<ProductPolicyMap>& policy_dict,
+                                   DialogBatchItem& item) {
+    if (!item.request->IsObject()) {
+        item.response = this->get_error_response(-1, "Invalid request");
+        return;
+    }
+    DialogTurn turn;
+    turn.policy_dict = policy_dict;
+    turn.access_token = item.access_token;
+    turn.request_doc.CopyFrom(*item.request, turn.request_doc.GetAllocator());
+    if (this->prepare_turn(turn) == 0) {
+        this->run_turn(turn);
+    }
+    item.response.swap(turn.response);
+}
+
+void DialogManager::resolve(BRPC_NAMESPACE::Controller* cntl,
+                            const DialogRequest* request,
+                            DialogResponse* response) {
+    (void)cntl;
+    if (FLAGS_log_request_body) {
+        this->add_notice_log("req", request->ShortDebugString());
+    }
+    std::string log_id = "dmkit_" + request->log_id();
+    this->set_log_id(log_id);
+    response->set_log_id(log_id);
+
+    if (request->query_info().has_asr_candidates()) {
+        const std::string& asr_candidates = request->query_info().asr_candidates();
+        ArenaDocument asr_candidates_doc;
+        if (asr_candidates_doc.Parse(asr_candidates.c_str()).HasParseError()
+                || !asr_candidates_doc.IsArray()) {
+            APP_LOG(ERROR) << "Invalid asr_candidates in query_info: " << asr_candidates;
+            response->set_error_code(-1);
+            response->set_error_msg("Invalid asr_candidates in query_info");
+            return;
+        }
+    }
+
+    std::string access_token = request->access_token();
+    if (access_token.empty() && this->_token_manager->get_access_token(
+                request->bot_id(), this->_remote_service_manager, access_token) != 0) {
+        APP_LOG(ERROR) << "Failed to get access token";
+        response->set_error_code(-1);
+        response->set_error_msg("Failed to get access token");
+        return;
+    }
+
+    PolicyOutputSession session;
+    std::string session_id;
+    const DialogSession& request_session = request->session();
+    if (request_session.has_session_id()) {
+        this->load_session(request->bot_id(), request_session.session_id(), session, session_id);
+    } else {
+        session.domain = request_session.domain();
+        session.state = request_session.state();
+        for (auto const& context: request_session.context()) {
+            KVPair kv = {context.key(), context.value()};
+            session.context.push_back(kv);
+        }
+    }
+    std::unordered_map<std::string, std::string> request_params;
+    for (auto const& param: request->client_params()) {
+        request_params[param.key()] = param.value();
+    }
+
+    UserFunctionMemo memo;
+    bool is_dmkit_response = false;
+    this->resolve_query(*request, log_id, access_token, request->query(),
+        request_params, session, session_id, &memo, *response, is_dmkit_response);
+    if (!is_dmkit_response && !request->rewrite_query().empty()) {
+        DialogResponse rewrite_query_response;
+        rewrite_query_response.set_log_id(log_id);
+        this->resolve_query(*request, log_id, access_token, request->rewrite_query(),
+            request_params, session, session_id, &memo, rewrite_query_response, is_dmkit_response);
+        if (is_dmkit_response) {
+            response->Swap(&rewrite_query_response);
+        }
+    }
+    if (!is_dmkit_response && response->error_code() == 0) {
+        // DM session is kept as it was for queries DMKit does not take actions.
+        response->mutable_session()->CopyFrom(request_session);
+    }
+    // Text format of the whole response costs as much as the rest of the turn,
+    // only the result is logged.
+    this->add_notice_log("ret", std::to_string(response->error_code()));
+    if (response->has_error_msg()) {
+        this->add_notice_log("error_msg", response->error_msg());
+    }
+}
+
+void DialogManager::resolve_query(const DialogRequest& request,
+                                  const std::string& log_id,
+                                  const std::string& access_token,
+                                  const std::string& query,
+                                  const std::unordered_map<std::string, std::string>& request_params,
+                                  const PolicyOutputSession& session,
+                                  const std::string& session_id,
+                                  UserFunctionMemo* memo,
+                                  DialogResponse& response,
+                                  bool& is_dmkit_response) {
+    is_dmkit_response = false;
+    BUTIL_NAMESPACE::IOBuf payload;
+    write_unit_request(request, log_id, query, payload);
+    RemoteServiceCall unit_bot_call;
+    this->call_unit_bot(access_token, payload, unit_bot_call, nullptr);
+    RemoteServiceResult rsr;
+    if (unit_bot_call.join(rsr) != 0) {
+        APP_LOG(ERROR) << "Failed to call unit bot api";
+        response.set_error_code(-1);
+        response.set_error_msg("Failed to call unit bot api");
+        return;
+    }
+    const std::string& unit_bot_result = rsr.result;
+    APP_LOG(TRACE) << "unit bot result: " << unit_bot_result;
+
+    ArenaDocument unit_response_doc;
+    if (unit_response_doc.Parse(unit_bot_result.c_str()).HasParseError()
+            || !unit_response_doc.IsObject()) {
+        APP_LOG(ERROR) << "Failed to parse unit bot result: " << unit_bot_result;
+        response.set_error_code(-1);
+        response.set_error_msg("Failed to parse unit bot result");
+        return;
+    }
+    if (!unit_response_doc.HasMember("error_code")
+            || !unit_response_doc["error_code"].IsInt()
+            || unit_response_doc["error_code"].GetInt() != 0) {
+        response.set_error_code(-1);
+        if (unit_response_doc.HasMember("error_code") && unit_response_doc["error_code"].IsInt()) {
+            response.set_error_code(unit_response_doc["error_code"].GetInt());
+        }
+        if (unit_response_doc.HasMember("error_msg") && unit_response_doc["error_msg"].IsString()) {
+            response.set_error_msg(unit_response_doc["error_msg"].GetString());
+        }
+        return;
+    }
+
+    // Bot session of unit bot is returned as it is, DMKit session has its own field
+    // so that it is not written into bot session like json responses.
+    const rapidjson::Value* bot_session_value = get_bot_session(unit_response_doc);
+    if (bot_session_value == nullptr) {
+        response.set_error_code(-1);
+        response.set_error_msg("Failed to parse bot session");
+        return;
+    }
+    const rapidjson::Value& bot_session = *bot_session_value;
+    ArenaDocument bot_session_doc;
+    if (bot_session_doc.Parse(bot_session.GetString(), bot_session.GetStringLength()).HasParseError()
+            || !bot_session_doc.IsObject()) {
+        APP_LOG(ERROR) << "Failed to parse bot session: " << bot_session.GetString();
+        response.set_error_code(-1);
+        response.set_error_msg("Failed to parse bot session");
+        return;
+    }
+    std::string action_type = get_action_type(unit_response_doc);
+    if (action_type == "satisfy") {
+        response.set_error_code(-1);
+        response.set_error_msg("Unsupported action type satisfy");
+        return;
+    }
+    response.set_error_code(0);
+    response.set_bot_session(bot_session.GetString(), bot_session.GetStringLength());
+    if (action_type != "understood") {
+        if (action_type.empty()) {
+            return;
+        }
+        for (auto& v_action: unit_response_doc["result"]["response"]["action_list"].GetArray()) {
+            DialogAction* action = response.add_action();
+            if (v_action.HasMember("action_id") && v_action["action_id"].IsString()) {
+                action->set_action_id(v_action["action_id"].GetString());
+            }
+            if (v_action.HasMember("type") && v_action["type"].IsString()) {
+                action->set_type(v_action["type"].GetString());
+            }
+            if (v_action.HasMember("say") && v_action["say"].IsString()) {
+                action->set_say(v_action["say"].GetString());
+            }
+        }
+        return;
+    }
+
+    std::string error_msg;
+    PolicyOutput& policy_output = current_thread_data()->policy_output();
+    memo->start_query();
+    if (this->resolve_policy_output(nullptr, request.bot_id(), log_id, query,
+            bot_session_doc["dialog_state"], request_params, session, nullptr, memo,
+            policy_output, error_msg) != 0) {
+        response.Clear();
+        response.set_log_id(log_id);
+        response.set_error_code(-1);
+        response.set_error_msg(error_msg);
+        return;
+    }
+    DialogSession* response_session = response.mutable_session();
+    if (this->_session_store != nullptr) {
+        response_session->set_session_id(this->save_session(
+            request.bot_id(), session_id, policy_output.session));
+    } else {
+        response_session->set_domain(policy_output.session.domain);
+        response_session->set_state(policy_output.session.state);
+        for (auto const& context: policy_output.session.context) {
+            KeyValue* kv = response_session->add_context();
+            kv->set_key(context.key);
+            kv->set_value(context.value);
+        }
+    }
+    DialogOutput* output = response.mutable_output();
+    for (auto const& meta: policy_output.meta) {
+        KeyValue* kv = output->add_meta();
+        kv->set_key(meta.key);
+        kv->set_value(meta.value);
+    }
+    for (auto const& result: policy_output.results) {
+        DialogResult* output_result = output->add_result();
+        output_result->set_type(result.type);
+        output_result->set_value(result.values[0]);
+        if (!result.extra.empty()) {
+            output_result->set_extra(result.extra);
+        }
+    }
+    is_dmkit_response = true;
+}
 
-    rapidjson::Document request_doc;
+bool DialogManager::is_async() const {
+    return FLAGS_async_run;
+}
+
+void DialogManager::run_async(BRPC_NAMESPACE::Controller* cntl,
+                              ThreadDataBase* data,
+                              google::protobuf::Closure* done) {
+    DialogTurn* turn = new DialogTurn();
+    turn->cntl = cntl;
+    turn->done = done;
+    turn->thread_data = data;
+    turn->service_calls.reset(new AsyncServiceCalls(this->_remote_service_manager));
+    // Like every continuation, run_async holds the turn until it returns, so that the turn
+    // is never finished while the thread data is still bound to current bthread.
+    turn->pending_calls = 1;
+    bool parsed = false;
+    {
+        ScopedThreadData scoped_data(data);
+        APP_LOG(TRACE) << "Running application asynchronously";
+        parsed = this->parse_request(*turn) == 0;
+        if (parsed) {
+            this->start_turn(turn);
+        }
+    }
+    if (!parsed) {
+        delete turn;
+        done->Run();
+        return;
+    }
+    this->release_turn(turn);
+}
+
+void DialogManager::start_turn(DialogTurn* turn) {
+    if (this->read_request(*turn) != 0) {
+        return;
+    }
+    if (turn->access_token.empty()
+            && this->_token_manager->get_cached_access_token(turn->bot_id, turn->access_token) != 0) {
+        // The token is got from remote in a continuation instead of blocking current bthread.
+        this->hold_turn(turn);
+        this->_token_manager->call_access_token(turn->bot_id, this->_remote_service_manager,
+            turn->token_call,
+            google::protobuf::NewCallback(this, &DialogManager::on_access_token_returned, turn));
+        return;
+    }
+    this->start_unit_bot_calls(turn);
+}
+
+void DialogManager::start_unit_bot_calls(DialogTurn* turn) {
+    this->write_payloads(*turn);
+    // The rewrite query call starts first, it is not canceled before starting that way.
+    if (turn->parallel_rewrite_query) {
+        this->hold_turn(turn);
+        this->call_unit_bot(turn->access_token, turn->rewrite_payload, turn->rewrite_query_call,
+            google::protobuf::NewCallback(this, &DialogManager::on_rewrite_query_returned, turn));
+    }
+    this->hold_turn(turn);
+    this->call_unit_bot(turn->access_token, turn->payload, turn->query_call,
+        google::protobuf::NewCallback(this, &DialogManager::on_query_returned, turn));
+}
+
+int DialogManager::parse_request(DialogTurn& turn) {
+    BRPC_NAMESPACE::Controller* cntl = turn.cntl;
+    const BUTIL_NAMESPACE::IOBuf& request_body = cntl->request_attachment();
+    APP_LOG(TRACE) << "received request: " << request_body;
+    if (FLAGS_log_request_body) {
+        this->add_notice_log("req", request_body.to_string());
+    }
+
+    // Copy request body into the reusable thread buffer and parse it in-situ,
+    // string values in request_doc are views into the buffer afterwards.
+    ThreadDataBase* tls = current_thread_data();
+    std::vector<char>& request_buffer = tls->request_buffer();
+    request_buffer.resize(request_body.size() + 1);
+    request_body.copy_to(request_buffer.data(), request_body.size());
+    request_buffer[request_body.size()] = '\0';
+
+    ArenaDocument& request_doc = turn.request_doc;
     // In the case we cannot parse the request json, it is not a valid request.
-    if (request_doc.Parse(request_json.c_str()).HasParseError() || !request_doc.IsObject()) {
+    if (request_doc.ParseInsitu(request_buffer.data()).HasParseError() || !request_doc.IsObject()) {
         APP_LOG(WARNING) << "Failed to parse request data to json";
         cntl->http_response().set_status_code(400);
-        return 0;
+        return -1;
     }
 
+    return 0;
+}
+
+int DialogManager::prepare_turn(DialogTurn& turn) {
+    if (this->read_request(turn) != 0) {
+        return -1;
+    }
+    if (turn.access_token.empty() && this->_token_manager->get_access_token(
+                turn.bot_id, this->_remote_service_manager, turn.access_token) != 0) {
+        APP_LOG(ERROR) << "Failed to get access token";
+        turn.response = this->get_error_response(-1, "Failed to get access token");
+        return -1;
+    }
+    this->write_payloads(turn);
+
+    return 0;
+}
+
+int DialogManager::read_request(DialogTurn& turn) {
+    ArenaDocument& request_doc = turn.request_doc;
     // Need to set log_id as soon as we can get it to avoid missing log_id in logs.
     if (!request_doc.HasMember("log_id") || !request_doc["log_id"].IsString()) {
         APP_LOG(WARNING) << "Missing log_id";
-        this->send_json_response(cntl, this->get_error_response(-1, "Missing log_id"));
-        return 0;
+        turn.response = this->get_error_response(-1, "Missing log_id");
+        return -1;
     }
     std::string log_id = request_doc["log_id"].GetString();
     std::string dmkit_log_id_prefix = "dmkit_";
@@ -87,106 +971,287 @@ int DialogManager::run(BRPC_NAMESPACE::Controller* cntl) {
     // Parsing bot_id from request json
     if (!request_doc.HasMember("bot_id") || !request_doc["bot_id"].IsString()) {
         APP_LOG(WARNING) << "Missing bot_id";
-        this->send_json_response(cntl, this->get_error_response(-1, "Missing bot_id"));
-        return 0;
+        turn.response = this->get_error_response(-1, "Missing bot_id");
+        return -1;
     }
-    std::string bot_id = request_doc["bot_id"].GetString();
+    std::string& bot_id = turn.bot_id;
+    bot_id = request_doc["bot_id"].GetString();
 
     if (!request_doc.HasMember("request") || !request_doc["request"].HasMember("query")
             || !request_doc["request"]["query"].IsString()) {
         APP_LOG(WARNING) << "Missing query";
-        this->send_json_response(cntl, this->get_error_response(-1, "Missing query"));
-        return 0;
+        turn.response = this->get_error_response(-1, "Missing query");
+        return -1;
     }
-    std::string query = request_doc["request"]["query"].GetString();
-    std::string rewrite_query;
     if (request_doc["request"].HasMember("rewrite_query") 
             && request_doc["request"]["rewrite_query"].IsString()) {
-        rewrite_query = request_doc["request"]["rewrite_query"].GetString();
+        turn.rewrite_query = request_doc["request"]["rewrite_query"].GetString();
         request_doc["request"].RemoveMember("rewrite_query");
     }
 
     // Get dmkit session from request. We saved it in the bot session in latest response.
-    std::string dm_session;
     if (request_doc.HasMember("bot_session")) {
-        std::string request_bot_session = request_doc["bot_session"].GetString();
-        rapidjson::Document request_bot_session_doc;
-        if (request_bot_session.empty()
-                || request_bot_session_doc.Parse(request_bot_session.c_str()).HasParseError()
-                || !request_bot_session_doc.IsObject()
-                || !request_bot_session_doc.HasMember("bot_id")
-                || !request_bot_session_doc["bot_id"].IsString()
-                || request_bot_session_doc["bot_id"].GetString() != bot_id
-                || !request_bot_session_doc.HasMember("session_id")
-                || !request_bot_session_doc.HasMember("dialog_state")
-                || !request_bot_session_doc["dialog_state"].HasMember("contexts")
-                || !request_bot_session_doc["dialog_state"]["contexts"].HasMember("dmkit")
-                || !request_bot_session_doc["dialog_state"]["contexts"]["dmkit"].HasMember("session")) {
+        const rapidjson::Value& request_bot_session = request_doc["bot_session"];
+        if (!request_bot_session.IsString()
+                || extract_dm_session(request_bot_session.GetString(),
+                    request_bot_session.GetStringLength(), bot_id, turn.dm_session) != 0) {
             // Not a valid session from DMKit
             request_doc["bot_session"].SetString("", 0, request_doc.GetAllocator());
-        } else {
-            dm_session =
-                request_bot_session_doc["dialog_state"]["contexts"]["dmkit"]["session"].GetString();
+            turn.dm_session.clear();
         }
     }
-    APP_LOG(TRACE) << "dm session: " << dm_session;
-    PolicyOutputSession session = PolicyOutputSession::from_json_str(dm_session);
+    APP_LOG(TRACE) << "dm session: " << turn.dm_session;
 
     // Get access_token from request uri.
-    std::string access_token;
-    const std::string* access_token_ptr = cntl->http_request().uri().GetQuery("access_token");
-    if (access_token_ptr != nullptr) {
-        access_token = *access_token_ptr;
+    if (turn.access_token.empty() && turn.cntl != nullptr) {
+        const std::string* access_token_ptr = turn.cntl->http_request().uri().GetQuery("access_token");
+        if (access_token_ptr != nullptr) {
+            turn.access_token = *access_token_ptr;
+        }
     }
-    if (access_token.empty() && this->_token_manager->get_access_token(
-                bot_id, this->_remote_service_manager, access_token) != 0) {
-        APP_LOG(ERROR) << "Failed to get access token";
-        this->send_json_response(cntl, this->get_error_response(-1, "Failed to get access token"));
-        return 0;
+
+    return 0;
+}
+
+void DialogManager::write_payloads(DialogTurn& turn) {
+    // The UNIT request is serialized only once, the rewrite query request
+    // shares the other parts and only has the query value replaced.
+    BUTIL_NAMESPACE::IOBuf payload_prefix;
+    BUTIL_NAMESPACE::IOBuf payload_query;
+    BUTIL_NAMESPACE::IOBuf payload_suffix;
+    write_unit_request(turn.request_doc, payload_prefix, payload_query, payload_suffix);
+    turn.payload = payload_prefix;
+    turn.payload.append(payload_query);
+    turn.payload.append(payload_suffix);
+
+    if (!turn.rewrite_query.empty()) {
+        turn.rewrite_payload = payload_prefix;
+        write_query_value(turn.rewrite_query, turn.rewrite_payload);
+        turn.rewrite_payload.append(payload_suffix);
     }
+    turn.parallel_rewrite_query = FLAGS_parallel_rewrite_query && !turn.rewrite_query.empty();
+}
 
-    std::string query_response;
+int DialogManager::process_rewrite_query(DialogTurn& turn) {
+    turn.request_doc["request"]["query"].SetString(turn.rewrite_query.c_str(), 
+        turn.rewrite_query.length(), turn.request_doc.GetAllocator());
+    std::string rewrite_query_response;
     bool is_dmkit_response = false;
-    this->process_request(request_doc, dm_session, access_token, query_response, is_dmkit_response);
-    if (is_dmkit_response || rewrite_query.empty()) {
-        this->send_json_response(cntl, query_response);
-        return 0;
+    if (this->process_request(turn, turn.rewrite_query_call, rewrite_query_response,
+            is_dmkit_response) == PROCESS_WAITING_SERVICE_CALLS) {
+        return PROCESS_WAITING_SERVICE_CALLS;
     }
-    std::string rewrite_query_response;
-    request_doc["request"]["query"].SetString(rewrite_query.c_str(), 
-        rewrite_query.length(), request_doc.GetAllocator());
-    this->process_request(request_doc, dm_session, access_token, 
-        rewrite_query_response, is_dmkit_response);
     if (is_dmkit_response) {
-        this->send_json_response(cntl, rewrite_query_response);
-        return 0;
+        turn.response.swap(rewrite_query_response);
+    } else {
+        turn.response.swap(turn.query_response);
     }
-    this->send_json_response(cntl, query_response);
     return 0;
 }
 
-int DialogManager::process_request(const rapidjson::Document& request_doc,
-                                   const std::string& dm_session,
-                                   const std::string& access_token,
+void DialogManager::on_access_token_returned(DialogTurn* turn) {
+    {
+        ScopedThreadData scoped_data(turn->thread_data);
+        if (this->_token_manager->finish_access_token(
+                turn->bot_id, turn->token_call, turn->access_token) != 0) {
+            APP_LOG(ERROR) << "Failed to get access token";
+            turn->response = this->get_error_response(-1, "Failed to get access token");
+        } else {
+            this->start_unit_bot_calls(turn);
+        }
+    }
+    this->release_turn(turn);
+}
+
+void DialogManager::on_query_returned(DialogTurn* turn) {
+    {
+        ScopedThreadData scoped_data(turn->thread_data);
+        this->process_query_async(turn);
+    }
+    this->release_turn(turn);
+}
+
+void DialogManager::process_query_async(DialogTurn* turn) {
+    bool is_dmkit_response = false;
+    if (this->process_request(*turn, turn->query_call, turn->query_response,
+            is_dmkit_response) == PROCESS_WAITING_SERVICE_CALLS) {
+        // The query is processed again once the service calls have finished.
+        this->wait_service_calls(turn, &DialogManager::on_query_returned);
+        return;
+    }
+
+    bool finished = false;
+    bool process_rewrite_query = false;
+    bool call_rewrite_query = false;
+    {
+        std::lock_guard<std::mutex> lock(turn->mutex);
+        if (is_dmkit_response || turn->rewrite_query.empty()) {
+            turn->response.swap(turn->query_response);
+            turn->finished = true;
+            finished = true;
+        } else if (turn->rewrite_query_returned) {
+            process_rewrite_query = true;
+        } else {
+            turn->query_processed = true;
+            if (!turn->parallel_rewrite_query) {
+                ++turn->pending_calls;
+                call_rewrite_query = true;
+            }
+        }
+    }
+
+    if (finished) {
+        if (turn->parallel_rewrite_query) {
+            // Response of the original query is used, cancel the rewrite query call.
+            turn->rewrite_query_call.cancel();
+        }
+    } else if (process_rewrite_query) {
+        this->process_rewrite_query_async(turn);
+    } else if (call_rewrite_query) {
+        this->call_unit_bot(turn->access_token, turn->rewrite_payload, turn->rewrite_query_call,
+            google::protobuf::NewCallback(this, &DialogManager::on_rewrite_query_returned, turn));
+    }
+}
+
+void DialogManager::on_rewrite_query_returned(DialogTurn* turn) {
+    {
+        ScopedThreadData scoped_data(turn->thread_data);
+        bool process_rewrite_query = false;
+        {
+            std::lock_guard<std::mutex> lock(turn->mutex);
+            if (turn->query_processed) {
+                process_rewrite_query = true;
+            } else if (!turn->finished) {
+                turn->rewrite_query_returned = true;
+            }
+        }
+
+        // Otherwise the original query is processed later, or its response is used
+        // and the result of this call is dropped.
+        if (process_rewrite_query) {
+            this->process_rewrite_query_async(turn);
+        }
+    }
+    this->release_turn(turn);
+}
+
+void DialogManager::on_rewrite_query_resumed(DialogTurn* turn) {
+    {
+        ScopedThreadData scoped_data(turn->thread_data);
+        this->process_rewrite_query_async(turn);
+    }
+    this->release_turn(turn);
+}
+
+void DialogManager::process_rewrite_query_async(DialogTurn* turn) {
+    if (this->process_rewrite_query(*turn) == PROCESS_WAITING_SERVICE_CALLS) {
+        this->wait_service_calls(turn, &DialogManager::on_rewrite_query_resumed);
+    }
+}
+
+void DialogManager::wait_service_calls(DialogTurn* turn, void (DialogManager::*resume)(DialogTurn*)) {
+    this->hold_turn(turn);
+    turn->service_calls->wait(google::protobuf::NewCallback(this, resume, turn));
+}
+
+void DialogManager::hold_turn(DialogTurn* turn) {
+    std::lock_guard<std::mutex> lock(turn->mutex);
+    ++turn->pending_calls;
+}
+
+void DialogManager::release_turn(DialogTurn* turn) {
+    {
+        std::lock_guard<std::mutex> lock(turn->mutex);
+        if (--turn->pending_calls > 0) {
+            return;
+        }
+    }
+    {
+        // Results of all calls are collected here instead of in rpc callbacks, so that
+        // the request's notice log is never written by two bthreads at the same time.
+        ScopedThreadData scoped_data(turn->thread_data);
+        RemoteServiceResult unused_result;
+        turn->query_call.join(unused_result);
+        turn->rewrite_query_call.join(unused_result);
+        this->send_json_response(turn->cntl, turn->response);
+    }
+    google::protobuf::Closure* done = turn->done;
+    delete turn;
+    // The thread data is given to other requests by done, it is not bound any more.
+    done->Run();
+}
+
+int DialogManager::process_request(DialogTurn& turn,
+                                   RemoteServiceCall& unit_bot_call,
                                    std::string& json_response,
                                    bool& is_dmkit_response) {
+    const ArenaDocument& request_doc = turn.request_doc;
+    std::unique_ptr<PolicyOutputSession>& session = turn.session;
     std::string bot_id = request_doc["bot_id"].GetString();
     std::string log_id = request_doc["log_id"].GetString();
     std::string query = request_doc["request"]["query"].GetString();
     is_dmkit_response = false;
-    std::string request_json = utils::json_to_string(request_doc);
-    // Call unit bot api with the request json as dmkit use the same data contract.
-    std::string unit_bot_result;
-    if (this->call_unit_bot(access_token, request_json, unit_bot_result) != 0) {
+    // A query waiting for service calls is resumed with its unit bot response parsed before.
+    std::unique_ptr<UnitBotResponse> unit_response(turn.waiting_response.release());
+    if (unit_response == nullptr) {
+        unit_response.reset(new UnitBotResponse());
+        if (this->parse_unit_bot_response(turn, unit_bot_call, *unit_response, json_response) != 0) {
+            return 0;
+        }
+        // Results of functions with side effects are recorded anew for each query.
+        turn.memo.start_query();
+    }
+    ArenaDocument& unit_response_doc = unit_response->unit_response_doc;
+    ArenaDocument& bot_session_doc = unit_response->bot_session_doc;
+    if (session == nullptr) {
+        session.reset(new PolicyOutputSession());
+        this->load_session(bot_id, turn.dm_session, *session, turn.session_id);
+    }
+    std::string error_msg;
+    PolicyOutput& policy_output = current_thread_data()->policy_output();
+    AsyncServiceCalls* service_calls = turn.service_calls.get();
+    if (service_calls != nullptr) {
+        service_calls->collect();
+    }
+    int ret = this->resolve_policy_output(turn.policy_dict, bot_id, log_id, query,
+        bot_session_doc["dialog_state"], unit_response->request_params, *session, service_calls,
+        &turn.memo, policy_output, error_msg);
+    if (service_calls != nullptr && service_calls->has_started_calls()) {
+        // Resolution stopped at the first call its policies wait for, it is resumed
+        // from the recorded results once the call finishes.
+        turn.waiting_response.swap(unit_response);
+        return PROCESS_WAITING_SERVICE_CALLS;
+    }
+    if (ret != 0) {
+        json_response = this->get_error_response(-1, error_msg);
+        return 0;
+    }
+    this->set_dm_response(unit_response_doc, bot_session_doc, bot_id, turn.session_id, policy_output);
+    is_dmkit_response = true;
+    json_response = utils::json_to_string(unit_response_doc);
+    return 0;
+}
+
+int DialogManager::parse_unit_bot_response(DialogTurn& turn,
+                                           RemoteServiceCall& unit_bot_call,
+                                           UnitBotResponse& unit_response,
+                                           std::string& json_response) {
+    const ArenaDocument& request_doc = turn.request_doc;
+    const std::string& dm_session = turn.dm_session;
+    // Wait for unit bot api result of the request.
+    RemoteServiceResult rsr;
+    if (unit_bot_call.join(rsr) != 0) {
         APP_LOG(ERROR) << "Failed to call unit bot api";
         json_response = get_error_response(-1, "Failed to call unit bot api");
         return 0;
     }
+    APP_LOG(TRACE) << "Got unit bot result";
+    const std::string& unit_bot_result = rsr.result;
     APP_LOG(TRACE) << "unit bot result: " << unit_bot_result;
 
     // Parse unit bot response.
     // In the case something wrong with unit bot response, informs users.
-    rapidjson::Document unit_response_doc;
+    ArenaDocument& unit_response_doc = unit_response.unit_response_doc;
     if (unit_response_doc.Parse(unit_bot_result.c_str()).HasParseError()
             || !unit_response_doc.IsObject()) {
         APP_LOG(ERROR) << "Failed to parse unit bot result: " << unit_bot_result;
@@ -197,73 +1262,92 @@ int DialogManager::process_request(const rapidjson::Document& request_doc,
             || !unit_response_doc["error_code"].IsInt()
             || unit_response_doc["error_code"].GetInt() != 0) {
         json_response = unit_bot_result;
-        return 0;
+        return -1;
     }
 
     // The bot status is included in bot_session
-    std::string bot_session = unit_response_doc["result"]["bot_session"].GetString();
-    rapidjson::Document bot_session_doc;
+    const rapidjson::Value* bot_session_value = get_bot_session(unit_response_doc);
+    if (bot_session_value == nullptr) {
+        json_response = get_error_response(-1, "Failed to parse bot session");
+        return -1;
+    }
+    std::string bot_session = bot_session_value->GetString();
+    ArenaDocument& bot_session_doc = unit_response.bot_session_doc;
     if (bot_session_doc.Parse(bot_session.c_str()).HasParseError()
             || !bot_session_doc.IsObject()) {
         APP_LOG(ERROR) << "Failed to parse bot session: " << bot_session;
         json_response = get_error_response(-1, "Failed to parse bot session");
-        return 0;
+        return -1;
     }
     if (this->handle_unsatisfied_intent(unit_response_doc, 
             bot_session_doc, dm_session, json_response) == 0) {
-        return 0;
+        return -1;
     }
 
     // Handle satify/understood intents
-    QuResult* qu_result = QuResult::parse_from_dialog_state(
-        bot_id, bot_session_doc["dialog_state"]);
-    if (qu_result == nullptr) {
-        json_response = this->get_error_response(-1, "Failed to parse qu_result");
-        return 0;
-    }
-    auto qu_map = new BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>();
-    // 2: bucket_count, initial count of buckets, big enough to avoid resize.
-    // 50: load_factor, element_count * 100 / bucket_count.
-    qu_map->init(2, 50);
-    qu_map->insert(bot_id, qu_result);
     // Parsing request params from client_session, only string value is accepted
-    std::unordered_map<std::string, std::string> request_params;
-    std::string product = "default";
+    std::unordered_map<std::string, std::string>& request_params = unit_response.request_params;
     if (request_doc["request"].HasMember("client_session")) {
         std::string client_session = request_doc["request"]["client_session"].GetString();
-        rapidjson::Document client_session_doc;
+        ArenaDocument client_session_doc;
         if (!client_session_doc.Parse(client_session.c_str()).HasParseError() && client_session_doc.IsObject()) {
             for (auto& m_param: client_session_doc.GetObject()) {
                 if (!m_param.value.IsString()) {
                     continue;
                 }
-                std::string param_name = m_param.name.GetString();
-                std::string param_value = m_param.value.GetString();
-                if (param_name == "product") {
-                    product = param_value;
-                }
-                request_params[param_name] = param_value;
+                request_params[m_param.name.GetString()] = m_param.value.GetString();
             }
         }
     }
-    PolicyOutputSession session = PolicyOutputSession::from_json_str(dm_session);
-    RequestContext context(this->_remote_service_manager, log_id, request_params);
-    PolicyOutput* policy_output = this->_policy_manager->resolve(
-        product, qu_map, session, context);
-    for (auto iter = qu_map->begin(); iter != qu_map->end(); ++iter) {
-        QuResult* qu_ptr = iter->second;
-        if (qu_ptr != nullptr) {
-            delete qu_ptr;
-        }
+    return 0;
+}
+
+int DialogManager::resolve_policy_output(
+        const std::shared_ptr<ProductPolicyMap>& policy_dict,
+        const std::string& bot_id,
+        const std::string& log_id,
+        const std::string& query,
+        const rapidjson::Value& dialog_state,
+        const std::unordered_map<std::string, std::string>& request_params,
+        const PolicyOutputSession& session,
+        AsyncServiceCalls* async_service_calls,
+        UserFunctionMemo* memo,
+        PolicyOutput& policy_output,
+        std::string& error_msg) {
+    std::string product = "default";
+    auto product_iter = request_params.find("product");
+    if (product_iter != request_params.end()) {
+        product = product_iter->second;
+    }
+    // Intent and slot names are mapped to symbol ids of the product's policies once here.
+    std::shared_ptr<ProductPolicyMap> current_policy_dict = policy_dict != nullptr
+        ? policy_dict : this->_policy_manager->get_policy_dict();
+    // Qu result and its map are kept in the thread data and refilled in place every turn.
+    ThreadDataBase* tls = current_thread_data();
+    QuResult& qu_result = tls->qu_result();
+    if (qu_result.parse_dialog_state(
+            bot_id, dialog_state, PolicyManager::get_symbol_table(current_policy_dict, product)) != 0) {
+        error_msg = "Failed to parse qu_result";
+        return -1;
+    }
+    BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>& qu_map = tls->qu_map();
+    qu_map.clear();
+    qu_map.insert(bot_id, &qu_result);
+    if (memo != nullptr) {
+        memo->start_pass();
     }
-    delete qu_map;
+    RequestContext context(this->_remote_service_manager, log_id, request_params,
+                           async_service_calls, memo);
+    int ret = this->_policy_manager->resolve(
+        current_policy_dict, product, &qu_map, session, context, policy_output);
+    qu_map.clear();
 
-    if (policy_output == nullptr) {
-        json_response = this->get_error_response(-1, "DM policy resolve failed");
-        return 0;
+    if (ret != 0) {
+        error_msg = "DM policy resolve failed";
+        return -1;
     }
     bool has_query = false;
-    for (auto const& meta: policy_output->meta) {
+    for (auto const& meta: policy_output.meta) {
         if (meta.key == "query") {
             has_query = true;
         }
@@ -272,18 +1356,15 @@ int DialogManager::process_request(const rapidjson::Document& request_doc,
         KVPair meta_query;
         meta_query.key = "query";
         meta_query.value = query;
-        policy_output->meta.push_back(meta_query);
+        policy_output.meta.push_back(meta_query);
     }
-    this->set_dm_response(unit_response_doc, bot_session_doc, policy_output);
-    delete policy_output;
-    is_dmkit_response = true;
-    json_response = utils::json_to_string(unit_response_doc);
     return 0;
 }
 
-int DialogManager::call_unit_bot(const std::string& access_token,
-                                         const std::string& payload,
-                                         std::string& result) {
+void DialogManager::call_unit_bot(const std::string& access_token,
+                                  const BUTIL_NAMESPACE::IOBuf& payload,
+                                  RemoteServiceCall& call,
+                                  google::protobuf::Closure* done) {
     std::string url = "/rpc/2.0/unit/bot/chat?access_token=";
     url += access_token;
     RemoteServiceParam rsp = {
@@ -291,37 +1372,20 @@ int DialogManager::call_unit_bot(const std::string& access_token,
         HTTP_METHOD_POST,
         payload
     };
-    RemoteServiceResult rsr;
     APP_LOG(TRACE) << "Calling unit bot service, url: "<< url;
     APP_LOG(TRACE) <<  payload;
+    // Call unit bot api with the request json as dmkit use the same data contract.
     // unit_bot is a remote service configured in conf/app/remote_services.json
-    if (this->_remote_service_manager->call("unit_bot", rsp, rsr) !=0) {
+    if (this->_remote_service_manager->call_async("unit_bot", rsp, call, done) != 0) {
         APP_LOG(ERROR) << "Failed to get unit bot result" ;
-        return -1;
     }
-    APP_LOG(TRACE) << "Got unit bot result";
-
-    result = rsr.result;
-
-    return 0;
 }
 
-int DialogManager::handle_unsatisfied_intent(rapidjson::Document& unit_response_doc,
-                                             rapidjson::Document& bot_session_doc,
+int DialogManager::handle_unsatisfied_intent(ArenaDocument& unit_response_doc,
+                                             ArenaDocument& bot_session_doc,
                                              const std::string& dm_session,
                                              std::string& response) {
-    std::string action_type;
-    if (unit_response_doc.HasMember("result")
-            && unit_response_doc["result"].HasMember("response")
-            && unit_response_doc["result"]["response"].HasMember("action_list")
-            && unit_response_doc["result"]["response"]["action_list"].Size() > 0
-            && unit_response_doc["result"]["response"]["action_list"][0].HasMember("type")) {
-        action_type = unit_response_doc["result"]["response"]["action_list"][0]["type"].GetString();
-    } else {
-        APP_LOG(WARNING) << "Failed to parse action type from unit bot response: "
-            << utils::json_to_string(unit_response_doc);
-    }
-
+    std::string action_type = get_action_type(unit_response_doc);
     if (action_type == "satisfy") {
         response = this->get_error_response(-1, "Unsupported action type satisfy");
         return 0;
@@ -361,12 +1425,14 @@ int DialogManager::handle_unsatisfied_intent(rapidjson::Document& unit_response_
     return -1;
 }
 
-void DialogManager::set_dm_response(rapidjson::Document& unit_response_doc,
-                                            rapidjson::Document& bot_session_doc,
-                                            const PolicyOutput* policy_output) {
-    std::string session_str = PolicyOutputSession::to_json_str(policy_output->session);
-    rapidjson::Value dm_session;
-    dm_session.SetString(session_str.c_str(), session_str.length(), bot_session_doc.GetAllocator());
+void DialogManager::set_dm_response(ArenaDocument& unit_response_doc,
+                                            ArenaDocument& bot_session_doc,
+                                            const std::string& bot_id,
+                                            const std::string& session_id,
+                                            const PolicyOutput& policy_output) {
+    std::string session_str = this->save_session(bot_id, session_id, policy_output.session);
+    rapidjson::Value dm_session_json;
+    dm_session_json.SetString(session_str.c_str(), session_str.length(), bot_session_doc.GetAllocator());
 
     
     if (!bot_session_doc.HasMember("dialog_state")) {
@@ -385,19 +1451,13 @@ void DialogManager::set_dm_response(rapidjson::Document& unit_response_doc,
         bot_session_doc["dialog_state"]["contexts"]["dmkit"].RemoveMember("session");    
     }
     bot_session_doc["dialog_state"]["contexts"]["dmkit"].AddMember(
-        "session", dm_session, bot_session_doc.GetAllocator());
+        "session", dm_session_json, bot_session_doc.GetAllocator());
     
     // DMKit result as a custom reply
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-    writer.StartObject();
-    writer.Key("event_name");
-    writer.String("DM_RESULT");
-    writer.Key("result");
-    std::string policy_output_str = PolicyOutput::to_json_str(*policy_output);
-    writer.String(policy_output_str.c_str(), policy_output_str.length());
-    writer.EndObject();
-    std::string custom_reply = buffer.GetString();
+    std::string policy_output_str = PolicyOutput::to_json_str(policy_output);
+    std::string custom_reply = "{\"event_name\":\"DM_RESULT\",\"result\":";
+    utils::append_json_string(custom_reply, policy_output_str);
+    custom_reply.push_back('}');
     APP_LOG(TRACE) << "custom_reply: " << custom_reply;
 
     bot_session_doc["interactions"][0]["response"]["action_list"][0]["type"] = "event";
@@ -416,9 +1476,45 @@ void DialogManager::set_dm_response(rapidjson::Document& unit_response_doc,
         bot_session.c_str(), bot_session.length(), unit_response_doc.GetAllocator());
 }
 
+void DialogManager::load_session(const std::string& bot_id,
+                                 const std::string& dm_session,
+                                 PolicyOutputSession& session,
+                                 std::string& session_id) {
+    session_id.clear();
+    if (!SessionStore::is_session_id(dm_session)) {
+        session = PolicyOutputSession::from_json_str(dm_session);
+        return;
+    }
+    if (this->_session_store == nullptr
+            || this->_session_store->get(bot_id, dm_session, session) != 0) {
+        APP_LOG(WARNING) << "Session not found for " << dm_session << ", starting a new one";
+        session = PolicyOutputSession();
+        return;
+    }
+    session_id = dm_session;
+}
+
+std::string DialogManager::save_session(const std::string& bot_id,
+                                        const std::string& session_id,
+                                        const PolicyOutputSession& session) {
+    if (this->_session_store == nullptr) {
+        return PolicyOutputSession::to_json_str(session);
+    }
+    // The session id is kept for the whole dialog. Ids not found in session store,
+    // including ones chosen by clients, are never written back and get a new id.
+    std::string new_session_id = session_id;
+    if (new_session_id.empty()) {
+        new_session_id = SessionStore::new_session_id();
+    }
+    if (this->_session_store->put(bot_id, new_session_id, session) != 0) {
+        APP_LOG(WARNING) << "Failed to persist session " << new_session_id;
+    }
+    return new_session_id;
+}
+
 std::string DialogManager::get_error_response(int error_code, const std::string& error_msg) {
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    ArenaStringBuffer buffer(current_json_arena());
+    ArenaWriter writer(buffer, current_json_arena());
     writer.StartObject();
     writer.Key("error_code");
     writer.Int(error_code);
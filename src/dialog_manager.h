@@ -12,12 +12,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <memory>
+#include <unordered_map>
 #include "application_base.h"
+#include "butil.h"
 #include "policy.h"
 #include "policy_manager.h"
 #include "qu_result.h"
 #include "rapidjson.h"
 #include "remote_service_manager.h"
+#include "request_context.h"
+#include "session_store.h"
 #include "token_manager.h"
 
 #ifndef DMKIT_DIALOG_MANAGER_H
@@ -25,6 +30,10 @@
 
 namespace dmkit {
 
+struct DialogTurn;
+struct UnitBotResponse;
+struct DialogBatchItem;
+
 // The Dialog Manager application
 class DialogManager : public ApplicationBase {
 public:
@@ -32,20 +41,121 @@ public:
     virtual ~DialogManager();
     virtual int init();
     virtual int run(BRPC_NAMESPACE::Controller* cntl);
+    virtual bool is_async() const;
+    virtual void run_async(BRPC_NAMESPACE::Controller* cntl,
+                           ThreadDataBase* data,
+                           google::protobuf::Closure* done);
+    virtual void run_batch(BRPC_NAMESPACE::Controller* cntl);
+    virtual void resolve(BRPC_NAMESPACE::Controller* cntl,
+                         const DialogRequest* request,
+                         DialogResponse* response);
 
 private:
-    int process_request(const rapidjson::Document& request_doc,
-                        const std::string& dm_session,
-                        const std::string& access_token,
+    // Parse request body of the http request, responds 400 if it is not a json object.
+    int parse_request(DialogTurn& turn);
+
+    // Validate the request, get the access token, then build the unit bot payloads.
+    // Returns 0 if unit bot should be called, otherwise turn.response is set to an error.
+    int prepare_turn(DialogTurn& turn);
+
+    // Validate the request and read the fields of the turn from it.
+    // Returns 0 if the request is valid, otherwise turn.response is set to an error.
+    int read_request(DialogTurn& turn);
+
+    // Build the unit bot payloads of a turn with its access token.
+    void write_payloads(DialogTurn& turn);
+
+    // Call unit bot and resolve the response of a prepared turn synchronously.
+    void run_turn(DialogTurn& turn);
+
+    // Worker bthread of a batch, processes items until none is left.
+    static void* run_batch_worker(void* arg);
+
+    // Process a request in a batch with the policy dict snapshot of the batch.
+    void run_batch_item(const std::shared_ptr<ProductPolicyMap>& policy_dict,
+                        DialogBatchItem& item);
+
+    // Process the rewrite query result and decide the response of the turn.
+    // Returns the same as process_request.
+    int process_rewrite_query(DialogTurn& turn);
+
+    // Get the access token of an asynchronous turn and start calling unit bot.
+    void start_turn(DialogTurn* turn);
+    void start_unit_bot_calls(DialogTurn* turn);
+
+    // Continuations of an asynchronous turn, run when remote calls finish.
+    // Each of them binds the thread data of the turn and releases the turn after unbinding it.
+    void on_access_token_returned(DialogTurn* turn);
+    void on_query_returned(DialogTurn* turn);
+    void on_rewrite_query_returned(DialogTurn* turn);
+    void on_rewrite_query_resumed(DialogTurn* turn);
+
+    void process_query_async(DialogTurn* turn);
+    void process_rewrite_query_async(DialogTurn* turn);
+
+    // Continue an asynchronous turn with resume once service calls of user functions finish.
+    void wait_service_calls(DialogTurn* turn, void (DialogManager::*resume)(DialogTurn*));
+
+    // Hold an asynchronous turn for a continuation which will release it.
+    void hold_turn(DialogTurn* turn);
+
+    // Release a finished continuation of an asynchronous turn, the response is sent after
+    // the last one. The thread data of the turn must not be bound by the caller.
+    void release_turn(DialogTurn* turn);
+
+    // Process the unit bot result of a request and resolve DMKit response.
+    // Returns 1 if an asynchronous turn started service calls of user functions,
+    // it should be processed again once they finish, which resumes the resolution with
+    // the unit bot response and user function results kept by the turn.
+    int process_request(DialogTurn& turn,
+                        RemoteServiceCall& unit_bot_call,
                         std::string& json_response,
                         bool& is_dmkit_response);
 
-    int call_unit_bot(const std::string& access_token,
-                      const std::string& payload,
-                      std::string& result);
+    // Join the unit bot call of a query and parse its response. Returns 0 if the query is
+    // understood and its policies are to be resolved, otherwise json_response is set.
+    int parse_unit_bot_response(DialogTurn& turn,
+                                RemoteServiceCall& unit_bot_call,
+                                UnitBotResponse& unit_response,
+                                std::string& json_response);
 
-    int handle_unsatisfied_intent(rapidjson::Document& unit_response_doc,
-                                  rapidjson::Document& bot_session_doc,
+    // Call unit bot for a query of a protobuf request and resolve the response.
+    void resolve_query(const DialogRequest& request,
+                       const std::string& log_id,
+                       const std::string& access_token,
+                       const std::string& query,
+                       const std::unordered_map<std::string, std::string>& request_params,
+                       const PolicyOutputSession& session,
+                       const std::string& session_id,
+                       UserFunctionMemo* memo,
+                       DialogResponse& response,
+                       bool& is_dmkit_response);
+
+    // Resolve DMKit output of a query understood by unit bot with the policies,
+    // shared by json and protobuf requests, into policy_output reused by the thread data.
+    // Pure user function results are memoized in memo, shared by all passes of the turn.
+    // Returns -1 and sets error_msg on failure.
+    int resolve_policy_output(const std::shared_ptr<ProductPolicyMap>& policy_dict,
+                              const std::string& bot_id,
+                              const std::string& log_id,
+                              const std::string& query,
+                              const rapidjson::Value& dialog_state,
+                              const std::unordered_map<std::string, std::string>& request_params,
+                              const PolicyOutputSession& session,
+                              AsyncServiceCalls* async_service_calls,
+                              UserFunctionMemo* memo,
+                              PolicyOutput& policy_output,
+                              std::string& error_msg);
+
+    // Start calling unit bot api, the result is joined in process_request.
+    // done is run once the call finishes if not null.
+    void call_unit_bot(const std::string& access_token,
+                       const BUTIL_NAMESPACE::IOBuf& payload,
+                       RemoteServiceCall& call,
+                       google::protobuf::Closure* done);
+
+    int handle_unsatisfied_intent(ArenaDocument& unit_response_doc,
+                                  ArenaDocument& bot_session_doc,
                                   const std::string& dm_session,
                                   std::string& response);
 
@@ -53,13 +163,31 @@ private:
 
     void send_json_response(BRPC_NAMESPACE::Controller* cntl, const std::string& data);
 
-    void set_dm_response(rapidjson::Document& unit_response_doc,
-                         rapidjson::Document& bot_session_doc,
-                         const PolicyOutput* policy_output);
+    void set_dm_response(ArenaDocument& unit_response_doc,
+                         ArenaDocument& bot_session_doc,
+                         const std::string& bot_id,
+                         const std::string& session_id,
+                         const PolicyOutput& policy_output);
+
+    // Load the session from the dmkit session string carried in bot_session,
+    // which is either a session json or a session id in session store.
+    // session_id is set to the id only if it is found in session store of the bot.
+    void load_session(const std::string& bot_id,
+                      const std::string& dm_session,
+                      PolicyOutputSession& session,
+                      std::string& session_id);
+
+    // Save the session and get the dmkit session string to be carried in bot_session.
+    // A new session id is issued if session_id is empty.
+    std::string save_session(const std::string& bot_id,
+                             const std::string& session_id,
+                             const PolicyOutputSession& session);
 
     RemoteServiceManager* _remote_service_manager;
     PolicyManager* _policy_manager;
     TokenManager* _token_manager;
+    // Only created when sessions are kept on server side
+    SessionStore* _session_store;
 };
 
 } // namespace dmkit
@@ -15,6 +15,7 @@
 #include "file_watcher.h"
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <vector>
 #include "app_log.h"
 #include "utils.h"
 
@@ -37,13 +38,15 @@ FileWatcher::~FileWatcher() {
     }
 }
 
-static int get_file_last_modified_time(const std::string& file_path, std::string& mtime_str) {
+int FileWatcher::get_file_last_modified_time(const std::string& file_path, std::string& mtime_str) {
     struct stat f_stat;
     if (stat(file_path.c_str(), &f_stat) != 0) {
         LOG(WARNING) << "Failed to get file modified time" << file_path;
         return -1;
     }
-    mtime_str = ctime(&f_stat.st_mtime);
+    // Seconds alone miss edits made within the same second, nanoseconds and size are included.
+    mtime_str = std::to_string(f_stat.st_mtim.tv_sec) + "." + std::to_string(f_stat.st_mtim.tv_nsec)
+        + ":" + std::to_string(f_stat.st_size);
     return 0;
 }
 
@@ -58,7 +61,7 @@ int FileWatcher::register_file(const std::string file_path,
     }
 
     FileStatus file_status = {file_path, last_modified_time, cb, param, level_trigger};
-    std::lock_guard<std::mutex> lock(this->_mutex);
+    std::lock_guard<std::recursive_mutex> lock(this->_mutex);
     this->_file_info[file_path] = file_status;
     if (!this->_is_running) {
         this->_is_running = true;
@@ -69,13 +72,15 @@ int FileWatcher::register_file(const std::string file_path,
 
 int FileWatcher::unregister_file(const std::string file_path) {
     LOG(TRACE) << "FileWatcher unregistering file " << file_path;
-    std::lock_guard<std::mutex> lock(this->_mutex);
+    std::lock_guard<std::recursive_mutex> lock(this->_mutex);
     if (this->_file_info.erase(file_path) != 1) {
         return -1;
     }
+    // The watcher thread keeps running if the last file is unregistered by a callback
     if (this->_file_info.size() == 0
         && this->_is_running
-        && this->_watcher_thread.joinable()) {
+        && this->_watcher_thread.joinable()
+        && this->_watcher_thread.get_id() != std::this_thread::get_id()) {
         this->_is_running = false;
         this->_watcher_thread.join();
     }
@@ -86,16 +91,27 @@ void FileWatcher::watcher_thread_func() {
     LOG(TRACE) << "Watcher thread starting...";
     while (this->_is_running) {
         {
-            std::lock_guard<std::mutex> lock(this->_mutex);
+            std::lock_guard<std::recursive_mutex> lock(this->_mutex);
+            // Callbacks may register or unregister files, so files are checked by a copy of paths.
+            std::vector<std::string> file_paths;
             for (const auto& file : this->_file_info) {
+                file_paths.push_back(file.first);
+            }
+            for (const auto& file_path : file_paths) {
+                auto iter = this->_file_info.find(file_path);
+                if (iter == this->_file_info.end()) {
+                    continue;
+                }
                 std::string last_modified_time;
-                get_file_last_modified_time(file.first, last_modified_time);
-                if (last_modified_time != file.second.last_modified_time) {
-                    LOG(TRACE) << "File Changed. " << file.first << " modified time " << last_modified_time;
-                    if (file.second.callback(file.second.param) == 0
-                            || !file.second.level_trigger) {
-                        if (this->_file_info.find(file.first) != this->_file_info.end()) {
-                            this->_file_info[file.first].last_modified_time = last_modified_time;
+                get_file_last_modified_time(file_path, last_modified_time);
+                if (last_modified_time != iter->second.last_modified_time) {
+                    LOG(TRACE) << "File Changed. " << file_path << " modified time " << last_modified_time;
+                    FileStatus file_status = iter->second;
+                    if (file_status.callback(file_status.param) == 0
+                            || !file_status.level_trigger) {
+                        iter = this->_file_info.find(file_path);
+                        if (iter != this->_file_info.end()) {
+                            iter->second.last_modified_time = last_modified_time;
                         }
                     }
                 }
@@ -46,6 +46,9 @@ public:
 
     int unregister_file(const std::string file_path);
 
+    // Get the modified time of a file as a string, which changes whenever the file is rewritten.
+    static int get_file_last_modified_time(const std::string& file_path, std::string& mtime_str);
+
     // Do not need copy constructor and assignment operator for a singleton class
     FileWatcher(FileWatcher const&) = delete;
     void operator=(FileWatcher const&) = delete;
@@ -55,7 +58,8 @@ private:
 
     void watcher_thread_func();
 
-    std::mutex _mutex;
+    // Recursive so that callbacks can register or unregister files
+    std::recursive_mutex _mutex;
     std::atomic<bool> _is_running;
     std::thread _watcher_thread;
     std::unordered_map<std::string, FileStatus> _file_info;
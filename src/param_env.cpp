@@ -0,0 +1,53 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "param_env.h"
+#include <new>
+#include "thread_data_base.h"
+
+namespace dmkit {
+
+ParamEnv::ParamEnv() : _json_arena(&_own_json_arena) {
+}
+
+void ParamEnv::reset(size_t size, rapidjson::MemoryPoolAllocator<>* json_arena) {
+    if (this->_values.size() < size) {
+        this->_values.resize(size);
+        this->_json_docs.resize(size);
+    }
+    // Parsed json is not kept for following policies, it may be much larger than its value.
+    for (auto& doc: this->_json_docs) {
+        doc = nullptr;
+    }
+    this->_own_json_arena.Clear();
+    this->_json_arena = json_arena != nullptr ? json_arena : &this->_own_json_arena;
+    this->_is_set.assign(size, false);
+    this->_json_states.assign(size, JSON_UNPARSED);
+}
+
+const rapidjson::Value* ParamEnv::get_json(int slot) {
+    if (this->_json_states[slot] == JSON_UNPARSED) {
+        this->_json_states[slot] = JSON_INVALID;
+        void* buffer = this->_json_arena->Malloc(sizeof(ArenaDocument));
+        ArenaDocument* doc = new (buffer) ArenaDocument(this->_json_arena);
+        this->_json_docs[slot] = doc;
+        if (!doc->Parse(this->_values[slot].c_str()).HasParseError()
+                && (doc->IsObject() || doc->IsArray())) {
+            this->_json_states[slot] = JSON_PARSED;
+        }
+    }
+    return this->_json_states[slot] == JSON_PARSED ? this->_json_docs[slot] : nullptr;
+}
+
+} // namespace dmkit
@@ -0,0 +1,85 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_PARAM_ENV_H
+#define DMKIT_PARAM_ENV_H
+
+#include <string>
+#include <vector>
+#include "compiled_policy.h"
+#include "rapidjson.h"
+
+namespace dmkit {
+
+// Values of the params of a policy, indexed by the slots param names are bound to
+// when the policy is loaded. An environment is reused by the policies evaluated
+// in a request, values keep their capacity when it is reset.
+// Besides the string value, a slot keeps the json parsed from it once it is needed,
+// so that a json value is parsed once however many times it is read.
+class ParamEnv {
+public:
+    ParamEnv();
+
+    // Unset all values, with size slots available. Json parsed from values is drawn from
+    // json_arena, or from an arena of the environment itself if it is null.
+    void reset(size_t size, rapidjson::MemoryPoolAllocator<>* json_arena);
+
+    bool has(int slot) const { return this->_is_set[slot]; }
+
+    const std::string& get(int slot) const { return this->_values[slot]; }
+
+    // Values of the environment as seen by compiled templates and assertions.
+    CompiledParamEnv compiled_env() const {
+        CompiledParamEnv env = {this->_values.data(), this->_is_set.data(), this->_values.size()};
+        return env;
+    }
+
+    void set(int slot, const std::string& value) {
+        this->_values[slot].assign(value);
+        this->_is_set[slot] = true;
+        this->_json_states[slot] = JSON_UNPARSED;
+    }
+
+    // Set a value by swapping it into the slot.
+    void swap(int slot, std::string& value) {
+        this->_values[slot].swap(value);
+        this->_is_set[slot] = true;
+        this->_json_states[slot] = JSON_UNPARSED;
+    }
+
+    // Get the json object or array parsed from the value of a set slot,
+    // returns null if the value is not a json object or array.
+    const rapidjson::Value* get_json(int slot);
+
+private:
+    enum JsonState {
+        JSON_UNPARSED,
+        JSON_PARSED,
+        JSON_INVALID
+    };
+
+    std::vector<std::string> _values;
+    // Not a vector of bool, so that compiled functions can read it as an array.
+    std::vector<char> _is_set;
+    // Documents constructed in the json arena, they are dropped without being destructed
+    // since nothing is freed until the arena is cleared.
+    std::vector<rapidjson::Value*> _json_docs;
+    std::vector<JsonState> _json_states;
+    rapidjson::MemoryPoolAllocator<>* _json_arena;
+    rapidjson::MemoryPoolAllocator<> _own_json_arena;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_PARAM_ENV_H
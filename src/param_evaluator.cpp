@@ -0,0 +1,424 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "param_evaluator.h"
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <unordered_map>
+#include "app_log.h"
+#include "bthread.h"
+#include "thread_data_base.h"
+#include "user_function/shared.h"
+#include "utils.h"
+
+namespace dmkit {
+
+DEFINE_int32(param_call_concurrency, 8, "Max number of independent pure func_val params called concurrently, 1 to call them in order");
+
+static const char* const PARAM_LAST_TTS = "dmkit_param_last_tts";
+
+ParamEvaluator::ParamEvaluator(const Policy* policy,
+                               QuResult* qu_result,
+                               const PolicyOutputSession& session,
+                               const RequestContext& context,
+                               UserFunctionManager* user_function_manager)
+    : _policy(policy), _qu_result(qu_result), _session(session), _context(context),
+      _user_function_manager(user_function_manager),
+      _param_states(policy->params().size(), PARAM_UNEVALUATED), _failed(false) {
+    ThreadDataBase* data = current_thread_data();
+    this->_param_env = data != nullptr ? &data->param_env() : &this->_own_param_env;
+    this->_param_env->reset(policy->param_slots().size(),
+                            data != nullptr ? &data->json_arena() : nullptr);
+    if (policy->lazy_params()) {
+        return;
+    }
+    // Default parameters
+    for (unsigned int i = 0; i < policy->param_slots().size(); ++i) {
+        this->set_default_param(i);
+    }
+    for (unsigned int i = 0; i < policy->params().size(); ++i) {
+        if (!this->evaluate_param(i)) {
+            this->_failed = true;
+            return;
+        }
+    }
+}
+
+bool ParamEvaluator::evaluate(const ParamDependency& dependency) {
+    if (!this->_policy->lazy_params()) {
+        return !this->_failed;
+    }
+    if (FLAGS_param_call_concurrency > 1 && !this->evaluate_concurrently(dependency)) {
+        return false;
+    }
+    for (int index: dependency.params) {
+        if (!this->evaluate_param(index)) {
+            return false;
+        }
+    }
+    for (int slot: dependency.default_params) {
+        this->set_default_param(slot);
+    }
+    return true;
+}
+
+// A func_val param called in its own bthread.
+struct ParamCall {
+    int index;
+    std::string func_name;
+    std::vector<std::string> args;
+    UserFunctionManager* user_function_manager;
+    const RequestContext* context;
+    ThreadDataBase* data;
+    std::string value;
+    bool success;
+};
+
+static void* run_param_call(void* arg) {
+    ParamCall* call = static_cast<ParamCall*>(arg);
+    ScopedThreadData scoped_data(call->data);
+    call->success = call->user_function_manager->call_user_function(
+        call->func_name, call->args, *call->context, call->value) == 0;
+    return nullptr;
+}
+
+bool ParamEvaluator::evaluate_concurrently(const ParamDependency& dependency) {
+    std::vector<bool> collected(this->_param_states.size(), false);
+    this->collect_unevaluated_params(dependency, collected);
+    const std::vector<PolicyParam>& params = this->_policy->params();
+    int call_count = 0;
+    for (unsigned int i = 0; i < params.size(); ++i) {
+        if (collected[i] && params[i].type_id == PARAM_FUNC_VAL) {
+            ++call_count;
+        }
+    }
+    // Workers draw their thread data from the pool of the request's thread data,
+    // params are evaluated one by one in current bthread without it.
+    ThreadDataBase* parent_data = current_thread_data();
+    if (call_count < 2 || parent_data == nullptr || parent_data->pool() == nullptr) {
+        return true;
+    }
+
+    // Params only depend on params defined before them, so that evaluating ready params
+    // in order of indexes makes params after them ready in the same round.
+    while (true) {
+        std::vector<ParamCall> calls;
+        // Whether all collected params before current one are evaluated.
+        bool in_order = true;
+        for (unsigned int i = 0; i < params.size(); ++i) {
+            if (!collected[i] || this->_param_states[i] != PARAM_UNEVALUATED) {
+                continue;
+            }
+            const PolicyParam& param = params[i];
+            bool ready = true;
+            for (int dependency_index: param.dependency.params) {
+                if (this->_param_states[dependency_index] == PARAM_FAILED) {
+                    this->_param_states[i] = PARAM_FAILED;
+                    return false;
+                }
+                if (this->_param_states[dependency_index] != PARAM_EVALUATED) {
+                    ready = false;
+                    break;
+                }
+            }
+            if (!ready) {
+                in_order = false;
+                continue;
+            }
+            if (param.type_id != PARAM_FUNC_VAL) {
+                if (!this->evaluate_param(i)) {
+                    return false;
+                }
+                continue;
+            }
+            for (int slot: param.dependency.default_params) {
+                this->set_default_param(slot);
+            }
+            APP_LOG(TRACE) << "resolving parameter [" << param.name << "]";
+            ParamCall call;
+            call.index = i;
+            call.user_function_manager = this->_user_function_manager;
+            call.context = &this->_context;
+            call.data = nullptr;
+            call.success = false;
+            if (!this->render_function_call(param, call.func_name, call.args)) {
+                if (!this->set_param_value(i, false, call.value)) {
+                    return false;
+                }
+                continue;
+            }
+            // Functions with side effects, such as posting to a service, are called in order
+            // in current bthread once all params before them are evaluated, so that they are
+            // not called if a required param before them fails.
+            if (!this->_user_function_manager->is_pure(call.func_name)) {
+                if (!in_order) {
+                    continue;
+                }
+                bool success = this->_user_function_manager->call_user_function(
+                    call.func_name, call.args, this->_context, call.value) == 0;
+                if (this->_context.has_pending_calls()) {
+                    this->_param_states[i] = PARAM_FAILED;
+                    return false;
+                }
+                if (!this->set_param_value(i, success, call.value)) {
+                    return false;
+                }
+                continue;
+            }
+            calls.push_back(std::move(call));
+            in_order = false;
+        }
+        if (calls.empty()) {
+            return true;
+        }
+
+        // Each call has its own thread data for remote service calls to add notice logs,
+        // which are merged into the request's notice log in order of params.
+        size_t concurrency = static_cast<size_t>(FLAGS_param_call_concurrency);
+        for (size_t begin = 0; begin < calls.size(); begin += concurrency) {
+            size_t end = std::min(calls.size(), begin + concurrency);
+            std::vector<bthread_t> tids(end - begin);
+            std::vector<bool> started(end - begin, false);
+            for (size_t i = begin; i < end; ++i) {
+                calls[i].data = acquire_worker_thread_data(parent_data);
+                if (i + 1 < end
+                        && bthread_start_background(&tids[i - begin], nullptr, run_param_call, &calls[i]) == 0) {
+                    started[i - begin] = true;
+                    continue;
+                }
+                // The last call of a batch, or calls failed to start, run in current bthread.
+                run_param_call(&calls[i]);
+            }
+            for (size_t i = begin; i < end; ++i) {
+                if (started[i - begin]) {
+                    bthread_join(tids[i - begin], nullptr);
+                }
+                release_worker_thread_data(parent_data, calls[i].data);
+            }
+        }
+        // Values of calls waiting for service calls are not known, the evaluation stops here.
+        if (this->_context.has_pending_calls()) {
+            for (auto& call: calls) {
+                this->_param_states[call.index] = PARAM_FAILED;
+            }
+            return false;
+        }
+        bool success = true;
+        for (auto& call: calls) {
+            if (!this->set_param_value(call.index, call.success, call.value)) {
+                success = false;
+            }
+        }
+        if (!success) {
+            return false;
+        }
+    }
+}
+
+void ParamEvaluator::collect_unevaluated_params(const ParamDependency& dependency,
+                                                std::vector<bool>& collected) {
+    for (int index: dependency.params) {
+        if (collected[index] || this->_param_states[index] != PARAM_UNEVALUATED) {
+            continue;
+        }
+        collected[index] = true;
+        this->collect_unevaluated_params(this->_policy->params()[index].dependency, collected);
+    }
+}
+
+const ParamEnv& ParamEvaluator::param_env() const {
+    return *this->_param_env;
+}
+
+void ParamEvaluator::get_saved_context(std::vector<KVPair>& context) const {
+    std::unordered_map<std::string, std::string> saved_context;
+    for (auto const& session_context: this->_session.context) {
+        if (session_context.key == PARAM_LAST_TTS || session_context.key.empty()) {
+            continue;
+        }
+        saved_context[session_context.key] = session_context.value;
+    }
+    for (auto const& saved_param: this->_policy->saved_context_params()) {
+        if (this->_param_env->has(saved_param.slot)) {
+            saved_context[saved_param.key] = this->_param_env->get(saved_param.slot);
+        }
+    }
+    for (auto const& saved: saved_context) {
+        KVPair kv = {saved.first, saved.second};
+        context.push_back(kv);
+    }
+}
+
+bool ParamEvaluator::evaluate_param(int index) {
+    if (this->_param_states[index] != PARAM_UNEVALUATED) {
+        return this->_param_states[index] == PARAM_EVALUATED;
+    }
+    const PolicyParam& param = this->_policy->params()[index];
+    this->_param_states[index] = PARAM_FAILED;
+    if (!this->evaluate(param.dependency)) {
+        return false;
+    }
+    APP_LOG(TRACE) << "resolving parameter [" << param.name << "]";
+    std::string value;
+    bool success = this->get_param_value(param, value);
+    // A param waiting for service calls fails without its default value,
+    // so that nothing after it is evaluated before the calls finish.
+    if (this->_context.has_pending_calls()) {
+        return false;
+    }
+    return this->set_param_value(index, success, value);
+}
+
+bool ParamEvaluator::set_param_value(int index, bool success, std::string& value) {
+    const PolicyParam& param = this->_policy->params()[index];
+    if (!success) {
+        if (param.required) {
+            this->_param_states[index] = PARAM_FAILED;
+            return false;
+        }
+        value = param.default_value;
+    }
+    APP_LOG(TRACE) << "Parameter value [" << value << "]";
+    this->_param_env->swap(param.slot, value);
+    this->_param_states[index] = PARAM_EVALUATED;
+    return true;
+}
+
+bool ParamEvaluator::get_param_value(const PolicyParam& param, std::string& value) {
+    switch (param.type_id) {
+    case PARAM_SLOT_VAL:
+    case PARAM_SLOT_VAL_ORI: {
+        int index = param.slot_index;
+        for (auto const& slot: this->_qu_result->slots()) {
+            if (slot.key() == param.slot_tag) {
+                if (index > 0) {
+                    index--;
+                    continue;
+                }
+                if (param.type_id == PARAM_SLOT_VAL && !slot.normalized_value().empty()) {
+                    value = slot.normalized_value();
+                    return true;
+                }
+                value = slot.value();
+                return true;
+            }
+        }
+        return false;
+    }
+    case PARAM_QU_INTENT:
+        value = this->_qu_result->intent();
+        return true;
+    case PARAM_SESSION_STATE:
+        value = this->_session.state;
+        return true;
+    case PARAM_SESSION_CONTEXT:
+        for (auto const& obj: this->_session.context) {
+            if (obj.key == param.value) {
+                value = obj.value;
+                return true;
+            }
+        }
+        return false;
+    case PARAM_CONST:
+        value = param.value;
+        return true;
+    case PARAM_STRING:
+        return param.value_template.render(*this->_param_env, value);
+    case PARAM_REQUEST_PARAM: {
+        const std::unordered_map<std::string, std::string>& request_params = this->_context.params();
+        auto find_res = request_params.find(param.value);
+        if (find_res == request_params.end()) {
+            return false;
+        }
+        value = find_res->second;
+        return true;
+    }
+    case PARAM_FUNC_VAL: {
+        std::string func_name;
+        std::vector<std::string> args;
+        if (!this->render_function_call(param, func_name, args)) {
+            return false;
+        }
+        return this->_user_function_manager->call_user_function(
+            func_name, args, this->_context, value) == 0;
+    }
+    case PARAM_JSON_GET_VALUE:
+        return this->get_json_value(param, value);
+    case PARAM_INVALID:
+        break;
+    }
+    APP_LOG(TRACE) << "Invalid param " << param.name << " of type " << param.type;
+    return false;
+}
+
+bool ParamEvaluator::get_json_value(const PolicyParam& param, std::string& value) {
+    int data_slot = param.arg_templates[0].param_slot();
+    if (!this->_param_env->has(data_slot)) {
+        APP_LOG(WARNING) << "Cannot resolve params in string, unknow param. "
+            << param.arg_templates[0].str();
+        return false;
+    }
+    std::vector<std::string> path;
+    if (!param.json_path_constant) {
+        std::string search;
+        if (!param.arg_templates[1].render(*this->_param_env, search)
+                || !user_function::json_split_path(search, path)) {
+            return false;
+        }
+    }
+    const rapidjson::Value* data = this->_param_env->get_json(data_slot);
+    if (data == nullptr) {
+        APP_LOG(WARNING) << "Failed to load json data: " << this->_param_env->get(data_slot);
+        return false;
+    }
+    return user_function::json_get_value_by_path(
+        *data, param.json_path_constant ? param.json_path : path, value) == 0;
+}
+
+bool ParamEvaluator::render_function_call(const PolicyParam& param,
+                                          std::string& func_name,
+                                          std::vector<std::string>& args) {
+    if (!param.value_template.render(*this->_param_env, func_name)
+            || !ParamTemplate::render_list(param.arg_templates, *this->_param_env, args)) {
+        return false;
+    }
+    utils::trim(func_name);
+    return true;
+}
+
+// Default params are the last tts, session contexts and qu slots.
+void ParamEvaluator::set_default_param(int slot) {
+    if (this->_param_env->has(slot)) {
+        return;
+    }
+    const ParamSlot& param_slot = this->_policy->param_slots()[slot];
+    if (param_slot.default_type == PARAM_DEFAULT_LAST_TTS
+            || param_slot.default_type == PARAM_DEFAULT_CONTEXT) {
+        for (auto const& context: this->_session.context) {
+            if (context.key == param_slot.default_key) {
+                this->_param_env->set(slot, context.value);
+            }
+        }
+    } else if (param_slot.default_type == PARAM_DEFAULT_SLOT) {
+        for (auto const& qu_slot: this->_qu_result->slots()) {
+            if (qu_slot.key() == param_slot.default_key) {
+                this->_param_env->set(slot, qu_slot.normalized_value().empty()
+                    ? qu_slot.value() : qu_slot.normalized_value());
+                return;
+            }
+        }
+    }
+}
+
+} // namespace dmkit
@@ -0,0 +1,106 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_PARAM_EVALUATOR_H
+#define DMKIT_PARAM_EVALUATOR_H
+
+#include <string>
+#include <vector>
+#include "param_env.h"
+#include "param_template.h"
+#include "policy.h"
+#include "qu_result.h"
+#include "request_context.h"
+#include "user_function_manager.h"
+
+namespace dmkit {
+
+// Evaluates params of a policy for a request and keeps their values for rendering
+// in the param environment of the request.
+// Params are evaluated on demand given the dependency of what is being rendered,
+// so that params only referenced by outputs which are not selected are never evaluated.
+// For policies which cannot evaluate params lazily, all params are evaluated in order
+// when the evaluator is created.
+class ParamEvaluator {
+public:
+    ParamEvaluator(const Policy* policy,
+                   QuResult* qu_result,
+                   const PolicyOutputSession& session,
+                   const RequestContext& context,
+                   UserFunctionManager* user_function_manager);
+
+    // Evaluate params of the dependency which have not been evaluated yet.
+    // Returns false if any required param fails, or a param waits for service calls
+    // of an asynchronous request.
+    bool evaluate(const ParamDependency& dependency);
+
+    const ParamEnv& param_env() const;
+
+    // Get the session context to be saved, which are contexts of current session
+    // and params saved into context.
+    void get_saved_context(std::vector<KVPair>& context) const;
+
+private:
+    enum ParamState {
+        PARAM_UNEVALUATED,
+        PARAM_EVALUATED,
+        PARAM_FAILED
+    };
+
+    bool evaluate_param(int index);
+
+    // Evaluate the unevaluated params of a dependency in rounds. In each round params
+    // whose dependencies are evaluated are ready, the ready func_val params of pure functions
+    // are called concurrently in bthreads and joined before any param depending on them
+    // is evaluated. Other functions are called in order after the params before them.
+    bool evaluate_concurrently(const ParamDependency& dependency);
+
+    // Add unevaluated params of a dependency and of the params it depends on.
+    void collect_unevaluated_params(const ParamDependency& dependency, std::vector<bool>& collected);
+
+    // Get the value of a json_get_value param from the parsed json of the param it reads.
+    bool get_json_value(const PolicyParam& param, std::string& value);
+
+    // Render the function name and arguments of a func_val param.
+    bool render_function_call(const PolicyParam& param,
+                              std::string& func_name,
+                              std::vector<std::string>& args);
+
+    // Set the value of an evaluated param, or the default value if it cannot be evaluated.
+    // Returns false if the param is required and cannot be evaluated.
+    bool set_param_value(int index, bool success, std::string& value);
+
+    // Get the value of a param, returns false if it cannot be evaluated.
+    bool get_param_value(const PolicyParam& param, std::string& value);
+
+    // Set a default param from the session or qu result unless it has a value.
+    void set_default_param(int slot);
+
+    const Policy* _policy;
+    QuResult* _qu_result;
+    const PolicyOutputSession& _session;
+    const RequestContext& _context;
+    UserFunctionManager* _user_function_manager;
+    // The param environment of current thread data, or the evaluator's own one
+    // outside of a request.
+    ParamEnv* _param_env;
+    ParamEnv _own_param_env;
+    std::vector<ParamState> _param_states;
+    // A required param failed when evaluating params in order
+    bool _failed;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_PARAM_EVALUATOR_H
@@ -0,0 +1,206 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "param_template.h"
+#include "app_log.h"
+#include "utils.h"
+
+namespace dmkit {
+
+ParamTemplate::ParamTemplate()
+    : _literal_size(0), _is_valid(true), _is_constant(true), _compiled(nullptr) {
+}
+
+ParamTemplate::ParamTemplate(const std::string& str)
+    : _str(str), _literal_size(0), _is_valid(true), _is_constant(true), _compiled(nullptr) {
+    this->parse();
+}
+
+const std::string& ParamTemplate::str() const {
+    return this->_str;
+}
+
+bool ParamTemplate::is_constant() const {
+    return this->_is_valid && this->_is_constant;
+}
+
+bool ParamTemplate::is_valid() const {
+    return this->_is_valid;
+}
+
+const std::vector<ParamTemplate::Segment>& ParamTemplate::segments() const {
+    return this->_segments;
+}
+
+int ParamTemplate::param_slot() const {
+    return this->is_param() ? this->_segments[0].slot : -1;
+}
+
+bool ParamTemplate::is_param() const {
+    return this->_segments.size() == 1 && this->_segments[0].is_param;
+}
+
+void ParamTemplate::get_param_slots(std::vector<int>& slots) const {
+    for (auto const& segment: this->_segments) {
+        if (segment.is_param) {
+            slots.push_back(segment.slot);
+        }
+    }
+}
+
+void ParamTemplate::bind(ParamSlotMap& slots) {
+    for (auto& segment: this->_segments) {
+        if (segment.is_param) {
+            segment.slot = slots.insert({segment.text, (int)slots.size()}).first->second;
+        }
+    }
+}
+
+// Params are enclosed by {% and %}. A {% inside a param starts a new param and
+// the text before it is kept as literal, a %} outside of params is an invalid format.
+void ParamTemplate::parse() {
+    const std::string& str = this->_str;
+    bool is_param = false;
+    unsigned int last_index = 0;
+    for (unsigned int i = 0; i < str.length(); ++i) {
+        if (str[i] == '{' && i + 1 < str.length() && str[i + 1] == '%') {
+            if (i > last_index) {
+                Segment literal = {false, str.substr(last_index, i - last_index), -1};
+                this->_segments.push_back(literal);
+            }
+            last_index = i + 2;
+            is_param = true;
+            ++i;
+        }
+        if (str[i] == '%' && i + 1 < str.length() && str[i + 1] == '}') {
+            if (!is_param) {
+                this->_is_valid = false;
+                break;
+            }
+            Segment param = {true, str.substr(last_index, i - last_index), -1};
+            this->_segments.push_back(param);
+            this->_is_constant = false;
+            last_index = i + 2;
+            is_param = false;
+            ++i;
+        }
+    }
+    if (is_param) {
+        this->_is_valid = false;
+    }
+    if (!this->_is_valid || this->_is_constant) {
+        this->_segments.clear();
+        return;
+    }
+    if (last_index < str.length()) {
+        Segment literal = {false, str.substr(last_index), -1};
+        this->_segments.push_back(literal);
+    }
+    for (auto const& segment: this->_segments) {
+        if (!segment.is_param) {
+            this->_literal_size += segment.text.length();
+        }
+    }
+}
+
+bool ParamTemplate::render(const ParamEnv& env, std::string& result) const {
+    if (!this->_is_valid) {
+        APP_LOG(WARNING) << "Cannot resolve params in string, invalid format. " << this->_str;
+        return false;
+    }
+    if (this->_is_constant) {
+        result.append(this->_str);
+        return true;
+    }
+    if (this->_compiled != nullptr) {
+        if (!this->_compiled(env.compiled_env(), result)) {
+            this->warn_unset_param(env);
+            return false;
+        }
+        return true;
+    }
+    result.reserve(result.length() + this->_literal_size);
+    for (auto const& segment: this->_segments) {
+        if (!segment.is_param) {
+            result.append(segment.text);
+            continue;
+        }
+        if (segment.slot < 0 || !env.has(segment.slot)) {
+            this->warn_unset_param(env);
+            return false;
+        }
+        result.append(env.get(segment.slot));
+    }
+    return true;
+}
+
+void ParamTemplate::warn_unset_param(const ParamEnv& env) const {
+    for (auto const& segment: this->_segments) {
+        if (segment.is_param && (segment.slot < 0 || !env.has(segment.slot))) {
+            APP_LOG(WARNING) << "Cannot resolve params in string, unknow param. "
+                << this->_str << " " << segment.text;
+            return;
+        }
+    }
+}
+
+void ParamTemplate::set_compiled(CompiledRenderFunc compiled) {
+    this->_compiled = compiled;
+}
+
+void ParamTemplate::split_list(const std::string& str,
+                               const char delimiter,
+                               std::vector<std::string>& parts) {
+    std::size_t pos = 0;
+    std::size_t last_pos = 0;
+    parts.clear();
+    while (last_pos < str.length() && (pos = str.find(delimiter, last_pos)) != std::string::npos) {
+        std::string part = str.substr(last_pos, pos - last_pos);
+        utils::trim(part);
+        parts.push_back(part);
+        last_pos = pos + 1;
+    }
+    if (last_pos < str.length()) {
+        std::string part = str.substr(last_pos);
+        utils::trim(part);
+        parts.push_back(part);
+    }
+}
+
+void ParamTemplate::parse_list(const std::string& str,
+                               const char delimiter,
+                               std::vector<ParamTemplate>& templates) {
+    std::vector<std::string> parts;
+    split_list(str, delimiter, parts);
+    templates.clear();
+    for (auto const& part: parts) {
+        templates.push_back(ParamTemplate(part));
+    }
+}
+
+bool ParamTemplate::render_list(const std::vector<ParamTemplate>& templates,
+                                const ParamEnv& env,
+                                std::vector<std::string>& result) {
+    result.clear();
+    result.resize(templates.size());
+    for (unsigned int i = 0; i < templates.size(); ++i) {
+        if (!templates[i].render(env, result[i])) {
+            result.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace dmkit
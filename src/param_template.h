@@ -0,0 +1,110 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_PARAM_TEMPLATE_H
+#define DMKIT_PARAM_TEMPLATE_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "param_env.h"
+
+namespace dmkit {
+
+// Slots of param names in the param environment of a policy.
+typedef std::unordered_map<std::string, int> ParamSlotMap;
+
+// A string with {%param_name%} references in policy configuration.
+// It is parsed once when policies are loaded into literal runs and param references,
+// so that rendering does not need to scan the string again.
+class ParamTemplate {
+public:
+    struct Segment {
+        bool is_param;
+        // Literal text or param name
+        std::string text;
+        // Slot of the param in the param environment
+        int slot;
+    };
+
+    ParamTemplate();
+    explicit ParamTemplate(const std::string& str);
+
+    // The string as configured
+    const std::string& str() const;
+
+    // Whether there is no param reference, it is rendered as the string itself.
+    bool is_constant() const;
+
+    // Whether the string is a valid format, an invalid template always fails to render.
+    bool is_valid() const;
+
+    // Literal runs and param references of a valid template which is not constant.
+    const std::vector<Segment>& segments() const;
+
+    // Slot of the param if the template is a single param reference without any literal,
+    // otherwise -1. Returns -1 before the template is bound as well.
+    int param_slot() const;
+
+    // Whether the template is a single param reference without any literal.
+    bool is_param() const;
+
+    // Bind param references to slots of the param environment, names not in slots
+    // are added with the next slot.
+    void bind(ParamSlotMap& slots);
+
+    // Slots of params referenced by the template, valid once it is bound.
+    void get_param_slots(std::vector<int>& slots) const;
+
+    // Render the template with param values and append to result.
+    // Returns false if the format is invalid or a param is not set.
+    bool render(const ParamEnv& env, std::string& result) const;
+
+    // Render with a function compiled from the template instead of the segments,
+    // see CompiledPolicyModule.
+    void set_compiled(CompiledRenderFunc compiled);
+
+    // Split a string by delimiter into trimmed parts, a trailing empty part is dropped.
+    static void split_list(const std::string& str,
+                           const char delimiter,
+                           std::vector<std::string>& parts);
+
+    // Split a string by delimiter and parse each trimmed part into a template.
+    static void parse_list(const std::string& str,
+                           const char delimiter,
+                           std::vector<ParamTemplate>& templates);
+
+    // Render a list of templates, result is cleared if any of them fails.
+    static bool render_list(const std::vector<ParamTemplate>& templates,
+                            const ParamEnv& env,
+                            std::vector<std::string>& result);
+
+private:
+    void parse();
+
+    // Log the first param which is not set when rendering fails.
+    void warn_unset_param(const ParamEnv& env) const;
+
+    std::string _str;
+    std::vector<Segment> _segments;
+    // Total length of literal segments, reserved before rendering
+    size_t _literal_size;
+    bool _is_valid;
+    bool _is_constant;
+    CompiledRenderFunc _compiled;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_PARAM_TEMPLATE_H
@@ -13,15 +13,421 @@
 // limitations under the License.
 
 #include "policy.h"
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
 #include "app_log.h"
+#include "user_function/shared.h"
 #include "utils.h"
 
 namespace dmkit {
 
+static const std::string PARAM_LAST_TTS = "dmkit_param_last_tts";
+static const std::string PARAM_CONTEXT_PREFIX = "dmkit_param_context_";
+static const std::string PARAM_SLOT_PREFIX = "dmkit_param_slot_";
+
+bool PolicyOutputAssertion::parse_op(const std::string& type, AssertionOp& op) {
+    static const std::pair<const char*, AssertionOp> OPS[] = {
+        {"not_empty", ASSERTION_NOT_EMPTY},
+        {"empty", ASSERTION_EMPTY},
+        {"in", ASSERTION_IN},
+        {"not_in", ASSERTION_NOT_IN},
+        {"eq", ASSERTION_EQ},
+        {"gt", ASSERTION_GT},
+        {"ge", ASSERTION_GE}
+    };
+    for (auto const& p: OPS) {
+        if (type == p.first) {
+            op = p.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+PolicyOutputTemplate PolicyOutputTemplate::compile(const PolicyOutput& output) {
+    PolicyOutputTemplate output_template;
+    output_template.assertions = output.assertions;
+    for (auto& assertion: output_template.assertions) {
+        assertion.compiled = nullptr;
+        std::vector<ParamTemplate> operand_values;
+        if (assertion.op == ASSERTION_NOT_EMPTY || assertion.op == ASSERTION_EMPTY) {
+            operand_values.push_back(ParamTemplate(assertion.value));
+        } else {
+            ParamTemplate::parse_list(assertion.value, ',', operand_values);
+            assertion.value_template = ParamTemplate(assertion.value);
+        }
+        bool is_numeric = assertion.op == ASSERTION_GT || assertion.op == ASSERTION_GE;
+        assertion.operands.clear();
+        for (auto const& operand_value: operand_values) {
+            AssertionOperand operand = {operand_value, -1, false, 0};
+            if (is_numeric && operand_value.is_constant()) {
+                operand.is_number = utils::try_atof(operand_value.str(), operand.number);
+            }
+            assertion.operands.push_back(operand);
+        }
+    }
+    for (auto const& meta: output.meta) {
+        KVTemplate meta_template = {ParamTemplate(meta.key), ParamTemplate(meta.value)};
+        output_template.meta.push_back(meta_template);
+    }
+    output_template.session_state = ParamTemplate(output.session.state);
+    for (auto const& context: output.session.context) {
+        KVTemplate context_template = {ParamTemplate(context.key), ParamTemplate(context.value)};
+        output_template.session_context.push_back(context_template);
+    }
+    for (auto const& result: output.results) {
+        PolicyOutputResultTemplate result_template;
+        result_template.type = result.type;
+        for (auto const& value: result.values) {
+            result_template.values.push_back(ParamTemplate(value));
+        }
+        result_template.extra = result.extra;
+        result_template.json = PolicyOutputResultJson::encode(result.type, result.extra);
+        output_template.results.push_back(result_template);
+    }
+    return output_template;
+}
+
+// Parse the type of a param, along with the slot tag and index of a slot_val param,
+// so that params are evaluated without comparing or splitting strings.
+static void compile_param(PolicyParam& param) {
+    static const std::pair<const char*, ParamType> TYPES[] = {
+        {"slot_val", PARAM_SLOT_VAL},
+        {"slot_val_ori", PARAM_SLOT_VAL_ORI},
+        {"qu_intent", PARAM_QU_INTENT},
+        {"session_state", PARAM_SESSION_STATE},
+        {"session_context", PARAM_SESSION_CONTEXT},
+        {"const", PARAM_CONST},
+        {"string", PARAM_STRING},
+        {"request_param", PARAM_REQUEST_PARAM},
+        {"func_val", PARAM_FUNC_VAL}
+    };
+    param.type_id = PARAM_INVALID;
+    param.slot_index = 0;
+    for (auto const& p: TYPES) {
+        if (param.type == p.first) {
+            param.type_id = p.second;
+            break;
+        }
+    }
+    if (param.type_id == PARAM_INVALID) {
+        LOG(WARNING) << "Unknown param type " << param.type;
+        return;
+    }
+    if (param.type_id != PARAM_SLOT_VAL && param.type_id != PARAM_SLOT_VAL_ORI) {
+        return;
+    }
+    // The value is a slot tag optionally followed by ',' and the index of the slot among slots of the tag.
+    std::vector<std::string> args;
+    if (!utils::split(param.value, ',', args)) {
+        param.type_id = PARAM_INVALID;
+        return;
+    }
+    param.slot_tag = args[0];
+    if (args.size() >= 2 && !utils::try_atoi(args[1], param.slot_index)) {
+        LOG(WARNING) << "Invalid index for slot_val parameter: " << param.value;
+        param.type_id = PARAM_INVALID;
+    }
+}
+
+// A json_get_value call on the whole value of a param is evaluated by the param evaluator
+// on the json parsed from the param value, which is parsed once for all such calls instead
+// of being rendered into an argument and parsed for each call.
+static void compile_json_get_value(PolicyParam& param) {
+    param.json_path_constant = false;
+    if (!param.value_template.is_constant() || param.arg_templates.size() != 2
+            || !param.arg_templates[0].is_param()) {
+        return;
+    }
+    std::string func_name = param.value_template.str();
+    utils::trim(func_name);
+    if (func_name != "json_get_value") {
+        return;
+    }
+    param.type_id = PARAM_JSON_GET_VALUE;
+    if (!param.arg_templates[1].is_constant()) {
+        return;
+    }
+    param.json_path_constant = true;
+    if (!user_function::json_split_path(param.arg_templates[1].str(), param.json_path)) {
+        LOG(WARNING) << "Invalid json path for json_get_value parameter: " << param.value;
+        param.type_id = PARAM_INVALID;
+    }
+}
+
 Policy::Policy(const PolicyTrigger& trigger, 
                const std::vector<PolicyParam>& params, 
                const std::vector<PolicyOutput>& outputs)
-    : _trigger(trigger), _params(params), _outputs(outputs) {
+    : _trigger(trigger), _params(params) {
+    this->_trigger.intent_id = SymbolTable::UNKNOWN;
+    this->_trigger.slot_ids.assign(this->_trigger.slots.size(), SymbolTable::UNKNOWN);
+    this->_trigger.state_id = SymbolTable::UNKNOWN;
+    for (auto& param: this->_params) {
+        compile_param(param);
+        if (param.type_id == PARAM_STRING) {
+            param.value_template = ParamTemplate(param.value);
+        } else if (param.type_id == PARAM_FUNC_VAL) {
+            // A func_val is a function name optionally followed by ':' and
+            // a comma separated argument list.
+            std::size_t pos = param.value.find(':');
+            if (pos == std::string::npos || pos == param.value.length() - 1) {
+                param.value_template = ParamTemplate(param.value);
+            } else {
+                param.value_template = ParamTemplate(param.value.substr(0, pos));
+                ParamTemplate::parse_list(param.value.substr(pos + 1), ',', param.arg_templates);
+            }
+            compile_json_get_value(param);
+        }
+    }
+    for (auto const& output: outputs) {
+        this->_outputs.push_back(PolicyOutputTemplate::compile(output));
+    }
+    // Identical operands in different outputs share a slot, so that
+    // each of them is resolved only once when outputs are evaluated.
+    std::unordered_map<std::string, int> operand_indexes;
+    for (auto& output: this->_outputs) {
+        for (auto& assertion: output.assertions) {
+            bool is_whole_value = assertion.op == ASSERTION_NOT_EMPTY || assertion.op == ASSERTION_EMPTY;
+            for (auto& operand: assertion.operands) {
+                if (operand.value.is_constant()) {
+                    continue;
+                }
+                // Operands split from a list are trimmed after resolving, they cannot
+                // share a slot with whole values.
+                std::string key = (is_whole_value ? "=" : ",") + operand.value.str();
+                auto index_iter = operand_indexes.find(key);
+                if (index_iter == operand_indexes.end()) {
+                    index_iter = operand_indexes.insert({key, (int)operand_indexes.size()}).first;
+                }
+                operand.index = index_iter->second;
+            }
+        }
+    }
+    this->_assertion_operand_count = operand_indexes.size();
+    this->bind_param_slots();
+    this->analyze_param_dependency();
+}
+
+void Policy::bind_param_slots() {
+    // A name defined by more than one param, or both defined and referenced, has a single slot.
+    ParamSlotMap slots;
+    for (auto& param: this->_params) {
+        param.slot = slots.insert({param.name, (int)slots.size()}).first->second;
+        param.value_template.bind(slots);
+        for (auto& arg_template: param.arg_templates) {
+            arg_template.bind(slots);
+        }
+    }
+    for (auto& output: this->_outputs) {
+        for (auto& assertion: output.assertions) {
+            for (auto& operand: assertion.operands) {
+                operand.value.bind(slots);
+            }
+            assertion.value_template.bind(slots);
+        }
+        for (auto& meta: output.meta) {
+            meta.key.bind(slots);
+            meta.value.bind(slots);
+        }
+        output.session_state.bind(slots);
+        for (auto& context: output.session_context) {
+            context.key.bind(slots);
+            context.value.bind(slots);
+        }
+        for (auto& result: output.results) {
+            for (auto& value: result.values) {
+                value.bind(slots);
+            }
+        }
+    }
+
+    // Names of default params are parsed here so that they are never built per request.
+    this->_param_slots.resize(slots.size());
+    for (auto const& slot: slots) {
+        const std::string& name = slot.first;
+        ParamSlot& param_slot = this->_param_slots[slot.second];
+        param_slot.name = name;
+        param_slot.default_type = PARAM_DEFAULT_NONE;
+        if (name == PARAM_LAST_TTS) {
+            param_slot.default_type = PARAM_DEFAULT_LAST_TTS;
+            param_slot.default_key = name;
+        } else if (name.compare(0, PARAM_CONTEXT_PREFIX.length(), PARAM_CONTEXT_PREFIX) == 0) {
+            // The last tts is not a context of the session.
+            std::string key = name.substr(PARAM_CONTEXT_PREFIX.length());
+            if (key != PARAM_LAST_TTS) {
+                param_slot.default_type = PARAM_DEFAULT_CONTEXT;
+                param_slot.default_key = key;
+            }
+        } else if (name.compare(0, PARAM_SLOT_PREFIX.length(), PARAM_SLOT_PREFIX) == 0) {
+            param_slot.default_type = PARAM_DEFAULT_SLOT;
+            param_slot.default_key = name.substr(PARAM_SLOT_PREFIX.length());
+        }
+    }
+
+    for (auto const& param: this->_params) {
+        if (param.name.compare(0, PARAM_CONTEXT_PREFIX.length(), PARAM_CONTEXT_PREFIX) != 0
+                || param.name.length() == PARAM_CONTEXT_PREFIX.length()) {
+            continue;
+        }
+        bool saved = false;
+        for (auto const& saved_param: this->_saved_context_params) {
+            if (saved_param.slot == param.slot) {
+                saved = true;
+                break;
+            }
+        }
+        if (!saved) {
+            SavedContextParam saved_param = {param.slot, param.name.substr(PARAM_CONTEXT_PREFIX.length())};
+            this->_saved_context_params.push_back(saved_param);
+        }
+    }
+}
+
+// Add params referenced by a template to a dependency. Slots are looked up in params
+// defined by the policy first, otherwise they are default params.
+static void add_dependency(const ParamTemplate& param_template,
+                           const std::vector<int>& param_indexes,
+                           const std::vector<ParamSlot>& param_slots,
+                           ParamDependency& dependency) {
+    std::vector<int> slots;
+    param_template.get_param_slots(slots);
+    for (int slot: slots) {
+        int index = param_indexes[slot];
+        if (index < 0) {
+            if (param_slots[slot].default_type != PARAM_DEFAULT_NONE
+                    && std::find(dependency.default_params.begin(), dependency.default_params.end(), slot)
+                    == dependency.default_params.end()) {
+                dependency.default_params.push_back(slot);
+            }
+            continue;
+        }
+        if (std::find(dependency.params.begin(), dependency.params.end(), index)
+                == dependency.params.end()) {
+            dependency.params.push_back(index);
+        }
+    }
+}
+
+void Policy::analyze_param_dependency() {
+    this->_lazy_params = true;
+    // Index of the first param defined for each slot, -1 for default params.
+    std::vector<int> param_indexes(this->_param_slots.size(), -1);
+    for (unsigned int i = 0; i < this->_params.size(); ++i) {
+        int& index = param_indexes[this->_params[i].slot];
+        if (index >= 0) {
+            this->_lazy_params = false;
+            continue;
+        }
+        index = i;
+    }
+    const std::vector<ParamSlot>& param_slots = this->_param_slots;
+    for (unsigned int i = 0; i < this->_params.size(); ++i) {
+        PolicyParam& param = this->_params[i];
+        add_dependency(param.value_template, param_indexes, param_slots, param.dependency);
+        for (auto const& arg_template: param.arg_templates) {
+            add_dependency(arg_template, param_indexes, param_slots, param.dependency);
+        }
+        for (int dependency_index: param.dependency.params) {
+            if (dependency_index >= (int)i) {
+                this->_lazy_params = false;
+            }
+        }
+    }
+    for (auto& output: this->_outputs) {
+        for (auto const& assertion: output.assertions) {
+            for (auto const& operand: assertion.operands) {
+                add_dependency(operand.value, param_indexes, param_slots, output.assertion_dependency);
+            }
+        }
+        for (auto const& meta: output.meta) {
+            add_dependency(meta.key, param_indexes, param_slots, output.output_dependency);
+            add_dependency(meta.value, param_indexes, param_slots, output.output_dependency);
+        }
+        add_dependency(output.session_state, param_indexes, param_slots, output.output_dependency);
+        for (auto const& context: output.session_context) {
+            add_dependency(context.key, param_indexes, param_slots, output.output_dependency);
+            add_dependency(context.value, param_indexes, param_slots, output.output_dependency);
+        }
+        for (auto const& result: output.results) {
+            for (auto const& value: result.values) {
+                add_dependency(value, param_indexes, param_slots, output.output_dependency);
+            }
+        }
+    }
+    // Params referenced by nothing are still evaluated for the calls they make,
+    // such as a func_val param which books a hotel.
+    std::vector<bool> referenced(this->_params.size(), false);
+    auto mark_referenced = [&referenced](const ParamDependency& dependency) {
+        for (int index: dependency.params) {
+            referenced[index] = true;
+        }
+    };
+    for (auto const& param: this->_params) {
+        mark_referenced(param.dependency);
+    }
+    for (auto const& output: this->_outputs) {
+        mark_referenced(output.assertion_dependency);
+        mark_referenced(output.output_dependency);
+    }
+    // Required params, params saved into session context and params not referenced
+    // by anything are evaluated along with whichever output is selected, so that
+    // all params needed after selection are evaluated together.
+    for (unsigned int i = 0; i < this->_params.size(); ++i) {
+        const PolicyParam& param = this->_params[i];
+        if (!param.required && referenced[i] && param.name.find(PARAM_CONTEXT_PREFIX) != 0) {
+            continue;
+        }
+        for (auto& output: this->_outputs) {
+            std::vector<int>& params = output.output_dependency.params;
+            if (std::find(params.begin(), params.end(), (int)i) == params.end()) {
+                params.push_back(i);
+            }
+        }
+    }
+}
+
+void Policy::intern_symbols(SymbolTable& symbols) {
+    this->_trigger.intent_id = symbols.intern(this->_trigger.intent);
+    for (unsigned int i = 0; i < this->_trigger.slots.size(); ++i) {
+        this->_trigger.slot_ids[i] = symbols.intern(this->_trigger.slots[i]);
+    }
+    if (!this->_trigger.state.empty()) {
+        this->_trigger.state_id = symbols.intern(this->_trigger.state);
+    }
+}
+
+void Policy::get_compiled_parts(std::vector<ParamTemplate*>& templates,
+                                std::vector<PolicyOutputAssertion*>& assertions) {
+    for (auto& param: this->_params) {
+        templates.push_back(&param.value_template);
+        for (auto& arg_template: param.arg_templates) {
+            templates.push_back(&arg_template);
+        }
+    }
+    for (auto& output: this->_outputs) {
+        for (auto& assertion: output.assertions) {
+            for (auto& operand: assertion.operands) {
+                templates.push_back(&operand.value);
+            }
+            templates.push_back(&assertion.value_template);
+            assertions.push_back(&assertion);
+        }
+        for (auto& meta: output.meta) {
+            templates.push_back(&meta.key);
+            templates.push_back(&meta.value);
+        }
+        templates.push_back(&output.session_state);
+        for (auto& context: output.session_context) {
+            templates.push_back(&context.key);
+            templates.push_back(&context.value);
+        }
+        for (auto& result: output.results) {
+            for (auto& value: result.values) {
+                templates.push_back(&value);
+            }
+        }
+    }
 }
 
 const PolicyTrigger& Policy::trigger() const {
@@ -32,10 +438,26 @@ const std::vector<PolicyParam>& Policy::params() const {
     return this->_params;
 }
 
-const std::vector<PolicyOutput>& Policy::outputs() const {
+const std::vector<PolicyOutputTemplate>& Policy::outputs() const {
     return this->_outputs;
 }
 
+int Policy::assertion_operand_count() const {
+    return this->_assertion_operand_count;
+}
+
+bool Policy::lazy_params() const {
+    return this->_lazy_params;
+}
+
+const std::vector<ParamSlot>& Policy::param_slots() const {
+    return this->_param_slots;
+}
+
+const std::vector<SavedContextParam>& Policy::saved_context_params() const {
+    return this->_saved_context_params;
+}
+
 // Parse a policy from json configuration.
 // A sample policy is as following:
 //    {
@@ -130,9 +552,14 @@ Policy* Policy::parse_from_json_value(const rapidjson::Value& value) {
             PolicyOutput output;
             if (v.HasMember("assertion") && v["assertion"].IsArray()) {
                 for (auto& v_assertion: v["assertion"].GetArray()) {
-                    std::string assertion_type = v_assertion["type"].GetString();
-                    std::string assertion_value = v_assertion["value"].GetString();
-                    PolicyOutputAssertion assertion = {assertion_type, assertion_value};
+                    PolicyOutputAssertion assertion;
+                    assertion.type = v_assertion["type"].GetString();
+                    assertion.value = v_assertion["value"].GetString();
+                    if (!PolicyOutputAssertion::parse_op(assertion.type, assertion.op)) {
+                        LOG(WARNING) << "Failed to parse policy from json, unknown assertion type "
+                            << assertion.type;
+                        return nullptr;
+                    }
                     output.assertions.push_back(assertion);
                 }
             }
@@ -173,7 +600,7 @@ Policy* Policy::parse_from_json_value(const rapidjson::Value& value) {
                 output.results.push_back(result);
             }
 
-            outputs.push_back(output);
+            outputs.push_back(std::move(output));
         }
     }
     
@@ -181,8 +608,8 @@ Policy* Policy::parse_from_json_value(const rapidjson::Value& value) {
 }
 
 std::string PolicyOutputSession::to_json_str(const PolicyOutputSession& session) {
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    ArenaStringBuffer buffer(current_json_arena());
+    ArenaWriter writer(buffer, current_json_arena());
     writer.StartObject();
     writer.Key("domain");
     writer.String(session.domain.c_str(), session.domain.length());
@@ -201,7 +628,7 @@ std::string PolicyOutputSession::to_json_str(const PolicyOutputSession& session)
 
 PolicyOutputSession PolicyOutputSession::from_json_str(const std::string& json_str) {
     PolicyOutputSession session;
-    rapidjson::Document session_doc;
+    ArenaDocument session_doc;
     if (session_doc.Parse(json_str.c_str()).HasParseError() || !session_doc.IsObject()) {
         return session;
     }
@@ -224,60 +651,86 @@ PolicyOutputSession PolicyOutputSession::from_json_str(const std::string& json_s
     return session;
 }
 
-std::string PolicyOutput::to_json_str(const PolicyOutput& output) {
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-    writer.StartObject();
-    writer.Key("meta");
+std::shared_ptr<const PolicyOutputResultJson> PolicyOutputResultJson::encode(
+        const std::string& type, const std::string& extra) {
+    std::shared_ptr<PolicyOutputResultJson> json = std::make_shared<PolicyOutputResultJson>();
+    json->head.append("{\"type\":");
+    utils::append_json_string(json->head, type);
+    json->head.append(",\"value\":");
+    if (extra.empty()) {
+        json->tail = "}";
+        return json;
+    }
+    ArenaDocument extra_doc;
+    if (extra_doc.Parse(extra.c_str()).HasParseError() || !extra_doc.IsObject()) {
+        LOG(WARNING) << "Failed to parse result extra json: " <<  extra;
+        json->tail = "}";
+        return json;
+    }
+    // Fields are encoded as an object, whose opening brace is replaced by the separator
+    // following the value.
+    ArenaStringBuffer buffer(current_json_arena());
+    ArenaWriter writer(buffer, current_json_arena());
     writer.StartObject();
-    for (auto const& meta: output.meta) {
-        writer.Key(meta.key.c_str(), meta.key.length());
-        writer.String(meta.value.c_str(), meta.value.length());
+    for (auto& v_extra: extra_doc.GetObject()) {
+        std::string extra_key = v_extra.name.GetString();
+        if (extra_key == "type" || extra_key == "value") {
+            LOG(WARNING) << "Unsupported extra key " << extra_key;
+        }
+        if (v_extra.value.IsString()) {
+            writer.Key(extra_key.c_str());
+            writer.String(v_extra.value.GetString(), v_extra.value.GetStringLength());
+        } else if (v_extra.value.IsBool()) {
+            writer.Key(extra_key.c_str());
+            writer.Bool(v_extra.value.GetBool());
+        } else if (v_extra.value.IsInt()) {
+            writer.Key(extra_key.c_str());
+            writer.Int(v_extra.value.GetInt());
+        } else if (v_extra.value.IsDouble()) {
+            writer.Key(extra_key.c_str());
+            writer.Double(v_extra.value.GetDouble());
+        } else {
+            LOG(WARNING) << "Unknown extra value type " << v_extra.value.GetType();
+        }
     }
     writer.EndObject();
-    writer.Key("result");
-    writer.StartArray();
-    for (auto const& result: output.results) {
-        writer.StartObject();
-        writer.Key("type");
-        writer.String(result.type.c_str(), result.type.length());
-        writer.Key("value");
-        writer.String(result.values[0].c_str(), result.values[0].length());
-        if (!result.extra.empty()) {
-            rapidjson::Document extra_doc;
-            if (!extra_doc.Parse(result.extra.c_str()).HasParseError() && extra_doc.IsObject()) {
-                for (auto& v_extra: extra_doc.GetObject()) {
-                    std::string extra_key = v_extra.name.GetString();
-                    if (extra_key == "type" || extra_key == "value") {
-                        LOG(WARNING) << "Unsupported extra key " << extra_key;
-                    }
-                    if (v_extra.value.IsString()) {
-                        std::string extra_value = v_extra.value.GetString();
-                        writer.Key(extra_key.c_str());
-                        writer.String(extra_value.c_str(), extra_value.length());
-                    } else if (v_extra.value.IsBool()) {
-                        writer.Key(extra_key.c_str());
-                        writer.Bool(v_extra.value.GetBool());
-                    } else if (v_extra.value.IsInt()) {
-                        writer.Key(extra_key.c_str());
-                        writer.Int(v_extra.value.GetInt());
-                    } else if (v_extra.value.IsDouble()) {
-                        writer.Key(extra_key.c_str());
-                        writer.Double(v_extra.value.GetDouble());
-                    } else {
-                        LOG(WARNING) << "Unknown extra value type " << v_extra.value.GetType();
-                    }
-                }
-            } else {
-                LOG(WARNING) << "Failed to parse result extra json: " <<  result.extra;
-            }
-        }
-        writer.EndObject();
+    std::string fields = buffer.GetString();
+    if (fields.length() > 2) {
+        json->tail = ",";
+        json->tail.append(fields, 1, std::string::npos);
+    } else {
+        json->tail = "}";
     }
-    writer.EndArray();
+    return json;
+}
 
-    writer.EndObject();
-    return buffer.GetString();
+// The output is appended from result json encoded when policies are loaded,
+// only meta and result values are encoded per response.
+std::string PolicyOutput::to_json_str(const PolicyOutput& output) {
+    std::string json;
+    json.append("{\"meta\":{");
+    for (unsigned int i = 0; i < output.meta.size(); ++i) {
+        if (i > 0) {
+            json.push_back(',');
+        }
+        utils::append_json_string(json, output.meta[i].key);
+        json.push_back(':');
+        utils::append_json_string(json, output.meta[i].value);
+    }
+    json.append("},\"result\":[");
+    for (unsigned int i = 0; i < output.results.size(); ++i) {
+        const PolicyOutputResult& result = output.results[i];
+        std::shared_ptr<const PolicyOutputResultJson> result_json = result.json != nullptr
+            ? result.json : PolicyOutputResultJson::encode(result.type, result.extra);
+        if (i > 0) {
+            json.push_back(',');
+        }
+        json.append(result_json->head);
+        utils::append_json_string(json, result.values[0]);
+        json.append(result_json->tail);
+    }
+    json.append("]}");
+    return json;
 }
 
 } // namespace dmkit
@@ -15,9 +15,12 @@
 #ifndef DMKIT_POLICY_H
 #define DMKIT_POLICY_H
 
+#include <memory>
 #include <string>
 #include <vector>
+#include "param_template.h"
 #include "rapidjson.h"
+#include "symbol_table.h"
 
 namespace dmkit {
 
@@ -32,6 +35,60 @@ struct PolicyTrigger {
     std::string intent;
     std::vector<std::string> slots;
     std::string state;
+    // Symbol ids of intent, slots and state, state_id is SymbolTable::UNKNOWN if state is empty
+    int intent_id;
+    std::vector<int> slot_ids;
+    int state_id;
+};
+
+// Params referenced by a part of a policy, analyzed when the policy is created
+// so that params can be evaluated only when they are needed.
+struct ParamDependency {
+    // Indexes of params in the policy
+    std::vector<int> params;
+    // Slots of default params which are not defined by the policy,
+    // such as session contexts and qu slots.
+    std::vector<int> default_params;
+};
+
+// Where the value of a default param comes from.
+enum ParamDefault {
+    PARAM_DEFAULT_NONE,
+    PARAM_DEFAULT_LAST_TTS,
+    PARAM_DEFAULT_CONTEXT,
+    PARAM_DEFAULT_SLOT
+};
+
+// A slot of the param environment of a policy, one for each distinct param name.
+struct ParamSlot {
+    std::string name;
+    ParamDefault default_type;
+    // Session context key or qu slot key of a default param.
+    std::string default_key;
+};
+
+// A param saved into session context.
+struct SavedContextParam {
+    int slot;
+    std::string key;
+};
+
+// Type of a param, parsed from the type name when the policy is created.
+enum ParamType {
+    PARAM_SLOT_VAL,
+    PARAM_SLOT_VAL_ORI,
+    PARAM_QU_INTENT,
+    PARAM_SESSION_STATE,
+    PARAM_SESSION_CONTEXT,
+    PARAM_CONST,
+    PARAM_STRING,
+    PARAM_REQUEST_PARAM,
+    PARAM_FUNC_VAL,
+    // A func_val calling json_get_value on the value of a param, which is evaluated
+    // on the json parsed once from the param value.
+    PARAM_JSON_GET_VALUE,
+    // Unknown types and params which are invalid for their types, which always fail.
+    PARAM_INVALID
 };
 
 // The parameter required in a policy.
@@ -41,6 +98,23 @@ struct PolicyParam {
     std::string value;
     std::string default_value;
     bool required;
+    ParamType type_id;
+    // Slot tag and index of a slot_val or slot_val_ori param.
+    std::string slot_tag;
+    int slot_index;
+    // Keys of the path of a json_get_value param, split when the policy is created
+    // if the path is constant.
+    std::vector<std::string> json_path;
+    bool json_path_constant;
+    // Compiled when the policy is created, the value of a string param
+    // or the function name of a func_val param.
+    ParamTemplate value_template;
+    // Arguments of a func_val param.
+    std::vector<ParamTemplate> arg_templates;
+    // Params referenced by the value or arguments
+    ParamDependency dependency;
+    // Slot of the param in the param environment
+    int slot;
 };
 
 // Session for policy output, including current domain, user defines contexts
@@ -55,11 +129,26 @@ struct PolicyOutputSession {
     static PolicyOutputSession from_json_str(const std::string& json_str);
 };
 
+// Json of a result except its value, encoded when the policy is loaded so that
+// the static part of a result, including the extra json, is appended as is.
+struct PolicyOutputResultJson {
+    // The opening brace, the type and the key of the value.
+    std::string head;
+    // Fields of the extra json and the closing brace.
+    std::string tail;
+
+    // Encode a result, fields of extra which cannot be encoded are skipped with a warning.
+    static std::shared_ptr<const PolicyOutputResultJson> encode(const std::string& type,
+                                                                const std::string& extra);
+};
+
 // A result item of dm output.
 struct PolicyOutputResult {
     std::string type;
     std::vector<std::string> values;
     std::string extra;
+    // Shared with the policy the result is rendered from, encoded on demand if not set.
+    std::shared_ptr<const PolicyOutputResultJson> json;
 };
 
 struct PolicyOutputQuSlot {
@@ -75,13 +164,45 @@ struct PolicyOutputQu {
     std::vector<PolicyOutputQuSlot> slots;
 };
 
+enum AssertionOp {
+    ASSERTION_NOT_EMPTY,
+    ASSERTION_EMPTY,
+    ASSERTION_IN,
+    ASSERTION_NOT_IN,
+    ASSERTION_EQ,
+    ASSERTION_GT,
+    ASSERTION_GE
+};
+
+// An operand of an assertion, compiled when the policy is created.
+struct AssertionOperand {
+    ParamTemplate value;
+    // Slot of the resolved value shared by identical operands of a policy, -1 if constant.
+    int index;
+    // Numeric value of a constant operand of gt/ge
+    bool is_number;
+    double number;
+};
+
 // An assertion defines the condition under which a result is choosen.
 struct PolicyOutputAssertion {
     std::string type;
     std::string value;
+    AssertionOp op;
+    // The whole value for empty/not_empty, otherwise the comma separated values.
+    std::vector<AssertionOperand> operands;
+    // The whole value of a list assertion. Like the value is rendered before split,
+    // it is rendered and split again if a param value in the list has commas.
+    ParamTemplate value_template;
+    // Function compiled from the assertion, null if it is interpreted.
+    CompiledAssertionFunc compiled;
+
+    // Get the op of an assertion type, returns false for unknown types.
+    static bool parse_op(const std::string& type, AssertionOp& op);
 };
 
-// Schema for DMKit output
+// Schema for DMKit output. Outputs are rendered in place into an output owned by
+// the caller, they can be moved but not copied.
 struct PolicyOutput {
     std::vector<PolicyOutputAssertion> assertions;
     PolicyOutputQu qu;
@@ -89,9 +210,45 @@ struct PolicyOutput {
     PolicyOutputSession session;
     std::vector<PolicyOutputResult> results;
 
+    PolicyOutput() = default;
+    PolicyOutput(PolicyOutput&&) = default;
+    PolicyOutput& operator=(PolicyOutput&&) = default;
+    PolicyOutput(const PolicyOutput&) = delete;
+    PolicyOutput& operator=(const PolicyOutput&) = delete;
+
     static std::string to_json_str(const PolicyOutput& output);
 };
 
+struct KVTemplate {
+    ParamTemplate key;
+    ParamTemplate value;
+};
+
+struct PolicyOutputResultTemplate {
+    std::string type;
+    std::vector<ParamTemplate> values;
+    std::string extra;
+    std::shared_ptr<const PolicyOutputResultJson> json;
+};
+
+// A policy output as configured, with strings compiled into templates.
+// It is rendered into a PolicyOutput with param values once it is selected.
+struct PolicyOutputTemplate {
+    std::vector<PolicyOutputAssertion> assertions;
+    std::vector<KVTemplate> meta;
+    ParamTemplate session_state;
+    std::vector<KVTemplate> session_context;
+    std::vector<PolicyOutputResultTemplate> results;
+    // Params referenced by the assertions
+    ParamDependency assertion_dependency;
+    // Params evaluated once the output is selected, which are params referenced by
+    // meta, session and results, along with required params, params saved into
+    // session context and params not referenced by anything.
+    ParamDependency output_dependency;
+
+    static PolicyOutputTemplate compile(const PolicyOutput& output);
+};
+
 // A policy defines a processing(params) & response(output),
 // given a trigger(intent+slots+state) condition.
 class Policy {
@@ -101,14 +258,40 @@ public:
            const std::vector<PolicyOutput>& outputs);
     const PolicyTrigger& trigger() const;
     const std::vector<PolicyParam>& params() const;
-    const std::vector<PolicyOutput>& outputs() const;
+    const std::vector<PolicyOutputTemplate>& outputs() const;
+    // Number of distinct non-constant assertion operands in all outputs.
+    int assertion_operand_count() const;
+    // Whether params can be evaluated on demand. It is false if a param name is defined
+    // more than once or referenced before its definition, in which case the value
+    // of a name depends on evaluation order and all params are evaluated in order.
+    bool lazy_params() const;
+    // Slots of the param environment, indexed by the slots params and templates are bound to.
+    const std::vector<ParamSlot>& param_slots() const;
+    // Params saved into session context, one for each context key.
+    const std::vector<SavedContextParam>& saved_context_params() const;
+    // Map names of the trigger to ids in the symbol table of the product loading the policy.
+    void intern_symbols(SymbolTable& symbols);
+    // Templates and assertions which can be compiled, in a fixed order shared by
+    // policy_compiler and the loader of compiled modules: templates of params,
+    // then for each output its assertion operands and values, meta, session and results.
+    void get_compiled_parts(std::vector<ParamTemplate*>& templates,
+                            std::vector<PolicyOutputAssertion*>& assertions);
 
     static Policy* parse_from_json_value(const rapidjson::Value& value);
 
 private:
     PolicyTrigger _trigger;
     std::vector<PolicyParam> _params;
-    std::vector<PolicyOutput> _outputs;
+    std::vector<PolicyOutputTemplate> _outputs;
+    int _assertion_operand_count;
+    bool _lazy_params;
+    std::vector<ParamSlot> _param_slots;
+    std::vector<SavedContextParam> _saved_context_params;
+
+    // Bind param names to slots of the param environment.
+    void bind_param_slots();
+
+    void analyze_param_dependency();
 };
 
 } // namespace dmkit
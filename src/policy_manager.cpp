@@ -13,26 +13,117 @@
 // limitations under the License.
 
 #include "policy_manager.h"
+#include <algorithm>
 #include <ctime>
-#include <forward_list>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/stat.h>
-#include <unordered_set>
-#include <unordered_map>
 #include <unistd.h>
 #include <utility>
 #include "app_log.h"
 #include "file_watcher.h"
+#include "param_evaluator.h"
 #include "utils.h"
 
 namespace dmkit {
 
-DomainPolicy::DomainPolicy(const std::string& name, int score, IntentPolicyMap* intent_policy_map)
-    : _name(name), _score(score), _intent_policy_map(intent_policy_map) {
+// When multiple policies satisfy the current intent,
+// the following strategy is applies to find the best one:
+// 1. The policies with none empty trigger state, it should match current DM state.
+// 2. Policy with maximum number of matched trigger slot is ranked top.
+// Candidates are stable sorted so that the first one in configuration wins a tie.
+static bool candidate_precedes(const PolicyCandidate& a, const PolicyCandidate& b) {
+    bool a_has_state = !a.policy->trigger().state.empty();
+    bool b_has_state = !b.policy->trigger().state.empty();
+    if (a_has_state != b_has_state) {
+        return a_has_state;
+    }
+    return a.policy->trigger().slots.size() > b.policy->trigger().slots.size();
+}
+
+static const std::string FALLBACK_INTENT = "dmkit_intent_fallback";
+
+DomainPolicy::DomainPolicy(const std::string& name,
+                           int score,
+                           const std::string& conf_path,
+                           const std::string& conf_mtime,
+                           const std::string& compiled_path,
+                           IntentPolicyMap* intent_policy_map,
+                           const std::shared_ptr<SymbolTable>& symbols,
+                           const std::shared_ptr<CompiledPolicyModule>& compiled_module)
+    : _name(name), _score(score), _conf_path(conf_path), _conf_mtime(conf_mtime),
+      _compiled_path(compiled_path), _intent_policy_map(intent_policy_map), _symbols(symbols),
+      _fallback_index(nullptr), _slot_count(0), _compiled_module(compiled_module) {
+    if (this->_intent_policy_map == nullptr) {
+        return;
+    }
+    for (IntentPolicyMap::iterator iter = this->_intent_policy_map->begin();
+            iter != this->_intent_policy_map->end(); ++iter) {
+        auto policy_vector = iter->second;
+        for (auto& candidate: *policy_vector) {
+            candidate.policy->intern_symbols(*symbols);
+            candidate.slot_counts.clear();
+            for (int symbol_id: candidate.policy->trigger().slot_ids) {
+                if (symbol_id >= (int)this->_slot_ids.size()) {
+                    this->_slot_ids.resize(symbol_id + 1, -1);
+                }
+                if (this->_slot_ids[symbol_id] < 0) {
+                    this->_slot_ids[symbol_id] = this->_slot_count++;
+                }
+                int slot_id = this->_slot_ids[symbol_id];
+                auto slot_count = std::find_if(candidate.slot_counts.begin(), candidate.slot_counts.end(),
+                    [slot_id](const std::pair<int, int>& p) { return p.first == slot_id; });
+                if (slot_count == candidate.slot_counts.end()) {
+                    candidate.slot_counts.push_back(std::make_pair(slot_id, 1));
+                } else {
+                    slot_count->second++;
+                }
+            }
+        }
+        std::stable_sort(policy_vector->begin(), policy_vector->end(), candidate_precedes);
+
+        // Sorted candidates are partitioned by state in order, so that each partition
+        // keeps the precedence of its candidates.
+        IntentPolicyIndex* index = new IntentPolicyIndex();
+        index->state_candidates.init(10, 80);
+        index->fallback = nullptr;
+        for (auto const& candidate: *policy_vector) {
+            int state_id = candidate.policy->trigger().state_id;
+            if (state_id == SymbolTable::UNKNOWN) {
+                index->stateless_candidates.push_back(candidate);
+                continue;
+            }
+            PolicyVector* state_seek = index->state_candidates.seek(state_id);
+            if (state_seek == nullptr) {
+                state_seek = index->state_candidates.insert(state_id, PolicyVector());
+            }
+            state_seek->push_back(candidate);
+        }
+        int intent_id = symbols->intern(iter->first);
+        if (intent_id >= (int)this->_policy_index.size()) {
+            this->_policy_index.resize(intent_id + 1, nullptr);
+        }
+        this->_policy_index[intent_id] = index;
+    }
+
+    int fallback_id = symbols->find(FALLBACK_INTENT);
+    if (fallback_id != SymbolTable::UNKNOWN && fallback_id < (int)this->_policy_index.size()) {
+        this->_fallback_index = this->_policy_index[fallback_id];
+    }
+    if (this->_fallback_index != nullptr) {
+        for (IntentPolicyIndex* index: this->_policy_index) {
+            if (index != nullptr && index != this->_fallback_index) {
+                index->fallback = this->_fallback_index;
+            }
+        }
+    }
 }
 
 DomainPolicy::~DomainPolicy() {
+    for (IntentPolicyIndex* index: this->_policy_index) {
+        delete index;
+    }
+    this->_policy_index.clear();
     if (this->_intent_policy_map == nullptr) {
         return;
     }
@@ -44,12 +135,8 @@ DomainPolicy::~DomainPolicy() {
         }
         for (PolicyVector::iterator iter2 = policy_vector->begin();
                 iter2 != policy_vector->end(); ++iter2) {
-            auto policy = *iter2;
-            if (policy == nullptr) {
-                continue;
-            }
-            delete policy;
-            *iter2 = nullptr;
+            delete iter2->policy;
+            iter2->policy = nullptr;
         }
         delete policy_vector;
         iter->second = nullptr;
@@ -66,10 +153,48 @@ const std::string& DomainPolicy::name() {
     return this->_name;
 }
 
+const std::string& DomainPolicy::conf_path() {
+    return this->_conf_path;
+}
+
+const std::string& DomainPolicy::conf_mtime() {
+    return this->_conf_mtime;
+}
+
+const std::string& DomainPolicy::compiled_path() {
+    return this->_compiled_path;
+}
+
+bool DomainPolicy::is_compiled() {
+    return this->_compiled_module != nullptr;
+}
+
 IntentPolicyMap* DomainPolicy::intent_policy_map() {
     return this->_intent_policy_map;
 }
 
+const SymbolTable* DomainPolicy::symbols() {
+    return this->_symbols.get();
+}
+
+const IntentPolicyIndex* DomainPolicy::policy_index(int intent_id) {
+    if (intent_id >= 0 && intent_id < (int)this->_policy_index.size()
+            && this->_policy_index[intent_id] != nullptr) {
+        return this->_policy_index[intent_id];
+    }
+    return this->_fallback_index;
+}
+
+void DomainPolicy::count_slots(const std::vector<Slot>& slots, std::vector<int>& slot_counts) {
+    slot_counts.assign(this->_slot_count, 0);
+    for (auto const& slot: slots) {
+        int symbol_id = slot.key_id();
+        if (symbol_id >= 0 && symbol_id < (int)this->_slot_ids.size() && this->_slot_ids[symbol_id] >= 0) {
+            slot_counts[this->_slot_ids[symbol_id]]++;
+        }
+    }
+}
+
 PolicyManager::PolicyManager() {
     this->_user_function_manager = nullptr;
 }
@@ -81,6 +206,10 @@ PolicyManager::~PolicyManager() {
     }
 
     FileWatcher::get_instance().unregister_file(this->_conf_file_path);
+    for (auto const& conf_path: this->_watched_conf_paths) {
+        FileWatcher::get_instance().unregister_file(conf_path);
+    }
+    this->_watched_conf_paths.clear();
     this->_p_policy_dict.reset();
 }
 
@@ -91,20 +220,13 @@ static inline void destroy_policy_dict(ProductPolicyMap* policy_dict) {
     }
     for (ProductPolicyMap::iterator iter = policy_dict->begin(); iter != policy_dict->end();
          ++iter) {
-        auto domain_policy_map = iter->second;
-        if (domain_policy_map == nullptr) {
+        auto product_policy = iter->second;
+        if (product_policy == nullptr) {
             continue;
         }
-        for (DomainPolicyMap::iterator iter2 = domain_policy_map->begin();
-             iter2 != domain_policy_map->end(); ++iter2) {
-            auto domain_policy = iter2->second;
-            if (domain_policy == nullptr) {
-                continue;
-            }
-            delete domain_policy;
-            iter2->second = nullptr;
-        }
-        delete domain_policy_map;
+        // Domains are only destroyed here if they are not reused by a newer dict
+        delete product_policy->domain_policy_map;
+        delete product_policy;
         iter->second = nullptr;
     }
     delete policy_dict;
@@ -125,7 +247,8 @@ int PolicyManager::init(const char* dir_path, const char* conf_file) {
     }
     this->_conf_file_path = file_path;
 
-    ProductPolicyMap* policy_dict = this->load_policy_dict();
+    std::unordered_set<std::string> conf_paths;
+    ProductPolicyMap* policy_dict = this->load_policy_dict(nullptr, conf_paths);
     if (policy_dict == nullptr) {
         APP_LOG(ERROR) << "Failed to init policy dict";
         return -1;
@@ -133,6 +256,7 @@ int PolicyManager::init(const char* dir_path, const char* conf_file) {
     this->_p_policy_dict.reset(policy_dict, [](ProductPolicyMap* p) { destroy_policy_dict(p); });
     FileWatcher::get_instance().register_file(
         this->_conf_file_path, PolicyManager::policy_conf_change_callback, this, true);
+    this->watch_domain_confs(conf_paths);
 
     this->_user_function_manager = new UserFunctionManager();
     if (this->_user_function_manager->init() != 0) {
@@ -143,51 +267,127 @@ int PolicyManager::init(const char* dir_path, const char* conf_file) {
     return 0;
 }
 
+// Reloads are triggered by changes of products.json or any domain conf file,
+// only domains whose conf changed are reparsed.
 int PolicyManager::reload() {
     LOG(TRACE) << "Reloading policy dict";
-    ProductPolicyMap * policy_dict = this->load_policy_dict();
+    std::unordered_set<std::string> conf_paths;
+    ProductPolicyMap * policy_dict = this->load_policy_dict(this->_p_policy_dict.get(), conf_paths);
     if (policy_dict == nullptr) {
         LOG(WARNING) << "Cannot reload policy! Policy dict load failed.";
         return -1;
     }
 
     this->_p_policy_dict.reset(policy_dict, [](ProductPolicyMap* p) { destroy_policy_dict(p); });
+    this->watch_domain_confs(conf_paths);
     APP_LOG(TRACE) << "Reload finished.";
     return 0;
 }
 
+void PolicyManager::watch_domain_confs(const std::unordered_set<std::string>& conf_paths) {
+    for (auto iter = this->_watched_conf_paths.begin(); iter != this->_watched_conf_paths.end();) {
+        if (conf_paths.count(*iter) == 0) {
+            FileWatcher::get_instance().unregister_file(*iter);
+            iter = this->_watched_conf_paths.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+    for (auto const& conf_path: conf_paths) {
+        if (this->_watched_conf_paths.count(conf_path) != 0 || conf_path == this->_conf_file_path) {
+            continue;
+        }
+        // Files failed to register, such as missing ones, are retried by next reload
+        if (FileWatcher::get_instance().register_file(
+                conf_path, PolicyManager::policy_conf_change_callback, this, true) == 0) {
+            this->_watched_conf_paths.insert(conf_path);
+        }
+    }
+}
+
 int PolicyManager::policy_conf_change_callback(void* param) {
     PolicyManager* pm = (PolicyManager*)param;
     return pm->reload();
 }
 
-PolicyOutput* PolicyManager::resolve(const std::string& product,
-                                     BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>* qu_result,
-                                     const PolicyOutputSession& session,
-                                     const RequestContext& context) {
+std::shared_ptr<ProductPolicyMap> PolicyManager::get_policy_dict() const {
+    return this->_p_policy_dict;
+}
+
+const SymbolTable* PolicyManager::get_symbol_table(const std::shared_ptr<ProductPolicyMap>& policy_dict,
+                                                   const std::string& product) {
+    if (policy_dict == nullptr) {
+        return nullptr;
+    }
+    ProductPolicy** seek_result = policy_dict->seek(product);
+    return seek_result != nullptr ? (*seek_result)->symbols.get() : nullptr;
+}
+
+int PolicyManager::resolve(const std::string& product,
+                           BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>* qu_result,
+                           const PolicyOutputSession& session,
+                           const RequestContext& context,
+                           PolicyOutput& output) {
     std::shared_ptr<ProductPolicyMap> p_policy_map(this->_p_policy_dict);
+    return this->resolve(p_policy_map, product, qu_result, session, context, output);
+}
+
+int PolicyManager::resolve(const std::shared_ptr<ProductPolicyMap>& p_policy_map,
+                           const std::string& product,
+                           BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>* qu_result,
+                           const PolicyOutputSession& session,
+                           const RequestContext& context,
+                           PolicyOutput& output) {
     if (p_policy_map == nullptr) {
         APP_LOG(ERROR) << "Policy resolve failed, empty policy dict";
-        return nullptr;
+        return -1;
     }
 
-    DomainPolicyMap** seek_result = p_policy_map->seek(product);
+    ProductPolicy** seek_result = p_policy_map->seek(product);
     if (seek_result == nullptr) {
         APP_LOG(WARNING) << "unkown product " << product;
-        return nullptr;
+        return -1;
     }
 
-    DomainPolicyMap* domain_policy_map = *seek_result;
-    DomainPolicy* state_domain_policy = nullptr;
-    Policy* state_policy = nullptr;
-    std::forward_list<std::pair<DomainPolicy*, Policy*>> ranked_policies;
+    ProductPolicy* product_policy = *seek_result;
     std::vector<Slot> empty_slots;
-    QuResult empty_qu("", "", empty_slots);
+    QuResult empty_qu("", "", empty_slots, product_policy->symbols->find(""));
     std::string request_domain;
     context.try_get_param("domain", request_domain);
-    for (DomainPolicyMap::iterator iter = domain_policy_map->begin();
-            iter != domain_policy_map->end(); ++iter) {
-        auto domain_policy = iter->second;
+
+    // Policy with a domain and trigger state matches current DMKit domain&state is ranked top,
+    // it is resolved before matching any other domain.
+    DomainPolicy* session_domain_policy = nullptr;
+    Policy* session_domain_result = nullptr;
+    if (!session.domain.empty() && !session.state.empty()
+            && (request_domain.empty() || request_domain == session.domain)) {
+        std::shared_ptr<DomainPolicy>* domain_seek_result =
+            product_policy->domain_policy_map->seek(session.domain);
+        if (domain_seek_result != nullptr) {
+            session_domain_policy = domain_seek_result->get();
+            QuResult** qu_seek_result = qu_result->seek(session.domain);
+            QuResult* qu = qu_seek_result != nullptr ? *qu_seek_result : &empty_qu;
+            session_domain_result = this->find_best_policy(session_domain_policy, qu, session, context);
+            if (session_domain_result != nullptr
+                    && session_domain_result->trigger().state == session.state) {
+                APP_LOG(TRACE) << "Resolving policy output for domain [" << session.domain << "]";
+                if (this->resolve_policy_output(session.domain,
+                        session_domain_result, qu, session, context, output) == 0) {
+                    APP_LOG(TRACE) << "Final result domain [" << session.domain << "]";
+                    return 0;
+                }
+                // Other policies are not tried before the service calls finish.
+                if (context.has_pending_calls()) {
+                    return -1;
+                }
+                session_domain_result = nullptr;
+            }
+        }
+    }
+
+    // In case there are multiple domain results, the policies are ranked by static domain score.
+    // Domains are matched lazily in that order and the first output resolved successfully is returned.
+    for (DomainPolicy* domain_policy: product_policy->ranked_domains) {
         const std::string& domain_name = domain_policy->name();
         if (!request_domain.empty() && domain_name != request_domain) {
             continue;
@@ -196,54 +396,31 @@ PolicyOutput* PolicyManager::resolve(const std::string& product,
         QuResult* qu = qu_seek_result != nullptr ? *qu_seek_result : &empty_qu;
 
         // Find a best policy give the qu result in current domain
-        Policy* find_result = this->find_best_policy(domain_policy, qu, session, context);
-        if (find_result == nullptr) {
-            continue;
+        Policy* find_result = nullptr;
+        if (domain_policy == session_domain_policy) {
+            find_result = session_domain_result;
+        } else {
+            find_result = this->find_best_policy(domain_policy, qu, session, context);
         }
-
-        // Policy with a domain and trigger state matches current DMKit domain&state is ranked top
-        if (!session.domain.empty() && (domain_name == session.domain)
-            && !session.state.empty() && (find_result->trigger().state == session.state)) {
-            state_domain_policy = domain_policy;
-            state_policy = find_result;;
+        if (find_result == nullptr) {
             continue;
         }
 
-        // In case there are multiple domain results, the policies a ranked by static domain score
-        auto previous_it = ranked_policies.before_begin();
-        for (auto it = ranked_policies.begin(); it != ranked_policies.end(); ++it) {
-            if (domain_policy->score() > it->first->score()) {
-                break;
-            }
-            previous_it = it;
-        }
-        std::pair<DomainPolicy*, Policy*> p(domain_policy, find_result);
-        ranked_policies.insert_after(previous_it, p);
-    }
-
-    if (state_domain_policy != nullptr && state_policy != nullptr) {
-        std::pair<DomainPolicy*, Policy*> p(state_domain_policy, state_policy);
-        ranked_policies.insert_after(ranked_policies.before_begin(), p);
-    }
-
-    // Resolve policy output and returns the first output resolved successfully.
-    for (auto& p: ranked_policies) {
-        const std::string& domain_name = p.first->name();
         APP_LOG(TRACE) << "Resolving policy output for domain [" << domain_name << "]";
-        QuResult** qu_seek_result = qu_result->seek(domain_name);
-        QuResult* qu = qu_seek_result != nullptr ? *qu_seek_result : &empty_qu;
-        PolicyOutput* result = this->resolve_policy_output(domain_name,
-                p.second, qu, session, context);
-        if (result != nullptr) {
+        if (this->resolve_policy_output(domain_name, find_result, qu, session, context, output) == 0) {
             APP_LOG(TRACE) << "Final result domain [" << domain_name << "]";
-            return result;
+            return 0;
+        }
+        if (context.has_pending_calls()) {
+            return -1;
         }
     }
 
-    return nullptr;
+    return -1;
 }
 
-ProductPolicyMap* PolicyManager::load_policy_dict() {
+ProductPolicyMap* PolicyManager::load_policy_dict(const ProductPolicyMap* last_dict,
+                                                  std::unordered_set<std::string>& conf_paths) {
     ProductPolicyMap* product_policy_map = new ProductPolicyMap();
     // 10: bucket_count, initial count of buckets, big enough to avoid resize.
     // 80: load_factor, element_count * 100 / bucket_count.
@@ -275,20 +452,48 @@ ProductPolicyMap* PolicyManager::load_policy_dict() {
             destroy_policy_dict(product_policy_map);
             return nullptr;
         }
-        DomainPolicyMap* domain_policy_map = this->load_domain_policy_map(prod_name, prod_iter->value);
+        const ProductPolicy* last_product = nullptr;
+        if (last_dict != nullptr) {
+            ProductPolicy* const* last_seek = last_dict->seek(prod_name);
+            last_product = last_seek != nullptr ? *last_seek : nullptr;
+        }
+        // Symbols are copied in order from the last table so that existing names keep their ids.
+        ProductPolicy* product_policy = new ProductPolicy();
+        product_policy->symbols = std::make_shared<SymbolTable>();
+        if (last_product != nullptr) {
+            for (int id = 0; id < last_product->symbols->size(); ++id) {
+                product_policy->symbols->intern(last_product->symbols->name(id));
+            }
+        }
+        DomainPolicyMap* domain_policy_map = this->load_domain_policy_map(
+            prod_name, prod_iter->value, last_product, product_policy->symbols, conf_paths);
         if (domain_policy_map == nullptr) {
             APP_LOG(ERROR) << "Failed to load policies for product " << prod_name;
+            delete product_policy;
             destroy_policy_dict(product_policy_map);
             return nullptr;
         }
-        product_policy_map->insert(prod_name, domain_policy_map);
+        APP_LOG(TRACE) << "Product " << prod_name << " has " << product_policy->symbols->size() << " symbols";
+        // Domains are ranked by score here, so that they are resolved in order of score
+        // and matching stops at the first domain resolved.
+        product_policy->domain_policy_map = domain_policy_map;
+        for (DomainPolicyMap::iterator iter = domain_policy_map->begin();
+                iter != domain_policy_map->end(); ++iter) {
+            product_policy->ranked_domains.push_back(iter->second.get());
+        }
+        std::stable_sort(product_policy->ranked_domains.begin(), product_policy->ranked_domains.end(),
+                         [](DomainPolicy* a, DomainPolicy* b) { return a->score() > b->score(); });
+        product_policy_map->insert(prod_name, product_policy);
     }
 
     return product_policy_map;
 }
 
 DomainPolicyMap* PolicyManager::load_domain_policy_map(const std::string& product_name,
-                                                        const rapidjson::Value& product_json) {
+                                                        const rapidjson::Value& product_json,
+                                                        const ProductPolicy* last_product,
+                                                        const std::shared_ptr<SymbolTable>& symbols,
+                                                        std::unordered_set<std::string>& conf_paths) {
     DomainPolicyMap* domain_policy_map = new DomainPolicyMap();
     // 10: bucket_count, initial count of buckets, big enough to avoid resize.
     // 80: load_factor, element_count * 100 / bucket_count.
@@ -315,17 +520,50 @@ DomainPolicyMap* PolicyManager::load_domain_policy_map(const std::string& produc
             continue;
         }
         std::string conf_path = setting_iter->value.GetString();
+        conf_paths.insert(conf_path);
+
+        std::string compiled_path;
+        setting_iter = domain_json.FindMember("compiled_path");
+        if (setting_iter != domain_json.MemberEnd() && setting_iter->value.IsString()) {
+            compiled_path = setting_iter->value.GetString();
+        }
+
+        // The modified time is got before parsing, a change while parsing is reloaded next time.
+        std::string conf_mtime;
+        FileWatcher::get_file_last_modified_time(conf_path, conf_mtime);
+        std::shared_ptr<DomainPolicy> last_domain;
+        if (last_product != nullptr) {
+            std::shared_ptr<DomainPolicy>* last_seek = last_product->domain_policy_map->seek(domain_name);
+            if (last_seek != nullptr && (*last_seek)->conf_path() == conf_path
+                    && (*last_seek)->compiled_path() == compiled_path) {
+                last_domain = *last_seek;
+            }
+        }
+        if (last_domain != nullptr && last_domain->score() == score
+                && !conf_mtime.empty() && last_domain->conf_mtime() == conf_mtime) {
+            APP_LOG(TRACE) << "Reusing policies for domain " << domain_name << ", conf unchanged";
+            domain_policy_map->insert(domain_name, last_domain);
+            continue;
+        }
 
         APP_LOG(TRACE) << "Loading policies for domain " << domain_name << " from " << conf_path;
-        DomainPolicy* domain_policy = this->load_domain_policy(domain_name, score, conf_path);
+        DomainPolicy* domain_policy = this->load_domain_policy(
+            domain_name, score, conf_path, conf_mtime, compiled_path, symbols);
         if (domain_policy == nullptr) {
+            // A conf being edited may be incomplete, policies loaded last time are kept.
+            if (last_domain != nullptr && last_domain->score() == score) {
+                APP_LOG(WARNING) << "Failed to reload policy for domain "
+                    << domain_name << " in product " << product_name << ", last policies kept";
+                domain_policy_map->insert(domain_name, last_domain);
+                continue;
+            }
             APP_LOG(WARNING) << "Failed to load policy for domain "
                 << domain_name << " in product " << product_name << ", skipped";
             continue;
         }
         APP_LOG(TRACE) << "Loaded policies for domain " << domain_name;
 
-        domain_policy_map->insert(domain_name, domain_policy);
+        domain_policy_map->insert(domain_name, std::shared_ptr<DomainPolicy>(domain_policy));
     }
 
     return domain_policy_map;
@@ -333,17 +571,25 @@ DomainPolicyMap* PolicyManager::load_domain_policy_map(const std::string& produc
 
 DomainPolicy* PolicyManager::load_domain_policy(const std::string& domain_name,
                                                 int score,
-                                                const std::string& conf_path) {
+                                                const std::string& conf_path,
+                                                const std::string& conf_mtime,
+                                                const std::string& compiled_path,
+                                                const std::shared_ptr<SymbolTable>& symbols) {
+    // The conf is read as a whole since a compiled module is checked against its content.
     FILE* fp = fopen(conf_path.c_str(), "r");
     if (fp == nullptr) {
         APP_LOG(ERROR) << "Failed to open file " << conf_path;
         return nullptr;
     }
+    std::string conf;
     char read_buffer[1024];
-    rapidjson::FileReadStream is(fp, read_buffer, sizeof(read_buffer));
-    rapidjson::Document doc;
-    doc.ParseStream(is);
+    size_t read_size = 0;
+    while ((read_size = fread(read_buffer, 1, sizeof(read_buffer), fp)) > 0) {
+        conf.append(read_buffer, read_size);
+    }
     fclose(fp);
+    rapidjson::Document doc;
+    doc.Parse(conf.c_str());
     if (doc.HasParseError() || !doc.IsArray()) {
         APP_LOG(ERROR) << "Failed to parse domain conf " << conf_path;
         return nullptr;
@@ -352,6 +598,8 @@ DomainPolicy* PolicyManager::load_domain_policy(const std::string& domain_name,
     // 10: bucket_count, initial count of buckets, big enough to avoid resize.
     // 80: load_factor, element_count * 100 / bucket_count.
     intent_policy_map->init(10, 80);
+    // Policies in the order of the conf, which is the order they are compiled in.
+    std::vector<Policy*> policies;
     for (rapidjson::Value::ConstValueIterator policy_iter = doc.Begin();
             policy_iter != doc.End(); ++policy_iter) {
         APP_LOG(TRACE) << "loading policy...";
@@ -360,69 +608,53 @@ DomainPolicy* PolicyManager::load_domain_policy(const std::string& domain_name,
             APP_LOG(WARNING) << "Found invalid policy conf in path " << conf_path << ", skipped";
             continue;
         }
+        policies.push_back(policy);
         const std::string& trigger_intent = policy->trigger().intent;
         if (intent_policy_map->seek(trigger_intent) == nullptr) {
             intent_policy_map->insert(trigger_intent, new PolicyVector);
         }
-        (*intent_policy_map)[trigger_intent]->push_back(policy);
+        PolicyCandidate candidate;
+        candidate.policy = policy;
+        (*intent_policy_map)[trigger_intent]->push_back(candidate);
+    }
+    std::shared_ptr<CompiledPolicyModule> compiled_module;
+    if (!compiled_path.empty()) {
+        compiled_module = CompiledPolicyModule::load(
+            compiled_path, CompiledPolicyModule::fingerprint(conf));
+        if (compiled_module != nullptr && !compiled_module->attach(policies)) {
+            compiled_module.reset();
+        }
+        if (compiled_module == nullptr) {
+            APP_LOG(WARNING) << "Policies of domain " << domain_name << " are interpreted";
+        } else {
+            APP_LOG(TRACE) << "Policies of domain " << domain_name << " are compiled";
+        }
     }
     APP_LOG(TRACE) << "initializing domain policy...";
-    DomainPolicy* domain_policy = new DomainPolicy(domain_name, score, intent_policy_map);
+    DomainPolicy* domain_policy = new DomainPolicy(domain_name, score, conf_path, conf_mtime,
+        compiled_path, intent_policy_map, symbols, compiled_module);
     APP_LOG(TRACE) << "finish initializing domain policy...";
     return domain_policy;
 }
 
-// When multiple policies satisfy the current intent,
-// the following strategy is applies to find the best one:
-// 1. The policies with none empty trigger state, it should match current DM state.
-// 2. Policy with maximum number of matched trigger slot is ranked top.
-static Policy* find_best_policy_from_candidates(PolicyVector& policy_vector,
-                                                std::string& state,
-                                                std::unordered_multiset<std::string>& qu_slot_set) {
-    Policy* policy_result = nullptr;
-    for (auto const& policy: policy_vector) {
-        if (!policy->trigger().state.empty() && policy->trigger().state != state) {
-            continue;
-        }
-
+// Candidates are presorted by precedence, the best policy is the first one
+// whose trigger slots are satisfied.
+static Policy* find_best_policy_from_candidates(const PolicyVector& policy_vector,
+                                                const std::vector<int>& qu_slot_counts) {
+    for (auto const& candidate: policy_vector) {
         bool missing_slot = false;
-        std::unordered_multiset<std::string> trigger_slot_set;
-        for (auto const& slot: policy->trigger().slots) {
-            trigger_slot_set.insert(slot);
-        }
-        for (auto iter = trigger_slot_set.begin(); iter != trigger_slot_set.end();) {
-            int trigger_slot_cnt = trigger_slot_set.count(*iter);
-            int qu_slot_cnt = qu_slot_set.count(*iter);
-            if (qu_slot_cnt < trigger_slot_cnt) {
+        for (auto const& slot_count: candidate.slot_counts) {
+            if (qu_slot_counts[slot_count.first] < slot_count.second) {
                 missing_slot = true;
                 break;
             }
-            std::advance(iter, trigger_slot_cnt);
-        }
-        if (missing_slot) {
-            continue;
-        }
-
-        if (policy_result == nullptr) {
-            policy_result = policy;
-            continue;
         }
-
-        if (!policy_result->trigger().state.empty() && policy->trigger().state.empty()) {
-            continue;
-        }
-
-        if (policy_result->trigger().state.empty() && !policy->trigger().state.empty()) {
-            policy_result = policy;
-            continue;
-        }
-
-        if (policy_result->trigger().slots.size() < policy->trigger().slots.size()) {
-            policy_result = policy;
+        if (!missing_slot) {
+            return candidate.policy;
         }
     }
 
-    return policy_result;
+    return nullptr;
 }
 
 Policy* PolicyManager::find_best_policy(DomainPolicy* domain_policy,
@@ -431,349 +663,227 @@ Policy* PolicyManager::find_best_policy(DomainPolicy* domain_policy,
                                         const RequestContext& context) {
     (void) context;
 
-    std::string state;
-    if (domain_policy->name() == session.domain) {
-        state = session.state;
+    int state_id = SymbolTable::UNKNOWN;
+    if (domain_policy->name() == session.domain && !session.state.empty()) {
+        state_id = domain_policy->symbols()->find(session.state);
     }
 
-    std::unordered_multiset<std::string> qu_slot_set;
-    IntentPolicyMap* intent_policy_map = domain_policy->intent_policy_map();
-    PolicyVector** policy_vector_seek = nullptr;
-    Policy* policy_result = nullptr;
-
-    for (auto const& slot: qu_result->slots()) {
-        qu_slot_set.insert(slot.key());
-    }
-    // Policy with matching intent.
+    std::vector<int> qu_slot_counts;
+    domain_policy->count_slots(qu_result->slots(), qu_slot_counts);
+    // Policy with matching intent, candidates with a trigger state matching current state
+    // precede stateless ones. The fallback policy is tried when none of the policies match intent.
     const std::string& intent = qu_result->intent();
-    policy_vector_seek = intent_policy_map->seek(intent);
-    if (policy_vector_seek != nullptr) {
-        APP_LOG(TRACE) << "intent [" << intent << "] candidate count [" << (*policy_vector_seek)->size() << "]";
-        policy_result = find_best_policy_from_candidates(**policy_vector_seek, state, qu_slot_set);
-    }
-
-    // Fallback policy when none of the policies match intent.
-    if (policy_result == nullptr) {
-        const std::string fallback_intent = "dmkit_intent_fallback";
-        policy_vector_seek = intent_policy_map->seek(fallback_intent);
-        if (policy_vector_seek != nullptr) {
-            APP_LOG(TRACE) << "dmkit_intent_fallback candidate count [" << (*policy_vector_seek)->size() << "]";
-            policy_result = find_best_policy_from_candidates(**policy_vector_seek, state, qu_slot_set);
+    for (const IntentPolicyIndex* index = domain_policy->policy_index(qu_result->intent_id());
+            index != nullptr; index = index->fallback) {
+        if (state_id != SymbolTable::UNKNOWN) {
+            const PolicyVector* state_seek = index->state_candidates.seek(state_id);
+            if (state_seek != nullptr) {
+                APP_LOG(TRACE) << "intent [" << intent << "] state [" << session.state
+                    << "] candidate count [" << state_seek->size() << "]";
+                Policy* policy_result = find_best_policy_from_candidates(*state_seek, qu_slot_counts);
+                if (policy_result != nullptr) {
+                    return policy_result;
+                }
+            }
+        }
+        APP_LOG(TRACE) << "intent [" << intent << "] stateless candidate count ["
+            << index->stateless_candidates.size() << "]";
+        Policy* policy_result = find_best_policy_from_candidates(index->stateless_candidates, qu_slot_counts);
+        if (policy_result != nullptr) {
+            return policy_result;
         }
     }
 
-    return policy_result;
+    return nullptr;
 }
 
-// Resolve a string with params in it.
-static bool try_resolve_params(std::string& unresolved,
-                              const std::unordered_map<std::string, std::string>& param_map) {
-
-    if (unresolved.empty()) {
-        return true;
-    }
-
-    std::string resolved;
-    bool is_param = false;
-    unsigned int last_index = 0;
-    for (unsigned int i = 0; i < unresolved.length(); ++i) {
-        if (unresolved[i] == '{' && i + 1 < unresolved.length() && unresolved[i + 1] == '%' ) {
-            resolved += unresolved.substr(last_index, i - last_index);
-            last_index = i + 2;
-            is_param = true;
-            ++i;
-        }
-        if (unresolved[i] == '%' && i + 1 < unresolved.length() && unresolved[i + 1] == '}') {
-            if (!is_param) {
-                APP_LOG(WARNING) << "Cannot resolve params in string, invalid format. " << unresolved;
-                return false;
-            }
-            std::string param_name = unresolved.substr(last_index, i - last_index);
-            std::unordered_map<std::string, std::string>::const_iterator find_res = param_map.find(param_name);
-            if (find_res == param_map.end()) {
-                APP_LOG(WARNING) << "Cannot resolve params in string, unknow param. "
-                    << unresolved << " " << param_name;
-                return false;
+// Resolved values of the non-constant assertion operands of a policy in one evaluation,
+// indexed by operand slot so that an operand shared by outputs is resolved only once.
+struct AssertionOperandValues {
+    enum State {
+        UNRESOLVED,
+        RESOLVED,
+        FAILED
+    };
+
+    explicit AssertionOperandValues(int size)
+        : values(size), states(size, UNRESOLVED), numbers(size), number_states(size, UNRESOLVED) {}
+
+    std::vector<std::string> values;
+    std::vector<State> states;
+    // Numeric values of resolved operands compared by gt/ge, parsed once.
+    std::vector<double> numbers;
+    std::vector<State> number_states;
+};
+
+// Get the value of an operand, returns null if it cannot be resolved.
+static const std::string* resolve_operand(const AssertionOperand& operand,
+                                          bool trim,
+                                          const ParamEnv& param_env,
+                                          AssertionOperandValues& operand_values) {
+    if (operand.index < 0) {
+        return &operand.value.str();
+    }
+    std::string& value = operand_values.values[operand.index];
+    AssertionOperandValues::State& state = operand_values.states[operand.index];
+    if (state == AssertionOperandValues::UNRESOLVED) {
+        state = AssertionOperandValues::FAILED;
+        if (operand.value.render(param_env, value)) {
+            if (trim) {
+                utils::trim(value);
             }
-            resolved += find_res->second;
-            last_index = i + 2;
-            is_param = false;
-            ++i;
+            state = AssertionOperandValues::RESOLVED;
         }
     }
-    if (is_param) {
-        APP_LOG(WARNING) << "Cannot resolve params in string, invalid format. " << unresolved;
-        return false;
+    return state == AssertionOperandValues::RESOLVED ? &value : nullptr;
+}
+
+// Get the numeric value of a resolved operand.
+static bool get_operand_number(const AssertionOperand& operand, const std::string& value,
+                               AssertionOperandValues& operand_values, double& number) {
+    if (operand.index < 0) {
+        number = operand.number;
+        return operand.is_number;
     }
-    if (last_index < unresolved.length()) {
-        resolved += unresolved.substr(last_index);
+    AssertionOperandValues::State& state = operand_values.number_states[operand.index];
+    if (state == AssertionOperandValues::UNRESOLVED) {
+        state = utils::try_atof(value, operand_values.numbers[operand.index])
+            ? AssertionOperandValues::RESOLVED : AssertionOperandValues::FAILED;
     }
+    number = operand_values.numbers[operand.index];
+    return state == AssertionOperandValues::RESOLVED;
+}
 
-    unresolved = resolved;
-    return true;
+// Render a key value template into kv, replacing what kv has.
+static bool render_kv(const KVTemplate& kv_template, const ParamEnv& param_env, KVPair& kv) {
+    kv.key.clear();
+    kv.value.clear();
+    return kv_template.key.render(param_env, kv.key) && kv_template.value.render(param_env, kv.value);
 }
 
-// Resolve a string with delimiter and params in it
-static bool try_resolve_param_list(const std::string& unresolved,
-                                   const char delimiter,
-                                   const std::unordered_map<std::string, std::string>& param_map,
-                                   std::vector<std::string> &result) {
-    std::size_t pos = 0;
-    std::size_t last_pos = 0;
-    result.clear();
-    while (last_pos < unresolved.length() && (pos = unresolved.find(delimiter, last_pos)) != std::string::npos) {
-        std::string part = unresolved.substr(last_pos, pos - last_pos);
-        utils::trim(part);
-        if (!try_resolve_params(part, param_map)) {
-            result.clear();
-            return false;
+// Evaluate a list assertion by rendering the whole value and splitting it,
+// so that a param value with commas gives several values of the list.
+static bool evaluate_value_list(const PolicyOutputAssertion& assertion, const ParamEnv& param_env) {
+    std::string value;
+    if (!assertion.value_template.render(param_env, value)) {
+        return false;
+    }
+    std::vector<std::string> values;
+    ParamTemplate::split_list(value, ',', values);
+    size_t size = values.size();
+    switch (assertion.op) {
+    case ASSERTION_IN:
+    case ASSERTION_NOT_IN: {
+        bool has_match = false;
+        for (size_t i = 1; i < size; ++i) {
+            if (values[0] == values[i]) {
+                has_match = true;
+                break;
+            }
         }
-        result.push_back(part);
-        last_pos = pos + 1;
+        return assertion.op == ASSERTION_IN ? has_match : !has_match;
     }
-    if (last_pos < unresolved.length()) {
-        std::string part = unresolved.substr(last_pos);
-        utils::trim(part);
-        if (!try_resolve_params(part, param_map)) {
-            result.clear();
+    case ASSERTION_EQ:
+        return size >= 2 && values[0] == values[1];
+    case ASSERTION_GT:
+    case ASSERTION_GE: {
+        double left_val = 0;
+        double right_val = 0;
+        if (size < 2 || !utils::try_atof(values[0], left_val) || !utils::try_atof(values[1], right_val)) {
             return false;
         }
-        result.push_back(part);
+        return assertion.op == ASSERTION_GT ? left_val > right_val : left_val >= right_val;
+    }
+    default:
+        return false;
     }
-
-    return true;
 }
 
-PolicyOutput* PolicyManager::resolve_policy_output(const std::string& domain,
-                                                   Policy* policy,
-                                                   QuResult* qu_result,
-                                                   const PolicyOutputSession& session,
-                                                   const RequestContext& context) {
-    // Process parameters
-    std::unordered_map<std::string, std::string> param_map;
-    // Default parameters
-    for (auto const& context: session.context) {
-        if (context.key == "dmkit_param_last_tts") {
-            param_map[context.key] =  context.value;
-            continue;
-        }
-        std::string param_key = "dmkit_param_context_";
-        param_key += context.key;
-        param_map[param_key] =  context.value;
+// Evaluate an assertion, an assertion with any operand which cannot be resolved fails.
+static bool evaluate_assertion(const PolicyOutputAssertion& assertion,
+                               const ParamEnv& param_env,
+                               AssertionOperandValues& operand_values) {
+    if (assertion.compiled != nullptr) {
+        return assertion.compiled(param_env.compiled_env());
     }
-    for (auto const& slot: qu_result->slots()) {
-        std::string param_key = "dmkit_param_slot_";
-        param_key += slot.key();
-        if (param_map.find(param_key) != param_map.end()) {
-            continue;
+    bool is_whole_value = assertion.op == ASSERTION_NOT_EMPTY || assertion.op == ASSERTION_EMPTY;
+    for (auto const& operand: assertion.operands) {
+        if (resolve_operand(operand, !is_whole_value, param_env, operand_values) == nullptr) {
+            return false;
         }
-        std::string param_value = slot.normalized_value();
-        if (param_value.empty()) {
-            param_value = slot.value();
-        }
-        param_map[param_key] = param_value;
-    }
-    for (auto const& param: policy->params()) {
-        APP_LOG(TRACE) << "resolving parameter [" << param.name << "]";
-        std::string value;
-        if (param.type == "slot_val" || param.type == "slot_val_ori") {
-            bool success = false;
-            std::vector<std::string> args;
-            utils::split(param.value, ',', args);
-            int index = 0;
-            if (args.size() >= 2 && !utils::try_atoi(args[1], index)) {
-                APP_LOG(WARNING) << "Invalid index for slot_val parameter: " << param.value;
-                index = -1;
-            }
-            for (auto const& slot: qu_result->slots()) {
-                if (index < 0) {
-                    break;
-                }
-                if (slot.key() == args[0]) {
-                    if (index > 0) {
-                        index--;
-                        continue;
-                    }
-                    if (param.type == "slot_val" && !slot.normalized_value().empty()) {
-                        value = slot.normalized_value();
-                        success = true;
-                        break;
-                    }
-                    value = slot.value();
-                    success = true;
-                    break;
-                }
-            }
-            if (!success) {
-                if (param.required) {
-                    return nullptr;
-                }
-                value = param.default_value;
-            }
-        } else if (param.type == "qu_intent") {
-            value = qu_result->intent();
-        } else if (param.type == "session_state") {
-            value = session.state;
-        } else if (param.type == "session_context") {
-            bool success = false;
-            for (auto const& obj: session.context) {
-                if (obj.key == param.value) {
-                    value = obj.value;
-                    success = true;
-                    break;
-                }
-            }
-            if (!success) {
-                if (param.required) {
-                    return nullptr;
-                }
-                value = param.default_value;
-            }
-        }else if (param.type == "const") {
-            value = param.value;
-        } else if (param.type == "string") {
-            value = param.value;
-            if (!try_resolve_params(value, param_map)) {
-                if (param.required) {
-                    return nullptr;
-                }
-                value = param.default_value;
-            }
-        } else if (param.type == "request_param") {
-            const std::unordered_map<std::string, std::string> request_params = context.params();
-            std::unordered_map<std::string, std::string>::const_iterator find_res
-                = request_params.find(param.value);
-            bool success = false;
-            if (find_res != request_params.end()) {
-                value = find_res->second;
-                success = true;
-            }
-            if (!success) {
-                if (param.required) {
-                    return nullptr;
-                }
-                value = param.default_value;
-            }
-        } else if (param.type == "func_val") {
-            std::string func_val = param.value;
-            std::string func_name;
-            std::vector<std::string> args;
-            std::size_t pos = func_val.find(':');
-            bool has_error = false;
-            if (pos == std::string::npos || pos == func_val.length() - 1) {
-                func_name = func_val;
-                if (!try_resolve_params(func_name, param_map)) {
-                    has_error = true;
-                }
-            } else {
-                func_name = func_val.substr(0, pos);
-                if (!try_resolve_params(func_name, param_map)) {
-                    has_error = true;;
-                }
-                std::string arg_list = func_val.substr(pos + 1);
-                if (!try_resolve_param_list(arg_list, ',', param_map, args)) {
-                    has_error = true;
-                }
-            }
-            utils::trim(func_name);
-            if (has_error || this->_user_function_manager->call_user_function(func_name, args, context, value) != 0) {
-                has_error = true;
-            }
-            if (has_error) {
-                if (param.required) {
-                    return nullptr;
-                }
-                value = param.default_value;
+    }
+    // All operands are resolved, getting them again is only a lookup.
+    auto values = [&](unsigned int i) -> const std::string* {
+        return resolve_operand(assertion.operands[i], !is_whole_value, param_env, operand_values);
+    };
+    size_t size = assertion.operands.size();
+    APP_LOG(TRACE) << "evaluating assertion, type[" << assertion.type << "] value[" << assertion.value << "]";
+    if (!is_whole_value) {
+        for (unsigned int i = 0; i < size; ++i) {
+            if (assertion.operands[i].index >= 0 && values(i)->find(',') != std::string::npos) {
+                return evaluate_value_list(assertion, param_env);
             }
-        } else {
-            APP_LOG(WARNING) << "Unknown param type " << param.type;
-            if (param.required) {
-                return nullptr;
+        }
+        // The whole value ends with a comma when the last param renders empty,
+        // and splitting it drops the last value.
+        if (size > 0 && assertion.operands[size - 1].index >= 0 && values(size - 1)->empty()) {
+            return evaluate_value_list(assertion, param_env);
+        }
+    }
+    switch (assertion.op) {
+    case ASSERTION_NOT_EMPTY:
+        return !values(0)->empty();
+    case ASSERTION_EMPTY:
+        return values(0)->empty();
+    case ASSERTION_IN:
+    case ASSERTION_NOT_IN: {
+        bool has_match = false;
+        for (unsigned int i = 1; i < size; ++i) {
+            if (*values(0) == *values(i)) {
+                has_match = true;
+                break;
             }
-            value = param.default_value;
         }
-        param_map[param.name] =  value;
-        APP_LOG(TRACE) << "Parameter value [" << value << "]";
+        return assertion.op == ASSERTION_IN ? has_match : !has_match;
+    }
+    case ASSERTION_EQ:
+        return size >= 2 && *values(0) == *values(1);
+    case ASSERTION_GT:
+    case ASSERTION_GE: {
+        double left_val = 0;
+        double right_val = 0;
+        if (size < 2
+                || !get_operand_number(assertion.operands[0], *values(0), operand_values, left_val)
+                || !get_operand_number(assertion.operands[1], *values(1), operand_values, right_val)) {
+            return false;
+        }
+        return assertion.op == ASSERTION_GT ? left_val > right_val : left_val >= right_val;
     }
+    }
+    return false;
+}
+
+int PolicyManager::resolve_policy_output(const std::string& domain,
+                                         Policy* policy,
+                                         QuResult* qu_result,
+                                         const PolicyOutputSession& session,
+                                         const RequestContext& context,
+                                         PolicyOutput& output) {
+    // Params are evaluated when assertions or the selected output need them.
+    ParamEvaluator param_evaluator(policy, qu_result, session, context, this->_user_function_manager);
+    const ParamEnv& param_env = param_evaluator.param_env();
 
     int selected_output_index = -1;
+    AssertionOperandValues operand_values(policy->assertion_operand_count());
+    APP_LOG(TRACE) << "Candidate output size [" << policy->outputs().size() << "]";
     for (unsigned int i = 0; i < policy->outputs().size(); ++i) {
+        if (!param_evaluator.evaluate(policy->outputs()[i].assertion_dependency)) {
+            return -1;
+        }
         bool failed = false;
         // Process assertions
-        APP_LOG(TRACE) << "Candidate output size [" << policy->outputs().size() << "]";
-        for (unsigned int j = 0; j < policy->outputs()[i].assertions.size(); ++j) {
-            std::string assertion_type = policy->outputs()[i].assertions[j].type;
-            std::string assertion_value = policy->outputs()[i].assertions[j].value;
-            if (!try_resolve_params(assertion_value, param_map)) {
-                failed = true;
-                break;
-            }
-            APP_LOG(TRACE) << "evaluating assertion, type[" << assertion_type << "] value[" << assertion_value << "]";
-            if (assertion_type == "not_empty") {
-                if (assertion_value.empty()) {
-                    failed = true;
-                    break;
-                }
-            } else if (assertion_type == "empty") {
-                if (!assertion_value.empty()) {
-                    failed = true;
-                    break;
-                }
-            } else if (assertion_type == "in") {
-                std::vector<std::string> value_list;
-                bool has_match = false;
-                if (try_resolve_param_list(assertion_value, ',', param_map, value_list)) {
-                    for (unsigned int k = 1; k < value_list.size(); k++) {
-                        if (value_list[0] == value_list[k]) {
-                            has_match = true;
-                            break;
-                        }
-                    }
-                }
-                if (!has_match) {
-                    failed = true;
-                }
-            } else if (assertion_type == "not_in") {
-                std::vector<std::string> value_list;
-                if (try_resolve_param_list(assertion_value, ',', param_map, value_list)) {
-                    for (unsigned int k = 1; k < value_list.size(); k++) {
-                        if (value_list[0] == value_list[k]) {
-                            failed = true;
-                            break;
-                        }
-                    }
-                }
-            } else if (assertion_type == "eq") {
-                std::vector<std::string> value_list;
-                if (!try_resolve_param_list(assertion_value, ',', param_map, value_list)
-                    || value_list.size() < 2
-                    || value_list[0] != value_list[1]) {
-                    failed = true;
-                }
-            } else if (assertion_type == "gt") {
-                std::vector<std::string> value_list;
-                double left_val = 0;
-                double right_val = 0;
-                if (!try_resolve_param_list(assertion_value, ',', param_map, value_list)
-                    || value_list.size() < 2
-                    || !utils::try_atof(value_list[0], left_val)
-                    || !utils::try_atof(value_list[1], right_val)
-                    || left_val <= right_val) {
-                    failed  = true;
-                }
-            } else if (assertion_type == "ge") {
-                std::vector<std::string> value_list;
-                double left_val = 0;
-                double right_val = 0;
-                if (!try_resolve_param_list(assertion_value, ',', param_map, value_list)
-                    || value_list.size() < 2
-                    || !utils::try_atof(value_list[0], left_val)
-                    || !utils::try_atof(value_list[1], right_val)
-                    || left_val < right_val) {
-                    failed  = true;
-                }
-            } else {
-                APP_LOG(WARNING) << "Unknown assertion type " << assertion_type;
+        for (auto const& assertion: policy->outputs()[i].assertions) {
+            if (!evaluate_assertion(assertion, param_env, operand_values)) {
                 failed = true;
                 break;
             }
@@ -785,101 +895,71 @@ PolicyOutput* PolicyManager::resolve_policy_output(const std::string& domain,
         }
     }
     if (selected_output_index == -1) {
-        return nullptr;
+        return -1;
     }
 
-    PolicyOutput output;
-    output.meta = policy->outputs()[selected_output_index].meta;
-    output.session = policy->outputs()[selected_output_index].session;
-    output.qu = policy->outputs()[selected_output_index].qu;
-    output.results = policy->outputs()[selected_output_index].results;
-
-    for (unsigned int i = 0; i < output.meta.size(); ++i) {
-        if (!try_resolve_params(output.meta[i].key, param_map)) {
-            return nullptr;
-        }
-        if (!try_resolve_params(output.meta[i].value, param_map)) {
-            return nullptr;
-        }
-    }
-    if (!try_resolve_params(output.session.domain, param_map)) {
-        return nullptr;
-    }
-    if (!try_resolve_params(output.session.state, param_map)) {
-        return nullptr;
+    // Render the selected output into the fields of output in place, strings of an output
+    // reused by the caller keep their capacity. A failure of any template fails the policy.
+    const PolicyOutputTemplate& output_template = policy->outputs()[selected_output_index];
+    if (!param_evaluator.evaluate(output_template.output_dependency)) {
+        return -1;
     }
-    for (unsigned int i = 0; i < output.session.context.size(); ++i) {
-        if (!try_resolve_params(output.session.context[i].key, param_map)) {
-            return nullptr;
-        }
-        if (!try_resolve_params(output.session.context[i].value, param_map)) {
-            return nullptr;
+    output.meta.resize(output_template.meta.size());
+    for (unsigned int i = 0; i < output_template.meta.size(); ++i) {
+        if (!render_kv(output_template.meta[i], param_env, output.meta[i])) {
+            return -1;
         }
     }
-    if (!try_resolve_params(output.qu.domain, param_map)) {
-        return nullptr;
-    }
-    if (!try_resolve_params(output.qu.intent, param_map)) {
-        return nullptr;
+    output.session.domain = domain;
+    output.session.state.clear();
+    if (!output_template.session_state.render(param_env, output.session.state)) {
+        return -1;
     }
-    for (unsigned int i = 0; i < output.qu.slots.size(); ++i) {
-        if (!try_resolve_params(output.qu.slots[i].key, param_map)) {
-            return nullptr;
-        }
-        if (!try_resolve_params(output.qu.slots[i].value, param_map)) {
-            return nullptr;
-        }
-        if (!try_resolve_params(output.qu.slots[i].normalized_value, param_map)) {
-            return nullptr;
+    output.session.context.resize(output_template.session_context.size());
+    for (unsigned int i = 0; i < output_template.session_context.size(); ++i) {
+        if (!render_kv(output_template.session_context[i], param_env, output.session.context[i])) {
+            return -1;
         }
     }
-    for (unsigned int i = 0; i < output.results.size(); ++i) {
-        if (output.results[i].values.empty()) {
+    output.results.resize(output_template.results.size());
+    for (unsigned int i = 0; i < output_template.results.size(); ++i) {
+        const PolicyOutputResultTemplate& result_template = output_template.results[i];
+        if (result_template.values.empty()) {
             APP_LOG(WARNING) << "empty result value!";
-            return nullptr;
+            return -1;
         }
-        if (output.results[i].values.size() > 1) {
-            int size = output.results[i].values.size();
-            int index = std::time(nullptr) % size;
+        int index = 0;
+        if (result_template.values.size() > 1) {
+            int size = result_template.values.size();
+            index = std::time(nullptr) % size;
             if (index < 0 || index >= size) {
                 index = 0;
             }
-            std::string value = output.results[i].values[index];
-            output.results[i].values.clear();
-            output.results[i].values.push_back(value);
         }
-        if (!try_resolve_params(output.results[i].values[0], param_map)) {
-            return nullptr;
+        PolicyOutputResult& result = output.results[i];
+        result.type = result_template.type;
+        result.extra = result_template.extra;
+        result.json = result_template.json;
+        result.values.resize(1);
+        result.values[0].clear();
+        if (!result_template.values[index].render(param_env, result.values[0])) {
+            return -1;
         }
     }
 
-    PolicyOutput* output_ptr = new PolicyOutput();
-    *output_ptr = output;
-    output_ptr->session.domain = domain;
-
     // Saved parameters
-    for (auto const& param: param_map) {
-        if (param.first.find("dmkit_param_context_") != 0) {
-            continue;
-        }
-        std::string context_key = param.first.substr(20);
-        if (context_key.empty()) {
-            continue;
-        }
-        KVPair context = {context_key, param.second};
-        output_ptr->session.context.push_back(context);
-    }
-    std::string first_tts;
-    for (unsigned int i = 0; i < output_ptr->results.size(); ++i) {
-        if (output_ptr->results[i].type == "tts") {
-            first_tts = output_ptr->results[i].values[0];
+    param_evaluator.get_saved_context(output.session.context);
+    const std::string* first_tts = nullptr;
+    for (auto const& result: output.results) {
+        if (result.type == "tts") {
+            first_tts = &result.values[0];
             break;
         }
     }
-    KVPair last_tts_context = {"dmkit_param_last_tts", first_tts};
-    output_ptr->session.context.push_back(last_tts_context);
+    KVPair last_tts_context = {"dmkit_param_last_tts", first_tts != nullptr ? *first_tts : ""};
+    output.session.context.push_back(std::move(last_tts_context));
 
-    return output_ptr;
+    return 0;
 }
 
 } // namespace dmkit
@@ -19,36 +19,109 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include "butil.h"
+#include "compiled_policy_module.h"
 #include "policy.h"
 #include "qu_result.h"
 #include "request_context.h"
+#include "symbol_table.h"
 #include "user_function_manager.h"
 
 namespace dmkit {
 
-typedef std::vector<Policy*> PolicyVector;
+// A candidate policy of an intent, with trigger slots compiled into slot ids of its domain.
+struct PolicyCandidate {
+    Policy* policy;
+    // Pairs of slot id and the number of times the slot is required by the trigger
+    std::vector<std::pair<int, int>> slot_counts;
+};
+
+typedef std::vector<PolicyCandidate> PolicyVector;
 typedef BUTIL_NAMESPACE::FlatMap<std::string, PolicyVector*> IntentPolicyMap;
 
+// Candidates of an intent partitioned by trigger state, each sorted by precedence.
+// Candidates with a trigger state only apply when the state matches current state,
+// so they are looked up by state directly instead of being scanned.
+struct IntentPolicyIndex {
+    // Candidates by symbol id of trigger state
+    BUTIL_NAMESPACE::FlatMap<int, PolicyVector> state_candidates;
+    PolicyVector stateless_candidates;
+    // Index of dmkit_intent_fallback, tried when no candidate of the intent applies.
+    // It is null for the fallback intent itself.
+    const IntentPolicyIndex* fallback;
+};
+
 // Holds all policies given a domain.
+// A domain is immutable once loaded and shared by policy dicts until its conf changes.
 class DomainPolicy {
 public:
-    DomainPolicy(const std::string& name, int score, IntentPolicyMap* intent_policy_map);
+    // Trigger names of the policies are interned into symbols, trigger slots are compiled
+    // and candidates of each intent are sorted by precedence here,
+    // the first feasible candidate is the best one.
+    DomainPolicy(const std::string& name,
+                 int score,
+                 const std::string& conf_path,
+                 const std::string& conf_mtime,
+                 const std::string& compiled_path,
+                 IntentPolicyMap* intent_policy_map,
+                 const std::shared_ptr<SymbolTable>& symbols,
+                 const std::shared_ptr<CompiledPolicyModule>& compiled_module);
     ~DomainPolicy();
     const std::string& name();
     int score();
+    // Conf file of the domain and its modified time before it was loaded
+    const std::string& conf_path();
+    const std::string& conf_mtime();
+    // Compiled module of the domain as configured, empty if none is configured
+    const std::string& compiled_path();
+    // Whether the compiled module is loaded and attached to the policies, otherwise
+    // the policies are interpreted.
+    bool is_compiled();
     // Maps a intent to a vector of policies
     IntentPolicyMap* intent_policy_map();
+    // Symbol table of the product the domain is loaded with
+    const SymbolTable* symbols();
+    // Get the candidate index of an intent by symbol id, which is the index of
+    // dmkit_intent_fallback if the intent has no policy. Returns null if neither has any policy.
+    const IntentPolicyIndex* policy_index(int intent_id);
+    // Count qu slots by slot id, slots not required by any trigger of the domain are ignored.
+    void count_slots(const std::vector<Slot>& slots, std::vector<int>& slot_counts);
 
 private:
     std::string _name;
     int _score;
+    std::string _conf_path;
+    std::string _conf_mtime;
+    std::string _compiled_path;
     IntentPolicyMap* _intent_policy_map;
+    std::shared_ptr<const SymbolTable> _symbols;
+    // Intent indexes by symbol id of intent
+    std::vector<IntentPolicyIndex*> _policy_index;
+    IntentPolicyIndex* _fallback_index;
+    // Slot ids by symbol id of trigger slots in the domain, -1 for other symbols
+    std::vector<int> _slot_ids;
+    int _slot_count;
+    // Unloaded after the policies are destroyed
+    std::shared_ptr<CompiledPolicyModule> _compiled_module;
 };
 
-typedef BUTIL_NAMESPACE::FlatMap<std::string, DomainPolicy*> DomainPolicyMap;
-typedef BUTIL_NAMESPACE::FlatMap<std::string, DomainPolicyMap*> ProductPolicyMap;
+typedef BUTIL_NAMESPACE::FlatMap<std::string, std::shared_ptr<DomainPolicy>> DomainPolicyMap;
+
+// Holds all domains given a product.
+struct ProductPolicy {
+    // Symbols of trigger names in all domains of the product. A reload starts from
+    // a copy of the last table, so ids stay valid for domains reused from the last dict.
+    std::shared_ptr<SymbolTable> symbols;
+    DomainPolicyMap* domain_policy_map;
+    // Domains ranked by score when loaded, domains of the same score
+    // are in the iteration order of domain_policy_map.
+    std::vector<DomainPolicy*> ranked_domains;
+};
+
+typedef BUTIL_NAMESPACE::FlatMap<std::string, ProductPolicy*> ProductPolicyMap;
 
 class PolicyManager {
 public:
@@ -56,37 +129,75 @@ public:
     ~PolicyManager();
     int init(const char* dir_path, const char* conf_file);
     int reload();
-    // Resolve a policy output given a qu result and current dm session
-    PolicyOutput* resolve(const std::string& product,
-                          BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>* qu_result,
-                          const PolicyOutputSession& session,
-                          const RequestContext& context);
+    // Resolve a policy output given a qu result and current dm session into output,
+    // which is owned by the caller and can be reused across requests. Returns 0 on success.
+    // Resolving an asynchronous request fails at the first service call it has to wait for,
+    // without trying other policies, see RequestContext::has_pending_calls.
+    int resolve(const std::string& product,
+                BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>* qu_result,
+                const PolicyOutputSession& session,
+                const RequestContext& context,
+                PolicyOutput& output);
+
+    // Resolve with a policy dict snapshot got by get_policy_dict
+    int resolve(const std::shared_ptr<ProductPolicyMap>& policy_dict,
+                const std::string& product,
+                BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>* qu_result,
+                const PolicyOutputSession& session,
+                const RequestContext& context,
+                PolicyOutput& output);
+
+    // Get a snapshot of current policy dict, which is kept alive by the caller
+    // even if policies are reloaded meanwhile.
+    std::shared_ptr<ProductPolicyMap> get_policy_dict() const;
+
+    // Get the symbol table of a product for parsing qu results, null if the product is unknown.
+    static const SymbolTable* get_symbol_table(const std::shared_ptr<ProductPolicyMap>& policy_dict,
+                                               const std::string& product);
 
     static int policy_conf_change_callback(void* param);
 
 private:
+    // Domains unchanged since last_product are reused instead of being reparsed,
+    // last_product is null if the product is new.
     DomainPolicyMap* load_domain_policy_map(const std::string& product_name,
-                                             const rapidjson::Value& product_json);
+                                             const rapidjson::Value& product_json,
+                                             const ProductPolicy* last_product,
+                                             const std::shared_ptr<SymbolTable>& symbols,
+                                             std::unordered_set<std::string>& conf_paths);
 
+    // Templates and assertions of the policies are run by the module at compiled_path
+    // if it is set and matches the conf, otherwise the policies are interpreted.
     DomainPolicy* load_domain_policy(const std::string& domain_name,
                                      int score,
-                                     const std::string& conf_path);
+                                     const std::string& conf_path,
+                                     const std::string& conf_mtime,
+                                     const std::string& compiled_path,
+                                     const std::shared_ptr<SymbolTable>& symbols);
 
     Policy* find_best_policy(DomainPolicy* domain_policy,
                              QuResult* qu_result,
                              const PolicyOutputSession& session,
                              const RequestContext& context);
 
-    PolicyOutput* resolve_policy_output(const std::string& domain,
-                                        Policy* policy,
-                                        QuResult* qu_result,
-                                        const PolicyOutputSession& session,
-                                        const RequestContext& context);
+    int resolve_policy_output(const std::string& domain,
+                              Policy* policy,
+                              QuResult* qu_result,
+                              const PolicyOutputSession& session,
+                              const RequestContext& context,
+                              PolicyOutput& output);
+
+    // Load policy dict from products.json, reusing unchanged domains of last_dict.
+    // Conf paths of all domains are collected into conf_paths.
+    ProductPolicyMap* load_policy_dict(const ProductPolicyMap* last_dict,
+                                       std::unordered_set<std::string>& conf_paths);
 
-    ProductPolicyMap* load_policy_dict();
+    // Watch domain conf files so that editing a domain reloads policies.
+    void watch_domain_confs(const std::unordered_set<std::string>& conf_paths);
 
     std::string _conf_file_path;
     std::shared_ptr<ProductPolicyMap> _p_policy_dict;
+    std::unordered_set<std::string> _watched_conf_paths;
 
     UserFunctionManager* _user_function_manager;
 };
@@ -18,8 +18,12 @@
 
 namespace dmkit {
 
-Slot::Slot(const std::string& key, const std::string& value, const std::string& normalized_value)
-    : _key(key), _value(value), _normalized_value(normalized_value) {
+Slot::Slot() : _key_id(SymbolTable::UNKNOWN) {
+}
+
+Slot::Slot(const std::string& key, const std::string& value, const std::string& normalized_value,
+           int key_id)
+    : _key(key), _key_id(key_id), _value(value), _normalized_value(normalized_value) {
 }
 
 const std::string& Slot::key() const {
@@ -34,28 +38,45 @@ const std::string& Slot::normalized_value() const {
     return this->_normalized_value;
 }
 
+int Slot::key_id() const {
+    return this->_key_id;
+}
+
+QuResult::QuResult() : _intent_id(SymbolTable::UNKNOWN) {
+}
+
 QuResult::QuResult(const std::string& domain,
                    const std::string& intent,
-                   const std::vector<Slot>& slots)
-    : _domain(domain), _intent(intent), _slots(slots) {
+                   const std::vector<Slot>& slots,
+                   int intent_id)
+    : _domain(domain), _intent(intent), _intent_id(intent_id), _slots(slots) {
 }
 
 // Parse QU result from dialog state in unit response
-QuResult* QuResult::parse_from_dialog_state(const std::string& domain, 
-                                            const rapidjson::Value& value) {
+int QuResult::parse_dialog_state(const std::string& domain,
+                                 const rapidjson::Value& value,
+                                 const SymbolTable* symbols) {
     if (!value.IsObject()) {
         APP_LOG(WARNING) << "Failed to parse qu result from json, not an object";
-        return nullptr;
+        return -1;
     }
     
-    if (!value.HasMember("intents") || !value["intents"].IsArray() || value["intents"].Size() < 1) {
+    if (!value.HasMember("intents") || !value["intents"].IsArray() || value["intents"].Size() < 1
+            || !value.HasMember("user_slots") || !value["user_slots"].IsObject()) {
         APP_LOG(WARNING) << "Failed to parse qu result from json";
+        return -1;
     }
     int intents_size = value["intents"].Size();
-    std::string intent = value["intents"][intents_size - 1]["name"].GetString();
-    std::vector<Slot> slots;
+    const rapidjson::Value& intent = value["intents"][intents_size - 1]["name"];
+    this->_domain = domain;
+    this->_intent.assign(intent.GetString(), intent.GetStringLength());
+    this->_intent_id = symbols != nullptr ? symbols->find(this->_intent) : SymbolTable::UNKNOWN;
+    // Slots of the last result are overwritten in place and the rest are dropped at the end.
+    size_t slot_count = 0;
     for (auto& m_slot: value["user_slots"].GetObject()) {
-        std::string tag = m_slot.name.GetString();
+        // Symbol id of the tag is looked up once the tag is copied into its first slot.
+        int tag_id = SymbolTable::UNKNOWN;
+        bool has_tag_id = false;
         for (auto& m_value: m_slot.value.GetObject()["values"].GetObject()) {
             int slot_state = m_value.value.GetObject()["state"].GetInt();
             // Slot state possible values are
@@ -66,16 +87,25 @@ QuResult* QuResult::parse_from_dialog_state(const std::string& domain,
             if (slot_state == 0 || slot_state == 4) {
                 continue;
             }
-            std::string normalized_value = m_value.name.GetString();
-            std::string value = m_value.value.GetObject()["original_name"].GetString();
-            Slot slot(tag, value, normalized_value);
-            slots.push_back(slot);
+            if (slot_count == this->_slots.size()) {
+                this->_slots.emplace_back();
+            }
+            Slot& slot = this->_slots[slot_count++];
+            slot._key.assign(m_slot.name.GetString(), m_slot.name.GetStringLength());
+            if (!has_tag_id) {
+                tag_id = symbols != nullptr ? symbols->find(slot._key) : SymbolTable::UNKNOWN;
+                has_tag_id = true;
+            }
+            slot._key_id = tag_id;
+            slot._normalized_value.assign(m_value.name.GetString(), m_value.name.GetStringLength());
+            const rapidjson::Value& original_name = m_value.value.GetObject()["original_name"];
+            slot._value.assign(original_name.GetString(), original_name.GetStringLength());
         }
     }
+    this->_slots.erase(this->_slots.begin() + slot_count, this->_slots.end());
 
-    QuResult* result = new QuResult(domain, intent, slots);
-    APP_LOG(TRACE) << result->to_string();
-    return result;
+    APP_LOG(TRACE) << this->to_string();
+    return 0;
 }
 
 const std::string& QuResult::domain() const {
@@ -90,6 +120,10 @@ const std::vector<Slot>& QuResult::slots() const {
     return this->_slots;
 }
 
+int QuResult::intent_id() const {
+    return this->_intent_id;
+}
+
 std::string QuResult::to_string() const {
     std::string result;
     result += "domain:";
@@ -18,19 +18,29 @@
 #include <string>
 #include <vector>
 #include "rapidjson.h"
+#include "symbol_table.h"
 
 namespace dmkit {
 
 class Slot {
 public:
-    Slot(const std::string& key, const std::string& value, const std::string& normalized_value);
+    // An empty slot to be filled when parsing a qu result.
+    Slot();
+
+    Slot(const std::string& key, const std::string& value, const std::string& normalized_value,
+         int key_id);
     
     const std::string& key() const;
     const std::string& value() const;
     const std::string& normalized_value() const;
+    // Symbol id of the key in the symbol table of policies
+    int key_id() const;
 
 private:
+    friend class QuResult;
+
     std::string _key;
+    int _key_id;
     std::string _value;
     std::string _normalized_value;
 };
@@ -39,19 +49,32 @@ private:
 // generally includes domain, intent and slots.
 class QuResult {
 public:
-    QuResult(const std::string& domain, const std::string& intent, const std::vector<Slot>& slots);
+    // An empty qu result to be filled by parse_dialog_state.
+    QuResult();
+
+    QuResult(const std::string& domain, const std::string& intent, const std::vector<Slot>& slots,
+             int intent_id);
 
-    static QuResult* parse_from_dialog_state(const std::string& domain,
-                                             const rapidjson::Value& value);
+    // Parse qu result from dialog state in unit response into this result in place,
+    // strings and slots of the last parsed result keep their capacity.
+    // Intent and slot tags are mapped to ids in symbols of the product when parsed,
+    // names not in symbols, or all names if the product has no symbols, are mapped to
+    // SymbolTable::UNKNOWN. Returns -1 if dialog state is invalid.
+    int parse_dialog_state(const std::string& domain,
+                           const rapidjson::Value& value,
+                           const SymbolTable* symbols);
 
     const std::string& domain() const;
     const std::string& intent() const;
     const std::vector<Slot>& slots() const;
+    // Symbol id of the intent in the symbol table of policies
+    int intent_id() const;
 
     std::string to_string() const;
 private:
     std::string _domain;
     std::string _intent;
+    int _intent_id;
     std::vector<Slot> _slots;
 };
 
@@ -17,12 +17,67 @@
 #include <cstdio>
 #include <string>
 #include "app_log.h"
+#include "bthread.h"
 #include "file_watcher.h"
 #include "rapidjson.h"
 #include "thread_data_base.h"
 
 namespace dmkit {
 
+static void prepare_http_request(BRPC_NAMESPACE::Controller& cntl,
+                                 const std::string& url,
+                                 const HttpMethod method,
+                                 const std::vector<std::pair<std::string, std::string>>& headers,
+                                 const BUTIL_NAMESPACE::IOBuf& payload) {
+    cntl.http_request().uri() = url.c_str();
+    if (method == HTTP_METHOD_POST) {
+        cntl.http_request().set_method(BRPC_NAMESPACE::HTTP_METHOD_POST);
+        cntl.request_attachment().append(payload);
+    }
+    for (auto const& header: headers) {
+        if (header.first == "Content-Type" || header.first == "content-type") {
+            cntl.http_request().set_content_type(header.second);
+            continue;
+        }
+        cntl.http_request().SetHeader(header.first, header.second);
+    }
+}
+
+static int read_http_response(BRPC_NAMESPACE::Controller& cntl,
+                              std::string& result,
+                              std::string& remote_side,
+                              int& latency) {
+    remote_side = BUTIL_NAMESPACE::endpoint2str(cntl.remote_side()).c_str();
+    latency = cntl.latency_us() / 1000;
+    if (cntl.Failed()) {
+        APP_LOG(WARNING) << "Call failed, error: " << cntl.ErrorText();
+        return -1;
+    }
+    result = cntl.response_attachment().to_string();
+
+    return 0;
+}
+
+static void add_service_notice_log(const std::string& service_name,
+                                   const std::string& remote_side,
+                                   int latency,
+                                   int ret) {
+    std::string log_str;
+    log_str += "remote:";
+    log_str += remote_side;
+    log_str += "|tm:";
+    log_str += std::to_string(latency);
+    log_str += "|ret:";
+    log_str += std::to_string(ret);
+    std::string log_key = "service_";
+    log_key += service_name;
+
+    APP_LOG(TRACE) << "remote_side=" << remote_side << ", cost=" << latency;
+    ThreadDataBase* tls = current_thread_data();
+    // All backend requests are logged.
+    tls->add_notice_log(log_key, log_str);
+}
+
 RemoteServiceManager::RemoteServiceManager() {
 }
 
@@ -109,52 +164,251 @@ int RemoteServiceManager::call(const std::string& service_name,
 
     RemoteServiceChannel& service_channel = (*p_channel_map)[service_name];
 
+    // Cached responses are served without calling the service, a stale response is
+    // served while one caller refreshes it in background.
+    bool use_cache = params.http_method == HTTP_METHOD_GET && service_channel.cache != nullptr;
+    if (use_cache) {
+        ResponseCacheStatus status = service_channel.cache->get(params.url, result.result);
+        if (status != RESPONSE_CACHE_MISS) {
+            if (status == RESPONSE_CACHE_REFRESH) {
+                this->start_cache_refresh(p_channel_map, service_name, params.url);
+            }
+            add_service_notice_log(service_name, "cache", 0, 0);
+            return 0;
+        }
+    }
+
     APP_LOG(TRACE) << "Calling service " << service_name;
 
-    int ret = 0;
     std::string remote_side;
     int latency = 0;
-    if (service_channel.protocol == "http") {
-        if (service_channel.channel != nullptr) {
-            ret = this->call_http_by_BRPC_NAMESPACE(service_channel.channel,
-                                          params.url,
-                                          params.http_method,
-                                          service_channel.headers,
-                                          params.payload,
-                                          result.result,
-                                          remote_side,
-                                          latency);
-        } else {
-            ret = this->call_http_by_curl(params.url,
-                                          params.http_method,
-                                          service_channel.headers,
-                                          params.payload,
-                                          service_channel.timeout_ms,
-                                          service_channel.max_retry,
-                                          result.result,
-                                          remote_side,
-                                          latency);
-        }
-    } else {
+    int ret = this->call_channel(service_channel, params, result.result, remote_side, latency);
+    add_service_notice_log(service_name, remote_side, latency, ret);
+    if (use_cache && ret == 0) {
+        service_channel.cache->put(params.url, result.result);
+    }
+
+    return ret;
+}
+
+int RemoteServiceManager::call_channel(const RemoteServiceChannel& service_channel,
+                                       const RemoteServiceParam& params,
+                                       std::string& result,
+                                       std::string& remote_side,
+                                       int& latency) const {
+    if (service_channel.protocol != "http") {
         APP_LOG(ERROR) << "Remote service call failed. Unknown protocol" << service_channel.protocol;
-        ret = -1;
+        return -1;
     }
-    std::string log_str;
-    log_str += "remote:";
-    log_str += remote_side;
-    log_str += "|tm:";
-    log_str += std::to_string(latency);
-    log_str += "|ret:";
-    log_str += std::to_string(ret);
-    std::string log_key = "service_";
-    log_key += service_name;
+    if (service_channel.channel != nullptr) {
+        return this->call_http_by_BRPC_NAMESPACE(service_channel.channel,
+                                                 params.url,
+                                                 params.http_method,
+                                                 service_channel.headers,
+                                                 params.payload,
+                                                 result,
+                                                 remote_side,
+                                                 latency);
+    }
+    return this->call_http_by_curl(params.url,
+                                   params.http_method,
+                                   service_channel.headers,
+                                   params.payload,
+                                   service_channel.timeout_ms,
+                                   service_channel.max_retry,
+                                   result,
+                                   remote_side,
+                                   latency);
+}
 
-    APP_LOG(TRACE) << "remote_side=" << remote_side << ", cost=" << latency;
-    ThreadDataBase* tls = static_cast<ThreadDataBase*>(BRPC_NAMESPACE::thread_local_data());
-    // All backend requests are logged.
-    tls->add_notice_log(log_key, log_str);
+// A background refresh of a stale cached response.
+struct CacheRefresh {
+    const RemoteServiceManager* manager;
+    std::shared_ptr<ChannelMap> p_channel_map;
+    std::string service_name;
+    std::string url;
+};
+
+void RemoteServiceManager::start_cache_refresh(const std::shared_ptr<ChannelMap>& p_channel_map,
+                                               const std::string& service_name,
+                                               const std::string& url) const {
+    CacheRefresh* refresh = new CacheRefresh();
+    refresh->manager = this;
+    refresh->p_channel_map = p_channel_map;
+    refresh->service_name = service_name;
+    refresh->url = url;
+    bthread_t tid;
+    if (bthread_start_background(&tid, nullptr, RemoteServiceManager::run_cache_refresh, refresh) != 0) {
+        APP_LOG(WARNING) << "Failed to start cache refresh of " << url;
+        (*p_channel_map)[service_name].cache->cancel_refresh(url);
+        delete refresh;
+    }
+}
 
-    return ret;
+void* RemoteServiceManager::run_cache_refresh(void* arg) {
+    CacheRefresh* refresh = static_cast<CacheRefresh*>(arg);
+    const RemoteServiceChannel& service_channel = (*refresh->p_channel_map)[refresh->service_name];
+    RemoteServiceParam params = {
+        refresh->url,
+        HTTP_METHOD_GET,
+        BUTIL_NAMESPACE::IOBuf()
+    };
+    std::string result;
+    std::string remote_side;
+    int latency = 0;
+    // The refresh is not part of any request, it is not added to notice logs.
+    if (refresh->manager->call_channel(service_channel, params, result, remote_side, latency) == 0) {
+        service_channel.cache->put(refresh->url, result);
+    } else {
+        APP_LOG(WARNING) << "Failed to refresh cached response of " << refresh->url;
+        service_channel.cache->cancel_refresh(refresh->url);
+    }
+    delete refresh;
+    return nullptr;
+}
+
+int RemoteServiceManager::call_async(const std::string& service_name,
+                                     const RemoteServiceParam& params,
+                                     RemoteServiceCall& call,
+                                     google::protobuf::Closure* done) const {
+    BRPC_NAMESPACE::ClosureGuard done_guard(done);
+    call._service_name = service_name;
+    call._p_channel_map = this->_p_channel_map;
+    call._ret = -1;
+    if (call._p_channel_map == nullptr) {
+        APP_LOG(ERROR) << "Remote service call failed, channel map is null";
+        return -1;
+    }
+
+    auto channel_iter = call._p_channel_map->find(service_name);
+    if (channel_iter == call._p_channel_map->end()) {
+        APP_LOG(ERROR) << "Remote service call failed, cannot find service " << service_name;
+        return -1;
+    }
+
+    const RemoteServiceChannel& service_channel = channel_iter->second;
+    if (service_channel.protocol != "http" || service_channel.channel == nullptr) {
+        call._ret = this->call(service_name, params, call._result);
+        return call._ret;
+    }
+
+    if (params.http_method == HTTP_METHOD_GET && service_channel.cache != nullptr) {
+        ResponseCacheStatus status = service_channel.cache->get(params.url, call._result.result);
+        if (status != RESPONSE_CACHE_MISS) {
+            if (status == RESPONSE_CACHE_REFRESH) {
+                this->start_cache_refresh(call._p_channel_map, service_name, params.url);
+            }
+            add_service_notice_log(service_name, "cache", 0, 0);
+            call._ret = 0;
+            return 0;
+        }
+        call._cache = service_channel.cache;
+        call._cache_url = params.url;
+    }
+
+    APP_LOG(TRACE) << "Calling service asynchronously " << service_name;
+    prepare_http_request(call._cntl, params.url, params.http_method,
+                         service_channel.headers, params.payload);
+    google::protobuf::Closure* rpc_done = BRPC_NAMESPACE::DoNothing();
+    if (done != nullptr) {
+        rpc_done = done_guard.release();
+    }
+    call._has_done = (done != nullptr);
+    call._in_flight = true;
+    // With a done closure, the call may be finished and destroyed before CallMethod returns.
+    service_channel.channel->CallMethod(NULL, &call._cntl, NULL, NULL, rpc_done);
+    return 0;
+}
+
+RemoteServiceCall::RemoteServiceCall() : _in_flight(false), _has_done(false), _ret(-1) {
+}
+
+RemoteServiceCall::~RemoteServiceCall() {
+    // The rpc id is still locked by brpc while done is running,
+    // a call with done must not be joined by brpc here.
+    if (this->_in_flight && !this->_has_done) {
+        BRPC_NAMESPACE::Join(this->_cntl.call_id());
+        this->_in_flight = false;
+    }
+}
+
+void RemoteServiceCall::cancel() {
+    if (this->_in_flight) {
+        APP_LOG(TRACE) << "Canceling call to service " << this->_service_name;
+        BRPC_NAMESPACE::StartCancel(this->_cntl.call_id());
+    }
+}
+
+int RemoteServiceCall::join(RemoteServiceResult& result) {
+    if (this->_in_flight) {
+        if (!this->_has_done) {
+            BRPC_NAMESPACE::Join(this->_cntl.call_id());
+        }
+        this->_in_flight = false;
+        std::string remote_side;
+        int latency = 0;
+        this->_ret = read_http_response(this->_cntl, this->_result.result, remote_side, latency);
+        add_service_notice_log(this->_service_name, remote_side, latency, this->_ret);
+        if (this->_cache != nullptr && this->_ret == 0) {
+            this->_cache->put(this->_cache_url, this->_result.result);
+        }
+        this->_cache.reset();
+    }
+    result = this->_result;
+    return this->_ret;
+}
+
+static int load_cache_options(const std::string& service_name,
+                              const rapidjson::Value& settings,
+                              std::shared_ptr<ResponseCache>& cache) {
+    if (!settings.IsObject()) {
+        APP_LOG(ERROR) << "Invalid service settings for " << service_name
+            << ", expecting type Object for property cache.";
+        return -1;
+    }
+    rapidjson::Value::ConstMemberIterator setting_iter = settings.FindMember("ttl_ms");
+    if (setting_iter == settings.MemberEnd() || !setting_iter->value.IsInt()
+            || setting_iter->value.GetInt() <= 0) {
+        APP_LOG(ERROR) << "Invalid cache settings for " << service_name
+            << ", expecting positive Int for property ttl_ms.";
+        return -1;
+    }
+    ResponseCacheOptions options;
+    options.ttl_ms = setting_iter->value.GetInt();
+    options.stale_ms = options.ttl_ms;
+    options.max_entries = 10000;
+    options.max_bytes = 64 * 1024 * 1024;
+    setting_iter = settings.FindMember("stale_ms");
+    if (setting_iter != settings.MemberEnd()) {
+        if (!setting_iter->value.IsInt() || setting_iter->value.GetInt() < 0) {
+            APP_LOG(ERROR) << "Invalid cache settings for " << service_name
+                << ", expecting non-negative Int for property stale_ms.";
+            return -1;
+        }
+        options.stale_ms = setting_iter->value.GetInt();
+    }
+    setting_iter = settings.FindMember("max_entries");
+    if (setting_iter != settings.MemberEnd()) {
+        if (!setting_iter->value.IsInt() || setting_iter->value.GetInt() <= 0) {
+            APP_LOG(ERROR) << "Invalid cache settings for " << service_name
+                << ", expecting positive Int for property max_entries.";
+            return -1;
+        }
+        options.max_entries = setting_iter->value.GetInt();
+    }
+    setting_iter = settings.FindMember("max_bytes");
+    if (setting_iter != settings.MemberEnd()) {
+        if (!setting_iter->value.IsInt64() || setting_iter->value.GetInt64() <= 0) {
+            APP_LOG(ERROR) << "Invalid cache settings for " << service_name
+                << ", expecting positive Int for property max_bytes.";
+            return -1;
+        }
+        options.max_bytes = setting_iter->value.GetInt64();
+    }
+    cache.reset(new ResponseCache(service_name, options));
+    APP_LOG(TRACE) << "Caching responses of service " << service_name
+        << " for " << options.ttl_ms << "ms";
+    return 0;
 }
 
 ChannelMap* RemoteServiceManager::load_channel_map() {
@@ -262,6 +516,18 @@ ChannelMap* RemoteServiceManager::load_channel_map() {
             }
         }
 
+        // Cache of GET responses, such as:
+        //     "cache": {"ttl_ms": 60000, "stale_ms": 60000, "max_entries": 10000, "max_bytes": 67108864}
+        // Only ttl_ms is required, stale_ms defaults to ttl_ms.
+        std::shared_ptr<ResponseCache> cache;
+        setting_iter = settings.FindMember("cache");
+        if (setting_iter != settings.MemberEnd()) {
+            if (load_cache_options(service_name, setting_iter->value, cache) != 0) {
+                destroy_channel_map(channel_map);
+                return nullptr;
+            }
+        }
+
         BRPC_NAMESPACE::Channel* rpc_channel = nullptr;
         if (protocol == "http") {
             if (client.empty() || client == "brpc") {
@@ -297,7 +563,8 @@ ChannelMap* RemoteServiceManager::load_channel_map() {
             .channel = rpc_channel,
             .timeout_ms = timeout_ms,
             .max_retry = retry,
-            .headers = headers
+            .headers = headers,
+            .cache = cache
         };
         channel_map->insert({service_name, service_channel});
         APP_LOG(TRACE) << "Loaded service " << service_name;
@@ -310,37 +577,14 @@ int RemoteServiceManager::call_http_by_BRPC_NAMESPACE(BRPC_NAMESPACE::Channel* c
                                             const std::string& url,
                                             const HttpMethod method,
                                             const std::vector<std::pair<std::string, std::string>>& headers,
-                                            const std::string& payload,
+                                            const BUTIL_NAMESPACE::IOBuf& payload,
                                             std::string& result,
                                             std::string& remote_side,
                                             int& latency) const {
     BRPC_NAMESPACE::Controller cntl;
-    cntl.http_request().uri() = url.c_str();
-    if (method == HTTP_METHOD_POST) {
-        cntl.http_request().set_method(BRPC_NAMESPACE::HTTP_METHOD_POST);
-        cntl.request_attachment().append(payload);
-    }
-    for (auto const& header: headers) {
-        if (header.first == "Content-Type" || header.first == "content-type") {
-            cntl.http_request().set_content_type(header.second);
-            continue;
-        }
-        cntl.http_request().SetHeader(header.first, header.second);
-    }
-
+    prepare_http_request(cntl, url, method, headers, payload);
     channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
-    if (cntl.Failed()) {
-        APP_LOG(WARNING) << "Call failed, error: " << cntl.ErrorText();
-        remote_side = BUTIL_NAMESPACE::endpoint2str(cntl.remote_side()).c_str();
-        latency = cntl.latency_us() / 1000;
-        return -1;
-    }
-    result = cntl.response_attachment().to_string();
-
-    remote_side = BUTIL_NAMESPACE::endpoint2str(cntl.remote_side()).c_str();
-    latency = cntl.latency_us() / 1000;
-
-    return 0;
+    return read_http_response(cntl, result, remote_side, latency);
 }
 
 static size_t curl_write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
@@ -353,7 +597,7 @@ static size_t curl_write_callback(void *contents, size_t size, size_t nmemb, voi
 int RemoteServiceManager::call_http_by_curl(const std::string& url,
                                             const HttpMethod method,
                                             const std::vector<std::pair<std::string, std::string>>& headers,
-                                            const std::string& payload,
+                                            const BUTIL_NAMESPACE::IOBuf& payload,
                                             const int timeout_ms,
                                             const int max_retry,
                                             std::string& result,
@@ -374,10 +618,13 @@ int RemoteServiceManager::call_http_by_curl(const std::string& url,
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, static_cast<void*>(&response_buffer));
 
+    // Post fields are not copied by curl, the data must be kept until the request completes.
+    std::string post_data;
     if (method == HTTP_METHOD_POST) {
+         post_data = payload.to_string();
          curl_easy_setopt(curl, CURLOPT_POST, 1L);
-         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload.c_str());
-         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, payload.length());
+         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data.c_str());
+         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, post_data.length());
     }
 
     for (auto const& header: headers) {
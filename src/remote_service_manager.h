@@ -15,6 +15,7 @@
 #ifndef DMKIT_REMOTE_SERVICE_MANAGER_H
 #define DMKIT_REMOTE_SERVICE_MANAGER_H
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -22,6 +23,7 @@
 #include <vector>
 #include "brpc.h"
 #include "butil.h"
+#include "response_cache.h"
 
 namespace dmkit {
 
@@ -38,8 +40,8 @@ struct RemoteServiceParam {
     std::string url;
     // Http method
     HttpMethod http_method;
-    // Request body
-    std::string payload;
+    // Request body, blocks are shared with the rpc request instead of copied
+    BUTIL_NAMESPACE::IOBuf payload;
 };
 
 struct RemoteServiceResult {
@@ -60,11 +62,51 @@ struct RemoteServiceChannel {
     int max_retry;
     // Headers for http procotol
     std::vector<std::pair<std::string, std::string>> headers;
+    // Cache of GET responses, null if the service is not cached
+    std::shared_ptr<ResponseCache> cache;
 };
 
 // Type for channel map
 typedef std::unordered_map<std::string, RemoteServiceChannel> ChannelMap;
 
+// A remote service call started by RemoteServiceManager::call_async.
+// The call is joined when destroyed if it is still in flight,
+// a call started with a done closure must not be destroyed before done is run.
+class RemoteServiceCall {
+public:
+    RemoteServiceCall();
+
+    ~RemoteServiceCall();
+
+    // Cancel the call if it is still in flight, the call fails afterwards.
+    void cancel();
+
+    // Wait until the call finishes, returns 0 if the call succeeded.
+    // A call started with a done closure must only be joined after done is run,
+    // join does not block in that case and collects the result in the caller's bthread.
+    int join(RemoteServiceResult& result);
+
+    RemoteServiceCall(RemoteServiceCall const&) = delete;
+    void operator=(RemoteServiceCall const&) = delete;
+
+private:
+    friend class RemoteServiceManager;
+
+    std::string _service_name;
+    // Keeps the channel alive in case services are reloaded during the call
+    std::shared_ptr<ChannelMap> _p_channel_map;
+    BRPC_NAMESPACE::Controller _cntl;
+    // Whether an asynchronous rpc is in flight and not joined yet
+    std::atomic<bool> _in_flight;
+    // Whether the rpc was started with a done closure instead of being joined
+    bool _has_done;
+    int _ret;
+    RemoteServiceResult _result;
+    // Cache the response is put into once the call succeeds, null if not cached
+    std::shared_ptr<ResponseCache> _cache;
+    std::string _cache_url;
+};
+
 // A configurable remote service manager class.
 // All remote service channels are created with configuration file
 // when initialization. Caller calls a remote service by supplying
@@ -89,13 +131,39 @@ public:
              const RemoteServiceParam& params,
              RemoteServiceResult &result) const;
 
+    // Start calling a remote service without waiting for the result,
+    // the result is got by RemoteServiceCall::join.
+    // If done is not null, it is run once the call finishes, the result is still got by join.
+    // Only brpc client calls asynchronously, other clients finish the call before return,
+    // in which case done is also run before return. Cached GET responses are served
+    // the same way as call does.
+    int call_async(const std::string& service_name,
+                   const RemoteServiceParam& params,
+                   RemoteServiceCall& call,
+                   google::protobuf::Closure* done) const;
+
 private:
+    // Call a remote service without notice log.
+    int call_channel(const RemoteServiceChannel& service_channel,
+                     const RemoteServiceParam& params,
+                     std::string& result,
+                     std::string& remote_side,
+                     int& latency) const;
+
+    // Refresh a stale cached response in background, the channel map is kept alive
+    // until the refresh finishes.
+    void start_cache_refresh(const std::shared_ptr<ChannelMap>& p_channel_map,
+                             const std::string& service_name,
+                             const std::string& url) const;
+
+    static void* run_cache_refresh(void* arg);
+
     // Http is the most common protocol.
    int call_http_by_BRPC_NAMESPACE(BRPC_NAMESPACE::Channel* channel,
                          const std::string& url,
                          const HttpMethod method,
                          const std::vector<std::pair<std::string, std::string>>& headers,
-                         const std::string& payload,
+                         const BUTIL_NAMESPACE::IOBuf& payload,
                          std::string& result,
                          std::string& remote_side,
                          int& latency) const;
@@ -103,7 +171,7 @@ private:
     int call_http_by_curl(const std::string& url,
                           const HttpMethod method,
                           const std::vector<std::pair<std::string, std::string>>& headers,
-                          const std::string& payload,
+                          const BUTIL_NAMESPACE::IOBuf& payload,
                           const int timeout_ms,
                           const int max_retry,
                           std::string& result,
@@ -13,13 +13,153 @@
 // limitations under the License.
 
 #include "request_context.h"
+#include "app_log.h"
 
 namespace dmkit {
 
+AsyncServiceCalls::AsyncServiceCalls(const RemoteServiceManager* remote_service_manager)
+    : _remote_service_manager(remote_service_manager), _in_flight_count(0), _done(nullptr) {
+}
+
+AsyncServiceCalls::~AsyncServiceCalls() {
+}
+
+int AsyncServiceCalls::call(const std::string& service_name,
+                            const RemoteServiceParam& params,
+                            std::string& result) {
+    // Lengths are prefixed so that keys are unambiguous.
+    std::string body = params.payload.to_string();
+    std::string key = std::to_string(service_name.length()) + ":" + service_name + "|"
+        + std::to_string(params.http_method) + "|"
+        + std::to_string(params.url.length()) + ":" + params.url + "|" + body;
+    Call* call = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        auto iter = this->_calls.find(key);
+        if (iter != this->_calls.end()) {
+            if (!iter->second->collected) {
+                return -1;
+            }
+            result = iter->second->result;
+            return iter->second->ret;
+        }
+        call = new Call();
+        call->collected = false;
+        call->ret = -1;
+        this->_calls[key].reset(call);
+        this->_started_calls.push_back(call);
+        ++this->_in_flight_count;
+    }
+    // done may be run before call_async returns, the lock is not held here.
+    APP_LOG(TRACE) << "Starting service call of user function to " << service_name;
+    this->_remote_service_manager->call_async(service_name, params, call->call,
+        google::protobuf::NewCallback(this, &AsyncServiceCalls::on_call_done));
+    return -1;
+}
+
+bool AsyncServiceCalls::has_started_calls() {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    return !this->_started_calls.empty();
+}
+
+void AsyncServiceCalls::wait(google::protobuf::Closure* done) {
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        if (this->_in_flight_count > 0) {
+            this->_done = done;
+            return;
+        }
+    }
+    done->Run();
+}
+
+void AsyncServiceCalls::collect() {
+    std::vector<Call*> started_calls;
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        started_calls.swap(this->_started_calls);
+    }
+    for (Call* call: started_calls) {
+        RemoteServiceResult rsr;
+        call->ret = call->call.join(rsr);
+        call->result.swap(rsr.result);
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        call->collected = true;
+    }
+}
+
+void AsyncServiceCalls::on_call_done() {
+    google::protobuf::Closure* done = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        if (--this->_in_flight_count == 0) {
+            done = this->_done;
+            this->_done = nullptr;
+        }
+    }
+    if (done != nullptr) {
+        done->Run();
+    }
+}
+
+bool UserFunctionMemo::try_get(const std::string& key, std::string& result) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    auto search = this->_results.find(key);
+    if (search == this->_results.end()) {
+        return false;
+    }
+
+    result = search->second;
+    return true;
+}
+
+void UserFunctionMemo::set(const std::string& key, const std::string& result) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_results[key] = result;
+}
+
+bool UserFunctionMemo::try_replay(const std::string& key, int& ret, std::string& result) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    auto search = this->_recorded_calls.find(key);
+    if (search == this->_recorded_calls.end()
+            || search->second.position >= search->second.results.size()) {
+        return false;
+    }
+
+    RecordedCalls& calls = search->second;
+    ret = calls.results[calls.position].first;
+    result = calls.results[calls.position].second;
+    ++calls.position;
+    return true;
+}
+
+void UserFunctionMemo::record(const std::string& key, int ret, const std::string& result) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    RecordedCalls& calls = this->_recorded_calls[key];
+    calls.results.resize(calls.position);
+    calls.results.push_back(std::make_pair(ret, result));
+    calls.position = calls.results.size();
+}
+
+void UserFunctionMemo::start_pass() {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    for (auto& calls: this->_recorded_calls) {
+        calls.second.position = 0;
+    }
+}
+
+void UserFunctionMemo::start_query() {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_recorded_calls.clear();
+}
+
 RequestContext::RequestContext(RemoteServiceManager* remote_service_manager,
                                const std::string& qid,
-                               const std::unordered_map<std::string, std::string>& params)
-    : _remote_service_manager(remote_service_manager), _qid(qid), _params(params) {
+                               const std::unordered_map<std::string, std::string>& params,
+                               AsyncServiceCalls* async_service_calls,
+                               UserFunctionMemo* memo)
+    : _remote_service_manager(remote_service_manager), _async_service_calls(async_service_calls),
+      _qid(qid), _params(params), _memo(memo != nullptr ? memo : &_own_memo) {
 
 }
 
@@ -30,6 +170,15 @@ const RemoteServiceManager* RequestContext::remote_service_manager() const {
     return _remote_service_manager;
 }
 
+int RequestContext::call_service(const std::string& service_name,
+                                 const RemoteServiceParam& params,
+                                 RemoteServiceResult& result) const {
+    if (this->_async_service_calls != nullptr) {
+        return this->_async_service_calls->call(service_name, params, result.result);
+    }
+    return this->_remote_service_manager->call(service_name, params, result);
+}
+
 const std::string& RequestContext::qid() const {
     return _qid;
 }
@@ -54,4 +203,24 @@ bool RequestContext::try_get_param(const std::string& param_name, std::string& v
     return true;
 }
 
+bool RequestContext::has_pending_calls() const {
+    return this->_async_service_calls != nullptr && this->_async_service_calls->has_started_calls();
+}
+
+bool RequestContext::try_get_memoized_result(const std::string& key, std::string& result) const {
+    return this->_memo->try_get(key, result);
+}
+
+void RequestContext::memoize_result(const std::string& key, const std::string& result) const {
+    this->_memo->set(key, result);
+}
+
+bool RequestContext::try_replay_result(const std::string& key, int& ret, std::string& result) const {
+    return this->_memo->try_replay(key, ret, result);
+}
+
+void RequestContext::record_result(const std::string& key, int ret, const std::string& result) const {
+    this->_memo->record(key, ret, result);
+}
+
 } // namespace dmkit
@@ -15,31 +15,140 @@
 #ifndef DMKIT_REQUEST_CONTEXT_H
 #define DMKIT_REQUEST_CONTEXT_H
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "remote_service_manager.h"
 
 namespace dmkit {
 
+// Remote service calls made by user functions of an asynchronous request.
+// A call is started without waiting for it and fails until it has finished,
+// the request resolves its policies again with the results once all started
+// calls have finished, so that no bthread is blocked on the calls.
+// Calls are keyed by service, method, url and body, each of them is made once for the request.
+class AsyncServiceCalls {
+public:
+    explicit AsyncServiceCalls(const RemoteServiceManager* remote_service_manager);
+
+    // All started calls must have finished before destroyed.
+    ~AsyncServiceCalls();
+
+    // Get the result of a call, returns 0 if it has finished successfully.
+    // Returns -1 if it failed or has not finished, in which case it is started if not yet.
+    int call(const std::string& service_name,
+             const RemoteServiceParam& params,
+             std::string& result);
+
+    // Whether calls were started after the last collect.
+    bool has_started_calls();
+
+    // Run done once all started calls have finished, done may be run before return.
+    void wait(google::protobuf::Closure* done);
+
+    // Collect results of finished calls with the thread data of the request bound.
+    void collect();
+
+    AsyncServiceCalls(AsyncServiceCalls const&) = delete;
+    void operator=(AsyncServiceCalls const&) = delete;
+
+private:
+    struct Call {
+        RemoteServiceCall call;
+        bool collected;
+        int ret;
+        std::string result;
+    };
+
+    void on_call_done();
+
+    const RemoteServiceManager* _remote_service_manager;
+    std::mutex _mutex;
+    std::unordered_map<std::string, std::unique_ptr<Call>> _calls;
+    // Calls started after the last collect
+    std::vector<Call*> _started_calls;
+    int _in_flight_count;
+    google::protobuf::Closure* _done;
+};
+
+// Results of pure user function calls memoized for a dialog turn, keyed by function name
+// and arguments. A turn keeps one memo for all passes resolving its queries, the calls may
+// be made from concurrent bthreads.
+// Results of other functions are recorded in order of calls while a query is resolved,
+// a pass resuming the resolution after service calls replays them up to where the last
+// pass stopped instead of calling the functions again.
+class UserFunctionMemo {
+public:
+    UserFunctionMemo() {}
+
+    bool try_get(const std::string& key, std::string& result);
+    void set(const std::string& key, const std::string& result);
+
+    // Get the recorded result of the next call of a function with the same key in current pass.
+    bool try_replay(const std::string& key, int& ret, std::string& result);
+    void record(const std::string& key, int ret, const std::string& result);
+    // Start a pass resolving current query, recorded results are replayed from the first call.
+    void start_pass();
+    // Start resolving another query, recorded results are dropped.
+    void start_query();
+
+    UserFunctionMemo(UserFunctionMemo const&) = delete;
+    void operator=(UserFunctionMemo const&) = delete;
+
+private:
+    struct RecordedCalls {
+        std::vector<std::pair<int, std::string>> results;
+        // Number of the calls replayed or recorded in current pass
+        size_t position;
+    };
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, std::string> _results;
+    std::unordered_map<std::string, RecordedCalls> _recorded_calls;
+};
+
 // Request context for user functions to access,
 // including request parameters and an remote_service_manager instance
 class RequestContext {
 public:
     RequestContext(RemoteServiceManager* remote_service_manager,
                    const std::string& qid,
-                   const std::unordered_map<std::string, std::string>& params);
+                   const std::unordered_map<std::string, std::string>& params,
+                   AsyncServiceCalls* async_service_calls = nullptr,
+                   UserFunctionMemo* memo = nullptr);
     ~RequestContext();
 
     const RemoteServiceManager* remote_service_manager() const;
+    // Call a remote service for user functions. The call is made by async_service_calls
+    // if the request is asynchronous, otherwise current bthread waits for it.
+    int call_service(const std::string& service_name,
+                     const RemoteServiceParam& params,
+                     RemoteServiceResult& result) const;
     const std::string& qid() const;
     const std::unordered_map<std::string, std::string>& params() const;
     bool set_param_value(const std::string& param_name, const std::string& value);
     bool try_get_param(const std::string& param_name, std::string& value) const;
 
+    // Whether an asynchronous request has started service calls which have not finished.
+    // Resolution stops at the first of them and is resumed once they finish.
+    bool has_pending_calls() const;
+
+    // Results of user function calls memoized and recorded in the memo of the turn,
+    // or of the context if it is created without one.
+    bool try_get_memoized_result(const std::string& key, std::string& result) const;
+    void memoize_result(const std::string& key, const std::string& result) const;
+    bool try_replay_result(const std::string& key, int& ret, std::string& result) const;
+    void record_result(const std::string& key, int ret, const std::string& result) const;
+
 private:
     RemoteServiceManager* _remote_service_manager;
+    AsyncServiceCalls* _async_service_calls;
     std::string _qid;
     std::unordered_map<std::string, std::string> _params;
+    UserFunctionMemo* _memo;
+    UserFunctionMemo _own_memo;
 };
 
 } // namespace dmkit
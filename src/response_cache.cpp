@@ -0,0 +1,130 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "response_cache.h"
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include "app_log.h"
+
+namespace dmkit {
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bvars cannot be exposed twice with the same name, counters of a service are created
+// once and kept for the lifetime of the process.
+struct ResponseCacheCounters {
+    bvar::Adder<int64_t>* hit_count;
+    bvar::Adder<int64_t>* miss_count;
+};
+
+static ResponseCacheCounters get_counters(const std::string& service_name) {
+    static std::mutex s_counters_mutex;
+    static std::unordered_map<std::string, ResponseCacheCounters> s_counters;
+    std::lock_guard<std::mutex> lock(s_counters_mutex);
+    auto iter = s_counters.find(service_name);
+    if (iter == s_counters.end()) {
+        ResponseCacheCounters counters = {
+            new bvar::Adder<int64_t>("dmkit_service_" + service_name + "_cache_hit"),
+            new bvar::Adder<int64_t>("dmkit_service_" + service_name + "_cache_miss")
+        };
+        iter = s_counters.insert({service_name, counters}).first;
+    }
+    return iter->second;
+}
+
+ResponseCache::ResponseCache(const std::string& service_name, const ResponseCacheOptions& options)
+    : _options(options) {
+    this->_shard_max_entries = options.max_entries / SHARD_COUNT + 1;
+    this->_shard_max_bytes = options.max_bytes / SHARD_COUNT + 1;
+    for (auto& shard: this->_shards) {
+        shard.bytes = 0;
+    }
+    ResponseCacheCounters counters = get_counters(service_name);
+    this->_hit_count = counters.hit_count;
+    this->_miss_count = counters.miss_count;
+}
+
+ResponseCacheStatus ResponseCache::get(const std::string& url, std::string& response) {
+    int64_t now = now_ms();
+    Shard& shard = this->get_shard(url);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(url);
+    if (iter == shard.index.end()) {
+        *this->_miss_count << 1;
+        return RESPONSE_CACHE_MISS;
+    }
+    Entry& entry = *iter->second;
+    int64_t age = now - entry.fetch_time_ms;
+    if (age >= this->_options.ttl_ms + this->_options.stale_ms) {
+        this->erase_entry(shard, iter->second);
+        *this->_miss_count << 1;
+        return RESPONSE_CACHE_MISS;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+    response = entry.response;
+    *this->_hit_count << 1;
+    if (age < this->_options.ttl_ms || entry.refreshing) {
+        return RESPONSE_CACHE_HIT;
+    }
+    entry.refreshing = true;
+    return RESPONSE_CACHE_REFRESH;
+}
+
+void ResponseCache::put(const std::string& url, const std::string& response) {
+    if (response.size() >= this->_shard_max_bytes) {
+        APP_LOG(TRACE) << "Response of " << url << " is too large to cache";
+        this->cancel_refresh(url);
+        return;
+    }
+    Shard& shard = this->get_shard(url);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(url);
+    if (iter != shard.index.end()) {
+        this->erase_entry(shard, iter->second);
+    }
+    while (!shard.lru.empty() && (shard.lru.size() >= this->_shard_max_entries
+            || shard.bytes + response.size() > this->_shard_max_bytes)) {
+        this->erase_entry(shard, std::prev(shard.lru.end()));
+    }
+    Entry entry = {url, response, now_ms(), false};
+    shard.lru.push_front(std::move(entry));
+    shard.index[url] = shard.lru.begin();
+    shard.bytes += response.size();
+}
+
+void ResponseCache::cancel_refresh(const std::string& url) {
+    Shard& shard = this->get_shard(url);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.index.find(url);
+    if (iter != shard.index.end()) {
+        iter->second->refreshing = false;
+    }
+}
+
+ResponseCache::Shard& ResponseCache::get_shard(const std::string& url) {
+    return this->_shards[std::hash<std::string>()(url) % SHARD_COUNT];
+}
+
+void ResponseCache::erase_entry(Shard& shard, std::list<Entry>::iterator iter) {
+    shard.bytes -= iter->response.size();
+    shard.index.erase(iter->url);
+    shard.lru.erase(iter);
+}
+
+} // namespace dmkit
@@ -0,0 +1,99 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_RESPONSE_CACHE_H
+#define DMKIT_RESPONSE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "bvar.h"
+
+namespace dmkit {
+
+// Cache settings of a remote service, configured as "cache" of the service
+// in remote_services.json.
+struct ResponseCacheOptions {
+    // Milliseconds a response is fresh after it was fetched
+    int64_t ttl_ms;
+    // Milliseconds an expired response is still served while it is being refreshed
+    int64_t stale_ms;
+    // Max number of responses cached
+    size_t max_entries;
+    // Max total bytes of cached responses
+    size_t max_bytes;
+};
+
+// Result of looking up a response in the cache.
+enum ResponseCacheStatus {
+    RESPONSE_CACHE_MISS,
+    RESPONSE_CACHE_HIT,
+    // The response is stale and the caller should refresh it in background,
+    // other callers keep getting the stale response as a hit until it is refreshed.
+    RESPONSE_CACHE_REFRESH
+};
+
+// Responses of http GET calls to a remote service cached across requests by url.
+// Responses are kept in a sharded LRU bounded by entries and bytes.
+class ResponseCache {
+public:
+    ResponseCache(const std::string& service_name, const ResponseCacheOptions& options);
+
+    ResponseCacheStatus get(const std::string& url, std::string& response);
+
+    void put(const std::string& url, const std::string& response);
+
+    // A background refresh failed, the stale response may be refreshed by the next caller.
+    void cancel_refresh(const std::string& url);
+
+    ResponseCache(ResponseCache const&) = delete;
+    void operator=(ResponseCache const&) = delete;
+
+private:
+    struct Entry {
+        std::string url;
+        std::string response;
+        int64_t fetch_time_ms;
+        bool refreshing;
+    };
+
+    // Responses are spread into shards by url to reduce lock contention.
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used entry at front
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        size_t bytes;
+    };
+
+    Shard& get_shard(const std::string& url);
+
+    void erase_entry(Shard& shard, std::list<Entry>::iterator iter);
+
+    static const size_t SHARD_COUNT = 16;
+    Shard _shards[SHARD_COUNT];
+    ResponseCacheOptions _options;
+    size_t _shard_max_entries;
+    size_t _shard_max_bytes;
+    // Counters exported per service, shared by caches of the service across reloads.
+    bvar::Adder<int64_t>* _hit_count;
+    bvar::Adder<int64_t>* _miss_count;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_RESPONSE_CACHE_H
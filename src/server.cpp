@@ -23,6 +23,8 @@ DEFINE_int32(internal_port, -1, "Only allow builtin services at this port");
 DEFINE_int32(idle_timeout_s, -1, "Connection will be closed if there is no read/write operations during this time");
 DEFINE_int32(max_concurrency, 0, "Limit of requests processing in parallel");
 DEFINE_string(url_path, "", "Url path of the app");
+DEFINE_string(batch_url_path, "", "Url path of batch requests to the app, disabled if empty");
+DEFINE_string(resolve_url_path, "", "Url path of protobuf requests to the app over http, disabled if empty");
 DEFINE_bool(log_to_file, false, "Log to file");
 
 namespace dmkit {
@@ -46,12 +48,30 @@ public:
               const HttpRequest*,
               HttpResponse*,
               google::protobuf::Closure* done) {
-        // This object helps you to call done->Run() in RAII style. If you need
-        // to process the request asynchronously, pass done_guard.release().
+        // done is run by the container once the request is finished, for asynchronous
+        // applications it happens after this method returns.
+        BRPC_NAMESPACE::Controller* cntl = static_cast<BRPC_NAMESPACE::Controller*>(cntl_base);
+        this->_app_container.run(cntl, done);
+    }
+
+    void run_batch(google::protobuf::RpcController* cntl_base,
+                   const HttpRequest*,
+                   HttpResponse*,
+                   google::protobuf::Closure* done) {
+        BRPC_NAMESPACE::ClosureGuard done_guard(done);
+
+        BRPC_NAMESPACE::Controller* cntl = static_cast<BRPC_NAMESPACE::Controller*>(cntl_base);
+        this->_app_container.run_batch(cntl);
+    }
+
+    void resolve(google::protobuf::RpcController* cntl_base,
+                 const DialogRequest* request,
+                 DialogResponse* response,
+                 google::protobuf::Closure* done) {
         BRPC_NAMESPACE::ClosureGuard done_guard(done);
 
         BRPC_NAMESPACE::Controller* cntl = static_cast<BRPC_NAMESPACE::Controller*>(cntl_base);
-        this->_app_container.run(cntl);
+        this->_app_container.resolve(cntl, request, response);
     }
 
 private:
@@ -87,6 +107,14 @@ int main(int argc, char* argv[]) {
     // service is put on stack, we don't want server to delete it, otherwise
     // use baidu::rpc::SERVER_OWNS_SERVICE.
     std::string mapping = FLAGS_url_path + " => run";
+    if (!FLAGS_batch_url_path.empty()) {
+        mapping += ", " + FLAGS_batch_url_path + " => run_batch";
+    }
+    // resolve is served over baidu_std and h2 on the same port as well, the url path
+    // is only needed for http clients posting application/proto or json bodies.
+    if (!FLAGS_resolve_url_path.empty()) {
+        mapping += ", " + FLAGS_resolve_url_path + " => resolve";
+    }
     if (server.AddService(&http_svc,
                           BRPC_NAMESPACE::SERVER_DOESNT_OWN_SERVICE,
                           mapping.c_str()) != 0) {
@@ -0,0 +1,363 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "session_store.h"
+#include <leveldb/write_batch.h>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include "app_log.h"
+#include "butil.h"
+
+namespace dmkit {
+
+static const char SESSION_ID_PREFIX[] = "sid:";
+static const size_t SESSION_ID_PREFIX_LENGTH = sizeof(SESSION_ID_PREFIX) - 1;
+// Number of random bytes in a session id, hex encoded after the prefix.
+static const size_t SESSION_ID_RANDOM_BYTES = 16;
+static const size_t SESSION_ID_LENGTH = SESSION_ID_PREFIX_LENGTH + 2 * SESSION_ID_RANDOM_BYTES;
+
+// Sessions are persisted in a compact binary format instead of json:
+// 8 bytes expire time, then domain, state, context count and context key/values,
+// with all strings & the count prefixed by a varint length.
+static void append_varint(std::string& buf, uint32_t value) {
+    while (value >= 0x80) {
+        buf.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buf.push_back(static_cast<char>(value));
+}
+
+static bool read_varint(const std::string& buf, size_t& pos, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift <= 28 && pos < buf.size(); shift += 7) {
+        uint32_t byte = static_cast<unsigned char>(buf[pos++]);
+        value |= (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void append_string(std::string& buf, const std::string& str) {
+    append_varint(buf, str.length());
+    buf.append(str);
+}
+
+static bool read_string(const std::string& buf, size_t& pos, std::string& str) {
+    uint32_t length = 0;
+    if (!read_varint(buf, pos, length) || buf.size() - pos < length) {
+        return false;
+    }
+    str.assign(buf, pos, length);
+    pos += length;
+    return true;
+}
+
+static std::string encode_session(const PolicyOutputSession& session, std::time_t expire_time) {
+    std::string buf;
+    uint64_t expire = static_cast<uint64_t>(expire_time);
+    for (int i = 0; i < 8; ++i) {
+        buf.push_back(static_cast<char>((expire >> (i * 8)) & 0xff));
+    }
+    append_string(buf, session.domain);
+    append_string(buf, session.state);
+    append_varint(buf, session.context.size());
+    for (auto const& context: session.context) {
+        append_string(buf, context.key);
+        append_string(buf, context.value);
+    }
+    return buf;
+}
+
+static bool decode_expire_time(const leveldb::Slice& buf, std::time_t& expire_time) {
+    if (buf.size() < 8) {
+        return false;
+    }
+    uint64_t expire = 0;
+    for (int i = 0; i < 8; ++i) {
+        expire |= static_cast<uint64_t>(static_cast<unsigned char>(buf[i])) << (i * 8);
+    }
+    expire_time = static_cast<std::time_t>(expire);
+    return true;
+}
+
+static int decode_session(const std::string& buf, PolicyOutputSession& session, std::time_t& expire_time) {
+    if (!decode_expire_time(buf, expire_time)) {
+        return -1;
+    }
+    size_t pos = 8;
+    uint32_t context_count = 0;
+    if (!read_string(buf, pos, session.domain) || !read_string(buf, pos, session.state)
+            || !read_varint(buf, pos, context_count)) {
+        return -1;
+    }
+    session.context.clear();
+    for (uint32_t i = 0; i < context_count; ++i) {
+        KVPair context;
+        if (!read_string(buf, pos, context.key) || !read_string(buf, pos, context.value)) {
+            return -1;
+        }
+        session.context.push_back(context);
+    }
+    return 0;
+}
+
+SessionStore::SessionStore()
+    : _shard_capacity(0), _ttl_s(0), _sweep_interval_s(0), _db(nullptr), _is_running(false) {
+}
+
+SessionStore::~SessionStore() {
+    {
+        std::lock_guard<std::mutex> lock(this->_sweeper_mutex);
+        this->_is_running = false;
+    }
+    this->_sweeper_cond.notify_all();
+    if (this->_sweeper_thread.joinable()) {
+        this->_sweeper_thread.join();
+    }
+    delete this->_db;
+    this->_db = nullptr;
+}
+
+int SessionStore::init(const std::string& db_path, size_t capacity, int ttl_s, int sweep_interval_s) {
+    this->_shard_capacity = capacity / SHARD_COUNT + 1;
+    this->_ttl_s = ttl_s;
+    this->_sweep_interval_s = sweep_interval_s;
+    if (db_path.empty()) {
+        APP_LOG(TRACE) << "Session store keeps sessions in memory only";
+    } else {
+        // leveldb creates only the last component of the path if missing.
+        BUTIL_NAMESPACE::FilePath parent_dir = BUTIL_NAMESPACE::FilePath(db_path).DirName();
+        if (!BUTIL_NAMESPACE::CreateDirectory(parent_dir)) {
+            APP_LOG(ERROR) << "Failed to create session db directory " << parent_dir.value();
+            return -1;
+        }
+        leveldb::Options options;
+        options.create_if_missing = true;
+        leveldb::Status status = leveldb::DB::Open(options, db_path, &this->_db);
+        if (!status.ok()) {
+            APP_LOG(ERROR) << "Failed to open session db " << db_path << ", error: " << status.ToString();
+            this->_db = nullptr;
+            return -1;
+        }
+        APP_LOG(TRACE) << "Opened session db " << db_path;
+    }
+
+    if (this->_sweep_interval_s > 0) {
+        this->_is_running = true;
+        this->_sweeper_thread = std::thread(&SessionStore::sweeper_thread_func, this);
+    }
+
+    return 0;
+}
+
+int SessionStore::get(const std::string& bot_id,
+                      const std::string& session_id,
+                      PolicyOutputSession& session) {
+    if (!is_session_id(session_id)) {
+        return -1;
+    }
+    std::string key = get_key(bot_id, session_id);
+    std::time_t now = std::time(nullptr);
+    Shard& shard = this->get_shard(key);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.index.find(key);
+        if (iter != shard.index.end()) {
+            if (iter->second->expire_time > now) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+                session = iter->second->session;
+                return 0;
+            }
+            shard.lru.erase(iter->second);
+            shard.index.erase(iter);
+        }
+    }
+
+    if (this->_db == nullptr) {
+        return -1;
+    }
+    std::string value;
+    leveldb::Status status = this->_db->Get(leveldb::ReadOptions(), key, &value);
+    if (!status.ok()) {
+        if (!status.IsNotFound()) {
+            APP_LOG(WARNING) << "Failed to read session " << session_id << ", error: " << status.ToString();
+        }
+        return -1;
+    }
+    std::time_t expire_time = 0;
+    if (decode_session(value, session, expire_time) != 0 || expire_time <= now) {
+        this->_db->Delete(leveldb::WriteOptions(), key);
+        session = PolicyOutputSession();
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    this->cache_entry(shard, key, session, expire_time);
+
+    return 0;
+}
+
+int SessionStore::put(const std::string& bot_id,
+                      const std::string& session_id,
+                      const PolicyOutputSession& session) {
+    if (!is_session_id(session_id)) {
+        APP_LOG(WARNING) << "Invalid session id " << session_id;
+        return -1;
+    }
+    std::string key = get_key(bot_id, session_id);
+    std::time_t expire_time = std::time(nullptr) + this->_ttl_s;
+    int ret = 0;
+    if (this->_db != nullptr) {
+        leveldb::Status status = this->_db->Put(
+            leveldb::WriteOptions(), key, encode_session(session, expire_time));
+        if (!status.ok()) {
+            APP_LOG(ERROR) << "Failed to persist session " << session_id << ", error: " << status.ToString();
+            ret = -1;
+        }
+    }
+    Shard& shard = this->get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    this->cache_entry(shard, key, session, expire_time);
+
+    return ret;
+}
+
+size_t SessionStore::sweep() {
+    std::time_t now = std::time(nullptr);
+    for (size_t i = 0; i < SHARD_COUNT; ++i) {
+        Shard& shard = this->_shards[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto iter = shard.lru.begin(); iter != shard.lru.end();) {
+            if (iter->expire_time > now) {
+                ++iter;
+                continue;
+            }
+            shard.index.erase(iter->key);
+            iter = shard.lru.erase(iter);
+        }
+    }
+
+    if (this->_db == nullptr) {
+        return 0;
+    }
+    // Expired keys are deleted in batches so that a large db is not held in memory.
+    static const size_t SWEEP_BATCH_SIZE = 1000;
+    size_t removed_count = 0;
+    size_t batch_count = 0;
+    leveldb::WriteBatch batch;
+    leveldb::ReadOptions read_options;
+    read_options.fill_cache = false;
+    std::unique_ptr<leveldb::Iterator> iter(this->_db->NewIterator(read_options));
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+        std::time_t expire_time = 0;
+        if (decode_expire_time(iter->value(), expire_time) && expire_time > now) {
+            continue;
+        }
+        batch.Delete(iter->key());
+        if (++batch_count >= SWEEP_BATCH_SIZE) {
+            this->_db->Write(leveldb::WriteOptions(), &batch);
+            batch.Clear();
+            removed_count += batch_count;
+            batch_count = 0;
+        }
+    }
+    if (!iter->status().ok()) {
+        APP_LOG(WARNING) << "Failed to iterate session db, error: " << iter->status().ToString();
+    }
+    if (batch_count > 0) {
+        this->_db->Write(leveldb::WriteOptions(), &batch);
+        removed_count += batch_count;
+    }
+
+    return removed_count;
+}
+
+std::string SessionStore::new_session_id() {
+    unsigned char random_bytes[SESSION_ID_RANDOM_BYTES];
+    BUTIL_NAMESPACE::RandBytes(random_bytes, sizeof(random_bytes));
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    std::string session_id = SESSION_ID_PREFIX;
+    for (size_t i = 0; i < sizeof(random_bytes); ++i) {
+        session_id.push_back(HEX_DIGITS[random_bytes[i] >> 4]);
+        session_id.push_back(HEX_DIGITS[random_bytes[i] & 0x0f]);
+    }
+    return session_id;
+}
+
+bool SessionStore::is_session_id(const std::string& dm_session) {
+    if (dm_session.length() != SESSION_ID_LENGTH
+            || dm_session.compare(0, SESSION_ID_PREFIX_LENGTH, SESSION_ID_PREFIX) != 0) {
+        return false;
+    }
+    for (size_t i = SESSION_ID_PREFIX_LENGTH; i < SESSION_ID_LENGTH; ++i) {
+        char c = dm_session[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string SessionStore::get_key(const std::string& bot_id, const std::string& session_id) {
+    // Session ids have a fixed length, so the key is unambiguous whatever the bot id is.
+    std::string key = bot_id;
+    key.push_back('/');
+    key.append(session_id);
+    return key;
+}
+
+SessionStore::Shard& SessionStore::get_shard(const std::string& key) {
+    return this->_shards[std::hash<std::string>()(key) % SHARD_COUNT];
+}
+
+void SessionStore::cache_entry(Shard& shard,
+                               const std::string& key,
+                               const PolicyOutputSession& session,
+                               std::time_t expire_time) {
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end()) {
+        iter->second->session = session;
+        iter->second->expire_time = expire_time;
+        shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+        return;
+    }
+    if (shard.lru.size() >= this->_shard_capacity) {
+        shard.index.erase(shard.lru.back().key);
+        shard.lru.pop_back();
+    }
+    Entry entry = {key, session, expire_time};
+    shard.lru.push_front(entry);
+    shard.index[key] = shard.lru.begin();
+}
+
+void SessionStore::sweeper_thread_func() {
+    APP_LOG(TRACE) << "Session sweeper thread starting...";
+    std::unique_lock<std::mutex> lock(this->_sweeper_mutex);
+    while (this->_is_running) {
+        this->_sweeper_cond.wait_for(lock, std::chrono::seconds(this->_sweep_interval_s));
+        if (!this->_is_running) {
+            break;
+        }
+        lock.unlock();
+        size_t removed_count = this->sweep();
+        APP_LOG(TRACE) << "Swept " << removed_count << " expired sessions from session db";
+        lock.lock();
+    }
+    APP_LOG(TRACE) << "Session sweeper thread stopping...";
+}
+
+} // namespace dmkit
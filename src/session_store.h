@@ -0,0 +1,109 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_SESSION_STORE_H
+#define DMKIT_SESSION_STORE_H
+
+#include <leveldb/db.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "policy.h"
+
+namespace dmkit {
+
+// Server side store for dmkit sessions. Sessions are cached in a sharded in-memory LRU
+// with TTL and written through to a local leveldb, so that bot_session only carries
+// a compact session id instead of the whole session json.
+// Sessions are keyed by bot id and session id, and expired sessions are removed
+// from both memory and leveldb by a sweeper thread.
+class SessionStore {
+public:
+    SessionStore();
+
+    ~SessionStore();
+
+    // Initialization. Sessions are kept in memory only if db_path is empty.
+    // capacity is the max number of sessions cached in memory,
+    // a session expires ttl_s seconds after it was last saved,
+    // expired sessions are swept every sweep_interval_s seconds.
+    int init(const std::string& db_path, size_t capacity, int ttl_s, int sweep_interval_s);
+
+    // Get the session saved with a session id of a bot, returns -1 if not found or expired.
+    int get(const std::string& bot_id, const std::string& session_id, PolicyOutputSession& session);
+
+    // Save a session with a session id of a bot, returns -1 if failed to persist it.
+    // Only ids issued by new_session_id should be saved, ids from clients are
+    // reused only after they are found by get.
+    int put(const std::string& bot_id, const std::string& session_id, const PolicyOutputSession& session);
+
+    // Remove all expired sessions, returns the number of sessions removed from leveldb.
+    size_t sweep();
+
+    // Generate a new session id with a cryptographically secure random number.
+    static std::string new_session_id();
+
+    // Whether a dmkit session string carried in bot_session has the format of a session id.
+    static bool is_session_id(const std::string& dm_session);
+
+    SessionStore(SessionStore const&) = delete;
+    void operator=(SessionStore const&) = delete;
+
+private:
+    struct Entry {
+        std::string key;
+        PolicyOutputSession session;
+        std::time_t expire_time;
+    };
+
+    // Sessions are spread into shards by id to reduce lock contention.
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used entry at front
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    };
+
+    // Key of a session in memory & leveldb.
+    static std::string get_key(const std::string& bot_id, const std::string& session_id);
+
+    Shard& get_shard(const std::string& key);
+
+    // Insert or update an entry in its shard, evicting the least recently used one if full.
+    void cache_entry(Shard& shard, const std::string& key,
+                     const PolicyOutputSession& session, std::time_t expire_time);
+
+    void sweeper_thread_func();
+
+    static const size_t SHARD_COUNT = 32;
+    Shard _shards[SHARD_COUNT];
+    size_t _shard_capacity;
+    int _ttl_s;
+    int _sweep_interval_s;
+    leveldb::DB* _db;
+    std::mutex _sweeper_mutex;
+    std::condition_variable _sweeper_cond;
+    std::atomic<bool> _is_running;
+    std::thread _sweeper_thread;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_SESSION_STORE_H
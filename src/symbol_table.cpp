@@ -0,0 +1,51 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "symbol_table.h"
+
+namespace dmkit {
+
+const int SymbolTable::UNKNOWN;
+
+SymbolTable::SymbolTable() {
+    // 64: bucket_count, initial count of buckets.
+    // 80: load_factor, element_count * 100 / bucket_count.
+    this->_ids.init(64, 80);
+}
+
+int SymbolTable::intern(const std::string& name) {
+    int* id_seek = this->_ids.seek(name);
+    if (id_seek != nullptr) {
+        return *id_seek;
+    }
+    int id = this->_names.size();
+    this->_ids.insert(name, id);
+    this->_names.push_back(name);
+    return id;
+}
+
+int SymbolTable::find(const std::string& name) const {
+    int* id_seek = this->_ids.seek(name);
+    return id_seek != nullptr ? *id_seek : UNKNOWN;
+}
+
+const std::string& SymbolTable::name(int id) const {
+    return this->_names[id];
+}
+
+int SymbolTable::size() const {
+    return this->_names.size();
+}
+
+} // namespace dmkit
@@ -0,0 +1,55 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DMKIT_SYMBOL_TABLE_H
+#define DMKIT_SYMBOL_TABLE_H
+
+#include <string>
+#include <vector>
+#include "butil.h"
+
+namespace dmkit {
+
+// Integer ids of names known when policies are loaded, such as intents, slot tags
+// and states, so that they are compared and hashed as integers when matching policies.
+// Ids are dense and start from 0. Names are only added when loading policies,
+// the table is read only when it is shared by requests.
+class SymbolTable {
+public:
+    // Id of names not in the table
+    static const int UNKNOWN = -1;
+
+    SymbolTable();
+
+    // Get the id of a name, the name is added if not found.
+    int intern(const std::string& name);
+
+    // Get the id of a name, returns UNKNOWN if not found.
+    int find(const std::string& name) const;
+
+    const std::string& name(int id) const;
+
+    int size() const;
+
+    SymbolTable(SymbolTable const&) = delete;
+    void operator=(SymbolTable const&) = delete;
+
+private:
+    BUTIL_NAMESPACE::FlatMap<std::string, int> _ids;
+    std::vector<std::string> _names;
+};
+
+} // namespace dmkit
+
+#endif  //DMKIT_SYMBOL_TABLE_H
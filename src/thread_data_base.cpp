@@ -0,0 +1,169 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_data_base.h"
+#include <gflags/gflags.h>
+#include <pthread.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include "application_base.h"
+#include "brpc.h"
+#include "bthread.h"
+#include "bvar.h"
+
+DEFINE_int32(json_arena_size_kb, 64, "Initial size in KB of the per request json arena");
+DEFINE_int32(max_json_arena_size_kb, 4096, "Max size in KB the json arena buffer grows to");
+
+namespace dmkit {
+
+// Exposed in /vars for sizing the json arena.
+static bvar::Maxer<int64_t> s_json_arena_peak_size("dmkit_json_arena_peak_size");
+static bvar::Adder<int64_t> s_json_arena_reset_count("dmkit_json_arena_reset_count");
+static bvar::Adder<int64_t> s_json_arena_grow_count("dmkit_json_arena_grow_count");
+
+ThreadDataBase::ThreadDataBase()
+    : _pool(nullptr), _json_arena_peak_size(0), _json_arena_reset_count(0) {
+    // 2: bucket_count, initial count of buckets, big enough to avoid resize.
+    // 50: load_factor, element_count * 100 / bucket_count.
+    this->_qu_map.init(2, 50);
+    this->_json_arena_buffer.resize(std::max(FLAGS_json_arena_size_kb, 1) * 1024);
+    this->_json_arena = new JsonArenaAllocator(
+        this->_json_arena_buffer.data(), this->_json_arena_buffer.size());
+}
+
+ThreadDataBase::~ThreadDataBase() {
+    delete this->_json_arena;
+    this->_json_arena = nullptr;
+}
+
+void ThreadDataBase::reset_json_arena() {
+    size_t used_size = this->_json_arena->Size();
+    this->_json_arena_peak_size = std::max(this->_json_arena_peak_size, used_size);
+    this->_json_arena_reset_count++;
+    s_json_arena_peak_size << static_cast<int64_t>(used_size);
+    s_json_arena_reset_count << 1;
+
+    size_t max_size = static_cast<size_t>(FLAGS_max_json_arena_size_kb) * 1024;
+    bool ran_out = this->_json_arena->Capacity() > this->_json_arena_buffer.size();
+    if (!ran_out || this->_json_arena_buffer.size() >= max_size) {
+        this->_json_arena->Clear();
+        return;
+    }
+    // Leave some headroom over the peak to avoid growing again for slightly larger requests.
+    size_t new_size = std::min(std::max(this->_json_arena_peak_size * 3 / 2,
+                                        this->_json_arena_buffer.size() * 2), max_size);
+    delete this->_json_arena;
+    std::vector<char>(new_size).swap(this->_json_arena_buffer);
+    this->_json_arena = new JsonArenaAllocator(
+        this->_json_arena_buffer.data(), this->_json_arena_buffer.size());
+    s_json_arena_grow_count << 1;
+}
+
+static bthread_key_t s_bound_data_key;
+static pthread_once_t s_bound_data_key_once = PTHREAD_ONCE_INIT;
+
+static void create_bound_data_key() {
+    // The bound data is owned by the request, nothing to destroy with the key.
+    bthread_key_create(&s_bound_data_key, nullptr);
+}
+
+static inline bthread_key_t& bound_data_key() {
+    pthread_once(&s_bound_data_key_once, create_bound_data_key);
+    return s_bound_data_key;
+}
+
+ThreadDataBase* current_thread_data() {
+    void* bound_data = bthread_getspecific(bound_data_key());
+    if (bound_data != nullptr) {
+        return static_cast<ThreadDataBase*>(bound_data);
+    }
+    return static_cast<ThreadDataBase*>(BRPC_NAMESPACE::thread_local_data());
+}
+
+JsonArenaAllocator* current_json_arena() {
+    ThreadDataBase* data = current_thread_data();
+    return data == nullptr ? nullptr : &data->json_arena();
+}
+
+ThreadDataPool::ThreadDataPool(const ApplicationBase* application) {
+    this->_application = application;
+}
+
+ThreadDataPool::~ThreadDataPool() {
+    for (ThreadDataBase* data: this->_free_data) {
+        this->destroy(data);
+    }
+    this->_free_data.clear();
+    this->_application = nullptr;
+}
+
+ThreadDataBase* ThreadDataPool::create() {
+    ThreadDataBase* data = static_cast<ThreadDataBase*>(this->_application->create_thread_data());
+    data->set_pool(this);
+    return data;
+}
+
+void ThreadDataPool::destroy(ThreadDataBase* data) {
+    this->_application->destroy_thread_data(data);
+}
+
+ThreadDataBase* ThreadDataPool::acquire() {
+    ThreadDataBase* data = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        if (!this->_free_data.empty()) {
+            data = this->_free_data.back();
+            this->_free_data.pop_back();
+        }
+    }
+    if (data == nullptr) {
+        data = this->create();
+    }
+    // Need to reset thread data status before using it for a request
+    data->reset();
+    return data;
+}
+
+void ThreadDataPool::release(ThreadDataBase* data) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_free_data.push_back(data);
+}
+
+ThreadDataBase* acquire_worker_thread_data(ThreadDataBase* parent) {
+    if (parent == nullptr || parent->pool() == nullptr) {
+        return nullptr;
+    }
+    ThreadDataBase* data = parent->pool()->acquire();
+    data->set_log_id(parent->get_log_id());
+    return data;
+}
+
+void release_worker_thread_data(ThreadDataBase* parent, ThreadDataBase* data) {
+    parent->merge_notice_log(data);
+    // Free the json arena of the worker before it waits in the pool.
+    data->reset();
+    parent->pool()->release(data);
+}
+
+ScopedThreadData::ScopedThreadData(ThreadDataBase* data) {
+    this->_previous_data = bthread_getspecific(bound_data_key());
+    bthread_setspecific(bound_data_key(), data);
+}
+
+ScopedThreadData::~ScopedThreadData() {
+    bthread_setspecific(bound_data_key(), this->_previous_data);
+}
+
+} // namespace dmkit
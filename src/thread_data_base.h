@@ -15,20 +15,54 @@
 #ifndef DMKIT_THREAD_DATA_BASE_H
 #define DMKIT_THREAD_DATA_BASE_H
 
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
+#include "butil.h"
+#include "param_env.h"
+#include "policy.h"
+#include "qu_result.h"
+#include "rapidjson.h"
 
 namespace dmkit {
 
+// Allocator of the per request json arena.
+typedef rapidjson::MemoryPoolAllocator<> JsonArenaAllocator;
+
+// String buffer drawing from the json arena, construct it with current_json_arena().
+typedef rapidjson::GenericStringBuffer<rapidjson::UTF8<>, JsonArenaAllocator> ArenaStringBuffer;
+
+// Writer with its level stack drawn from the json arena, construct it with current_json_arena().
+typedef rapidjson::Writer<ArenaStringBuffer, rapidjson::UTF8<>, rapidjson::UTF8<>,
+                          JsonArenaAllocator> ArenaWriter;
+
+class ApplicationBase;
+class ThreadDataPool;
+
 class ThreadDataBase {
 public:
-    ThreadDataBase() {}
+    ThreadDataBase();
     
-    virtual ~ThreadDataBase() {}
+    virtual ~ThreadDataBase();
+
+    // The pool the thread data is created by, null if it is created elsewhere.
+    ThreadDataPool* pool() const { return this->_pool; }
+
+    void set_pool(ThreadDataPool* pool) { this->_pool = pool; }
     
     virtual void reset() {
         this->_log_id.clear();
         this->_notice_log.clear();
+        // Keep the capacity of request buffer for following requests,
+        // unless an oversized request made it too large.
+        if (this->_request_buffer.capacity() > MAX_KEPT_REQUEST_BUFFER_SIZE) {
+            std::vector<char>().swap(this->_request_buffer);
+        }
+        this->_request_buffer.clear();
+        this->_qu_map.clear();
+        this->reset_json_arena();
     }
     
     // Set a logid for current request, this logid will show in all logs for current request
@@ -45,6 +79,14 @@ public:
         this->_notice_log.push_back(log);
     }
 
+    // Move notice logs of another thread data working for the same request to the end.
+    void merge_notice_log(ThreadDataBase* other) {
+        for (auto& v: other->_notice_log) {
+            this->_notice_log.push_back(std::move(v));
+        }
+        other->_notice_log.clear();
+    }
+
     // Get notice log as a string in the format "key1=value1 key2=value2"
     const std::string get_notice_log() {
         std::string log_str;
@@ -55,9 +97,126 @@ public:
         return log_str;
     }
 
+    // A reusable buffer for the request body of current request. Request json can be parsed
+    // in-situ inside this buffer, so the parsed strings are views into the buffer
+    // and are valid until the thread data is reset.
+    std::vector<char>& request_buffer() { return this->_request_buffer; }
+
+    // Param environment reused by the policies evaluated in the request, one at a time.
+    ParamEnv& param_env() { return this->_param_env; }
+
+    // Qu result parsed in place by the request, slots of last request's result
+    // keep their capacity like policy output.
+    QuResult& qu_result() { return this->_qu_result; }
+
+    // Qu results of the request by domain for resolving policies, buckets are kept when cleared.
+    BUTIL_NAMESPACE::FlatMap<std::string, QuResult*>& qu_map() { return this->_qu_map; }
+
+    // Policy output filled in place by the request, strings of last request's output
+    // keep their capacity so that building an output of a similar size does not allocate.
+    PolicyOutput& policy_output() { return this->_policy_output; }
+
+    // Arena for the rapidjson documents and string buffers of current request.
+    // Nothing is freed until the thread data is reset, so json values must not outlive the request.
+    JsonArenaAllocator& json_arena() { return *this->_json_arena; }
+
+    // Peak bytes used by the json arena in a single request.
+    size_t json_arena_peak_size() const { return this->_json_arena_peak_size; }
+
+    // Number of times the json arena has been reset.
+    uint64_t json_arena_reset_count() const { return this->_json_arena_reset_count; }
+
 private:
+    // Release memory of the json arena. If last request ran out of the arena buffer,
+    // the buffer grows to fit it so that following requests are served without malloc.
+    void reset_json_arena();
+
+    ThreadDataPool* _pool;
     std::string _log_id;
     std::vector<std::string> _notice_log;
+    std::vector<char> _request_buffer;
+    ParamEnv _param_env;
+    QuResult _qu_result;
+    BUTIL_NAMESPACE::FlatMap<std::string, QuResult*> _qu_map;
+    PolicyOutput _policy_output;
+    static const size_t MAX_KEPT_REQUEST_BUFFER_SIZE = 4 * 1024 * 1024;
+    std::vector<char> _json_arena_buffer;
+    JsonArenaAllocator* _json_arena;
+    size_t _json_arena_peak_size;
+    uint64_t _json_arena_reset_count;
+};
+
+// Creates thread data of an application with its create_thread_data(), so that all thread data
+// of requests, asynchronous requests and their workers are of the application's type.
+// Thread data not owned by a caller are kept in the pool and reused.
+class ThreadDataPool {
+public:
+    explicit ThreadDataPool(const ApplicationBase* application);
+    ~ThreadDataPool();
+
+    // Create a thread data owned by the caller, such as brpc thread local data.
+    ThreadDataBase* create();
+
+    // Destroy a thread data got from create.
+    void destroy(ThreadDataBase* data);
+
+    // Get a reset thread data from the pool, a new one is created if the pool is empty.
+    ThreadDataBase* acquire();
+
+    // Put a thread data got from acquire back to the pool.
+    void release(ThreadDataBase* data);
+
+    ThreadDataPool(ThreadDataPool const&) = delete;
+    void operator=(ThreadDataPool const&) = delete;
+
+private:
+    const ApplicationBase* _application;
+    std::mutex _mutex;
+    std::vector<ThreadDataBase*> _free_data;
+};
+
+// Get thread data of the request being processed by current bthread.
+// It is the brpc thread local data unless a request data is bound by ScopedThreadData.
+ThreadDataBase* current_thread_data();
+
+// Get the json arena of the request being processed by current bthread,
+// null outside of a request so that json values fall back to their own allocators.
+JsonArenaAllocator* current_json_arena();
+
+// Get a thread data for a bthread working on part of the request of parent concurrently,
+// which has the log id of parent and its own json arena and notice log.
+// It is acquired from the pool of parent, returns null if parent has no pool.
+ThreadDataBase* acquire_worker_thread_data(ThreadDataBase* parent);
+
+// Release the thread data of a worker after it finished, its notice log is merged into parent.
+void release_worker_thread_data(ThreadDataBase* parent, ThreadDataBase* data);
+
+// A rapidjson document drawing both its values and its parse stack from the json arena.
+class ArenaDocument
+    : public rapidjson::GenericDocument<rapidjson::UTF8<>, JsonArenaAllocator, JsonArenaAllocator> {
+public:
+    explicit ArenaDocument(JsonArenaAllocator* arena = current_json_arena())
+        : rapidjson::GenericDocument<rapidjson::UTF8<>, JsonArenaAllocator, JsonArenaAllocator>(
+              arena, STACK_CAPACITY, arena) {}
+
+private:
+    static const size_t STACK_CAPACITY = 1024;
+};
+
+// Bind the thread data of a request to current bthread during the scope.
+// Asynchronous requests continue in bthreads which do not own the brpc thread local data,
+// so they carry their own thread data and bind it in each continuation.
+class ScopedThreadData {
+public:
+    explicit ScopedThreadData(ThreadDataBase* data);
+
+    ~ScopedThreadData();
+
+    ScopedThreadData(ScopedThreadData const&) = delete;
+    void operator=(ScopedThreadData const&) = delete;
+
+private:
+    void* _previous_data;
 };
 
 } // namespace dmkit
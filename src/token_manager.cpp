@@ -79,17 +79,14 @@ int TokenManager::client_key_conf_change_callback(void* param) {
 int TokenManager::get_access_token(const std::string bot_id,
                                    const RemoteServiceManager* remote_service_manager,
                                    std::string& access_token) {
-    TokenValue token_value;
-    if (this->get_token_from_cache(bot_id, token_value) == 0) {
-        access_token = token_value.access_token;
+    if (this->get_cached_access_token(bot_id, access_token) == 0) {
         return 0;
     }
-    std::shared_ptr<ClientKeyMap> p_client_key_map(this->_p_client_key_map);
-    auto client_key_iter = p_client_key_map->find(bot_id);
-    if (client_key_iter == p_client_key_map->end()) {
+    ClientKey client_key;
+    if (this->get_client_key(bot_id, client_key) != 0) {
         return -1;
     }
-    ClientKey client_key = client_key_iter->second;
+    TokenValue token_value;
     if (this->get_token_from_remote(client_key, remote_service_manager, token_value) != 0) {
         return -1;
     }
@@ -98,6 +95,55 @@ int TokenManager::get_access_token(const std::string bot_id,
     return 0;
 }
 
+int TokenManager::get_cached_access_token(const std::string bot_id, std::string& access_token) {
+    TokenValue token_value;
+    if (this->get_token_from_cache(bot_id, token_value) != 0) {
+        return -1;
+    }
+    access_token = token_value.access_token;
+    return 0;
+}
+
+int TokenManager::call_access_token(const std::string bot_id,
+                                    const RemoteServiceManager* remote_service_manager,
+                                    RemoteServiceCall& call,
+                                    google::protobuf::Closure* done) {
+    BRPC_NAMESPACE::ClosureGuard done_guard(done);
+    ClientKey client_key;
+    if (this->get_client_key(bot_id, client_key) != 0) {
+        return -1;
+    }
+    return remote_service_manager->call_async(
+        "token_auth", get_token_request(client_key), call, done_guard.release());
+}
+
+int TokenManager::finish_access_token(const std::string bot_id,
+                                      RemoteServiceCall& call,
+                                      std::string& access_token) {
+    RemoteServiceResult rsr;
+    if (call.join(rsr) != 0) {
+        APP_LOG(ERROR) << "Failed to get authorization result";
+        return -1;
+    }
+    TokenValue token_value;
+    if (parse_token_result(rsr.result, token_value) != 0) {
+        return -1;
+    }
+    this->update_token_cache(bot_id, token_value);
+    access_token = token_value.access_token;
+    return 0;
+}
+
+int TokenManager::get_client_key(const std::string bot_id, ClientKey& client_key) {
+    std::shared_ptr<ClientKeyMap> p_client_key_map(this->_p_client_key_map);
+    auto client_key_iter = p_client_key_map->find(bot_id);
+    if (client_key_iter == p_client_key_map->end()) {
+        return -1;
+    }
+    client_key = client_key_iter->second;
+    return 0;
+}
+
 ClientKeyMap* TokenManager::load_client_key_map() {
     FILE* fp = fopen(this->_client_key_conf_path.c_str(), "r");
     if (fp == nullptr) {
@@ -167,20 +213,30 @@ int TokenManager::update_token_cache(const std::string bot_id, const TokenValue
 
 int TokenManager::get_token_from_remote(const ClientKey client_key,
         const RemoteServiceManager* remote_service_manager, TokenValue& token_value) {
+    RemoteServiceResult rsr;
+    if (remote_service_manager->call("token_auth", get_token_request(client_key), rsr) != 0) {
+        APP_LOG(ERROR) << "Failed to get authorization result";
+        return -1;
+    }
+    return parse_token_result(rsr.result, token_value);
+}
+
+RemoteServiceParam TokenManager::get_token_request(const ClientKey& client_key) {
     std::string url = "/oauth/2.0/token?grant_type=client_credentials";
     url += "&client_id=" + client_key.api_key + "&client_secret=" + client_key.secret_key;
     RemoteServiceParam rsp = {
         url,
         HTTP_METHOD_GET,
-        ""
+        BUTIL_NAMESPACE::IOBuf()
     };
-    RemoteServiceResult rsr;
-    if (remote_service_manager->call("token_auth", rsp, rsr) != 0) {
-        APP_LOG(ERROR) << "Failed to get authorization result";
-        return -1;
-    }
+    return rsp;
+}
+
+int TokenManager::parse_token_result(const std::string& result, TokenValue& token_value) {
     rapidjson::Document json;
-    if (json.Parse(rsr.result.c_str()).HasParseError()) {
+    if (json.Parse(result.c_str()).HasParseError() || !json.IsObject()
+            || !json.HasMember("access_token") || !json["access_token"].IsString()
+            || !json.HasMember("expires_in") || !json["expires_in"].IsInt()) {
         APP_LOG(ERROR) << "Failed to parse authorization result to json";
         return -1;
     }
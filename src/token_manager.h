@@ -60,13 +60,35 @@ public:
     int get_access_token(const std::string bot_id,
             const RemoteServiceManager* remote_service_manager, std::string& access_token);
 
+    // Get access token with bot id if it is cached, returns -1 if it needs to be got from remote.
+    int get_cached_access_token(const std::string bot_id, std::string& access_token);
+
+    // Start getting access token of a bot from remote without waiting,
+    // done is run once the call finishes, the token is got by finish_access_token then.
+    // Like RemoteServiceManager::call_async, done is always run even if it fails to start.
+    int call_access_token(const std::string bot_id,
+            const RemoteServiceManager* remote_service_manager,
+            RemoteServiceCall& call,
+            google::protobuf::Closure* done);
+
+    // Get access token of a bot from a finished call started by call_access_token.
+    int finish_access_token(const std::string bot_id, RemoteServiceCall& call, std::string& access_token);
+
 private:
     int get_token_from_cache(const std::string bot_id, TokenValue& token_value);
     int update_token_cache(const std::string bot_id, const TokenValue token_value);
 
+    int get_client_key(const std::string bot_id, ClientKey& client_key);
+
     int get_token_from_remote(const ClientKey client_key,
             const RemoteServiceManager* remote_service_manager, TokenValue& token_value);
 
+    // Remote service request of access token with a client key.
+    static RemoteServiceParam get_token_request(const ClientKey& client_key);
+
+    // Parse the result of access token request.
+    static int parse_token_result(const std::string& result, TokenValue& token_value);
+
     ClientKeyMap* load_client_key_map();
 
     std::string _client_key_conf_path;
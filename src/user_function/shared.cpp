@@ -37,30 +37,12 @@ namespace user_function {
 //    0 if function process success
 //    -1 if function process fail
 
-// Get value from a JSON string with supplied path.
-// args[0]: JSON string
-// args[1]: path to search for, split with a dot sign
-int json_get_value(const std::vector<std::string>& args,
-                   const RequestContext& context,
-                   std::string& result) {
-    (void)context;
-    result = "";
-    if (args.size() < 2) {
-        return -1;
-    }
-
-    std::string data = args[0];
-    std::string search = args[1];
+bool json_split_path(const std::string& search, std::vector<std::string>& keys) {
+    keys.clear();
     if (search.empty()) {
-        return -1;
-    }
-    rapidjson::Document doc;
-    if (doc.Parse(data.c_str()).HasParseError() || (!doc.IsObject() && !doc.IsArray())) {
-        APP_LOG(WARNING) << "Failed to load json data: " << data;
-        return -1;
+        return false;
     }
     std::size_t last_pos = 0;
-    const rapidjson::Value* value = &doc;
     while (last_pos < search.length()) {
         std::size_t pos = search.find('.', last_pos);
         if (pos == std::string::npos) {
@@ -71,9 +53,19 @@ int json_get_value(const std::vector<std::string>& args,
 
         utils::trim(key);
         if (key.empty()) {
-            return -1;
+            return false;
         }
+        keys.push_back(key);
+    }
+    return true;
+}
 
+int json_get_value_by_path(const rapidjson::Value& data,
+                           const std::vector<std::string>& keys,
+                           std::string& result) {
+    result = "";
+    const rapidjson::Value* value = &data;
+    for (auto const& key: keys) {
         if (value->IsObject()) {
             const rapidjson::Value::ConstMemberIterator miter = value->FindMember(key.c_str());
             if (miter == value->MemberEnd()) {
@@ -82,9 +74,6 @@ int json_get_value(const std::vector<std::string>& args,
             value = &(miter->value);
             continue;
         } else if (value->IsArray()) {
-            if (key.empty()) {
-                return -1;
-            }
             unsigned index = atoi(key.c_str());
             if (index == 0 && key[0] != '0') {
                 return -1;
@@ -120,8 +109,8 @@ int json_get_value(const std::vector<std::string>& args,
     } else if (value->IsString()) {
         result = value->GetString();
     } else {
-        rapidjson::StringBuffer buffer;
-        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        ArenaStringBuffer buffer(current_json_arena());
+        ArenaWriter writer(buffer, current_json_arena());
         value->Accept(writer);
         result = buffer.GetString();
     }
@@ -129,6 +118,31 @@ int json_get_value(const std::vector<std::string>& args,
     return 0;
 }
 
+// Get value from a JSON string with supplied path.
+// args[0]: JSON string
+// args[1]: path to search for, split with a dot sign
+int json_get_value(const std::vector<std::string>& args,
+                   const RequestContext& context,
+                   std::string& result) {
+    (void)context;
+    result = "";
+    if (args.size() < 2) {
+        return -1;
+    }
+
+    const std::string& data = args[0];
+    std::vector<std::string> keys;
+    if (!json_split_path(args[1], keys)) {
+        return -1;
+    }
+    ArenaDocument doc;
+    if (doc.Parse(data.c_str()).HasParseError() || (!doc.IsObject() && !doc.IsArray())) {
+        APP_LOG(WARNING) << "Failed to load json data: " << data;
+        return -1;
+    }
+    return json_get_value_by_path(doc, keys, result);
+}
+
 // String replacement.
 // args[0]: string
 // args[1]: sub string to be replaced
@@ -293,14 +307,13 @@ int service_http_get(const std::vector<std::string>& args,
         return -1;
     }
 
-    const RemoteServiceManager* rsm = context.remote_service_manager();
     RemoteServiceParam rsm_param = {
         args[1],
         HTTP_METHOD_GET,
-        "",
+        BUTIL_NAMESPACE::IOBuf(),
     };
     RemoteServiceResult rsm_result;
-    if (rsm->call(args[0], rsm_param, rsm_result) != 0) {
+    if (context.call_service(args[0], rsm_param, rsm_result) != 0) {
         return -1;
     }
 
@@ -318,7 +331,6 @@ int service_http_post(const std::vector<std::string>& args,
         return -1;
     }
 
-    const RemoteServiceManager* rsm = context.remote_service_manager();
     std::string post_data = "";
     for (size_t i = 2; i < args.size(); i++) {
         if (i == 2) {
@@ -331,10 +343,11 @@ int service_http_post(const std::vector<std::string>& args,
     RemoteServiceParam rsm_param = {
         args[1],
         HTTP_METHOD_POST,
-        post_data,
+        BUTIL_NAMESPACE::IOBuf(),
     };
+    rsm_param.payload.append(post_data);
     RemoteServiceResult rsm_result;
-    if (rsm->call(args[0], rsm_param, rsm_result) != 0) {
+    if (context.call_service(args[0], rsm_param, rsm_result) != 0) {
         return -1;
     }
 
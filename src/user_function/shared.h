@@ -17,12 +17,21 @@
 
 #include <string>
 #include <vector>
+#include "../rapidjson.h"
 #include "../request_context.h"
 
 namespace dmkit {
 namespace user_function {
 
 // JSON Operations
+// Split a path of json_get_value into keys, returns false if the path or any key is empty.
+bool json_split_path(const std::string& search, std::vector<std::string>& keys);
+
+// Get the value at the path of keys in parsed json data, formatted as json_get_value does.
+int json_get_value_by_path(const rapidjson::Value& data,
+                           const std::vector<std::string>& keys,
+                           std::string& result);
+
 int json_get_value(const std::vector<std::string>& args,
                    const RequestContext& context,
                    std::string& result);
@@ -21,7 +21,7 @@
 namespace dmkit {
 
 UserFunctionManager::UserFunctionManager() {
-    this->_user_function_map = new std::unordered_map<std::string, UserFunctionPtr>();
+    this->_user_function_map = new std::unordered_map<std::string, UserFunction>();
     this->_init = false;
 }
 
@@ -36,25 +36,27 @@ UserFunctionManager::~UserFunctionManager() {
 }
 
 int UserFunctionManager::init() {
-    // All user functions should be registered here.
+    // All user functions should be registered here, functions with side effects
+    // or returning different results for the same arguments must not be pure.
     // Shared functions.
-    (*_user_function_map)["json_get_value"] = user_function::json_get_value;
-    (*_user_function_map)["replace"] = user_function::replace;
-    (*_user_function_map)["split_and_choose"] = user_function::split_and_choose;
-    (*_user_function_map)["number_add"] = user_function::number_add;
-    (*_user_function_map)["float_mul"] = user_function::float_mul;
-    (*_user_function_map)["choose_if_equal"] = user_function::choose_if_equal;
-    (*_user_function_map)["url_encode"] = user_function::url_encode;
-    (*_user_function_map)["service_http_get"] = user_function::service_http_get;
-    (*_user_function_map)["service_http_post"] = user_function::service_http_post;
-    (*_user_function_map)["now_strftime"] = user_function::now_strftime;
+    this->register_user_function("json_get_value", user_function::json_get_value, true);
+    this->register_user_function("replace", user_function::replace, true);
+    this->register_user_function("split_and_choose", user_function::split_and_choose, false);
+    this->register_user_function("number_add", user_function::number_add, true);
+    this->register_user_function("float_mul", user_function::float_mul, true);
+    this->register_user_function("choose_if_equal", user_function::choose_if_equal, true);
+    this->register_user_function("url_encode", user_function::url_encode, true);
+    this->register_user_function("service_http_get", user_function::service_http_get, true);
+    this->register_user_function("service_http_post", user_function::service_http_post, false);
+    this->register_user_function("now_strftime", user_function::now_strftime, false);
 
     // Scenario specific functions.
-    (*_user_function_map)["demo_get_cellular_data_usage"] = 
-            user_function::demo::get_cellular_data_usage;
-    (*_user_function_map)["demo_get_cellular_data_left"] = 
-            user_function::demo::get_cellular_data_left;
-    (*_user_function_map)["demo_get_package_options"] = user_function::demo::get_package_options;
+    this->register_user_function("demo_get_cellular_data_usage",
+            user_function::demo::get_cellular_data_usage, true);
+    this->register_user_function("demo_get_cellular_data_left",
+            user_function::demo::get_cellular_data_left, true);
+    this->register_user_function("demo_get_package_options",
+            user_function::demo::get_package_options, true);
 
     // Curl init is required for url_encode function.
     if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
@@ -75,17 +77,53 @@ int UserFunctionManager::call_user_function(const std::string& func_name,
         APP_LOG(WARNING) << "call to undefined user function: " << func_name;
         return -1;
     }
-    UserFunctionPtr func_ptr = find_res->second;
+    const UserFunction& func = find_res->second;
+    // Arguments are prefixed with their lengths in the memo key so that keys are unambiguous.
+    std::string memo_key = func_name;
+    for (auto const& arg: args) {
+        memo_key += '|';
+        memo_key += std::to_string(arg.length());
+        memo_key += ':';
+        memo_key += arg;
+    }
     int res = -1;
+    if (func.pure && context.try_get_memoized_result(memo_key, result)) {
+        APP_LOG(TRACE) << "memoized result of user function [" << func_name << "]";
+        return 0;
+    }
+    // Functions with side effects are called once for a query, a resumed pass replays them.
+    if (!func.pure && context.try_replay_result(memo_key, res, result)) {
+        APP_LOG(TRACE) << "replayed result of user function [" << func_name << "]";
+        return res;
+    }
     try {
-        res = (*func_ptr)(args, context, result);
+        res = (*func.func)(args, context, result);
     } catch (const char* msg) {
         APP_LOG(WARNING) << "Exception calling user function ["
             << func_name << "], exception: " << msg;
         res = -1;
     }
+    // Failures are not memoized, a later call may succeed. Calls waiting for
+    // a service call are not recorded, they are made again when the pass is resumed.
+    if (func.pure && res == 0) {
+        context.memoize_result(memo_key, result);
+    } else if (!func.pure && !context.has_pending_calls()) {
+        context.record_result(memo_key, res, result);
+    }
 
     return res;
 }
 
+bool UserFunctionManager::is_pure(const std::string& func_name) const {
+    auto find_res = this->_user_function_map->find(func_name);
+    return find_res != this->_user_function_map->end() && find_res->second.pure;
+}
+
+void UserFunctionManager::register_user_function(const std::string& func_name,
+                                                 UserFunctionPtr func,
+                                                 bool pure) {
+    UserFunction user_function = {func, pure};
+    (*this->_user_function_map)[func_name] = user_function;
+}
+
 } // namespace dmkit
@@ -26,6 +26,13 @@ typedef int (*UserFunctionPtr)(const std::vector<std::string>& args,
                                const RequestContext& context,
                                std::string& result);
 
+struct UserFunction {
+    UserFunctionPtr func;
+    // A pure function returns the same result given the same arguments in a request
+    // and has no side effects, so that its results are memoized for the request.
+    bool pure;
+};
+
 class UserFunctionManager {
 public:
     UserFunctionManager();
@@ -36,9 +43,13 @@ public:
                            const std::vector<std::string>& args,
                            const RequestContext& context,
                            std::string& result);
+    // Whether a function is registered as pure, unknown functions are not.
+    bool is_pure(const std::string& func_name) const;
 
 private:
-    std::unordered_map<std::string, UserFunctionPtr>* _user_function_map;
+    void register_user_function(const std::string& func_name, UserFunctionPtr func, bool pure);
+
+    std::unordered_map<std::string, UserFunction>* _user_function_map;
     bool _init;
 };
 
@@ -85,12 +85,60 @@ static inline bool split(const std::string& str, const char sep, std::vector<std
 }
 
 static inline std::string json_to_string(const rapidjson::Value& value) {
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    ArenaStringBuffer buffer(current_json_arena());
+    ArenaWriter writer(buffer, current_json_arena());
     value.Accept(writer);
     return buffer.GetString();
 }
 
+// Append str to out as a quoted json string, escaped the same way as rapidjson writers.
+static inline void append_json_string(std::string& out, const std::string& str) {
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+    out.push_back('"');
+    size_t begin = 0;
+    for (size_t i = 0; i < str.length(); ++i) {
+        unsigned char ch = static_cast<unsigned char>(str[i]);
+        if (ch >= 0x20 && ch != '"' && ch != '\\') {
+            continue;
+        }
+        out.append(str, begin, i - begin);
+        begin = i + 1;
+        out.push_back('\\');
+        switch (ch) {
+        case '"': out.push_back('"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '\b': out.push_back('b'); break;
+        case '\f': out.push_back('f'); break;
+        case '\n': out.push_back('n'); break;
+        case '\r': out.push_back('r'); break;
+        case '\t': out.push_back('t'); break;
+        default:
+            out.append("u00");
+            out.push_back(HEX_DIGITS[ch >> 4]);
+            out.push_back(HEX_DIGITS[ch & 0xF]);
+        }
+    }
+    out.append(str, begin, std::string::npos);
+    out.push_back('"');
+}
+
+// Rapidjson output stream appending to IOBuf blocks directly,
+// so that json can be serialized into a request without a std::string copy.
+class IOBufOutputStream {
+public:
+    typedef char Ch;
+
+    void Put(char c) { this->_appender.push_back(c); }
+
+    void Flush() {}
+
+    // Move the data written so far to the end of buf.
+    void move_to(BUTIL_NAMESPACE::IOBuf& buf) { this->_appender.move_to(buf); }
+
+private:
+    BUTIL_NAMESPACE::IOBufAppender _appender;
+};
+
 } // namespace utils
 } // namespace dmkit
 
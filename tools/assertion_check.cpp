@@ -0,0 +1,238 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Check assertions evaluated on compiled operands against rendering the whole value and splitting it.
+//
+// Assertions used to be evaluated by rendering the whole assertion value with param values and
+// splitting the rendered value by commas. Operands are now compiled and rendered one by one,
+// which must give the same result, including param values with commas, params rendering empty
+// and spaces around the values. A policy is generated for every assertion type and value below,
+// with params a, b and c read from request params. Every policy is resolved with all
+// combinations of the param values and the selected output is compared with the result of
+// rendering and splitting the whole value.
+//
+// Build with -DBUILD_TOOLS=ON and run:
+//     ./assertion_check
+// It fails if any case differs.
+
+#include <stdlib.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "butil.h"
+#include "param_template.h"
+#include "policy.h"
+#include "policy_manager.h"
+#include "qu_result.h"
+#include "rapidjson.h"
+#include "request_context.h"
+#include "thread_data_base.h"
+#include "utils.h"
+
+static const char* BOT_ID = "9999";
+
+static const char* ASSERTION_TYPES[] = {"not_empty", "empty", "in", "not_in", "eq", "gt", "ge"};
+
+static const char* ASSERTION_VALUES[] = {
+    "{%a%}",
+    "{%a%},{%b%}",
+    "{%a%}, {%b%}",
+    "{%a%},{%b%},{%c%}",
+    "{%a%},x,{%b%}",
+    "x,{%a%}",
+    "{%a%},1",
+    "1,{%a%}",
+    "{%a%}{%b%},{%c%}",
+    " {%a%} , {%b%} "
+};
+
+static const char* PARAM_VALUES[] = {"", " ", "x", "1", "2", "1.5", "x,1", ",", "1,"};
+
+// Render a value by replacing {%name%} with the param value.
+static std::string render(const std::string& value,
+                          const std::unordered_map<std::string, std::string>& params) {
+    std::string result;
+    size_t pos = 0;
+    while (pos < value.size()) {
+        size_t start = value.find("{%", pos);
+        size_t end = start == std::string::npos ? start : value.find("%}", start + 2);
+        if (end == std::string::npos) {
+            result += value.substr(pos);
+            break;
+        }
+        result += value.substr(pos, start - pos);
+        result += params.at(value.substr(start + 2, end - start - 2));
+        pos = end + 2;
+    }
+    return result;
+}
+
+// Whether the assertion holds by rendering the whole value and splitting it.
+static bool expect_assertion(const std::string& type, const std::string& value) {
+    if (type == "not_empty") {
+        return !value.empty();
+    }
+    if (type == "empty") {
+        return value.empty();
+    }
+    std::vector<std::string> values;
+    dmkit::ParamTemplate::split_list(value, ',', values);
+    if (type == "in" || type == "not_in") {
+        bool has_match = false;
+        for (size_t i = 1; i < values.size(); ++i) {
+            if (values[0] == values[i]) {
+                has_match = true;
+                break;
+            }
+        }
+        return type == "in" ? has_match : !has_match;
+    }
+    if (type == "eq") {
+        return values.size() >= 2 && values[0] == values[1];
+    }
+    double left_val = 0;
+    double right_val = 0;
+    if (values.size() < 2 || !dmkit::utils::try_atof(values[0], left_val)
+            || !dmkit::utils::try_atof(values[1], right_val)) {
+        return false;
+    }
+    return type == "gt" ? left_val > right_val : left_val >= right_val;
+}
+
+static std::string escape_json(const std::string& str) {
+    std::string result;
+    for (char c: str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+// A policy for every assertion, triggered by INTENT_<index> and rendering true
+// if its assertion holds, otherwise false.
+static std::string get_policies_json(std::vector<std::pair<std::string, std::string>>& assertions) {
+    std::string json = "[";
+    for (const char* type: ASSERTION_TYPES) {
+        for (const char* value: ASSERTION_VALUES) {
+            if (!assertions.empty()) {
+                json += ",";
+            }
+            std::string intent = "INTENT_" + std::to_string(assertions.size());
+            assertions.push_back(std::make_pair(type, value));
+            json += "{\"trigger\": {\"intent\": \"" + intent + "\", \"slots\": [], \"state\": \"\"},"
+                " \"params\": [{\"name\": \"a\", \"type\": \"request_param\", \"value\": \"a\"},"
+                " {\"name\": \"b\", \"type\": \"request_param\", \"value\": \"b\"},"
+                " {\"name\": \"c\", \"type\": \"request_param\", \"value\": \"c\"}],"
+                " \"output\": [{\"assertion\": [{\"type\": \"" + std::string(type) + "\","
+                " \"value\": \"" + escape_json(value) + "\"}],"
+                " \"session\": {\"context\": {}, \"state\": \"\"},"
+                " \"result\": [{\"type\": \"tts\", \"value\": \"true\"}]},"
+                " {\"assertion\": [], \"session\": {\"context\": {}, \"state\": \"\"},"
+                " \"result\": [{\"type\": \"tts\", \"value\": \"false\"}]}]}";
+        }
+    }
+    return json + "]";
+}
+
+static bool write_file(const std::string& path, const std::string& content) {
+    std::ofstream out(path);
+    out << content;
+    return out.good();
+}
+
+// Resolve the policy triggered by intent, returns the rendered tts or an empty string on failure.
+static std::string resolve(dmkit::PolicyManager& policy_manager,
+                           const std::shared_ptr<dmkit::ProductPolicyMap>& policy_dict,
+                           const std::string& intent,
+                           const std::unordered_map<std::string, std::string>& params) {
+    rapidjson::Document dialog_state;
+    std::string dialog_state_json = "{\"intents\": [{\"name\": \"" + intent + "\"}], \"user_slots\": {}}";
+    dialog_state.Parse(dialog_state_json.c_str());
+    dmkit::ThreadDataBase* tls = dmkit::current_thread_data();
+    tls->reset();
+    dmkit::QuResult& qu_result = tls->qu_result();
+    if (qu_result.parse_dialog_state(BOT_ID, dialog_state,
+            dmkit::PolicyManager::get_symbol_table(policy_dict, "default")) != 0) {
+        return "";
+    }
+    BUTIL_NAMESPACE::FlatMap<std::string, dmkit::QuResult*>& qu_map = tls->qu_map();
+    qu_map.clear();
+    qu_map.insert(BOT_ID, &qu_result);
+    dmkit::RequestContext context(nullptr, "assertion_check", params);
+    dmkit::PolicyOutputSession session;
+    dmkit::PolicyOutput& output = tls->policy_output();
+    int ret = policy_manager.resolve(policy_dict, "default", &qu_map, session, context, output);
+    qu_map.clear();
+    if (ret != 0 || output.results.empty() || output.results[0].values.empty()) {
+        return "";
+    }
+    return output.results[0].values[0];
+}
+
+int main(int argc, char* argv[]) {
+    char dir_template[] = "/tmp/dmkit_assertion_check_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        fprintf(stderr, "Failed to create temporary directory\n");
+        return 1;
+    }
+    std::string dir = dir_template;
+    std::vector<std::pair<std::string, std::string>> assertions;
+    std::string domain_path = dir + "/assertion.json";
+    if (!write_file(domain_path, get_policies_json(assertions))
+            || !write_file(dir + "/products.json",
+                           std::string("{\"default\": {\"") + BOT_ID + "\": {\"score\": 1,"
+                           " \"conf_path\": \"" + domain_path + "\"}}}")) {
+        fprintf(stderr, "Failed to write policy conf to %s\n", dir.c_str());
+        return 1;
+    }
+
+    dmkit::ThreadDataBase data;
+    dmkit::ScopedThreadData scoped_data(&data);
+    dmkit::PolicyManager policy_manager;
+    if (policy_manager.init(dir.c_str(), "products.json") != 0) {
+        fprintf(stderr, "Failed to load policies\n");
+        return 1;
+    }
+    std::shared_ptr<dmkit::ProductPolicyMap> policy_dict = policy_manager.get_policy_dict();
+
+    int case_count = 0;
+    int failure_count = 0;
+    for (size_t i = 0; i < assertions.size(); ++i) {
+        std::string intent = "INTENT_" + std::to_string(i);
+        for (const char* a: PARAM_VALUES) {
+            for (const char* b: PARAM_VALUES) {
+                for (const char* c: PARAM_VALUES) {
+                    std::unordered_map<std::string, std::string> params = {{"a", a}, {"b", b}, {"c", c}};
+                    bool expected = expect_assertion(assertions[i].first,
+                                                     render(assertions[i].second, params));
+                    std::string result = resolve(policy_manager, policy_dict, intent, params);
+                    ++case_count;
+                    if (result != (expected ? "true" : "false")) {
+                        ++failure_count;
+                        printf("DIFF %s[%s] a=[%s] b=[%s] c=[%s] expected=%s got=%s\n",
+                               assertions[i].first.c_str(), assertions[i].second.c_str(),
+                               a, b, c, expected ? "true" : "false",
+                               result.empty() ? "failed" : result.c_str());
+                    }
+                }
+            }
+        }
+    }
+    printf("%d cases checked, %d differ from rendering the whole value\n", case_count, failure_count);
+    return failure_count > 0 ? 1 : 0;
+}
@@ -0,0 +1,385 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Check domains run by modules of tools/policy_compiler against the interpreter, and benchmark both.
+//
+// Policies of a products conf with compiled_path set for its domains are loaded three times:
+// as configured, which must attach every compiled module, without compiled_path, which
+// interprets every domain, and with each compiled domain conf changed by a trailing newline,
+// which must fall back to the interpreter as the module is compiled from a different conf.
+// Every turn is resolved by all three and the outputs must be the same. Turns are read from
+// a traffic file, one json per line:
+//     {"product": "default", "bot_id": "1234", "dialog_state": {...}, "session": {...}, "params": {...}}
+// where dialog_state is the dialog state of the unit bot response, session the dmkit session
+// and params the request params. Without a traffic file, turns are generated from the trigger
+// of every policy with combinations of slot values. Services called by policies are served
+// by a local server, returning the responses of tools/mock_api_server.py.
+//
+// Build with -DBUILD_TOOLS=ON, compile the domains as described in tools/policy_compiler.cpp
+// and run in the build directory:
+//     ./compiled_policy_check conf/app products.json [traffic file] [benchmark rounds] [port]
+// It fails if any turn differs or if a module is not attached or does not fall back.
+
+#include <stdlib.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "brpc.h"
+#include "butil.h"
+#include "http.pb.h"
+#include "policy.h"
+#include "policy_manager.h"
+#include "qu_result.h"
+#include "rapidjson.h"
+#include "remote_service_manager.h"
+#include "request_context.h"
+#include "thread_data_base.h"
+#include "utils.h"
+
+// Slot values of generated turns, including numbers, a list and an empty value.
+static const char* SLOT_VALUES[] = {"2018-01", "临时", "固定", "1", " 2 ", "x,1", ""};
+
+struct Turn {
+    std::string product;
+    std::string bot_id;
+    std::string dialog_state;
+    std::string session;
+    std::unordered_map<std::string, std::string> params;
+};
+
+// Services of the demo policies, the same as tools/mock_api_server.py.
+class LocalApiService : public dmkit::HttpService {
+public:
+    virtual void run(google::protobuf::RpcController* controller,
+                     const dmkit::HttpRequest* request,
+                     dmkit::HttpResponse* response,
+                     google::protobuf::Closure* done) {
+        (void)request;
+        (void)response;
+        BRPC_NAMESPACE::ClosureGuard done_guard(done);
+        BRPC_NAMESPACE::Controller* cntl = static_cast<BRPC_NAMESPACE::Controller*>(controller);
+        const std::string& path = cntl->http_request().uri().path();
+        if (path == "/hotel/search") {
+            cntl->response_attachment().append("如家酒店、四季酒店和香格里拉酒店");
+        } else if (path == "/hotel/book") {
+            cntl->response_attachment().append("OK");
+        } else {
+            cntl->http_response().set_status_code(404);
+        }
+    }
+};
+
+static bool read_file(const std::string& path, std::string& content) {
+    std::ifstream in(path);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    content = buffer.str();
+    return in.good();
+}
+
+static bool write_file(const std::string& path, const std::string& content) {
+    std::ofstream out(path);
+    out << content;
+    return out.good();
+}
+
+// Write the products conf with compiled_path removed, or with each compiled domain conf
+// copied into dir with a trailing newline.
+static bool write_products_conf(const rapidjson::Document& products, const std::string& dir,
+                                const std::string& file, bool fallback) {
+    rapidjson::Document doc;
+    doc.CopyFrom(products, doc.GetAllocator());
+    int index = 0;
+    for (auto& product: doc.GetObject()) {
+        for (auto& domain: product.value.GetObject()) {
+            if (!domain.value.HasMember("compiled_path")) {
+                continue;
+            }
+            if (!fallback) {
+                domain.value.RemoveMember("compiled_path");
+                continue;
+            }
+            std::string conf;
+            std::string conf_path = dir + "/domain_" + std::to_string(index++) + ".json";
+            if (!read_file(domain.value["conf_path"].GetString(), conf) || !write_file(conf_path, conf + "\n")) {
+                return false;
+            }
+            domain.value["conf_path"].SetString(conf_path.c_str(), conf_path.length(), doc.GetAllocator());
+        }
+    }
+    return write_file(dir + "/" + file, dmkit::utils::json_to_string(doc));
+}
+
+// Check every domain with compiled_path is compiled or interpreted as expected.
+static bool check_compiled(dmkit::PolicyManager& policy_manager, const rapidjson::Document& products,
+                           bool expected, const char* name) {
+    std::shared_ptr<dmkit::ProductPolicyMap> policy_dict = policy_manager.get_policy_dict();
+    bool success = true;
+    for (auto const& product: products.GetObject()) {
+        for (auto const& domain: product.value.GetObject()) {
+            if (!domain.value.HasMember("compiled_path")) {
+                continue;
+            }
+            dmkit::ProductPolicy** product_policy = policy_dict->seek(product.name.GetString());
+            std::shared_ptr<dmkit::DomainPolicy>* domain_policy = product_policy == nullptr ? nullptr
+                : (*product_policy)->domain_policy_map->seek(domain.name.GetString());
+            if (domain_policy == nullptr || (*domain_policy)->is_compiled() != expected) {
+                printf("Domain %s of %s is %s\n", domain.name.GetString(), name,
+                       expected ? "not compiled" : "compiled");
+                success = false;
+            }
+        }
+    }
+    return success;
+}
+
+static void add_slot_turns(const Turn& turn_template, const std::vector<std::string>& slots,
+                           size_t slot_index, rapidjson::Document& dialog_state, std::vector<Turn>& turns) {
+    if (slot_index == slots.size()) {
+        Turn turn = turn_template;
+        turn.dialog_state = dmkit::utils::json_to_string(dialog_state);
+        turns.push_back(turn);
+        return;
+    }
+    rapidjson::Document::AllocatorType& allocator = dialog_state.GetAllocator();
+    for (const char* value: SLOT_VALUES) {
+        rapidjson::Value slot_value(rapidjson::kObjectType);
+        slot_value.AddMember("name", rapidjson::Value(value, allocator), allocator);
+        slot_value.AddMember("original_name", rapidjson::Value(value, allocator), allocator);
+        slot_value.AddMember("state", 2, allocator);
+        rapidjson::Value values(rapidjson::kObjectType);
+        values.AddMember(rapidjson::Value(value, allocator), slot_value, allocator);
+        rapidjson::Value slot(rapidjson::kObjectType);
+        slot.AddMember("slot_name", rapidjson::Value(slots[slot_index].c_str(), allocator), allocator);
+        slot.AddMember("values", values, allocator);
+        rapidjson::Value& user_slots = dialog_state["user_slots"];
+        user_slots.RemoveMember(slots[slot_index].c_str());
+        user_slots.AddMember(rapidjson::Value(slots[slot_index].c_str(), allocator), slot, allocator);
+        add_slot_turns(turn_template, slots, slot_index + 1, dialog_state, turns);
+    }
+}
+
+// Turns of every policy trigger of the domains in the products conf, with all combinations
+// of slot values of the trigger slots.
+static bool generate_turns(const rapidjson::Document& products, std::vector<Turn>& turns) {
+    for (auto const& product: products.GetObject()) {
+        for (auto const& domain: product.value.GetObject()) {
+            std::string conf;
+            rapidjson::Document policies;
+            if (!read_file(domain.value["conf_path"].GetString(), conf)
+                    || policies.Parse(conf.c_str()).HasParseError() || !policies.IsArray()) {
+                fprintf(stderr, "Failed to read domain conf %s\n", domain.value["conf_path"].GetString());
+                return false;
+            }
+            for (auto const& policy: policies.GetArray()) {
+                const rapidjson::Value& trigger = policy["trigger"];
+                dmkit::PolicyOutputSession session;
+                session.domain = domain.name.GetString();
+                session.state = trigger["state"].GetString();
+                session.context.push_back({"dmkit_param_last_tts", "上一轮的回复"});
+                Turn turn;
+                turn.product = product.name.GetString();
+                turn.bot_id = domain.name.GetString();
+                turn.session = dmkit::PolicyOutputSession::to_json_str(session);
+                std::vector<std::string> slots;
+                for (auto const& slot: trigger["slots"].GetArray()) {
+                    slots.push_back(slot.GetString());
+                }
+                std::string intent = trigger["intent"].GetString();
+                rapidjson::Document dialog_state;
+                dialog_state.Parse(("{\"intents\": [{\"name\": \"" + intent + "\"}], \"user_slots\": {}}").c_str());
+                add_slot_turns(turn, slots, 0, dialog_state, turns);
+            }
+        }
+    }
+    return true;
+}
+
+static bool read_turns(const std::string& path, std::vector<Turn>& turns) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        rapidjson::Document doc;
+        if (doc.Parse(line.c_str()).HasParseError() || !doc.IsObject() || !doc.HasMember("bot_id")
+                || !doc.HasMember("dialog_state")) {
+            fprintf(stderr, "Invalid turn in %s: %s\n", path.c_str(), line.c_str());
+            return false;
+        }
+        Turn turn;
+        turn.product = doc.HasMember("product") ? doc["product"].GetString() : "default";
+        turn.bot_id = doc["bot_id"].GetString();
+        turn.dialog_state = dmkit::utils::json_to_string(doc["dialog_state"]);
+        turn.session = doc.HasMember("session") ? dmkit::utils::json_to_string(doc["session"]) : "{}";
+        if (doc.HasMember("params")) {
+            for (auto const& param: doc["params"].GetObject()) {
+                turn.params[param.name.GetString()] = param.value.GetString();
+            }
+        }
+        turns.push_back(turn);
+    }
+    return !turns.empty();
+}
+
+// Resolve a turn, returns the return code along with the output json.
+static std::string resolve(dmkit::PolicyManager& policy_manager,
+                           dmkit::RemoteServiceManager& remote_service_manager,
+                           const Turn& turn) {
+    std::shared_ptr<dmkit::ProductPolicyMap> policy_dict = policy_manager.get_policy_dict();
+    dmkit::ThreadDataBase* tls = dmkit::current_thread_data();
+    tls->reset();
+    rapidjson::Document dialog_state;
+    dialog_state.Parse(turn.dialog_state.c_str());
+    dmkit::QuResult& qu_result = tls->qu_result();
+    if (qu_result.parse_dialog_state(turn.bot_id, dialog_state,
+            dmkit::PolicyManager::get_symbol_table(policy_dict, turn.product)) != 0) {
+        return "invalid dialog state";
+    }
+    BUTIL_NAMESPACE::FlatMap<std::string, dmkit::QuResult*>& qu_map = tls->qu_map();
+    qu_map.clear();
+    qu_map.insert(turn.bot_id, &qu_result);
+    dmkit::RequestContext context(&remote_service_manager, "compiled_policy_check", turn.params);
+    dmkit::PolicyOutputSession session = dmkit::PolicyOutputSession::from_json_str(turn.session);
+    dmkit::PolicyOutput& output = tls->policy_output();
+    int ret = policy_manager.resolve(policy_dict, turn.product, &qu_map, session, context, output);
+    qu_map.clear();
+    if (ret != 0) {
+        return std::to_string(ret);
+    }
+    return std::to_string(ret) + " " + dmkit::PolicyOutput::to_json_str(output);
+}
+
+// Average microseconds of resolving all turns.
+static double benchmark(dmkit::PolicyManager& policy_manager,
+                        dmkit::RemoteServiceManager& remote_service_manager,
+                        const std::vector<Turn>& turns,
+                        int rounds) {
+    auto time_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        for (auto const& turn: turns) {
+            resolve(policy_manager, remote_service_manager, turn);
+        }
+    }
+    std::chrono::duration<double, std::micro> cost = std::chrono::steady_clock::now() - time_start;
+    return cost.count() / rounds / turns.size();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <conf dir> <products conf> [traffic file] [benchmark rounds] [port]\n",
+                argv[0]);
+        return 1;
+    }
+    std::string conf_dir = argv[1];
+    std::string products_file = argv[2];
+    std::string traffic_path = argc > 3 ? argv[3] : "";
+    int rounds = argc > 4 ? atoi(argv[4]) : 100;
+    int port = argc > 5 ? atoi(argv[5]) : 8021;
+
+    std::string products_json;
+    rapidjson::Document products;
+    if (!read_file(conf_dir + "/" + products_file, products_json)
+            || products.Parse(products_json.c_str()).HasParseError() || !products.IsObject()) {
+        fprintf(stderr, "Failed to read products conf %s/%s\n", conf_dir.c_str(), products_file.c_str());
+        return 1;
+    }
+    char dir_template[] = "/tmp/dmkit_compiled_policy_check_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        fprintf(stderr, "Failed to create temporary directory\n");
+        return 1;
+    }
+    std::string dir = dir_template;
+    if (!write_products_conf(products, dir, "interpreted.json", false)
+            || !write_products_conf(products, dir, "fallback.json", true)
+            || !write_file(dir + "/remote_services.json",
+                           "{\"hotel_service\": {\"naming_service_url\": \"http://127.0.0.1:"
+                           + std::to_string(port) + "\", \"load_balancer_name\": \"\", \"protocol\": \"http\","
+                           " \"client\": \"brpc\", \"timeout_ms\": 3000, \"retry\": 0, \"headers\": {}}}")) {
+        fprintf(stderr, "Failed to write conf to %s\n", dir.c_str());
+        return 1;
+    }
+    std::vector<Turn> turns;
+    if (traffic_path.empty() ? !generate_turns(products, turns) : !read_turns(traffic_path, turns)) {
+        fprintf(stderr, "No turns to check\n");
+        return 1;
+    }
+
+    LocalApiService api_service;
+    BRPC_NAMESPACE::Server server;
+    if (server.AddService(&api_service, BRPC_NAMESPACE::SERVER_DOESNT_OWN_SERVICE, "/hotel/* => run") != 0
+            || server.Start(port, nullptr) != 0) {
+        fprintf(stderr, "Failed to start local api server on port %d\n", port);
+        return 1;
+    }
+    int ret = 0;
+    {
+        dmkit::ThreadDataBase data;
+        dmkit::ScopedThreadData scoped_data(&data);
+        dmkit::RemoteServiceManager remote_service_manager;
+        dmkit::PolicyManager compiled;
+        dmkit::PolicyManager interpreted;
+        dmkit::PolicyManager fallback;
+        if (remote_service_manager.init(dir.c_str(), "remote_services.json") != 0
+                || compiled.init(conf_dir.c_str(), products_file.c_str()) != 0
+                || interpreted.init(dir.c_str(), "interpreted.json") != 0
+                || fallback.init(dir.c_str(), "fallback.json") != 0) {
+            fprintf(stderr, "Failed to load policies\n");
+            ret = 1;
+        } else if (!check_compiled(compiled, products, true, "compiled policies")
+                || !check_compiled(interpreted, products, false, "interpreted policies")
+                || !check_compiled(fallback, products, false, "changed domain conf")) {
+            ret = 1;
+        }
+
+        int failure_count = 0;
+        for (size_t i = 0; i < turns.size() && ret == 0; ++i) {
+            std::string expected = resolve(interpreted, remote_service_manager, turns[i]);
+            std::string compiled_result = resolve(compiled, remote_service_manager, turns[i]);
+            std::string fallback_result = resolve(fallback, remote_service_manager, turns[i]);
+            if (compiled_result != expected || fallback_result != expected) {
+                // A result with several values picks one by the current second, try again once.
+                expected = resolve(interpreted, remote_service_manager, turns[i]);
+                compiled_result = resolve(compiled, remote_service_manager, turns[i]);
+                fallback_result = resolve(fallback, remote_service_manager, turns[i]);
+            }
+            if (compiled_result != expected || fallback_result != expected) {
+                ++failure_count;
+                printf("DIFF bot_id=%s dialog_state=%s session=%s\n  interpreted=%s\n  compiled=%s\n"
+                       "  fallback=%s\n", turns[i].bot_id.c_str(), turns[i].dialog_state.c_str(),
+                       turns[i].session.c_str(), expected.c_str(), compiled_result.c_str(),
+                       fallback_result.c_str());
+            }
+        }
+        if (ret == 0) {
+            printf("%zu turns checked, %d differ from the interpreter\n", turns.size(), failure_count);
+            ret = failure_count > 0 ? 1 : 0;
+        }
+        if (ret == 0) {
+            double interpreted_cost = benchmark(interpreted, remote_service_manager, turns, rounds);
+            double compiled_cost = benchmark(compiled, remote_service_manager, turns, rounds);
+            printf("%-14s %-14s\n", "interpreted_us", "compiled_us");
+            printf("%-14.2f %-14.2f\n", interpreted_cost, compiled_cost);
+        }
+    }
+    server.Stop(0);
+    server.Join();
+    return ret;
+}
@@ -0,0 +1,186 @@
+# -*- coding: utf-8 -*-
+#
+# Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""
+Compare the json and protobuf endpoints of dmkit per dialog turn.
+The same dialog is replayed through both endpoints, reporting latency,
+client side encoding cost and bytes on the wire of each turn.
+
+Generate the protobuf module before running:
+    protoc --python_out=tools -Iproto proto/http.proto
+
+"""
+
+import json
+import random
+import requests
+import sys
+import time
+
+import http_pb2
+
+
+# Urls of dmkit, change these if you are runnning dmkit in a different ip/port.
+JSON_URL = "http://127.0.0.1:8010/search"
+PROTO_URL = "http://127.0.0.1:8010/search/resolve"
+
+
+class Stats(object):
+    """
+    Per turn measurements of an endpoint
+
+    """
+    def __init__(self, name):
+        self.name = name
+        self.latency_ms = []
+        self.codec_ms = []
+        self.request_bytes = []
+        self.response_bytes = []
+
+    def add(self, latency_ms, codec_ms, request_bytes, response_bytes):
+        self.latency_ms.append(latency_ms)
+        self.codec_ms.append(codec_ms)
+        self.request_bytes.append(request_bytes)
+        self.response_bytes.append(response_bytes)
+
+    def report(self):
+        turns = len(self.latency_ms)
+        if turns == 0:
+            print "%s: no turn finished" % self.name
+            return
+        latency = sorted(self.latency_ms)
+        print "%s: %d turns" % (self.name, turns)
+        print "  latency(ms)        avg %.3f  p50 %.3f  p99 %.3f" % (
+            sum(latency) / turns, latency[turns / 2], latency[min(turns - 1, turns * 99 / 100)])
+        print "  client codec(ms)   avg %.3f" % (sum(self.codec_ms) / turns)
+        print "  request bytes      avg %d" % (sum(self.request_bytes) / turns)
+        print "  response bytes     avg %d" % (sum(self.response_bytes) / turns)
+
+
+def run_json_turn(session, bot_id, token, user_id, query, bot_session, stats):
+    """
+    Send a turn to the json endpoint, returns the bot_session for next turn
+
+    """
+    codec_start = time.time()
+    payload = {
+        "version": "2.0",
+        "bot_id": bot_id,
+        "log_id": str(random.randint(100000, 999999)),
+        "request": {
+            "user_id": user_id,
+            "query": query,
+            "query_info": {
+                "type": "TEXT",
+                "source": "KEYBOARD"
+            },
+            "updates": "",
+            "client_session": "{}",
+            "bernard_level": 1
+        },
+        "bot_session": bot_session
+    }
+    data = json.dumps(payload)
+    codec_ms = (time.time() - codec_start) * 1000
+
+    start = time.time()
+    resp = session.post(JSON_URL + "?access_token=" + token, data=data,
+                        headers={'Content-Type': 'application/json'})
+    latency_ms = (time.time() - start) * 1000
+
+    codec_start = time.time()
+    obj = json.loads(resp.content)
+    next_bot_session = ""
+    if obj['error_code'] == 0:
+        next_bot_session = obj['result']['bot_session']
+        # The dmkit result is nested as json strings in the action.
+        action = obj['result']['response']['action_list'][0]
+        if action['type'] == 'event':
+            json.loads(json.loads(action['custom_reply'])['result'])
+    codec_ms += (time.time() - codec_start) * 1000
+
+    stats.add(latency_ms, codec_ms, len(data), len(resp.content))
+    return next_bot_session
+
+
+def run_proto_turn(session, bot_id, token, user_id, query, state, stats):
+    """
+    Send a turn to the protobuf endpoint, returns (bot_session, session) for next turn
+
+    """
+    bot_session, dm_session = state
+    codec_start = time.time()
+    request = http_pb2.DialogRequest()
+    request.log_id = str(random.randint(100000, 999999))
+    request.bot_id = bot_id
+    request.query = query
+    request.user_id = user_id
+    request.access_token = token
+    request.bot_session = bot_session
+    request.query_info.type = "TEXT"
+    request.query_info.source = "KEYBOARD"
+    request.updates = ""
+    request.bernard_level = 1
+    if dm_session is not None:
+        request.session.CopyFrom(dm_session)
+    data = request.SerializeToString()
+    codec_ms = (time.time() - codec_start) * 1000
+
+    start = time.time()
+    resp = session.post(PROTO_URL, data=data, headers={'Content-Type': 'application/proto'})
+    latency_ms = (time.time() - start) * 1000
+
+    codec_start = time.time()
+    response = http_pb2.DialogResponse()
+    response.ParseFromString(resp.content)
+    codec_ms += (time.time() - codec_start) * 1000
+
+    stats.add(latency_ms, codec_ms, len(data), len(resp.content))
+    if response.error_code != 0:
+        return ("", None)
+    return (response.bot_session, response.session)
+
+
+def main(bot_id, token, query_file, rounds):
+    """
+    Replay the queries in query_file, one query per line, as a dialog for rounds times
+
+    """
+    with open(query_file) as f:
+        queries = [line.strip() for line in f if line.strip()]
+    json_stats = Stats("json")
+    proto_stats = Stats("protobuf")
+    session = requests.Session()
+    for _ in range(rounds):
+        user_id = str(random.randint(1, 100000))
+        bot_session = ""
+        proto_state = ("", None)
+        for query in queries:
+            bot_session = run_json_turn(session, bot_id, token, user_id, query,
+                                        bot_session, json_stats)
+            proto_state = run_proto_turn(session, bot_id, token, user_id, query,
+                                         proto_state, proto_stats)
+    json_stats.report()
+    proto_stats.report()
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 4:
+        print "Usage: %s %s %s %s %s" % (sys.argv[0], "[bot_id]", "[access_token]",
+                                         "[query_file]", "[rounds]")
+    else:
+        main(sys.argv[1], sys.argv[2], sys.argv[3], int(sys.argv[4]) if len(sys.argv) > 4 else 10)
@@ -0,0 +1,277 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compare the server side cost of a dialog turn through the json and protobuf interfaces.
+//
+// Unit bot api is replaced by a local brpc server returning the same understood response
+// for every request, which triggers the demo policy checking cellular data usage.
+// DialogManager is initialized with conf/app/demo/cellular_data.json of the working directory
+// and remote services pointing to the local server. Each turn is resolved by run() with the
+// json request as it is received, and by resolve() with the protobuf request parsed from
+// its serialized bytes and the response serialized back, so that both include decoding the
+// request and encoding the response. The bot session of a response is sent with the next turn.
+// The call to the local unit bot server is included in both, the latency to the real unit bot
+// api is not.
+//
+// Build with -DBUILD_TOOLS=ON and run in the build directory:
+//     ./encoding_turn_benchmark [turns] [port of local unit bot server]
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include "brpc.h"
+#include "dialog_manager.h"
+#include "http.pb.h"
+#include "rapidjson.h"
+#include "thread_data_base.h"
+#include "utils.h"
+
+static const char* BOT_ID = "1234";
+static const char* ACCESS_TOKEN = "encoding_turn_benchmark";
+static const char* QUERY = "查一下一月份的流量";
+
+// Unit bot api returning an understood response of INTENT_CHECK_DATA_USAGE with user_time.
+class LocalUnitBotService : public dmkit::HttpService {
+public:
+    LocalUnitBotService() {
+        rapidjson::Document bot_session;
+        bot_session.Parse(
+            "{\"bot_id\": \"1234\", \"session_id\": \"session_1\","
+            " \"dialog_state\": {\"intents\": [{\"name\": \"INTENT_CHECK_DATA_USAGE\"}],"
+            " \"user_slots\": {\"user_time\": {\"slot_name\": \"user_time\", \"values\": {"
+            "\"2018-01\": {\"name\": \"2018-01\", \"original_name\": \"一月份\", \"state\": 2}}}},"
+            " \"contexts\": {}},"
+            " \"interactions\": [{\"interaction_id\": \"interaction_1\", \"response\": {"
+            "\"action_list\": [{\"action_id\": \"action_1\", \"confidence\": 1,"
+            " \"custom_reply\": \"\", \"say\": \"\", \"type\": \"understood\"}]}}]}");
+        std::string bot_session_str = dmkit::utils::json_to_string(bot_session);
+        rapidjson::Document response;
+        response.Parse(
+            "{\"error_code\": 0, \"result\": {\"version\": \"2.0\", \"bot_id\": \"1234\","
+            " \"log_id\": \"log_1\", \"interaction_id\": \"interaction_1\", \"bot_session\": \"\","
+            " \"response\": {\"status\": 0, \"msg\": \"ok\", \"action_list\": [{\"action_id\": \"action_1\","
+            " \"confidence\": 1, \"custom_reply\": \"\", \"say\": \"\", \"type\": \"understood\"}],"
+            " \"schema\": {\"intent\": \"INTENT_CHECK_DATA_USAGE\", \"slots\": []}}}}");
+        response["result"]["bot_session"].SetString(
+            bot_session_str.c_str(), bot_session_str.length(), response.GetAllocator());
+        _response = dmkit::utils::json_to_string(response);
+    }
+
+    virtual void run(google::protobuf::RpcController* controller,
+                     const dmkit::HttpRequest* request,
+                     dmkit::HttpResponse* response,
+                     google::protobuf::Closure* done) {
+        (void)request;
+        (void)response;
+        BRPC_NAMESPACE::ClosureGuard done_guard(done);
+        BRPC_NAMESPACE::Controller* cntl = static_cast<BRPC_NAMESPACE::Controller*>(controller);
+        cntl->http_response().set_content_type("application/json");
+        cntl->response_attachment().append(_response);
+    }
+
+private:
+    std::string _response;
+};
+
+struct TurnStats {
+    double cost_us;
+    size_t request_bytes;
+    size_t response_bytes;
+};
+
+static bool write_file(const std::string& path, const std::string& content) {
+    std::ofstream out(path);
+    out << content;
+    return out.good();
+}
+
+// Write conf/app of the dialog manager into dir, with unit bot api served on port.
+static bool write_conf(const std::string& dir, const std::string& policy_path, int port) {
+    std::string conf_dir = dir + "/conf/app";
+    if (system(("mkdir -p " + conf_dir).c_str()) != 0) {
+        return false;
+    }
+    return write_file(conf_dir + "/remote_services.json",
+                      "{\"unit_bot\": {\"naming_service_url\": \"http://127.0.0.1:" + std::to_string(port)
+                      + "\", \"load_balancer_name\": \"\", \"protocol\": \"http\", \"client\": \"brpc\","
+                      " \"timeout_ms\": 3000, \"retry\": 0,"
+                      " \"headers\": {\"Content-Type\": \"application/json\"}}}")
+        && write_file(conf_dir + "/products.json",
+                      std::string("{\"default\": {\"") + BOT_ID + "\": {\"score\": 1,"
+                      " \"conf_path\": \"" + policy_path + "\"}}}")
+        && write_file(conf_dir + "/bot_tokens.json",
+                      std::string("{\"") + BOT_ID + "\": {\"api_key\": \"\", \"secret_key\": \"\"}}");
+}
+
+// Resolve a turn through the json interface, bot_session is updated for the next turn.
+static int run_json_turn(dmkit::DialogManager& dialog_manager,
+                         std::string& bot_session,
+                         TurnStats& stats) {
+    rapidjson::Document request;
+    request.Parse(
+        "{\"version\": \"2.0\", \"bot_id\": \"1234\", \"log_id\": \"json_turn\","
+        " \"request\": {\"user_id\": \"user_1\", \"query\": \"\","
+        " \"query_info\": {\"type\": \"TEXT\", \"source\": \"KEYBOARD\"},"
+        " \"updates\": \"\", \"client_session\": \"{}\", \"bernard_level\": 1},"
+        " \"bot_session\": \"\"}");
+    request["request"]["query"].SetString(QUERY, request.GetAllocator());
+    request["bot_session"].SetString(bot_session.c_str(), bot_session.length(), request.GetAllocator());
+    std::string request_body = dmkit::utils::json_to_string(request);
+
+    BRPC_NAMESPACE::Controller cntl;
+    cntl.http_request().uri().SetQuery("access_token", ACCESS_TOKEN);
+    cntl.request_attachment().append(request_body);
+    dmkit::current_thread_data()->reset();
+    auto time_start = std::chrono::steady_clock::now();
+    dialog_manager.run(&cntl);
+    std::chrono::duration<double, std::micro> cost = std::chrono::steady_clock::now() - time_start;
+    std::string response_body = cntl.response_attachment().to_string();
+
+    rapidjson::Document response;
+    if (response.Parse(response_body.c_str()).HasParseError() || !response.IsObject()
+            || !response.HasMember("error_code") || !response["error_code"].IsInt()
+            || response["error_code"].GetInt() != 0
+            || response["result"]["response"]["action_list"][0]["type"] != "event") {
+        fprintf(stderr, "Unexpected json response: %s\n", response_body.c_str());
+        return -1;
+    }
+    bot_session = response["result"]["bot_session"].GetString();
+    stats.cost_us += cost.count();
+    stats.request_bytes += request_body.size();
+    stats.response_bytes += response_body.size();
+    return 0;
+}
+
+// Resolve a turn through the protobuf interface, bot_session and session are updated
+// for the next turn.
+static int run_proto_turn(dmkit::DialogManager& dialog_manager,
+                          std::string& bot_session,
+                          dmkit::DialogSession& session,
+                          TurnStats& stats) {
+    dmkit::DialogRequest client_request;
+    client_request.set_log_id("proto_turn");
+    client_request.set_bot_id(BOT_ID);
+    client_request.set_query(QUERY);
+    client_request.set_user_id("user_1");
+    client_request.set_access_token(ACCESS_TOKEN);
+    client_request.set_bot_session(bot_session);
+    client_request.mutable_session()->CopyFrom(session);
+    client_request.mutable_query_info()->set_type("TEXT");
+    client_request.mutable_query_info()->set_source("KEYBOARD");
+    client_request.set_updates("");
+    client_request.set_bernard_level(1);
+    std::string request_body;
+    client_request.SerializeToString(&request_body);
+
+    BRPC_NAMESPACE::Controller cntl;
+    dmkit::current_thread_data()->reset();
+    auto time_start = std::chrono::steady_clock::now();
+    dmkit::DialogRequest request;
+    dmkit::DialogResponse response;
+    std::string response_body;
+    if (!request.ParseFromString(request_body)) {
+        fprintf(stderr, "Failed to parse protobuf request\n");
+        return -1;
+    }
+    dialog_manager.resolve(&cntl, &request, &response);
+    response.SerializeToString(&response_body);
+    std::chrono::duration<double, std::micro> cost = std::chrono::steady_clock::now() - time_start;
+
+    if (response.error_code() != 0 || response.output().result_size() == 0) {
+        fprintf(stderr, "Unexpected protobuf response: %s\n", response.ShortDebugString().c_str());
+        return -1;
+    }
+    bot_session = response.bot_session();
+    session.CopyFrom(response.session());
+    stats.cost_us += cost.count();
+    stats.request_bytes += request_body.size();
+    stats.response_bytes += response_body.size();
+    return 0;
+}
+
+static void print_stats(const char* name, const TurnStats& stats, int turns) {
+    printf("%-10s %-14.2f %-16zu %-16zu\n", name, stats.cost_us / turns,
+           stats.request_bytes / turns, stats.response_bytes / turns);
+}
+
+int main(int argc, char* argv[]) {
+    int turns = argc > 1 ? atoi(argv[1]) : 10000;
+    int port = argc > 2 ? atoi(argv[2]) : 8020;
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        fprintf(stderr, "Failed to get working directory\n");
+        return 1;
+    }
+    std::string policy_path = std::string(cwd) + "/conf/app/demo/cellular_data.json";
+    if (access(policy_path.c_str(), R_OK) != 0) {
+        fprintf(stderr, "Demo policy %s not found, run in the build directory\n", policy_path.c_str());
+        return 1;
+    }
+    char dir_template[] = "/tmp/dmkit_encoding_turn_benchmark_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        fprintf(stderr, "Failed to create temporary directory\n");
+        return 1;
+    }
+    std::string dir = dir_template;
+    if (!write_conf(dir, policy_path, port) || chdir(dir.c_str()) != 0) {
+        fprintf(stderr, "Failed to write conf to %s\n", dir.c_str());
+        return 1;
+    }
+
+    LocalUnitBotService unit_bot_service;
+    BRPC_NAMESPACE::Server server;
+    if (server.AddService(&unit_bot_service, BRPC_NAMESPACE::SERVER_DOESNT_OWN_SERVICE,
+                          "/rpc/2.0/unit/bot/chat => run") != 0
+            || server.Start(port, nullptr) != 0) {
+        fprintf(stderr, "Failed to start local unit bot server on port %d\n", port);
+        return 1;
+    }
+
+    dmkit::DialogManager dialog_manager;
+    if (dialog_manager.init() != 0) {
+        fprintf(stderr, "Failed to init dialog manager\n");
+        return 1;
+    }
+    dmkit::ThreadDataPool data_pool(&dialog_manager);
+    dmkit::ThreadDataBase* data = data_pool.acquire();
+    int ret = 0;
+    {
+        dmkit::ScopedThreadData scoped_data(data);
+        TurnStats json_stats = {0, 0, 0};
+        TurnStats proto_stats = {0, 0, 0};
+        std::string json_bot_session;
+        std::string proto_bot_session;
+        dmkit::DialogSession proto_session;
+        for (int i = 0; i < turns && ret == 0; ++i) {
+            if (run_json_turn(dialog_manager, json_bot_session, json_stats) != 0
+                    || run_proto_turn(dialog_manager, proto_bot_session, proto_session, proto_stats) != 0) {
+                ret = 1;
+            }
+        }
+        if (ret == 0) {
+            printf("%d turns of the demo policy checking cellular data usage\n", turns);
+            printf("%-10s %-14s %-16s %-16s\n", "interface", "turn_cost_us", "request_bytes", "response_bytes");
+            print_stats("json", json_stats, turns);
+            print_stats("protobuf", proto_stats, turns);
+        }
+    }
+    data_pool.release(data);
+    server.Stop(0);
+    server.Join();
+    return ret;
+}
@@ -0,0 +1,278 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Check and benchmark json_get_value params evaluated on the json kept in the param environment.
+//
+// A func_val of the form json_get_value:{%data%},path is compiled into a param which reads
+// the json parsed once into the param environment. The check evaluates such params with
+// ParamEvaluator on fixed and random json data and paths, and compares each value and
+// failure with calling the json_get_value user function on the same arguments.
+// The benchmark then times a policy reading many paths of the same json both ways.
+// Only json_get_value params are compiled this way, other params and assertions are evaluated
+// as before. The demo policies under conf/app/demo read no json and are not affected.
+//
+// Build with -DBUILD_TOOLS=ON and run:
+//     ./param_json_benchmark [random cases] [benchmark rounds]
+// It fails if any case differs from the user function.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "param_evaluator.h"
+#include "policy.h"
+#include "qu_result.h"
+#include "rapidjson.h"
+#include "request_context.h"
+#include "thread_data_base.h"
+#include "user_function/shared.h"
+#include "user_function_manager.h"
+
+// Params data and path are read from request params, value is compiled into a json param.
+static const char* CHECK_POLICY_JSON =
+    "{\"trigger\": {\"intent\": \"INTENT_CHECK\", \"slots\": [], \"state\": \"\"},"
+    " \"params\": ["
+    "{\"name\": \"data\", \"type\": \"request_param\", \"value\": \"data\"},"
+    " {\"name\": \"path\", \"type\": \"request_param\", \"value\": \"path\"},"
+    " {\"name\": \"value\", \"type\": \"func_val\", \"required\": true,"
+    " \"value\": \"json_get_value:{%data%},{%path%}\"}],"
+    " \"output\": [{\"assertion\": [], \"session\": {\"context\": {}, \"state\": \"\"},"
+    " \"result\": [{\"type\": \"tts\", \"value\": \"{%value%}\"}]}]}";
+
+static const char* FIXED_DATA[] = {
+    "{\"a\": {\"b\": \"text\", \"c\": 12, \"d\": 1.5, \"e\": true, \"f\": null,"
+    " \"g\": [1, \"two\", {\"h\": \"three\"}], \"i\": {}, \"j\": []}}",
+    "[{\"a\": 1}, [2, 3], \"four\", -5, false]",
+    "{\"unicode\": \"\\u4e2d\\u6587\", \"escaped\": \"quote\\\" and \\\\\", \"1\": \"digit key\"}",
+    "{\"a\": 1} trailing",
+    "\"a string\"",
+    "42",
+    "",
+    "{\"a\": "
+};
+
+static const char* FIXED_PATHS[] = {
+    "a", "a.b", "a.c", "a.d", "a.e", "a.f", "a.g", "a.g.0", "a.g.1", "a.g.2.h", "a.g.3",
+    "a.g.x", "a.g.-1", "a.g.01", "a.i", "a.j", " a . b ", "a..b", "a.", ".a", "", "0", "0.a",
+    "1", "1.1", "2", "3", "4", "5", "unicode", "escaped", "missing", "a.b.c"
+};
+
+// A random json with keys and indexes picked from a small set, so that random paths hit it.
+static std::string random_json(std::mt19937& rng, int depth) {
+    static const char* KEYS[] = {"a", "b", "c", "0", "1"};
+    int type = std::uniform_int_distribution<int>(0, depth > 0 ? 7 : 5)(rng);
+    switch (type) {
+    case 0:
+        return "null";
+    case 1:
+        return rng() % 2 == 0 ? "true" : "false";
+    case 2:
+        return std::to_string(static_cast<int>(rng() % 2000) - 1000);
+    case 3:
+        return std::to_string(static_cast<int>(rng() % 1000) - 500) + ".25";
+    case 4:
+    case 5:
+        return "\"s" + std::to_string(rng() % 100) + "\"";
+    case 6: {
+        std::string json = "{";
+        int size = rng() % 4;
+        for (int i = 0; i < size; ++i) {
+            if (i > 0) {
+                json += ",";
+            }
+            json += "\"" + std::string(KEYS[rng() % 5]) + "\": " + random_json(rng, depth - 1);
+        }
+        return json + "}";
+    }
+    default: {
+        std::string json = "[";
+        int size = rng() % 4;
+        for (int i = 0; i < size; ++i) {
+            if (i > 0) {
+                json += ",";
+            }
+            json += random_json(rng, depth - 1);
+        }
+        return json + "]";
+    }
+    }
+}
+
+static std::string random_path(std::mt19937& rng) {
+    static const char* KEYS[] = {"a", "b", "c", "0", "1", "2", "x"};
+    std::string path;
+    int size = 1 + rng() % 4;
+    for (int i = 0; i < size; ++i) {
+        if (i > 0) {
+            path += ".";
+        }
+        path += KEYS[rng() % 7];
+    }
+    return path;
+}
+
+class JsonParamChecker {
+public:
+    JsonParamChecker(dmkit::Policy* policy, dmkit::UserFunctionManager* user_function_manager)
+        : _policy(policy), _user_function_manager(user_function_manager), _case_count(0),
+          _failure_count(0) {}
+
+    void check(const std::string& data, const std::string& path) {
+        ++this->_case_count;
+        std::unordered_map<std::string, std::string> params = {{"data", data}, {"path", path}};
+        dmkit::current_thread_data()->reset();
+        dmkit::RequestContext context(nullptr, "check", params);
+        dmkit::QuResult qu_result;
+        dmkit::PolicyOutputSession session;
+
+        std::string expected;
+        int expected_ret = dmkit::user_function::json_get_value({data, path}, context, expected);
+
+        // Params value depends on are evaluated along with it.
+        const dmkit::PolicyParam& value_param = this->_policy->params()[2];
+        dmkit::ParamDependency dependency;
+        dependency.params.push_back(2);
+        dmkit::ParamEvaluator evaluator(
+            this->_policy, &qu_result, session, context, this->_user_function_manager);
+        bool success = evaluator.evaluate(dependency);
+        std::string value = success ? evaluator.param_env().get(value_param.slot) : "";
+
+        if (success != (expected_ret == 0) || (success && value != expected)) {
+            ++this->_failure_count;
+            printf("DIFF data=%s path=%s json_param=%s[%s] json_get_value=%s[%s]\n",
+                   data.c_str(), path.c_str(), success ? "ok" : "failed", value.c_str(),
+                   expected_ret == 0 ? "ok" : "failed", expected.c_str());
+        }
+    }
+
+    int case_count() const { return this->_case_count; }
+    int failure_count() const { return this->_failure_count; }
+
+private:
+    dmkit::Policy* _policy;
+    dmkit::UserFunctionManager* _user_function_manager;
+    int _case_count;
+    int _failure_count;
+};
+
+// A policy reading count paths of the same json data, with json_get_value compiled into
+// json params, or called as a user function when the function name is rendered from a param.
+static std::unique_ptr<dmkit::Policy> get_benchmark_policy(int count, bool compiled) {
+    std::string params = "{\"name\": \"data\", \"type\": \"request_param\", \"value\": \"data\"},"
+        " {\"name\": \"func\", \"type\": \"const\", \"value\": \"json_get_value\"}";
+    std::string result;
+    for (int i = 0; i < count; ++i) {
+        std::string index = std::to_string(i);
+        std::string func = compiled ? "json_get_value" : "{%func%}";
+        params += ", {\"name\": \"v" + index + "\", \"type\": \"func_val\", \"value\": \""
+            + func + ":{%data%},items." + index + ".name\"}";
+        result += "{%v" + index + "%}";
+    }
+    std::string json = "{\"trigger\": {\"intent\": \"INTENT_BENCHMARK\", \"slots\": [], \"state\": \"\"},"
+        " \"params\": [" + params + "], \"output\": [{\"assertion\": [],"
+        " \"session\": {\"context\": {}, \"state\": \"\"},"
+        " \"result\": [{\"type\": \"tts\", \"value\": \"" + result + "\"}]}]}";
+    rapidjson::Document doc;
+    doc.Parse(json.c_str());
+    return std::unique_ptr<dmkit::Policy>(dmkit::Policy::parse_from_json_value(doc));
+}
+
+// Average microseconds of evaluating all params of the policy per request.
+static double benchmark(dmkit::Policy* policy,
+                        dmkit::UserFunctionManager* user_function_manager,
+                        const std::string& data,
+                        int rounds) {
+    std::unordered_map<std::string, std::string> params = {{"data", data}};
+    dmkit::QuResult qu_result;
+    dmkit::PolicyOutputSession session;
+    dmkit::ParamDependency dependency;
+    for (unsigned int i = 0; i < policy->params().size(); ++i) {
+        dependency.params.push_back(i);
+    }
+    auto time_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        dmkit::current_thread_data()->reset();
+        dmkit::RequestContext context(nullptr, "benchmark", params);
+        dmkit::ParamEvaluator evaluator(policy, &qu_result, session, context, user_function_manager);
+        if (!evaluator.evaluate(dependency)) {
+            return -1;
+        }
+    }
+    std::chrono::duration<double, std::micro> cost = std::chrono::steady_clock::now() - time_start;
+    return cost.count() / rounds;
+}
+
+int main(int argc, char* argv[]) {
+    int random_cases = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+
+    dmkit::ThreadDataBase data;
+    dmkit::ScopedThreadData scoped_data(&data);
+    dmkit::UserFunctionManager user_function_manager;
+    if (user_function_manager.init() != 0) {
+        fprintf(stderr, "Failed to init user functions\n");
+        return 1;
+    }
+
+    rapidjson::Document policy_doc;
+    policy_doc.Parse(CHECK_POLICY_JSON);
+    std::unique_ptr<dmkit::Policy> policy(dmkit::Policy::parse_from_json_value(policy_doc));
+    if (policy == nullptr || policy->params()[2].type_id != dmkit::PARAM_JSON_GET_VALUE) {
+        fprintf(stderr, "json_get_value param is not compiled into a json param\n");
+        return 1;
+    }
+
+    JsonParamChecker checker(policy.get(), &user_function_manager);
+    for (const char* fixed_data: FIXED_DATA) {
+        for (const char* fixed_path: FIXED_PATHS) {
+            checker.check(fixed_data, fixed_path);
+        }
+    }
+    std::mt19937 rng(20181);
+    for (int i = 0; i < random_cases; ++i) {
+        checker.check(random_json(rng, 4), random_path(rng));
+    }
+    printf("%d cases checked, %d differ from json_get_value\n",
+           checker.case_count(), checker.failure_count());
+    if (checker.failure_count() > 0) {
+        return 1;
+    }
+
+    std::string data_json = "{\"items\": [";
+    for (int i = 0; i < 50; ++i) {
+        if (i > 0) {
+            data_json += ",";
+        }
+        data_json += "{\"id\": " + std::to_string(i) + ", \"name\": \"item " + std::to_string(i)
+            + "\", \"tags\": [\"a\", \"b\", \"c\"], \"price\": " + std::to_string(i * 1.5) + "}";
+    }
+    data_json += "]}";
+    printf("%-8s %-20s %-20s\n", "params", "json_param_us", "json_get_value_us");
+    for (int count: {1, 5, 20}) {
+        std::unique_ptr<dmkit::Policy> compiled = get_benchmark_policy(count, true);
+        std::unique_ptr<dmkit::Policy> called = get_benchmark_policy(count, false);
+        if (compiled == nullptr || called == nullptr) {
+            fprintf(stderr, "Failed to create benchmark policies\n");
+            return 1;
+        }
+        double compiled_cost = benchmark(compiled.get(), &user_function_manager, data_json, rounds);
+        double called_cost = benchmark(called.get(), &user_function_manager, data_json, rounds);
+        printf("%-8d %-20.2f %-20.2f\n", count, compiled_cost, called_cost);
+    }
+    return 0;
+}
@@ -0,0 +1,446 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compile the policies of a domain conf into C++ source of a module loaded by dmkit.
+//
+// Policies are parsed the way PolicyManager loads them, so that param slots, templates and
+// assertions are the same as those the module is attached to. Every template with params
+// is compiled into a function appending its literals and param values, and every assertion
+// into a function evaluating its operands, constants included. Templates and assertions
+// which are not valid are left to the interpreter. Params, trigger matching and output
+// selection are still interpreted by dmkit. The module records the fingerprint of the conf
+// and the ABI it is built with, dmkit interprets the domain if either does not match.
+//
+// Build with -DBUILD_TOOLS=ON and run in the build directory:
+//     ./policy_compiler conf/app/demo/cellular_data.json cellular_data_policy.cpp
+//     g++ -std=c++11 -O2 -shared -fPIC -I../src cellular_data_policy.cpp -o conf/app/demo/cellular_data.so
+// Then set compiled_path of the domain in products.json to the shared object.
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "compiled_policy_module.h"
+#include "policy.h"
+#include "rapidjson.h"
+
+// Generated along with assertions falling back to a list, the same as evaluate_value_list
+// of PolicyManager.
+static const char* VALUE_LIST_SOURCE = R"(enum ListOp {
+    OP_IN,
+    OP_NOT_IN,
+    OP_EQ,
+    OP_GT,
+    OP_GE
+};
+
+// Evaluate a list assertion by rendering the whole value and splitting it.
+bool evaluate_value_list(ListOp op, dmkit::CompiledRenderFunc render, const dmkit::CompiledParamEnv& env) {
+    std::string value;
+    if (!render(env, value)) {
+        return false;
+    }
+    std::vector<std::string> values;
+    s_host->split_list(value, ',', values);
+    size_t size = values.size();
+    switch (op) {
+    case OP_IN:
+    case OP_NOT_IN: {
+        bool has_match = false;
+        for (size_t i = 1; i < size; ++i) {
+            if (values[0] == values[i]) {
+                has_match = true;
+                break;
+            }
+        }
+        return op == OP_IN ? has_match : !has_match;
+    }
+    case OP_EQ:
+        return size >= 2 && values[0] == values[1];
+    case OP_GT:
+    case OP_GE: {
+        double left_val = 0;
+        double right_val = 0;
+        if (size < 2 || !s_host->try_atof(values[0], left_val) || !s_host->try_atof(values[1], right_val)) {
+            return false;
+        }
+        return op == OP_GT ? left_val > right_val : left_val >= right_val;
+    }
+    }
+    return false;
+}
+
+)";
+
+// Quote a string as a C++ string literal. Bytes other than printable ascii are written
+// as three digit octal escapes, which never take the following character.
+static std::string quote(const std::string& str) {
+    std::string result = "\"";
+    char buffer[8];
+    for (unsigned char c: str) {
+        if (c == '"' || c == '\\' || c == '?') {
+            result += '\\';
+            result += c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            snprintf(buffer, sizeof(buffer), "\\%03o", c);
+            result += buffer;
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+// Quote a string in a comment, keeping it on one line.
+static std::string comment(const std::string& str) {
+    std::string result;
+    for (char c: str) {
+        result += (c == '\n' || c == '\r') ? ' ' : c;
+    }
+    size_t pos = 0;
+    while ((pos = result.find("*/", pos)) != std::string::npos) {
+        result.replace(pos, 2, "* /");
+    }
+    return result;
+}
+
+class PolicyCompiler {
+public:
+    PolicyCompiler(const std::vector<dmkit::Policy*>& policies, const std::string& fingerprint);
+
+    std::string generate();
+
+private:
+    // Whether a template is rendered by a compiled function.
+    bool is_compiled(const dmkit::ParamTemplate* param_template) const;
+
+    void generate_template(size_t index);
+    // Returns false if the assertion is left to the interpreter.
+    bool generate_assertion(size_t index);
+
+    std::string template_name(const dmkit::ParamTemplate* param_template) const;
+
+    std::string _fingerprint;
+    std::vector<size_t> _slot_counts;
+    std::vector<dmkit::ParamTemplate*> _templates;
+    // Number of param slots of the policy each template belongs to
+    std::vector<size_t> _template_slot_counts;
+    std::vector<dmkit::PolicyOutputAssertion*> _assertions;
+    std::unordered_map<const dmkit::ParamTemplate*, size_t> _template_indexes;
+    // Whether any assertion falls back to evaluate_value_list
+    bool _has_value_list;
+    std::ostringstream _constants;
+    std::ostringstream _functions;
+};
+
+PolicyCompiler::PolicyCompiler(const std::vector<dmkit::Policy*>& policies,
+                               const std::string& fingerprint)
+    : _fingerprint(fingerprint), _has_value_list(false) {
+    for (dmkit::Policy* policy: policies) {
+        size_t template_count = this->_templates.size();
+        policy->get_compiled_parts(this->_templates, this->_assertions);
+        this->_slot_counts.push_back(policy->param_slots().size());
+        this->_template_slot_counts.resize(this->_templates.size(), policy->param_slots().size());
+        for (size_t i = template_count; i < this->_templates.size(); ++i) {
+            this->_template_indexes[this->_templates[i]] = i;
+        }
+    }
+}
+
+bool PolicyCompiler::is_compiled(const dmkit::ParamTemplate* param_template) const {
+    if (!param_template->is_valid() || param_template->is_constant()) {
+        return false;
+    }
+    size_t slot_count = this->_template_slot_counts[this->_template_indexes.at(param_template)];
+    for (auto const& segment: param_template->segments()) {
+        if (segment.is_param && (segment.slot < 0 || segment.slot >= (int)slot_count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string PolicyCompiler::template_name(const dmkit::ParamTemplate* param_template) const {
+    return "render_" + std::to_string(this->_template_indexes.at(param_template));
+}
+
+void PolicyCompiler::generate_template(size_t index) {
+    const dmkit::ParamTemplate* param_template = this->_templates[index];
+    std::ostringstream& out = this->_functions;
+    out << "// " << comment(param_template->str()) << "\n";
+    out << "bool " << template_name(param_template)
+        << "(const dmkit::CompiledParamEnv& env, std::string& result) {\n";
+    std::string set_check;
+    std::string reserve;
+    size_t literal_size = 0;
+    for (auto const& segment: param_template->segments()) {
+        if (!segment.is_param) {
+            literal_size += segment.text.length();
+            continue;
+        }
+        std::string slot = std::to_string(segment.slot);
+        set_check += (set_check.empty() ? "" : " || ") + std::string("!env.is_set[") + slot + "]";
+        reserve += " + env.values[" + slot + "].size()";
+    }
+    out << "    if (" << set_check << ") {\n";
+    out << "        return false;\n";
+    out << "    }\n";
+    out << "    result.reserve(result.size()";
+    if (literal_size > 0) {
+        out << " + " << literal_size;
+    }
+    out << reserve << ");\n";
+    for (auto const& segment: param_template->segments()) {
+        if (segment.is_param) {
+            out << "    result.append(env.values[" << segment.slot << "]);\n";
+        } else {
+            out << "    result.append(" << quote(segment.text) << ", " << segment.text.length() << ");\n";
+        }
+    }
+    out << "    return true;\n";
+    out << "}\n\n";
+}
+
+// An assertion is evaluated the way PolicyManager interprets it. Operands are rendered in order
+// and trimmed unless they are the whole value. A list is rendered as a whole and split again
+// if a param operand has commas or the last one renders empty.
+bool PolicyCompiler::generate_assertion(size_t index) {
+    const dmkit::PolicyOutputAssertion& assertion = *this->_assertions[index];
+    bool is_whole_value = assertion.op == dmkit::ASSERTION_NOT_EMPTY
+        || assertion.op == dmkit::ASSERTION_EMPTY;
+    bool is_numeric = assertion.op == dmkit::ASSERTION_GT || assertion.op == dmkit::ASSERTION_GE;
+    const std::vector<dmkit::AssertionOperand>& operands = assertion.operands;
+    if (operands.empty()) {
+        return false;
+    }
+    bool has_param = false;
+    for (auto const& operand: operands) {
+        if (!operand.value.is_constant()) {
+            if (!is_compiled(&operand.value)) {
+                return false;
+            }
+            has_param = true;
+        }
+        if (is_numeric && operand.value.is_constant() && operand.is_number && !std::isfinite(operand.number)) {
+            return false;
+        }
+    }
+    if (has_param && !is_whole_value && !is_compiled(&assertion.value_template)) {
+        return false;
+    }
+
+    std::string prefix = "assertion_" + std::to_string(index) + "_";
+    std::vector<std::string> names;
+    for (size_t i = 0; i < operands.size(); ++i) {
+        if (operands[i].value.is_constant()) {
+            names.push_back(prefix + std::to_string(i));
+            this->_constants << "const std::string " << names.back() << "("
+                << quote(operands[i].value.str()) << ", " << operands[i].value.str().length() << ");\n";
+        } else {
+            names.push_back("value_" + std::to_string(i));
+        }
+    }
+
+    std::ostringstream& out = this->_functions;
+    out << "// " << comment(assertion.type) << ": " << comment(assertion.value) << "\n";
+    out << "bool evaluate_assertion_" << index << "(const dmkit::CompiledParamEnv& env) {\n";
+    for (size_t i = 0; i < operands.size(); ++i) {
+        if (operands[i].value.is_constant()) {
+            continue;
+        }
+        out << "    std::string " << names[i] << ";\n";
+        out << "    if (!" << template_name(&operands[i].value) << "(env, " << names[i] << ")) {\n";
+        out << "        return false;\n";
+        out << "    }\n";
+        if (!is_whole_value) {
+            out << "    s_host->trim(" << names[i] << ");\n";
+        }
+    }
+    if (!is_whole_value && has_param) {
+        std::string list_check;
+        for (size_t i = 0; i < operands.size(); ++i) {
+            if (!operands[i].value.is_constant()) {
+                list_check += (list_check.empty() ? "" : " || ") + names[i] + ".find(',') != std::string::npos";
+            }
+        }
+        if (!operands.back().value.is_constant()) {
+            list_check += " || " + names.back() + ".empty()";
+        }
+        static const char* OPS[] = {"", "", "OP_IN", "OP_NOT_IN", "OP_EQ", "OP_GT", "OP_GE"};
+        out << "    if (" << list_check << ") {\n";
+        this->_has_value_list = true;
+        out << "        return evaluate_value_list(" << OPS[assertion.op] << ", "
+            << template_name(&assertion.value_template) << ", env);\n";
+        out << "    }\n";
+    }
+    size_t size = operands.size();
+    switch (assertion.op) {
+    case dmkit::ASSERTION_NOT_EMPTY:
+    case dmkit::ASSERTION_EMPTY:
+        out << "    return " << (assertion.op == dmkit::ASSERTION_NOT_EMPTY ? "!" : "")
+            << names[0] << ".empty();\n";
+        break;
+    case dmkit::ASSERTION_IN:
+    case dmkit::ASSERTION_NOT_IN: {
+        std::string has_match;
+        for (size_t i = 1; i < size; ++i) {
+            has_match += (has_match.empty() ? "" : " || ") + names[0] + " == " + names[i];
+        }
+        if (has_match.empty()) {
+            has_match = "false";
+        }
+        out << "    return " << (assertion.op == dmkit::ASSERTION_NOT_IN ? "!(" : "(")
+            << has_match << ");\n";
+        break;
+    }
+    case dmkit::ASSERTION_EQ:
+        if (size < 2) {
+            out << "    return false;\n";
+        } else {
+            out << "    return " << names[0] << " == " << names[1] << ";\n";
+        }
+        break;
+    case dmkit::ASSERTION_GT:
+    case dmkit::ASSERTION_GE:
+        if (size < 2) {
+            out << "    return false;\n";
+            break;
+        }
+        for (size_t i = 0; i < 2; ++i) {
+            const dmkit::AssertionOperand& operand = operands[i];
+            if (!operand.value.is_constant()) {
+                out << "    double number_" << i << " = 0;\n";
+                out << "    if (!s_host->try_atof(" << names[i] << ", number_" << i << ")) {\n";
+                out << "        return false;\n";
+                out << "    }\n";
+            } else if (!operand.is_number) {
+                out << "    return false;\n";
+                out << "}\n\n";
+                return true;
+            } else {
+                char buffer[64];
+                snprintf(buffer, sizeof(buffer), "%.17g", operand.number);
+                out << "    double number_" << i << " = " << buffer << ";\n";
+            }
+        }
+        out << "    return number_0 " << (assertion.op == dmkit::ASSERTION_GT ? ">" : ">=") << " number_1;\n";
+        break;
+    }
+    out << "}\n\n";
+    return true;
+}
+
+std::string PolicyCompiler::generate() {
+    std::vector<bool> compiled_templates(this->_templates.size(), false);
+    for (size_t i = 0; i < this->_templates.size(); ++i) {
+        if (is_compiled(this->_templates[i])) {
+            compiled_templates[i] = true;
+            generate_template(i);
+        }
+    }
+    std::vector<bool> compiled_assertions(this->_assertions.size(), false);
+    for (size_t i = 0; i < this->_assertions.size(); ++i) {
+        compiled_assertions[i] = generate_assertion(i);
+    }
+
+    std::ostringstream out;
+    out << "// Generated by policy_compiler, do not edit.\n\n";
+    out << "#include \"compiled_policy.h\"\n\n";
+    out << "namespace {\n\n";
+    out << "const dmkit::CompiledPolicyHost* s_host = nullptr;\n\n";
+    if (this->_has_value_list) {
+        out << VALUE_LIST_SOURCE;
+    }
+    out << this->_constants.str() << "\n";
+    out << this->_functions.str();
+
+    // Arrays end with an extra entry so that none of them is empty.
+    out << "const size_t POLICY_SLOT_COUNTS[] = {";
+    for (size_t count: this->_slot_counts) {
+        out << count << ", ";
+    }
+    out << "0};\n\n";
+    out << "const dmkit::CompiledRenderFunc TEMPLATES[] = {\n";
+    for (size_t i = 0; i < this->_templates.size(); ++i) {
+        out << "    " << (compiled_templates[i] ? template_name(this->_templates[i]) : "nullptr") << ",\n";
+    }
+    out << "    nullptr\n};\n\n";
+    out << "const dmkit::CompiledAssertionFunc ASSERTIONS[] = {\n";
+    for (size_t i = 0; i < this->_assertions.size(); ++i) {
+        out << "    " << (compiled_assertions[i] ? "evaluate_assertion_" + std::to_string(i) : "nullptr")
+            << ",\n";
+    }
+    out << "    nullptr\n};\n\n";
+    out << "const dmkit::CompiledDomain DOMAIN = {\n"
+        << "    " << quote(this->_fingerprint) << ",\n"
+        << "    " << this->_slot_counts.size() << ", POLICY_SLOT_COUNTS,\n"
+        << "    " << this->_templates.size() << ", TEMPLATES,\n"
+        << "    " << this->_assertions.size() << ", ASSERTIONS\n"
+        << "};\n\n";
+    out << "} // namespace\n\n";
+    out << "extern \"C\" const dmkit::CompiledPolicyAbi* dmkit_compiled_policy_abi() {\n"
+           "    static const dmkit::CompiledPolicyAbi abi = dmkit::compiled_policy_abi();\n"
+           "    return &abi;\n"
+           "}\n\n";
+    out << "extern \"C\" const dmkit::CompiledDomain* dmkit_compiled_domain(const dmkit::CompiledPolicyHost* host) {\n"
+           "    s_host = host;\n"
+           "    return &DOMAIN;\n"
+           "}\n";
+    return out.str();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <domain conf> <output source>\n", argv[0]);
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    if (!in.good()) {
+        fprintf(stderr, "Failed to read %s\n", argv[1]);
+        return 1;
+    }
+    std::string conf = buffer.str();
+    rapidjson::Document doc;
+    doc.Parse(conf.c_str());
+    if (doc.HasParseError() || !doc.IsArray()) {
+        fprintf(stderr, "Failed to parse domain conf %s\n", argv[1]);
+        return 1;
+    }
+    // Invalid policies are skipped like PolicyManager does.
+    std::vector<dmkit::Policy*> policies;
+    for (auto const& policy_json: doc.GetArray()) {
+        dmkit::Policy* policy = dmkit::Policy::parse_from_json_value(policy_json);
+        if (policy != nullptr) {
+            policies.push_back(policy);
+        }
+    }
+    PolicyCompiler compiler(policies, dmkit::CompiledPolicyModule::fingerprint(conf));
+    std::string source = compiler.generate();
+    for (dmkit::Policy* policy: policies) {
+        delete policy;
+    }
+    std::ofstream out(argv[2]);
+    out << source;
+    if (!out.good()) {
+        fprintf(stderr, "Failed to write %s\n", argv[2]);
+        return 1;
+    }
+    printf("Compiled %zu policies of %s into %s\n", policies.size(), argv[1], argv[2]);
+    return 0;
+}
@@ -0,0 +1,245 @@
+// Copyright (c) 2018 Baidu, Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Count heap allocations of resolving a dialog turn into a policy output.
+//
+// A turn is resolved the way DialogManager::resolve_policy_output does it, with the qu result,
+// qu map and policy output kept in the thread data and refilled in place, and again with
+// a fresh qu result, qu map and policy output per turn as before they were kept.
+// Policies rendering 1, 10 and 100 meta and results are generated into a temporary directory.
+// Allocations through operator new are counted, the json arena and rapidjson draw from malloc
+// and are not counted, their growth is reported by dmkit_json_arena_grow_count.
+//
+// Build with -DBUILD_TOOLS=ON and run:
+//     ./policy_output_alloc_count
+// It fails if allocations of a reused turn grow with the size of the output.
+// Allocations per turn when the thread data was first kept:
+//     output_size  reused_allocs  fresh_allocs
+//     1            13             29
+//     10           13             74
+//     100          13             524
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "butil.h"
+#include "policy.h"
+#include "policy_manager.h"
+#include "qu_result.h"
+#include "rapidjson.h"
+#include "request_context.h"
+#include "thread_data_base.h"
+
+static std::atomic<bool> s_counting(false);
+static std::atomic<long> s_allocation_count(0);
+
+void* operator new(size_t size) {
+    if (s_counting.load(std::memory_order_relaxed)) {
+        s_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+static const char* BOT_ID = "9999";
+static const int TURNS = 100;
+
+// A policy triggered by INTENT_ALLOC rendering the slot into every meta and result.
+static std::string get_policy_json(int output_size) {
+    std::string meta;
+    std::string results;
+    for (int i = 0; i < output_size; ++i) {
+        if (i > 0) {
+            meta += ",";
+            results += ",";
+        }
+        std::string index = std::to_string(i);
+        meta += "\"meta_" + index + "\": \"meta of {%city%} " + index + "\"";
+        results += "{\"type\": \"tts\", \"value\": \"result of {%city%} with index " + index + "\"}";
+    }
+    return "[{\"trigger\": {\"intent\": \"INTENT_ALLOC\", \"slots\": [\"user_city\"], \"state\": \"\"},"
+        " \"params\": [{\"name\": \"city\", \"type\": \"slot_val\", \"value\": \"user_city\"}],"
+        " \"output\": [{\"assertion\": [{\"type\": \"not_empty\", \"value\": \"{%city%}\"}],"
+        " \"session\": {\"context\": {\"city\": \"{%city%}\"}, \"state\": \"001\"},"
+        " \"meta\": {" + meta + "}, \"result\": [" + results + "]}]}]";
+}
+
+static const char* DIALOG_STATE_JSON =
+    "{\"intents\": [{\"name\": \"INTENT_ALLOC\"}],"
+    " \"user_slots\": {\"user_city\": {\"values\": {"
+    "\"shanghai pudong new area\": {\"state\": 2, \"original_name\": \"pudong new area of shanghai\"}}}}}";
+
+static bool write_file(const std::string& path, const std::string& content) {
+    std::ofstream out(path);
+    out << content;
+    return out.good();
+}
+
+// Resolve a turn with the qu result, qu map and policy output of the thread data.
+static int resolve_reused(dmkit::PolicyManager& policy_manager,
+                          const std::shared_ptr<dmkit::ProductPolicyMap>& policy_dict,
+                          const rapidjson::Value& dialog_state,
+                          const dmkit::PolicyOutputSession& session,
+                          const std::unordered_map<std::string, std::string>& params) {
+    dmkit::ThreadDataBase* tls = dmkit::current_thread_data();
+    dmkit::QuResult& qu_result = tls->qu_result();
+    if (qu_result.parse_dialog_state(BOT_ID, dialog_state,
+            dmkit::PolicyManager::get_symbol_table(policy_dict, "default")) != 0) {
+        return -1;
+    }
+    BUTIL_NAMESPACE::FlatMap<std::string, dmkit::QuResult*>& qu_map = tls->qu_map();
+    qu_map.clear();
+    qu_map.insert(BOT_ID, &qu_result);
+    dmkit::RequestContext context(nullptr, "alloc_count", params);
+    int ret = policy_manager.resolve(
+        policy_dict, "default", &qu_map, session, context, tls->policy_output());
+    qu_map.clear();
+    return ret;
+}
+
+// Resolve a turn with a fresh qu result, qu map and policy output.
+static int resolve_fresh(dmkit::PolicyManager& policy_manager,
+                         const std::shared_ptr<dmkit::ProductPolicyMap>& policy_dict,
+                         const rapidjson::Value& dialog_state,
+                         const dmkit::PolicyOutputSession& session,
+                         const std::unordered_map<std::string, std::string>& params) {
+    dmkit::QuResult* qu_result = new dmkit::QuResult();
+    if (qu_result->parse_dialog_state(BOT_ID, dialog_state,
+            dmkit::PolicyManager::get_symbol_table(policy_dict, "default")) != 0) {
+        delete qu_result;
+        return -1;
+    }
+    auto qu_map = new BUTIL_NAMESPACE::FlatMap<std::string, dmkit::QuResult*>();
+    qu_map->init(2, 50);
+    qu_map->insert(BOT_ID, qu_result);
+    dmkit::RequestContext context(nullptr, "alloc_count", params);
+    dmkit::PolicyOutput output;
+    int ret = policy_manager.resolve(policy_dict, "default", qu_map, session, context, output);
+    delete qu_map;
+    delete qu_result;
+    return ret;
+}
+
+typedef int (*ResolveFunc)(dmkit::PolicyManager&,
+                           const std::shared_ptr<dmkit::ProductPolicyMap>&,
+                           const rapidjson::Value&,
+                           const dmkit::PolicyOutputSession&,
+                           const std::unordered_map<std::string, std::string>&);
+
+// Average allocations per turn after a warm up turn, -1 if any turn fails.
+static long count_allocations(ResolveFunc resolve,
+                              dmkit::PolicyManager& policy_manager,
+                              const rapidjson::Value& dialog_state) {
+    std::shared_ptr<dmkit::ProductPolicyMap> policy_dict = policy_manager.get_policy_dict();
+    dmkit::PolicyOutputSession session;
+    std::unordered_map<std::string, std::string> params;
+    dmkit::ThreadDataBase* tls = dmkit::current_thread_data();
+    tls->reset();
+    if (resolve(policy_manager, policy_dict, dialog_state, session, params) != 0) {
+        return -1;
+    }
+    long total = 0;
+    for (int i = 0; i < TURNS; ++i) {
+        tls->reset();
+        s_allocation_count = 0;
+        s_counting = true;
+        int ret = resolve(policy_manager, policy_dict, dialog_state, session, params);
+        s_counting = false;
+        if (ret != 0) {
+            return -1;
+        }
+        total += s_allocation_count;
+    }
+    return total / TURNS;
+}
+
+int main(int argc, char* argv[]) {
+    char dir_template[] = "/tmp/dmkit_alloc_count_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        fprintf(stderr, "Failed to create temporary directory\n");
+        return 1;
+    }
+    std::string dir = dir_template;
+
+    rapidjson::Document dialog_state;
+    dialog_state.Parse(DIALOG_STATE_JSON);
+
+    dmkit::ThreadDataBase data;
+    dmkit::ScopedThreadData scoped_data(&data);
+
+    bool passed = true;
+    long first_reused_count = -1;
+    printf("%-12s %-16s %-16s\n", "output_size", "reused_allocs", "fresh_allocs");
+    for (int output_size: {1, 10, 100}) {
+        std::string suffix = std::to_string(output_size);
+        std::string domain_path = dir + "/alloc_" + suffix + ".json";
+        std::string products_file = "products_" + suffix + ".json";
+        if (!write_file(domain_path, get_policy_json(output_size))
+                || !write_file(dir + "/" + products_file,
+                               std::string("{\"default\": {\"") + BOT_ID + "\": {\"score\": 1,"
+                               " \"conf_path\": \"" + domain_path + "\"}}}")) {
+            fprintf(stderr, "Failed to write policy conf to %s\n", dir.c_str());
+            return 1;
+        }
+        dmkit::PolicyManager policy_manager;
+        if (policy_manager.init(dir.c_str(), products_file.c_str()) != 0) {
+            fprintf(stderr, "Failed to load policies of output size %d\n", output_size);
+            return 1;
+        }
+        long reused_count = count_allocations(resolve_reused, policy_manager, dialog_state);
+        long fresh_count = count_allocations(resolve_fresh, policy_manager, dialog_state);
+        if (reused_count < 0 || fresh_count < 0) {
+            fprintf(stderr, "Failed to resolve policy output of size %d\n", output_size);
+            return 1;
+        }
+        printf("%-12d %-16ld %-16ld\n", output_size, reused_count, fresh_count);
+        if (first_reused_count < 0) {
+            first_reused_count = reused_count;
+        } else if (reused_count != first_reused_count) {
+            passed = false;
+        }
+    }
+    printf("%s\n", passed ? "PASS: allocations of a reused turn do not grow with the output"
+                          : "FAIL: allocations of a reused turn grow with the output");
+    return passed ? 0 : 1;
+}